@@ -12,6 +12,7 @@
 * - video must be encoded with wither h264 or vp6 video codecs
 * - audio must be encoded with mp3 or aac codecs
 * the above are FLV container limitations
+* see 06-transcoding.cpp auto mode for inputs which don't meet them
 *
 */
 
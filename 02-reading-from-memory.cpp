@@ -53,6 +53,9 @@ public:
     std::ifstream input_file;
 };
 
+// AVIOContext buffer size, 8192 unless given in command line
+size_t avio_buffer_size = 8192;
+
 // functions predeclarations
 bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, FileReader* reader, const char* filename);
 bool make_output_ctx(AVFormatContext** output_ctx, const char* format_name, const char* filename);
@@ -63,14 +66,19 @@ bool remux_streams(AVFormatContext** input_ctx, AVFormatContext** output_ctx, in
 bool close_output_file(AVFormatContext** output_ctx);
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        std::cout << "Usage: " << argv[0] << " <input file> <output file>\n";
+    if (argc != 3 && argc != 4) {
+        std::cout << "Usage: " << argv[0] << " <input file> <output file> [buffer size]\n";
         return EXIT_FAILURE;
     }
 
     const char* in_filename  = argv[1];
     const char* out_filename = argv[2];
 
+    // AVIOContext buffer size can be given to see how it affects performance
+    if (argc == 4) {
+        avio_buffer_size = atoi(argv[3]) > 0 ? atoi(argv[3]) : avio_buffer_size;
+    }
+
     // create input format context
     FileReader reader(in_filename);     // this is out "memory reader"
     AVIOContext* avio_input_ctx = NULL; // this is IO (input/output) context, needed for i/o customizations
@@ -150,8 +158,7 @@ bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, F
     // now we need to allocate a memory buffer for our context to use. keep in mind, that buffer size
     // should be chosen correctly for various containers, this noticeably affectes performance
     // NOTE: this buffer is managed by AVIOContext and you should not deallocate by yourself
-    const size_t buffer_size = 8192;
-    unsigned char* ctx_buffer = (unsigned char*)(av_malloc(buffer_size));
+    unsigned char* ctx_buffer = (unsigned char*)(av_malloc(avio_buffer_size));
     if (ctx_buffer == NULL) {
         std::cout << "Could not allocate read buffer for AVIOContext\n";
         return false;
@@ -166,7 +173,7 @@ bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, F
     // buffer size for reading and read callback that will do the actual reading into the buffer
     *avio_input_ctx = avio_alloc_context(
         ctx_buffer,        // memory buffer
-        buffer_size,       // memory buffer size
+        avio_buffer_size,  // memory buffer size
         0,                 // 0 for reading, 1 for writing. we're reading, so — 0.
         reader_ptr,        // pass our reader to context, it will be transparenty passed to read callback on each invocation
         &read_callback,     // out read callback
@@ -72,6 +72,14 @@ public:
     std::ofstream output_file;
 };
 
+// AVIOContext buffer size, 8192 unless given in command line
+size_t avio_buffer_size = 8192;
+
+// write callback calls and bytes, printed once at the end: printing (and flushing) on every
+// call would make terminal part of every buffer write
+int write_calls = 0;
+int64_t write_bytes = 0;
+
 // functions predeclarations
 bool make_input_ctx(AVFormatContext** input_ctx, const char* filename);
 bool make_output_ctx(AVFormatContext** output_ctx, AVIOContext** avio_output_ctx, FileWriter* writer, const char* format_name, const char* filename);
@@ -82,14 +90,19 @@ bool remux_streams(AVFormatContext** input_ctx, AVFormatContext** output_ctx, in
 bool close_output_file(AVFormatContext** output_ctx);
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        std::cout << "Usage: " << argv[0] << " <input file> <output file>\n";
+    if (argc != 3 && argc != 4) {
+        std::cout << "Usage: " << argv[0] << " <input file> <output file> [buffer size]\n";
         return EXIT_FAILURE;
     }
 
     const char* in_filename  = argv[1];
     const char* out_filename = argv[2];
 
+    // AVIOContext buffer size can be given to see how it affects performance
+    if (argc == 4) {
+        avio_buffer_size = atoi(argv[3]) > 0 ? atoi(argv[3]) : avio_buffer_size;
+    }
+
     // create input format context
     AVFormatContext* input_ctx = NULL;
     if (!make_input_ctx(&input_ctx, in_filename)) {
@@ -150,6 +163,8 @@ int main(int argc, char **argv) {
     av_freep(&streams_map);
     av_freep(&avio_output_ctx);
 
+    std::cout << "Write callback called " << write_calls << " times, " << write_bytes << " bytes.\n";
+
     return EXIT_SUCCESS;
 }
 
@@ -158,7 +173,8 @@ static int write_callback(void* opaque, uint8_t* buf, int buf_size) {
     auto& writer = *reinterpret_cast<FileWriter*>(opaque);
     writer.write((char*)buf, buf_size);
 
-    std::cout << buf_size << std::endl;
+    write_calls++;
+    write_bytes += buf_size;
 
     return buf_size; // we always write all requested data succesfully
 }
@@ -202,8 +218,7 @@ bool make_output_ctx(AVFormatContext** output_ctx, AVIOContext** avio_output_ctx
     // now we need to allocate a memory buffer for our context to use. keep in mind, that buffer size
     // should be chosen correctly for various containers, this noticeably affectes performance
     // NOTE: this buffer is managed by AVIOContext and you should not deallocate it by yourself
-    const size_t buffer_size = 8192;
-    unsigned char* ctx_buffer = (unsigned char*)(av_malloc(buffer_size));
+    unsigned char* ctx_buffer = (unsigned char*)(av_malloc(avio_buffer_size));
     if (ctx_buffer == NULL) {
         std::cout << "Could not allocate read buffer for AVIOContext\n";
         return false;
@@ -219,7 +234,7 @@ bool make_output_ctx(AVFormatContext** output_ctx, AVIOContext** avio_output_ctx
     // NOTE: seek callback is implemented too, see seek_callback() function description
     *avio_output_ctx = avio_alloc_context(
         ctx_buffer,        // memory buffer
-        buffer_size,       // memory buffer size
+        avio_buffer_size,  // memory buffer size
         1,                 // 0 for reading, 1 for writing. we're writing, so — 1.
         writer_ptr,        // pass our writer to context, it will be transparenty passed to write callback on each invocation
         NULL,              // read callback — we don't need one
@@ -7,10 +7,46 @@
 *
 * advanced libav remuxing example.
 * receive live video stream from SRT client, write data into memory buffer, configure AVFormatContext
-* to read from memory buffer, remux to FLV and write result to a file. receiving SRT data happens on
-* main thread and remuxing into FLV runs on separate thread. ring buffer is used to pass stream data
+* to read from memory buffer, remux to FLV and write result to a file. receiving SRT data and remuxing
+* into FLV run on separate threads. ring buffer is used to pass stream data
 * between threads.
 *
+* several SRT clients can be served at once (streams argument, see tools/srt_loadgen.cpp for load
+* generator): every connection gets its own receiving and remuxing threads, ring buffer and output
+* file named after client stream id. per stream stats show how often ring buffer was full
+* (remuxing couldn't keep up) and how many packets SRT lost
+*
+* capture and replay: network timing is different on every run, which makes live path hard to
+* profile. with -capture every srt_recvmsg() payload is written to a file together with time it
+* arrived at, -replay feeds the same ring buffer from that file instead of SRT, with original
+* timing or, with -fast, as fast as remuxing takes it. remuxing side can be profiled and
+* benchmarked on exactly the same input again and again, without network
+*
+* latency: every piece of data written to ring buffer is marked with time it came from SRT (before
+* waiting for ring buffer space). demuxer gives every packet position of its first byte in input,
+* which leads to the mark and ingest time of the packet. output goes through our own AVIOContext,
+* write callback follows FLV tags in bytes leaving it, and when tag of a packet is written,
+* time since ingest goes to latency histogram of the stream: p50/p99/p999 in the stream summary
+*
+* tracing: with -trace, time spent in srt_recvmsg(), ring buffer waits, read and write callbacks,
+* av_read_frame(), timestamps rescaling and av_interleaved_write_frame() is traced per thread and
+* written as Chrome trace JSON at exit or on SIGUSR1, open it in chrome://tracing or ui.perfetto.dev
+*
+* metrics: bytes in and out, ring buffer occupancy and stalls, per packet remux time, AVIO callback
+* sizes, write callback time and ingest to FLV tag latency are always counted per stream. with
+* -metrics they're served in Prometheus text format on local HTTP port or unix socket
+*
+* logging: pipeline threads and libav (av_log, av_dump_format) log through asynchronous logger,
+* none of them waits for terminal, -loglevel picks how much of it is shown (info by default)
+*
+* cost: receiving and remuxing threads are named (top -H, perf) and sample their own cpu time and
+* context switches once a second. memory held by ring buffer, AVIO buffers, packets and ingest
+* marks is accounted per stream. both go to metrics and the stream summary, per stage
+*
+* stalls: with -watchdog <seconds> every stream is watched, when nothing is received, remuxed or
+* written for that long, ring buffer state, stacks of both threads and their recent trace events
+* are logged, -teardown also shuts stalled stream down
+*
 * input file requirements:
 * - video must be encoded with wither h264 or vp6 video codecs
 * - audio must be encoded with mp3 or aac codecs
@@ -20,8 +56,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <limits>
+#include <algorithm>
 #include <thread>
 #include <chrono>
 #include <mutex>
@@ -30,35 +74,305 @@
 
 extern "C" {
     #include <libavformat/avformat.h>
+    #include <libavutil/time.h>
 }
 
 #include <srt/srt.h>
 
 #include "helpers.hpp"
 #include "ring_buffer.hpp"
+#include "latency_histogram.hpp"
+#include "tracer.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
+#include "thread_usage.hpp"
+#include "watchdog.hpp"
 
 int srt_server_socket = 0;
-int bytes_remuxed_to_flv = 0;
-std::mutex buf_mutex;
-std::condition_variable cond;
-std::atomic<bool> receiving_srt_data_done{false};
-std::atomic<bool> remuxing_thread_done{false};
+Metrics metrics;        // always counted, served with -metrics
+Watchdog watchdog;      // started with -watchdog
+int64_t stall_timeout = 0;  // us, 0 when streams aren't watched
+bool stall_teardown = false;    // tear stalled stream down after diagnostics
+
+// capture file: magic, then one record per srt_recvmsg(): microseconds since previous message
+// (4 bytes), payload size (2 bytes), both little endian, and payload itself
+const char CaptureMagic[] = "SRTCAP1\n";
+const int CaptureMagicSize = 8;
+const int TraceEventsPerThread = 1024 * 1024;   // 24 MB per traced thread, minutes of events
+const int CaptureRecordHeaderSize = 6;
+const int CaptureBufferSize = 1024 * 1024;  // receiving thread must not make a syscall for every message
+
+// FLV file header with PreviousTagSize0, then every tag: 11 bytes header, data, 4 bytes PreviousTagSize
+const int FlvFileHeaderSize = 9 + 4;
+const int FlvTagHeaderSize = 11;
+const int FlvTagPeekSize = 2;               // codec and AVC/AAC packet type, first bytes of tag data
+const int FlvTagAudio = 8;
+const int FlvTagVideo = 9;
+
+// ingest marks behind last demuxed position kept for packets which started earlier (video PES
+// is still being collected while audio packets come out), far more than any frame size
+const int64_t IngestMarksWindow = 16 * 1024 * 1024;
+
+// pipeline threads sample their own cpu time and context switches this often
+const int64_t UsageSampleInterval = 1000000;
+
+// stall is noticed this much later than timeout at worst
+const int64_t WatchdogCheckInterval = 100000;
+const size_t StallTraceEvents = 16;     // recent trace events per thread in stall diagnostics
+
+// srt_recvmsg() gives up this often when nothing comes, receiving thread sees teardown flag
+const int ReceiveTimeout = 200;         // ms
+
+// memory attributed to a stream: ring buffer, both AVIOContext buffers, packet being remuxed and
+// ingest times queued for muxer, ingest marks. libav internals (probe data, muxer interleaving
+// queue) aren't seen from outside and aren't counted
+enum MemoryKind {
+    MemoryRing,
+    MemoryAvio,
+    MemoryPackets,
+    MemoryMarks,
+    MemoryKinds
+};
+
+const char* const MemoryKindNames[MemoryKinds] = { "ring", "avio", "packets", "marks" };
+
+// thread running one pipeline stage: who it is, for diagnostics, and its cpu usage. thread and
+// name are set before watchdog sees the stream. usage is written by the thread itself, others
+// read it after join, live numbers go through metrics
+struct StageUsage {
+    StageUsage() : thread(0), last_sample_time(0), cpu_us(NULL), voluntary_switches(NULL), involuntary_switches(NULL) {}
+
+    pthread_t thread;
+    std::string thread_name;
+    ThreadUsage start;                  // when thread took the stage, replay runs on main thread
+    ThreadUsage last;                   // last sample
+    int64_t last_sample_time;
+    MetricCounter* cpu_us;
+    MetricCounter* voluntary_switches;
+    MetricCounter* involuntary_switches;
+};
+
+// metrics of one stream, updated from pipeline threads with relaxed atomics
+struct StreamMetrics {
+    MetricCounter* bytes_received;
+    MetricCounter* bytes_remuxed;
+    MetricCounter* packets_remuxed;
+    MetricCounter* ring_stalls;
+    MetricGauge* ring_occupancy;
+    MetricHistogram* remux_time;        // us, from av_read_frame() to av_interleaved_write_frame() return
+    MetricHistogram* read_size;         // bytes per read callback
+    MetricHistogram* write_size;        // bytes per write callback
+    MetricHistogram* write_time;        // us per write callback
+    MetricHistogram* latency;           // us, ingest to FLV tag written
+    MetricGauge* memory[MemoryKinds];   // bytes
+};
+
+// everything that belongs to one SRT client: SRT data is received on one thread and remuxed on another,
+// ring buffer is used to pass stream data between them
+struct SrtStream {
+    SrtStream() : socket(SRT_INVALID_SOCK), buff(40960), bytes_received(0), bytes_remuxed(0), ring_stalls(0),
+        receiving_done(false), remuxing_done(false), teardown(false), replay_fast(false), last_message_time(0),
+        ring_offset(0), output_file(NULL), flv_skip(FlvFileHeaderSize), flv_header_size(0), flv_rewriting(false), last_write_time(0) {
+        for (int i = 0; i < MemoryKinds; i++) {
+            memory[i].store(0);
+            memory_peak[i].store(0);
+        }
+    }
+
+    SRTSOCKET socket;
+    std::string stream_id;              // set by client, may be empty
+    std::string out_filename;
+    RingBuffer buff;                    // "memory reader", raw TS packets from SRT client consumed by libav
+    std::mutex buf_mutex;
+    std::condition_variable cond;
+    int64_t bytes_received;
+    std::atomic<int64_t> bytes_remuxed;
+    int64_t ring_stalls;                // times ring buffer was full and receiving had to wait
+    std::atomic<bool> receiving_done;
+    std::atomic<bool> remuxing_done;
+    std::atomic<bool> teardown;         // set by watchdog, pipeline gives up as soon as it can
+
+    std::string replay_filename;        // replay capture instead of receiving from SRT
+    bool replay_fast;                   // don't keep original timing
+    std::ofstream capture;              // open when capturing
+    std::vector<char> capture_buffer;
+    int64_t last_message_time;          // when previous message was received, for capture
+
+    // latency, ingest marks are written by receiving thread, under buf_mutex
+    int64_t ring_offset;                // bytes written to ring buffer so far
+    std::deque<std::pair<int64_t, int64_t> > ingest_marks;  // (ring offset after data, ingest time)
+
+    // remuxing thread only, write callback runs inside muxer calls
+    FILE* output_file;
+    std::deque<int64_t> pending[2];     // ingest times of packets given to muxer, audio and video
+    int64_t flv_skip;                   // bytes till next FLV tag header
+    unsigned char flv_header[FlvTagHeaderSize + FlvTagPeekSize];
+    int flv_header_size;
+    bool flv_rewriting;                 // trailer seeks back to update header, not tags anymore
+    std::atomic<int64_t> last_write_time;   // for watchdog
+    LatencyHistogram latency;
+
+    // per stage cost: cpu, context switches, memory
+    StageUsage receive_usage;
+    StageUsage remux_usage;
+    std::atomic<int64_t> memory[MemoryKinds];
+    std::atomic<int64_t> memory_peak[MemoryKinds];
+
+    StreamMetrics metrics;
+};
+
+// AVIOContext buffer size, 8192 unless given in command line
+size_t avio_buffer_size = 8192;
 
 // functions predeclarations
-bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, RingBuffer* reader);
+bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, SrtStream* stream);
 bool make_output_ctx(AVFormatContext** output_ctx, const char* format_name, const char* filename);
 bool make_streams_map(AVFormatContext** input_ctx, int** streams_map);
 bool ctx_init_output_from_input(AVFormatContext** input_ctx, AVFormatContext** output_ctx);
-bool open_output_file(AVFormatContext** output_ctx, const char* filename);
-bool remux_streams(AVFormatContext** input_ctx, AVFormatContext** output_ctx, int* streams_map);
-bool close_output_file(AVFormatContext** output_ctx);
-void remux_to_flv_worker(RingBuffer* buff, const char* out_filename);
-int start_srt_server(const char* ip, const char* port);
+bool open_output_file(AVFormatContext** output_ctx, SrtStream* stream);
+bool remux_streams(AVFormatContext** input_ctx, AVFormatContext** output_ctx, int* streams_map, SrtStream* stream);
+bool close_output_file(AVFormatContext** output_ctx, SrtStream* stream);
+int64_t ingest_time(SrtStream* stream, int64_t pos);
+void flv_tags_written(SrtStream* stream, const uint8_t* buf, int buf_size);
+void print_usage(const char* name);
+void register_metrics(SrtStream* stream);
+void serve_stream(SrtStream* stream);
+void receive_srt_stream(SrtStream* stream, SRT_TRACEBSTATS* perf);
+bool replay_capture(SrtStream* stream);
+bool open_capture(SrtStream* stream, const std::string& filename);
+void write_capture(SrtStream* stream, const char* msg, int size);
+bool write_to_ring(SrtStream* stream, const char* msg, int size);
+void remux_to_flv_worker(SrtStream* stream);
+void remux_to_flv(SrtStream* stream);
+void name_thread(const std::string& name);
+void start_stage(SrtStream* stream, StageUsage* usage, const char* stage);
+void sample_stage(StageUsage* usage, bool force);
+void account_memory(SrtStream* stream, MemoryKind kind, int64_t bytes);
+void stream_stalled(SrtStream* stream, int64_t stalled_us);
+void teardown_stream(SrtStream* stream);
+std::string stream_filename(const char* filename, const std::string& stream_id, int index);
+bool start_srt_server(const char* ip, const char* port, int backlog);
+SRTSOCKET accept_srt_client(std::string* stream_id);
 int stop_srt_server();
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        std::cout << "Usage: " << argv[0] << " <host> <port> <output file>\n";
+    const char* program = argv[0];
+    std::string capture_filename;
+    std::string replay_filename;
+    std::string trace_filename;
+    std::string metrics_address;
+    bool replay_fast = false;
+    LogLevel log_level = LogInfo;
+
+    // options go first, everything after them is positional arguments
+    int first_arg = 1;
+    for (; first_arg < argc && argv[first_arg][0] == '-'; first_arg += 2) {
+        const char* name = argv[first_arg];
+
+        if (strcmp(name, "-fast") == 0) {
+            replay_fast = true;
+            first_arg--;
+            continue;
+        }
+
+        if (strcmp(name, "-teardown") == 0) {
+            stall_teardown = true;
+            first_arg--;
+            continue;
+        }
+
+        if (first_arg + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        if (strcmp(name, "-capture") == 0) {
+            capture_filename = argv[first_arg + 1];
+        } else if (strcmp(name, "-replay") == 0) {
+            replay_filename = argv[first_arg + 1];
+        } else if (strcmp(name, "-trace") == 0) {
+            trace_filename = argv[first_arg + 1];
+        } else if (strcmp(name, "-metrics") == 0) {
+            metrics_address = argv[first_arg + 1];
+        } else if (strcmp(name, "-watchdog") == 0) {
+            stall_timeout = int64_t(atof(argv[first_arg + 1]) * 1000000);
+            if (stall_timeout <= 0) {
+                std::cout << "Watchdog timeout must be positive, seconds\n";
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(name, "-loglevel") == 0) {
+            bool ok = false;
+            log_level = Logger::parse_level(argv[first_arg + 1], &ok);
+            if (!ok) {
+                std::cout << "Unknown log level " << argv[first_arg + 1] << '\n';
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    argc -= first_arg - 1;
+    argv += first_arg - 1;
+
+    // kill -USR1 <pid> writes trace of what happened so far. signal is blocked before any
+    // thread is started, logger's included
+    if (!trace_filename.empty()) {
+        Tracer::enable(TraceEventsPerThread);
+        Tracer::dump_on_signal(SIGUSR1, trace_filename.c_str());
+    }
+
+    // from here on nothing but usage goes to std::cout directly
+    Logger::start(log_level, stderr);
+    Logger::redirect_av_log();
+
+    // scrapes are served from server's own thread
+    MetricsServer metrics_server(&metrics);
+    if (!metrics_address.empty() && !metrics_server.start(metrics_address)) {
+        Logger::stop();
+        return EXIT_FAILURE;
+    }
+
+    // silent hangs become stall reports, streams are watched while they're served
+    if (stall_timeout > 0) {
+        watchdog.start(WatchdogCheckInterval);
+    }
+
+    // replay: no SRT at all, capture goes to ring buffer of a single stream
+    if (!replay_filename.empty()) {
+        if (argc < 2 || argc > 3) {
+            Logger::stop();
+            print_usage(program);
+            return EXIT_FAILURE;
+        }
+
+        if (argc == 3) {
+            avio_buffer_size = atoi(argv[2]) > 0 ? atoi(argv[2]) : avio_buffer_size;
+        }
+
+        SrtStream stream;
+        stream.out_filename = argv[1];
+        stream.replay_filename = replay_filename;
+        stream.replay_fast = replay_fast;
+        serve_stream(&stream);
+        watchdog.stop();
+
+        if (!trace_filename.empty()) {
+            Tracer::dump(trace_filename.c_str());
+        }
+
+        Logger::stop();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc < 4 || argc > 6) {
+        Logger::stop();
+        print_usage(program);
         return EXIT_FAILURE;
     }
 
@@ -66,164 +380,600 @@ int main(int argc, char **argv) {
     const char* port  = argv[2];
     const char* out_filename = argv[3];
 
-    // RingBuffer is our "memory reader", we receive raw TS packets from SRT client and write them
-    // to ring buffer to be consumed by libav
-    RingBuffer buff(40960);
+    // AVIOContext buffer size can be given to see how it affects performance
+    if (argc >= 5) {
+        avio_buffer_size = atoi(argv[4]) > 0 ? atoi(argv[4]) : avio_buffer_size;
+    }
+
+    // number of SRT clients to serve, with more than one output file names get client stream id
+    int streams_count = 1;
+    if (argc == 6) {
+        streams_count = atoi(argv[5]) > 0 ? atoi(argv[5]) : 1;
+    }
 
     // start SRT server
-    int their_fd = start_srt_server(ip, port);
-    int bytes_received_from_srt = 0;
+    if (!start_srt_server(ip, port, streams_count)) {
+        Logger::stop();
+        return EXIT_FAILURE;
+    }
+
+    // every client is received and remuxed on its own threads, server goes on accepting the rest
+    std::vector<SrtStream*> streams;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < streams_count; i++) {
+        SrtStream* stream = new SrtStream();
+        stream->socket = accept_srt_client(&stream->stream_id);
+        if (stream->socket == SRT_INVALID_SOCK) {
+            delete stream;
+            break;
+        }
+
+        stream->out_filename = streams_count > 1 ? stream_filename(out_filename, stream->stream_id, i) : out_filename;
+
+        // every stream has its own capture, named like its output file
+        if (!capture_filename.empty()) {
+            std::string filename = streams_count > 1 ? stream_filename(capture_filename.c_str(), stream->stream_id, i) : capture_filename;
+            if (!open_capture(stream, filename)) {
+                srt_close(stream->socket);
+                delete stream;
+                break;
+            }
+        }
+
+        streams.push_back(stream);
+        threads.push_back(std::thread(serve_stream, stream));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+        delete streams[i];
+    }
+
+    stop_srt_server();
+    watchdog.stop();
+
+    if (!trace_filename.empty()) {
+        Tracer::dump(trace_filename.c_str());
+    }
+
+    Logger::stop();
+    return EXIT_SUCCESS;
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [-capture <file>] [-trace <file>] [-metrics <port|unix:path>] [-watchdog <seconds> [-teardown]] [-loglevel <level>] <host> <port> <output file> [buffer size] [streams]\n"
+              << "       " << name << " -replay <file> [-fast] [-trace <file>] [-metrics <port|unix:path>] [-watchdog <seconds> [-teardown]] [-loglevel <level>] <output file> [buffer size]\n";
+}
+
+// stream label is its id, output file name when client didn't set one
+void register_metrics(SrtStream* stream) {
+    std::string labels = Metrics::label("stream", stream->stream_id.empty() ? stream->out_filename : stream->stream_id);
+    StreamMetrics& m = stream->metrics;
+
+    m.bytes_received = metrics.counter("srt_to_flv_received_bytes_total", "Bytes received from SRT or replayed", labels);
+    m.bytes_remuxed = metrics.counter("srt_to_flv_remuxed_bytes_total", "Bytes read by demuxer from ring buffer", labels);
+    m.packets_remuxed = metrics.counter("srt_to_flv_remuxed_packets_total", "Packets written to FLV muxer", labels);
+    m.ring_stalls = metrics.counter("srt_to_flv_ring_stalls_total", "Times ring buffer was full and receiving waited", labels);
+    m.ring_occupancy = metrics.gauge("srt_to_flv_ring_occupancy_bytes", "Bytes in ring buffer", labels);
+    m.remux_time = metrics.histogram("srt_to_flv_remux_packet_seconds", "Time to read and write one packet", labels, 1000000, 1000000);
+    m.read_size = metrics.histogram("srt_to_flv_avio_read_bytes", "Bytes per AVIO read callback", labels, 1, 1024 * 1024);
+    m.write_size = metrics.histogram("srt_to_flv_avio_write_bytes", "Bytes per AVIO write callback", labels, 1, 1024 * 1024);
+    m.write_time = metrics.histogram("srt_to_flv_avio_write_seconds", "Time per AVIO write callback", labels, 1000000, 1000000);
+    m.latency = metrics.histogram("srt_to_flv_latency_seconds", "Time from SRT receive to FLV tag written", labels, 1000000, 60000000);
+
+    for (int i = 0; i < MemoryKinds; i++) {
+        m.memory[i] = metrics.gauge("srt_to_flv_memory_bytes", "Memory held by stream", labels + "," + Metrics::label("kind", MemoryKindNames[i]));
+    }
+}
+
+// same name in trace, log and for the OS
+void name_thread(const std::string& name) {
+    set_thread_name(name.c_str());
+    Tracer::set_thread_name(name.c_str());
+    Logger::set_thread_name(name.c_str());
+}
+
+// on the thread which is going to run the stage
+void start_stage(SrtStream* stream, StageUsage* usage, const char* stage) {
+    std::string labels = Metrics::label("stream", stream->stream_id.empty() ? stream->out_filename : stream->stream_id) +
+        "," + Metrics::label("stage", stage);
+
+    usage->cpu_us = metrics.counter("srt_to_flv_thread_cpu_microseconds_total", "CPU time of pipeline thread", labels);
+    usage->voluntary_switches = metrics.counter("srt_to_flv_thread_context_switches_total", "Context switches of pipeline thread",
+        labels + "," + Metrics::label("kind", "voluntary"));
+    usage->involuntary_switches = metrics.counter("srt_to_flv_thread_context_switches_total", "Context switches of pipeline thread",
+        labels + "," + Metrics::label("kind", "involuntary"));
+
+    usage->start = ThreadUsage::current();
+    usage->last = usage->start;
+    usage->last_sample_time = av_gettime_relative();
+}
+
+// on the thread running the stage, cheap enough for every message or packet: clock is only
+// read once, usage itself is sampled once per interval
+void sample_stage(StageUsage* usage, bool force) {
+    int64_t now = av_gettime_relative();
+    if (!force && now - usage->last_sample_time < UsageSampleInterval) {
+        return;
+    }
+
+    ThreadUsage current = ThreadUsage::current();
+    ThreadUsage delta = current - usage->last;
+    usage->cpu_us->add(delta.cpu_us);
+    usage->voluntary_switches->add(delta.voluntary_switches);
+    usage->involuntary_switches->add(delta.involuntary_switches);
+
+    usage->last = current;
+    usage->last_sample_time = now;
+}
+
+// any thread, bytes can be negative when memory is given back
+void account_memory(SrtStream* stream, MemoryKind kind, int64_t bytes) {
+    int64_t value = stream->memory[kind].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    stream->metrics.memory[kind]->add(bytes);
+
+    int64_t peak = stream->memory_peak[kind].load(std::memory_order_relaxed);
+    while (value > peak && !stream->memory_peak[kind].compare_exchange_weak(peak, value, std::memory_order_relaxed)) {
+    }
+}
+
+// watchdog thread. everything needed to tell why is logged at once: which side stopped (ring full
+// means remuxing is stuck, empty means nothing comes in), where threads are and what they did last
+void stream_stalled(SrtStream* stream, int64_t stalled_us) {
+    std::ostringstream out;
+    out << "Stream " << (stream->stream_id.empty() ? stream->out_filename : stream->stream_id) << " -> " << stream->out_filename
+        << " stalled: nothing received, remuxed or written for " << stalled_us / 1000000.0 << " s.\n";
+
+    int64_t last_write = stream->last_write_time.load();
+    out << "Received:          " << stream->metrics.bytes_received->value() << " bytes.\n";
+    out << "Remuxed:           " << stream->metrics.packets_remuxed->value() << " packets, " << stream->bytes_remuxed.load() << " bytes.\n";
+    if (last_write > 0) {
+        out << "Last write:        " << (av_gettime_relative() - last_write) / 1000 << " ms ago.\n";
+    } else {
+        out << "Last write:        never.\n";
+    }
+
+    {
+        // never held over blocking calls, waits release it. remuxing thread sets remuxing_done
+        // under it as its last action, so while it's held thread is alive if flag isn't set
+        std::lock_guard<std::mutex> lk(stream->buf_mutex);
+
+        out << "Ring buffer:       " << stream->buff.size() << " of " << stream->buff.capacity() << " bytes, "
+            << stream->ring_offset << " written in total, full " << stream->ring_stalls << " times.\n";
+        out << "Receiving done:    " << (stream->receiving_done.load() ? "yes" : "no")
+            << ", remuxing done: " << (stream->remuxing_done.load() ? "yes" : "no") << ".\n";
+
+        out << "Thread " << stream->receive_usage.thread_name << ":\n" << Watchdog::thread_stack(stream->receive_usage.thread, "    ");
+        if (!stream->remuxing_done.load()) {
+            out << "Thread " << stream->remux_usage.thread_name << ":\n" << Watchdog::thread_stack(stream->remux_usage.thread, "    ");
+        }
+    }
+
+    if (Tracer::enabled()) {
+        const StageUsage* stages[2] = { &stream->receive_usage, &stream->remux_usage };
+        for (int i = 0; i < 2; i++) {
+            std::string events;
+            Tracer::print_recent(&events, stages[i]->thread_name, StallTraceEvents, "    ");
+            out << "Recent trace events of " << stages[i]->thread_name << ":\n" << events;
+        }
+    }
+
+    Logger::log(LogError, "%s", out.str().c_str());
+
+    if (stall_teardown) {
+        teardown_stream(stream);
+    }
+}
+
+// receiving stops, ring buffer waits end and AVIO callbacks fail, so threads finish as soon as
+// they get out of whatever they're in. a write stuck in kernel can't be interrupted, it's only
+// not followed by another one. socket belongs to receiving thread, it notices the flag within
+// ReceiveTimeout and closes the socket itself
+void teardown_stream(SrtStream* stream) {
+    Logger::log(LogWarning, "Tearing down stalled stream %s", stream->out_filename.c_str());
+
+    {
+        std::lock_guard<std::mutex> lk(stream->buf_mutex);
+        stream->teardown.store(true);
+        stream->receiving_done.store(true);
+    }
+    stream->cond.notify_all();
+}
+
+// feeds stream from SRT or capture and remuxes it, on calling thread and one more thread
+void serve_stream(SrtStream* stream) {
+    int64_t start_time = av_gettime_relative();
+
+    MetricGauge* streams_active = metrics.gauge("srt_to_flv_streams_active", "Streams being received and remuxed", "");
+    streams_active->add(1);
+    register_metrics(stream);
+    account_memory(stream, MemoryRing, stream->buff.capacity());
+
+    stream->receive_usage.thread = pthread_self();
+    stream->receive_usage.thread_name = stream->replay_filename.empty() ? "receive " + stream->stream_id : "replay";
+    stream->remux_usage.thread_name = "remux " + stream->stream_id;
+
+    name_thread(stream->receive_usage.thread_name);
+    start_stage(stream, &stream->receive_usage, stream->replay_filename.empty() ? "receive" : "replay");
 
     // start remuxing thread
-    std::thread remuxing_thread(remux_to_flv_worker, &buff, out_filename);
+    std::thread remuxing_thread(remux_to_flv_worker, stream);
+    stream->remux_usage.thread = remuxing_thread.native_handle();
+
+    // stream is stalled when nothing is received, remuxed or written, all of these only grow
+    int watch_id = -1;
+    if (stall_timeout > 0) {
+        watch_id = watchdog.watch(stream->out_filename, stall_timeout,
+            [stream]() {
+                return stream->metrics.bytes_received->value() + stream->metrics.packets_remuxed->value() + stream->last_write_time.load();
+            },
+            [stream](int64_t stalled_us) { stream_stalled(stream, stalled_us); });
+    }
+
+    SRT_TRACEBSTATS perf;
+    memset(&perf, 0, sizeof perf);
+
+    if (stream->replay_filename.empty()) {
+        receive_srt_stream(stream, &perf);
+    } else {
+        replay_capture(stream);
+    }
+    sample_stage(&stream->receive_usage, true);
+
+    // set done flag
+    stream->receiving_done.store(true);
+
+    // allow remuxing thread to consume whatever is left in ring buffer
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    stream->cond.notify_all(); // notify current thread and remuxing thread that we're done
+    remuxing_thread.join(); // join remuxing thread
+
+    // trailer is written before join, stream is watched till then
+    if (watch_id >= 0) {
+        watchdog.unwatch(watch_id);
+    }
+
+    double seconds = (av_gettime_relative() - start_time) / 1000000.0;
+    streams_active->add(-1);
+    account_memory(stream, MemoryRing, -int64_t(stream->buff.capacity()));
+
+    // summary is rendered up front and logged as one message, so it stays in one piece
+    std::ostringstream out;
+    if (!stream->stream_id.empty()) {
+        out << "Stream " << stream->stream_id << " -> " << stream->out_filename << '\n';
+    }
+
+    if (stream->replay_filename.empty()) {
+        out << "Received from SRT: " << stream->bytes_received << " bytes.\n";
+    } else {
+        out << "Replayed:          " << stream->bytes_received << " bytes.\n";
+    }
+    out << "Remuxed to FLV:    " << stream->bytes_remuxed.load() << " bytes.\n";
+    out << "Ring buffer full:  " << stream->ring_stalls << " times.\n";
+    out << "Latency, ingest to FLV tag written:\n";
+    stream->latency.print(out, "    ");
+    if (stream->replay_filename.empty()) {
+        out << "SRT packets lost:  " << perf.pktRcvLossTotal << ", dropped: " << perf.pktRcvDropTotal << ".\n";
+    }
+    out << "Time:              " << seconds << " s.\n";
+
+    // what the session cost, stages separately
+    const char* stage_names[2] = { stream->replay_filename.empty() ? "receive" : "replay", "remux" };
+    StageUsage* stages[2] = { &stream->receive_usage, &stream->remux_usage };
+    for (int i = 0; i < 2; i++) {
+        ThreadUsage usage = stages[i]->last - stages[i]->start;
+        out << "CPU " << stage_names[i] << ":" << std::string(14 - strlen(stage_names[i]), ' ')
+            << usage.cpu_us / 1000000.0 << " s, " << (seconds > 0 ? 100.0 * usage.cpu_us / 1000000.0 / seconds : 0) << "% of one core, "
+            << "context switches: " << usage.voluntary_switches << " voluntary, " << usage.involuntary_switches << " involuntary.\n";
+    }
+
+    out << "Memory peak:      ";
+    for (int i = 0; i < MemoryKinds; i++) {
+        out << " " << MemoryKindNames[i] << " " << stream->memory_peak[i].load() << (i + 1 < MemoryKinds ? "," : " bytes.");
+    }
+
+    Logger::log(LogInfo, "%s", out.str().c_str());
+}
+
+void receive_srt_stream(SrtStream* stream, SRT_TRACEBSTATS* perf) {
+    stream->last_message_time = av_gettime_relative();
+
+    // blocking receive, but not forever: teardown is only a flag
+    int timeout = ReceiveTimeout;
+    srt_setsockflag(stream->socket, SRTO_RCVTIMEO, &timeout, sizeof timeout);
 
     // receive data from SRT client
-    int i;
-    for (i = 0; i < 40000; i++) {
+    int i = 0;
+    while (i < 40000 && !stream->teardown.load()) {
         char msg[2048];
-        int st = srt_recvmsg(their_fd, msg, sizeof msg);
+        int st;
+        {
+            TraceScope trace("srt_recvmsg");
+            st = srt_recvmsg(stream->socket, msg, sizeof msg);
+        }
         if (st == SRT_ERROR) {
+            // SRTO_RCVTIMEO expired (SRT_ETIMEOUT on blocking socket, SRT_EASYNCRCV on
+            // non-blocking one): nothing wrong with the connection, teardown flag is checked
+            int error = srt_getlasterror(NULL);
+            if (error == SRT_ETIMEOUT || error == SRT_EASYNCRCV) {
+                continue;
+            }
             break;
         }
+        i++;
 
-        bytes_received_from_srt += st;
+        stream->bytes_received += st;
+        stream->metrics.bytes_received->add(st);
 
-        if (!remuxing_thread_done.load()) {
-            std::unique_lock<std::mutex> lk(buf_mutex);
+        if (stream->capture.is_open()) {
+            write_capture(stream, msg, st);
+        }
+
+        write_to_ring(stream, msg, st);
+        sample_stage(&stream->receive_usage, false);
+    }
+
+    // SRT side of the story, before socket is gone
+    srt_bstats(stream->socket, perf, 0);
+    srt_close(stream->socket);
+
+    if (stream->capture.is_open()) {
+        stream->capture.close();
+    }
+}
+
+// returns false when nobody reads ring buffer anymore
+bool write_to_ring(SrtStream* stream, const char* msg, int size) {
+    if (stream->remuxing_done.load()) {
+        return false;
+    }
 
-            // wait for available free space in ring buffer
-            while (buff.avail() < st) {
-                // are we done processing data?
-                if (receiving_srt_data_done.load()) {
-                    break;
-                }
+    // waiting for ring buffer space is part of latency
+    int64_t now = av_gettime_relative();
 
-                cond.wait(lk);   // wait till ringbuffer has enough available space again
+    std::unique_lock<std::mutex> lk(stream->buf_mutex);
+
+    // remuxing can't keep up. while we wait nobody reads SRT socket, its receive buffer fills
+    // up and sooner or later SRT starts dropping packets
+    if (stream->buff.avail() < size_t(size)) {
+        stream->ring_stalls++;
+        stream->metrics.ring_stalls->add(1);
+
+        TraceScope trace("ring wait space");
+
+        // wait for available free space in ring buffer
+        while (stream->buff.avail() < size_t(size)) {
+            // nobody reads ring buffer anymore, there will be no free space
+            if (stream->remuxing_done.load() || stream->teardown.load()) {
+                break;
             }
 
-            buff.write(msg, st); // write SRT bytes to ring buffer
-            cond.notify_one();   // wake up remuxing thread to continue data consumption from ring buffer
+            stream->cond.wait(lk);   // wait till ringbuffer has enough available space again
         }
     }
 
-    // set done flag
-    receiving_srt_data_done.store(true);
+    if (stream->remuxing_done.load() || stream->teardown.load()) {
+        stream->cond.notify_one();
+        return false;
+    }
 
-    // allow remuxing thread to consume whatever is left in ring buffer
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    stream->buff.write(msg, size); // write SRT bytes to ring buffer
+    stream->ring_offset += size;
+    stream->ingest_marks.push_back(std::make_pair(stream->ring_offset, now));
+    account_memory(stream, MemoryMarks, sizeof(std::pair<int64_t, int64_t>));
+    stream->metrics.ring_occupancy->set(stream->buff.size());
 
-    cond.notify_all(); // notify current thread and remuxing thread that we're done
-    remuxing_thread.join(); // join remuxing thread
+    stream->cond.notify_one();     // wake up remuxing thread to continue data consumption from ring buffer
 
-    std::cout << "Received from SRT: " << bytes_received_from_srt << " bytes.\n" << std::flush;
-    std::cout << "Remuxed to FLV:    " << bytes_remuxed_to_flv << " bytes.\n" << std::flush;
+    return true;
+}
 
-    stop_srt_server();
+bool open_capture(SrtStream* stream, const std::string& filename) {
+    // bigger buffer has to be set before file is opened
+    stream->capture_buffer.resize(CaptureBufferSize);
+    stream->capture.rdbuf()->pubsetbuf(&stream->capture_buffer[0], stream->capture_buffer.size());
 
-    return EXIT_SUCCESS;
+    stream->capture.open(filename.c_str(), std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+    if (!stream->capture.is_open()) {
+        Logger::log(LogError, "Could not open capture file %s for writing", filename.c_str());
+        return false;
+    }
+
+    stream->capture.write(CaptureMagic, CaptureMagicSize);
+    return true;
 }
 
-void remux_to_flv_worker(RingBuffer* buff, const char* out_filename) {
-    // create input format context
-    AVIOContext* avio_input_ctx = NULL; // this is IO (input/output) context, needed for i/o customizations
-    AVFormatContext* input_ctx = NULL;  // this is AV (audio/video) context
-    if (!make_input_ctx(&input_ctx, &avio_input_ctx, buff)) {
-        return;
+void write_capture(SrtStream* stream, const char* msg, int size) {
+    int64_t now = av_gettime_relative();
+    uint32_t delta = uint32_t(now - stream->last_message_time);
+    stream->last_message_time = now;
+
+    unsigned char header[CaptureRecordHeaderSize] = {
+        uint8_t(delta), uint8_t(delta >> 8), uint8_t(delta >> 16), uint8_t(delta >> 24),
+        uint8_t(size), uint8_t(size >> 8)
+    };
+
+    stream->capture.write((const char*)header, sizeof header);
+    stream->capture.write(msg, size);
+}
+
+bool replay_capture(SrtStream* stream) {
+    std::ifstream file(stream->replay_filename.c_str(), std::ifstream::binary | std::ifstream::in);
+    if (!file.is_open()) {
+        Logger::log(LogError, "Could not open capture file %s", stream->replay_filename.c_str());
+        return false;
     }
-    
-    // create output format context
-    AVFormatContext* output_ctx = NULL; // this is AV (audio/video) context
-    if (!make_output_ctx(&output_ctx, "flv", out_filename)) {
-        return;
+
+    char magic[CaptureMagicSize];
+    if (!file.read(magic, sizeof magic) || memcmp(magic, CaptureMagic, CaptureMagicSize) != 0) {
+        Logger::log(LogError, "%s is not a capture file", stream->replay_filename.c_str());
+        return false;
     }
 
-    // create streams map, filtering out all streams except audio/video
-    int* streams_map = NULL;
-    if (!make_streams_map(&input_ctx, &streams_map)) {
-        return;
+    int64_t start_time = av_gettime_relative();
+    int64_t message_time = 0;   // since start of capture
+
+    unsigned char header[CaptureRecordHeaderSize];
+    while (file.read((char*)header, sizeof header)) {
+        uint32_t delta = header[0] | (header[1] << 8) | (header[2] << 16) | (uint32_t(header[3]) << 24);
+        int size = header[4] | (header[5] << 8);
+
+        char msg[2048];
+        if (size > int(sizeof msg) || !file.read(msg, size)) {
+            Logger::log(LogError, "Capture file %s is broken", stream->replay_filename.c_str());
+            return false;
+        }
+
+        // original timing: message goes to ring buffer when it arrived from SRT, relative to start
+        message_time += delta;
+        if (!stream->replay_fast) {
+            int64_t ahead_us = message_time - (av_gettime_relative() - start_time);
+            if (ahead_us > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(ahead_us));
+            }
+        }
+
+        stream->bytes_received += size;
+        stream->metrics.bytes_received->add(size);
+
+        if (!write_to_ring(stream, msg, size)) {
+            break;
+        }
+        sample_stage(&stream->receive_usage, false);
     }
 
-    // init output context from input context (create output streams in output context, copying codec params from input)
-    if (!ctx_init_output_from_input(&input_ctx, &output_ctx)) {
-        return;
+    return true;
+}
+
+void remux_to_flv_worker(SrtStream* stream) {
+    name_thread(stream->remux_usage.thread_name);
+    start_stage(stream, &stream->remux_usage, "remux");
+
+    remux_to_flv(stream);
+    sample_stage(&stream->remux_usage, true);
+
+    // contexts are gone, whatever is still accounted to them with them
+    for (int i = MemoryAvio; i <= MemoryMarks; i++) {
+        account_memory(stream, MemoryKind(i), -stream->memory[i].load());
     }
 
-    // dump input and output formats/streams info
-    // https://ffmpeg.org/doxygen/trunk/group__lavf__misc.html#gae2645941f2dc779c307eb6314fd39f10
-    std::cout << "-------------------------------- IN ------------------------------------\n";
-    av_dump_format(input_ctx, 0, "", 0);
-    std::cout << "-------------------------------- OUT -----------------------------------\n";
-    av_dump_format(output_ctx, 0, out_filename, 1);
-    std::cout << "------------------------------------------------------------------------\n";
+    // whatever happened, receiving thread must not wait for ring buffer space anymore
+    std::lock_guard<std::mutex> lk(stream->buf_mutex);
+    stream->remuxing_done.store(true);
+    stream->cond.notify_all();
+}
 
-    // create and open output file and write file header
-    if (!open_output_file(&output_ctx, out_filename)) {
-        return;
+void remux_to_flv(SrtStream* stream) {
+    const char* out_filename = stream->out_filename.c_str();
+
+    AVIOContext* avio_input_ctx = NULL; // this is IO (input/output) context, needed for i/o customizations
+    AVFormatContext* input_ctx = NULL;  // this is AV (audio/video) context
+    AVFormatContext* output_ctx = NULL; // this is AV (audio/video) context
+    int* streams_map = NULL;
+
+    // create input and output format contexts, streams map filtering out all streams except
+    // audio/video, and init output context from input context (create output streams in output
+    // context, copying codec params from input)
+    bool ok = make_input_ctx(&input_ctx, &avio_input_ctx, stream) &&
+        make_output_ctx(&output_ctx, "flv", out_filename) &&
+        make_streams_map(&input_ctx, &streams_map) &&
+        ctx_init_output_from_input(&input_ctx, &output_ctx);
+
+    if (ok) {
+        // dump input and output formats/streams info
+        // https://ffmpeg.org/doxygen/trunk/group__lavf__misc.html#gae2645941f2dc779c307eb6314fd39f10
+        // goes to logger through av_log callback, along with the rest of libav messages
+        av_dump_format(input_ctx, 0, "", 0);
+        av_dump_format(output_ctx, 0, out_filename, 1);
+
+        // create and open output file and write file header, read input streams, remux them
+        // and write into output file, close output file
+        ok = open_output_file(&output_ctx, stream) &&
+            remux_streams(&input_ctx, &output_ctx, streams_map, stream) &&
+            close_output_file(&output_ctx, stream);
     }
 
-    // read input file streams, remux them and write into output file
-    if (!remux_streams(&input_ctx, &output_ctx, streams_map)) {
-        return;
+    // cleanup, whatever step failed. output closed by close_output_file() has no i/o context and
+    // file left, failed one has. memory accounting is reset by the caller
+    if (output_ctx && output_ctx->pb) {
+        av_freep(&output_ctx->pb->buffer);
+        avio_context_free(&output_ctx->pb);
     }
 
-    // close output file
-    if (!close_output_file(&output_ctx)) {
-        return;
+    if (stream->output_file) {
+        fclose(stream->output_file);
+        stream->output_file = NULL;
     }
 
-    // close input context
+    // custom input i/o context isn't freed with input context, its buffer may be reallocated by it
     avformat_close_input(&input_ctx);
+    if (avio_input_ctx) {
+        av_freep(&avio_input_ctx->buffer);
+        avio_context_free(&avio_input_ctx);
+    }
 
-    // cleanup: free memory
-    avformat_free_context(input_ctx);
     avformat_free_context(output_ctx);
     av_freep(&streams_map);
-    av_freep(&avio_input_ctx);
 }
 
 // this callback will be used for our custom i/o context (AVIOContext)
 static int read_callback(void* opaque, uint8_t* buf, int buf_size) {
-    auto& buff = *reinterpret_cast<RingBuffer*>(opaque);
+    TraceScope trace("read_callback");
 
-    std::unique_lock<std::mutex> lk(buf_mutex);
+    auto& stream = *reinterpret_cast<SrtStream*>(opaque);
+
+    std::unique_lock<std::mutex> lk(stream.buf_mutex);
 
     // wait for more data arrival
-    while (buff.size() == 0) {
-        if (receiving_srt_data_done.load()) {
-            return AVERROR_EOF; // this is the way to tell our input context that there's no more data
+    if (stream.buff.size() == 0) {
+        TraceScope wait_trace("ring wait data");
+
+        while (stream.buff.size() == 0) {
+            if (stream.teardown.load()) {
+                return AVERROR_EXIT;
+            }
+
+            if (stream.receiving_done.load()) {
+                return AVERROR_EOF; // this is the way to tell our input context that there's no more data
+            }
+
+            stream.cond.wait(lk);
         }
-        
-        cond.wait(lk);
     }
     
-    size_t read_size = buff.read((char*)buf, buf_size);
-    cond.notify_one();
+    size_t read_size = stream.buff.read((char*)buf, buf_size);
+    stream.cond.notify_one();
 
-    bytes_remuxed_to_flv += read_size;
+    stream.bytes_remuxed += read_size;
+    stream.metrics.bytes_remuxed->add(read_size);
+    stream.metrics.read_size->observe(read_size);
+    stream.metrics.ring_occupancy->set(stream.buff.size());
     return read_size;
 }
 
-bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, RingBuffer* buff) {
+bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, SrtStream* stream) {
     // now we need to allocate a memory buffer for our context to use. keep in mind, that buffer size
     // should be chosen correctly for various containers, this noticeably affectes performance
     // NOTE: this buffer is managed by AVIOContext and you should not deallocate by yourself
-    const size_t buffer_size = 8192;
-    unsigned char* ctx_buffer = (unsigned char*)(av_malloc(buffer_size));
+    unsigned char* ctx_buffer = (unsigned char*)(av_malloc(avio_buffer_size));
     if (ctx_buffer == NULL) {
-        std::cout << "Could not allocate read buffer for AVIOContext\n";
+        Logger::log(LogError, "Could not allocate read buffer for AVIOContext");
         return false;
     }
+    account_memory(stream, MemoryAvio, avio_buffer_size);
 
     // let's setup a custom AVIOContext for AVFormatContext
 
-    // cast reader to convenient short variable
-    void* reader_ptr = reinterpret_cast<void*>(static_cast<RingBuffer*>(buff));
+    // cast reader to convenient short variable, read callback gets the whole stream: ring buffer and its lock
+    void* reader_ptr = reinterpret_cast<void*>(static_cast<SrtStream*>(stream));
 
     // now the important part, we need to create a custom AVIOContext, provide it buffer and
     // buffer size for reading and read callback that will do the actual reading into the buffer
     *avio_input_ctx = avio_alloc_context(
         ctx_buffer,        // memory buffer
-        buffer_size,       // memory buffer size
+        avio_buffer_size,  // memory buffer size
         0,                 // 0 for reading, 1 for writing. we're reading, so — 0.
         reader_ptr,        // pass our reader to context, it will be transparenty passed to read callback on each invocation
         &read_callback,    // out read callback
@@ -243,13 +993,13 @@ bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, R
     // note "some_dummy_filename", ffmpeg requires it as some default non-empty placeholder
     int ret = avformat_open_input(input_ctx, "some_dummy_filename", NULL, NULL);
     if (ret < 0) {
-        std::cout << "Could not open input stream, reason: " << av_err2str(ret) << '\n';
+        Logger::log(LogError, "Could not open input stream, reason: %s", av_err2str(ret));
         return false;
     }
 
     ret = avformat_find_stream_info(*input_ctx, NULL);
     if (ret < 0) {
-        std::cout << "Failed to retrieve input stream information, reason: " << av_err2str(ret) << '\n';
+        Logger::log(LogError, "Failed to retrieve input stream information, reason: %s", av_err2str(ret));
         return false;
     }
 
@@ -259,12 +1009,12 @@ bool make_input_ctx(AVFormatContext** input_ctx, AVIOContext** avio_input_ctx, R
 bool make_output_ctx(AVFormatContext** output_ctx, const char* format_name, const char* filename) {
     int ret = avformat_alloc_output_context2(output_ctx, NULL, format_name, filename);
     if (ret < 0) {
-        std::cout << "Could not create output context, reason: " << av_err2str(ret) << '\n';
+        Logger::log(LogError, "Could not create output context, reason: %s", av_err2str(ret));
         return false;
     }
 
     if (!(*output_ctx)) {
-        std::cout << "Could not create output context, no further details.\n";
+        Logger::log(LogError, "Could not create output context, no further details.");
         return false;
     }
 
@@ -278,7 +1028,7 @@ bool make_streams_map(AVFormatContext** input_ctx, int** streams_map) {
 
     smap = (int*)av_mallocz_array(input_streams_count, sizeof(int));
     if (!smap) {
-        std::cout << "Could not allocate streams list.\n";
+        Logger::log(LogError, "Could not allocate streams list.");
         return false;
     }
 
@@ -309,13 +1059,13 @@ bool ctx_init_output_from_input(AVFormatContext** input_ctx, AVFormatContext** o
 
         AVStream* out_stream = avformat_new_stream(*output_ctx, NULL);
         if (!out_stream) {
-            std::cout << "Failed allocating output stream\n";
+            Logger::log(LogError, "Failed allocating output stream");
             return false;
         }
 
         int ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
         if (ret < 0) {
-            std::cout << "Failed to copy codec parameters, reason: " << av_err2str(ret) << '\n';
+            Logger::log(LogError, "Failed to copy codec parameters, reason: %s", av_err2str(ret));
             return false;
         }
 
@@ -326,45 +1076,112 @@ bool ctx_init_output_from_input(AVFormatContext** input_ctx, AVFormatContext** o
     return true;
 }
 
-bool open_output_file(AVFormatContext** output_ctx, const char* filename) {
-    // unless it's a no file (we'll talk later about that) write to the disk (FLAG_WRITE)
-    // but basically it's a way to save the file to a buffer so you can store it
-    // wherever you want.
-    int ret = avio_open(&((*output_ctx)->pb), filename, AVIO_FLAG_WRITE);
-    if (ret < 0) {
-        std::cout << "Could not open output file " << filename << ", reason: " << av_err2str(ret) << '\n';
+// output goes through our own AVIOContext, write callback sees bytes when they actually leave
+static int write_callback(void* opaque, uint8_t* buf, int buf_size) {
+    TraceScope trace("write_callback");
+    int64_t start_time = av_gettime_relative();
+
+    auto& stream = *reinterpret_cast<SrtStream*>(opaque);
+
+    if (stream.teardown.load()) {
+        return AVERROR_EXIT;
+    }
+
+    if (fwrite(buf, 1, buf_size, stream.output_file) != size_t(buf_size)) {
+        return AVERROR(EIO);
+    }
+
+    flv_tags_written(&stream, buf, buf_size);
+
+    stream.metrics.write_size->observe(buf_size);
+    stream.metrics.write_time->observe(av_gettime_relative() - start_time);
+    stream.last_write_time.store(av_gettime_relative());
+    return buf_size;
+}
+
+// FLV muxer seeks back on trailer to write duration and file size into header
+static int64_t seek_callback(void* opaque, int64_t offset, int whence) {
+    auto& stream = *reinterpret_cast<SrtStream*>(opaque);
+
+    if (whence & AVSEEK_SIZE) {
+        return AVERROR(ENOSYS);
+    }
+
+    stream.flv_rewriting = true;
+    if (fseeko(stream.output_file, offset, whence & ~AVSEEK_FORCE) != 0) {
+        return AVERROR(EIO);
+    }
+
+    return ftello(stream.output_file);
+}
+
+bool open_output_file(AVFormatContext** output_ctx, SrtStream* stream) {
+    const char* filename = stream->out_filename.c_str();
+
+    stream->output_file = fopen(filename, "wb");
+    if (!stream->output_file) {
+        Logger::log(LogError, "Could not open output file %s", filename);
         return false;
     }
 
+    // NOTE: this buffer is managed by AVIOContext and you should not deallocate it by yourself
+    unsigned char* ctx_buffer = (unsigned char*)(av_malloc(avio_buffer_size));
+    if (ctx_buffer == NULL) {
+        Logger::log(LogError, "Could not allocate write buffer for AVIOContext");
+        return false;
+    }
+    account_memory(stream, MemoryAvio, avio_buffer_size);
+
+    (*output_ctx)->pb = avio_alloc_context(
+        ctx_buffer,        // memory buffer
+        avio_buffer_size,  // memory buffer size
+        1,                 // 0 for reading, 1 for writing. we're writing, so — 1.
+        stream,            // passed to write and seek callbacks
+        NULL,              // read callback — we don't need one
+        &write_callback,   // our write callback
+        &seek_callback     // our seek callback
+    );
+    (*output_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
     // https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga18b7b10bb5b94c4842de18166bc677cb
-    ret = avformat_write_header(*output_ctx, NULL);
+    int ret = avformat_write_header(*output_ctx, NULL);
     if (ret < 0) {
-        std::cout << "Failed to write output file header to " << filename << ", reason: " << av_err2str(ret) << '\n';
+        Logger::log(LogError, "Failed to write output file header to %s, reason: %s", filename, av_err2str(ret));
         return false;
     }
 
     return true;
 }
 
-bool remux_streams(AVFormatContext** input_ctx, AVFormatContext** output_ctx, int* streams_map) {
+bool remux_streams(AVFormatContext** input_ctx, AVFormatContext** output_ctx, int* streams_map, SrtStream* stream) {
     AVPacket packet;
     int input_streams_count = (*input_ctx)->nb_streams;
 
     while (1) {
-        int ret = av_read_frame(*input_ctx, &packet);
+        int64_t packet_start = av_gettime_relative();
+
+        int ret;
+        {
+            TraceScope trace("av_read_frame");
+            ret = av_read_frame(*input_ctx, &packet);
+        }
         if (ret == AVERROR_EOF) { // we have reached end of input file
             break;
         }
 
         // handle any other error
         if (ret < 0) {
-            std::cout << "Failed to read packet from input, reason: " << av_err2str(ret) << '\n';
+            Logger::log(LogError, "Failed to read packet from input, reason: %s", av_err2str(ret));
             return false;
         }
 
+        int packet_size = packet.size;
+        account_memory(stream, MemoryPackets, packet_size);
+
         // ignore any packets that are present in non-mapped streams
         if (packet.stream_index >= input_streams_count || streams_map[packet.stream_index] < 0) {
             av_packet_unref(&packet);
+            account_memory(stream, MemoryPackets, -packet_size);
             continue;
         }
 
@@ -375,102 +1192,248 @@ bool remux_streams(AVFormatContext** input_ctx, AVFormatContext** output_ctx, in
         AVStream* in_stream  = (*input_ctx)->streams[packet.stream_index];
         AVStream* out_stream = (*output_ctx)->streams[packet.stream_index];
 
-        AVRounding avr = (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
-        packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base, avr);
-        packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base, avr);
-        packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
+        {
+            TraceScope trace("rescale");
+
+            AVRounding avr = (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+            packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base, avr);
+            packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base, avr);
+            packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
+        }
+
+        // packet tag is written in this call or later one, FLV keeps order of audio and video tags
+        // as they're given to muxer, so ingest times are queued by media type
+        int type = out_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO ? 1 : 0;
+        stream->pending[type].push_back(ingest_time(stream, packet.pos));
+        account_memory(stream, MemoryPackets, sizeof(int64_t));
 
         // https://ffmpeg.org/doxygen/trunk/structAVPacket.html#ab5793d8195cf4789dfb3913b7a693903
         packet.pos = -1;
 
         //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga37352ed2c63493c38219d935e71db6c1
-        ret = av_interleaved_write_frame(*output_ctx, &packet);
+        {
+            TraceScope trace("av_interleaved_write_frame");
+            ret = av_interleaved_write_frame(*output_ctx, &packet);
+        }
         if (ret < 0) {
-            std::cout << "Failed to write packet to output, reason: " << av_err2str(ret) << '\n';
+            Logger::log(LogError, "Failed to write packet to output, reason: %s", av_err2str(ret));
             return false;
         }
 
+        stream->metrics.packets_remuxed->add(1);
+        stream->metrics.remux_time->observe(av_gettime_relative() - packet_start);
+
         av_packet_unref(&packet);
+        account_memory(stream, MemoryPackets, -packet_size);
+        sample_stage(&stream->remux_usage, false);
     }
 
     return true;
 }
 
-bool close_output_file(AVFormatContext** output_ctx) {
+bool close_output_file(AVFormatContext** output_ctx, SrtStream* stream) {
     //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga7f14007e7dc8f481f054b21614dfec13
     int ret = av_write_trailer(*output_ctx);
     if (ret < 0) {
-        std::cout << "Failed to write trailer to output, reason: " << av_err2str(ret) << '\n';
+        Logger::log(LogError, "Failed to write trailer to output, reason: %s", av_err2str(ret));
         return false;
     }
 
-    /* close output */
-    if (output_ctx && !((*output_ctx)->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_closep(&(*output_ctx)->pb);
-        if (ret < 0) {
-            std::cout << "Failed to close AV output, reason: " << av_err2str(ret) << '\n';
-            return false;
-        }
+    /* close output, custom i/o context is ours to free */
+    avio_flush((*output_ctx)->pb);
+    account_memory(stream, MemoryAvio, -int64_t(avio_buffer_size));
+    av_freep(&(*output_ctx)->pb->buffer);
+    avio_context_free(&(*output_ctx)->pb);
+
+    if (fclose(stream->output_file) != 0) {
+        Logger::log(LogError, "Failed to close output file %s", stream->out_filename.c_str());
+        return false;
     }
+    stream->output_file = NULL;
 
     return true;
 }
 
-int start_srt_server(const char* ip, const char* port) {
+// time data at given input position came from SRT, -1 if unknown
+int64_t ingest_time(SrtStream* stream, int64_t pos) {
+    if (pos < 0) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lk(stream->buf_mutex);
+
+    std::deque<std::pair<int64_t, int64_t> >& marks = stream->ingest_marks;
+    while (!marks.empty() && marks.front().first + IngestMarksWindow <= pos) {
+        marks.pop_front();
+        account_memory(stream, MemoryMarks, -int64_t(sizeof(std::pair<int64_t, int64_t>)));
+    }
+
+    // first mark ending after pos, marks are sorted by ring offset
+    std::deque<std::pair<int64_t, int64_t> >::const_iterator it = std::upper_bound(marks.begin(), marks.end(),
+        std::make_pair(pos, std::numeric_limits<int64_t>::max()));
+    if (it == marks.end()) {
+        return -1;
+    }
+
+    return it->second;
+}
+
+// follows FLV tags in bytes leaving AVIOContext. tag header is only 11 bytes, but it can still be
+// split between two writes, it's collected till complete. first two bytes of tag data tell frames
+// from AVC and AAC sequence headers, which muxer writes on its own and which are not packets
+void flv_tags_written(SrtStream* stream, const uint8_t* buf, int buf_size) {
+    if (stream->flv_rewriting) {
+        return;
+    }
+
+    int i = 0;
+    while (i < buf_size) {
+        if (stream->flv_skip > 0) {
+            int64_t n = std::min(stream->flv_skip, int64_t(buf_size - i));
+            stream->flv_skip -= n;
+            i += n;
+            continue;
+        }
+
+        stream->flv_header[stream->flv_header_size++] = buf[i++];
+        if (stream->flv_header_size < FlvTagHeaderSize + FlvTagPeekSize) {
+            continue;
+        }
+
+        const unsigned char* h = stream->flv_header;
+        int tag_type = h[0] & 0x1f;
+        int64_t data_size = (h[1] << 16) | (h[2] << 8) | h[3];
+        stream->flv_skip = std::max(data_size - FlvTagPeekSize, int64_t(0)) + 4;
+        stream->flv_header_size = 0;
+
+        bool frame = false;
+        if (tag_type == FlvTagVideo) {
+            int codec_id = h[FlvTagHeaderSize] & 0x0f;
+            frame = (codec_id != 7 && codec_id != 12) || h[FlvTagHeaderSize + 1] == 1;   // AVC/HEVC NALUs
+        } else if (tag_type == FlvTagAudio) {
+            int sound_format = h[FlvTagHeaderSize] >> 4;
+            frame = sound_format != 10 || h[FlvTagHeaderSize + 1] == 1;                 // AAC raw
+        }
+
+        // script data tags (onMetaData) and sequence headers
+        if (!frame) {
+            continue;
+        }
+
+        std::deque<int64_t>& pending = stream->pending[tag_type == FlvTagVideo ? 1 : 0];
+        if (pending.empty()) {
+            continue;
+        }
+
+        int64_t ingested = pending.front();
+        pending.pop_front();
+        account_memory(stream, MemoryPackets, -int64_t(sizeof(int64_t)));
+        if (ingested >= 0) {
+            int64_t latency = av_gettime_relative() - ingested;
+            stream->latency.add(latency);
+            stream->metrics.latency->observe(latency);
+        }
+    }
+}
+
+bool start_srt_server(const char* ip, const char* port, int backlog) {
     struct sockaddr_in sa;
-    struct sockaddr_storage their_addr;
 
-    printf("srt startup\n");
+    Logger::log(LogDebug, "srt startup");
     srt_startup();
 
-    printf("srt socket\n");
+    Logger::log(LogDebug, "srt socket");
     srt_server_socket = srt_create_socket();
     if (srt_server_socket == SRT_ERROR) {
-        fprintf(stderr, "srt_socket: %s\n", srt_getlasterror_str());
-        return 1;
+        Logger::log(LogError, "srt_socket: %s", srt_getlasterror_str());
+        return false;
     }
 
-    printf("srt bind address\n");
+    Logger::log(LogDebug, "srt bind address");
     sa.sin_family = AF_INET;
     sa.sin_port = htons(atoi(port));
     if (inet_pton(AF_INET, ip, &sa.sin_addr) != 1) {
-        return 1;
+        return false;
     }
 
-    printf("srt setsockflag SRTO_RCVSYN = true\n");
+    Logger::log(LogDebug, "srt setsockflag SRTO_RCVSYN = true");
     int yes = 1;
     srt_setsockflag(srt_server_socket, SRTO_RCVSYN, &yes, sizeof yes);
 
-    printf("srt bind\n");
+    Logger::log(LogDebug, "srt bind");
     int st = srt_bind(srt_server_socket, (struct sockaddr*)&sa, sizeof sa);
     if (st == SRT_ERROR) {
-        fprintf(stderr, "srt_bind: %s\n", srt_getlasterror_str());
-        return 1;
+        Logger::log(LogError, "srt_bind: %s", srt_getlasterror_str());
+        return false;
     }
 
-    printf("srt listen\n");
-    st = srt_listen(srt_server_socket, 2);
+    // clients connecting at the same time wait in backlog till we accept them
+    Logger::log(LogDebug, "srt listen");
+    st = srt_listen(srt_server_socket, backlog > 2 ? backlog : 2);
     if (st == SRT_ERROR) {
-        fprintf(stderr, "srt_listen: %s\n", srt_getlasterror_str());
-        return 1;
+        Logger::log(LogError, "srt_listen: %s", srt_getlasterror_str());
+        return false;
     }
 
-    printf("srt accept\n");
+    return true;
+}
+
+SRTSOCKET accept_srt_client(std::string* stream_id) {
+    struct sockaddr_storage their_addr;
+
+    Logger::log(LogDebug, "srt accept");
     int addr_size = sizeof their_addr;
     SRTSOCKET client_socket = srt_accept(srt_server_socket, (struct sockaddr *)&their_addr, &addr_size);
+    if (client_socket == SRT_INVALID_SOCK) {
+        Logger::log(LogError, "srt_accept: %s", srt_getlasterror_str());
+        return SRT_INVALID_SOCK;
+    }
 
-    printf("srt client connected\n");
+    // stream id is set by client before connecting (SRTO_STREAMID), it tells streams apart
+    char id[512];
+    int id_size = sizeof id;
+    if (srt_getsockflag(client_socket, SRTO_STREAMID, id, &id_size) != SRT_ERROR && id_size > 0) {
+        stream_id->assign(id, id_size);
+    }
+
+    Logger::log(LogInfo, "srt client connected %s", stream_id->c_str());
     return client_socket;
 }
 
+// "out.flv" -> "out_<stream id>.flv", stream index when client didn't set stream id.
+// stream id comes from network, only safe characters go to file name
+std::string stream_filename(const char* filename, const std::string& stream_id, int index) {
+    std::string suffix;
+    for (size_t i = 0; i < stream_id.size(); i++) {
+        char c = stream_id[i];
+        if (isalnum((unsigned char)c) || c == '-' || c == '_') {
+            suffix += c;
+        }
+    }
+
+    if (suffix.empty()) {
+        suffix = std::to_string(index);
+    }
+
+    std::string name = filename;
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos || name.find('/', dot) != std::string::npos) {
+        return name + "_" + suffix;
+    }
+
+    return name.substr(0, dot) + "_" + suffix + name.substr(dot);
+}
+
 int stop_srt_server() {
-    printf("srt close\n");
+    Logger::log(LogDebug, "srt close");
 
     if (srt_close(srt_server_socket) == SRT_ERROR) {
-        fprintf(stderr, "srt_close: %s\n", srt_getlasterror_str());
+        Logger::log(LogError, "srt_close: %s", srt_getlasterror_str());
         return 1;
     }
 
-    printf("srt cleanup\n");
+    Logger::log(LogDebug, "srt cleanup");
     srt_cleanup();
+
+    return 0;
 }
\ No newline at end of file
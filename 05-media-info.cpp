@@ -0,0 +1,170 @@
+/*
+*
+* File: 05-media-info.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* libav media info example.
+* scan files and directory trees and print media info (container, duration, streams, codecs,
+* video size, audio sample rate etc.) of every file as JSON, one line per file. files are
+* scanned in parallel on a thread pool. only container headers are read unless they miss
+* something, results are cached, so rescan of unchanged files costs nothing.
+* see media_scanner.hpp/media_scanner.cpp for the scanner
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "thread_pool.hpp"
+#include "media_scanner.hpp"
+
+// functions predeclarations
+void print_usage(const char* name);
+bool parse_options(int argc, char** argv, ScanOptions* options, int* jobs, std::string* cache_filename, int* first_arg);
+void walk(const std::string& path, ThreadPool* pool, MediaScanner* scanner, std::mutex* print_mutex);
+void scan_file(const std::string& path, MediaScanner* scanner, std::mutex* print_mutex);
+
+int main(int argc, char** argv) {
+    ScanOptions options;
+    int jobs = std::thread::hardware_concurrency();
+    std::string cache_filename;
+    int first_arg = 0;
+
+    if (!parse_options(argc, argv, &options, &jobs, &cache_filename, &first_arg) || first_arg >= argc) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // errors go to JSON output, libav complaints about non-media files are just noise
+    av_log_set_level(AV_LOG_QUIET);
+
+    MediaScanner scanner(options);
+    if (!cache_filename.empty()) {
+        scanner.load_cache(cache_filename.c_str());
+    }
+
+    std::mutex print_mutex;
+
+    // directories are walked on main thread, files are scanned on the pool
+    {
+        ThreadPool pool(jobs > 0 ? jobs : 1);
+        for (int i = first_arg; i < argc; i++) {
+            walk(argv[i], &pool, &scanner, &print_mutex);
+        }
+        pool.wait();
+    }
+
+    if (!cache_filename.empty() && !scanner.save_cache(cache_filename.c_str())) {
+        std::cerr << "Failed to save cache to " << cache_filename << '\n';
+    }
+
+    // summary goes to stderr, stdout is JSON lines only
+    std::cerr << "cached: " << scanner.count(SCAN_CACHE)
+              << ", headers: " << scanner.count(SCAN_HEADER)
+              << ", probed: " << scanner.count(SCAN_PROBE)
+              << ", errors: " << scanner.count(SCAN_ERROR) << '\n';
+
+    return EXIT_SUCCESS;
+}
+
+// scan file or every file in directory tree
+void walk(const std::string& path, ThreadPool* pool, MediaScanner* scanner, std::mutex* print_mutex) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        std::cerr << "Could not stat " << path << '\n';
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        pool->submit(std::bind(scan_file, path, scanner, print_mutex));
+        return;
+    }
+
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        std::cerr << "Could not open directory " << path << '\n';
+        return;
+    }
+
+    while (struct dirent* entry = readdir(dir)) {
+        // symlinks are not followed inside directories, they may loop
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || entry->d_type == DT_LNK) {
+            continue;
+        }
+
+        walk(path + "/" + entry->d_name, pool, scanner, print_mutex);
+    }
+
+    closedir(dir);
+}
+
+void scan_file(const std::string& path, MediaScanner* scanner, std::mutex* print_mutex) {
+    ScanSource source;
+    std::string json = scanner->scan(path.c_str(), &source);
+
+    std::lock_guard<std::mutex> lk(*print_mutex);
+    std::cout << json << '\n';
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [options] <file or directory> [file or directory ...]\n"
+              << "Options:\n"
+              << "  -j <n>           files scanned in parallel, default: number of cores\n"
+              << "  -c <file>        cache file, loaded before and saved after scan, default: no cache\n"
+              << "  -probesize <kb>  max data read when headers are not enough, default: 1024\n"
+              << "  -analyze <ms>    max duration analyzed when headers are not enough, default: 1000\n"
+              << "  -full            always probe streams with unlimited avformat_find_stream_info()\n";
+}
+
+bool parse_options(int argc, char** argv, ScanOptions* options, int* jobs, std::string* cache_filename, int* first_arg) {
+    int i = 1;
+
+    // options go first, everything after them is positional arguments
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        const char* name = argv[i];
+
+        // flags, options without value
+        if (strcmp(name, "-full") == 0) {
+            options->full_probe = true;
+            i--;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            return false;
+        }
+
+        const char* value = argv[i + 1];
+
+        if (strcmp(name, "-j") == 0) {
+            *jobs = atoi(value);
+        } else if (strcmp(name, "-c") == 0) {
+            *cache_filename = value;
+        } else if (strcmp(name, "-probesize") == 0) {
+            options->probesize = atoll(value) * 1024;
+        } else if (strcmp(name, "-analyze") == 0) {
+            options->analyze_duration = atoll(value) * 1000;
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            return false;
+        }
+    }
+
+    *first_arg = i;
+    return true;
+}
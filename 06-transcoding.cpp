@@ -0,0 +1,353 @@
+/*
+*
+* File: 06-transcoding.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* multi-threaded libav transcoding example.
+* read video file from disk, decode video, scale it, encode with x264 and write resulting
+* FLV file to disk. audio is copied, or transcoded to AAC on its own thread where needed (see
+* auto mode and -aac below). decoding, scaling and encoding run as separate pipeline stages on
+* their own threads, see transcoder.hpp/transcoder.cpp for the engine.
+* per stage fps is printed while transcoding, so you can see which stage is the bottleneck.
+* for 4K input scaling threads can also split every frame into slices (-sl option)
+*
+* ladder mode (-r option) produces several renditions of the same input in one go, e.g. for
+* adaptive streaming: video is decoded once, every rendition has its own scaler and encoder
+* and keyframes are aligned between renditions
+*
+* auto mode (-auto option) transcodes only streams FLV can't carry: h264 video and aac/mp3 audio
+* are copied as is, everything else is re-encoded (video with x264, audio with fdk-aac). typical
+* broadcast input with h264 video and AC-3 audio costs little more than a remux this way.
+* transcoded audio is normalized to 48 kHz stereo, -aac option transcodes all audio streams
+*
+* autotune mode (-autotune option) is for live transcoding: every encoder measures its own speed and
+* moves through x264 presets and threads on GOP boundaries, keeping the best quality which still
+* keeps up with real time. -calibrate measures presets speed on a sample clip and saves it as per-host
+* profile, autotune uses it to predict speed of other presets
+*
+* several input/output file pairs run as concurrent sessions sharing the host (see core_scheduler.hpp):
+* every session gets its own block of cores, decoder and encoder threads are sized to it and
+* pinned there. when a session finishes its cores go to the rest. -cores option turns scheduler on
+* for single session too, or limits cores all sessions share
+*
+* input file requirements:
+* - video can be encoded with any codec libavcodec can decode
+* - audio must be encoded with mp3 or aac codecs, unless auto mode is on
+* the above are FLV container limitations
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "helpers.hpp"
+#include "transcoder.hpp"
+#include "core_scheduler.hpp"
+
+// one input file transcoded to its renditions, runs on its own thread
+struct Session {
+    const char* in_filename;
+    std::vector<RenditionOptions> ladder;
+    bool ok;
+};
+
+// functions predeclarations
+void print_usage(const char* name);
+bool parse_options(int argc, char** argv, TranscodeOptions* options, std::vector<RenditionOptions>* ladder, std::string* calibrate_profile, int* cores, int* first_arg);
+bool parse_rendition(const char* value, RenditionOptions* rendition);
+bool calibrate(const char* profile_filename, const char* clip_filename, const TranscodeOptions& options);
+void run_session(Session* session, const TranscodeOptions& options, CoreScheduler* scheduler, std::mutex* print_mutex);
+
+int main(int argc, char** argv) {
+    TranscodeOptions options;
+    std::vector<RenditionOptions> ladder;
+    std::string calibrate_profile;
+    int cores = -1;
+    int first_arg = 0;
+
+    if (!parse_options(argc, argv, &options, &ladder, &calibrate_profile, &cores, &first_arg)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // calibration takes sample clip only, nothing is written except the profile
+    if (!calibrate_profile.empty()) {
+        if (argc - first_arg != 1) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        return calibrate(calibrate_profile.c_str(), argv[first_arg], options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // in ladder mode output files come with renditions, only input file is expected. otherwise
+    // every input/output file pair is a session
+    int args = argc - first_arg;
+    if (ladder.empty() ? (args < 2 || args % 2 != 0) : args != 1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Session> sessions;
+
+    if (!ladder.empty()) {
+        Session session = { argv[first_arg], ladder, false };
+        sessions.push_back(session);
+    }
+
+    for (int i = first_arg; ladder.empty() && i < argc; i += 2) {
+        RenditionOptions rendition;
+        rendition.filename = argv[i + 1];
+        rendition.width = options.width;
+        rendition.height = options.height;
+        rendition.video_bitrate = options.video_bitrate;
+
+        Session session = { argv[i], std::vector<RenditionOptions>(1, rendition), false };
+        sessions.push_back(session);
+    }
+
+    // renditions are switched by players at keyframes, they must be at the same positions
+    options.align_keyframes = ladder.size() > 1;
+
+    // single session runs alone unless asked otherwise, several ones share cores
+    CoreScheduler* scheduler = NULL;
+    if (sessions.size() > 1 || cores >= 0) {
+        scheduler = new CoreScheduler(cores > 0 ? cores : 0);
+        std::cout << "Scheduler: " << sessions.size() << " sessions share " << scheduler->cores() << " cores\n";
+    }
+
+    // periodic stats of several sessions would be unreadable, they print final stats only
+    if (sessions.size() > 1) {
+        options.stats_interval_ms = 0;
+    }
+
+    std::mutex print_mutex;
+
+    if (sessions.size() == 1) {
+        run_session(&sessions[0], options, scheduler, &print_mutex);
+    } else {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < sessions.size(); i++) {
+            threads.push_back(std::thread(run_session, &sessions[i], options, scheduler, &print_mutex));
+        }
+
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+    }
+
+    delete scheduler;
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (!sessions[i].ok) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void run_session(Session* session, const TranscodeOptions& options, CoreScheduler* scheduler, std::mutex* print_mutex) {
+    // open input, decoder, encoders and output files
+    Transcoder transcoder(options, scheduler);
+    if (!transcoder.open(session->in_filename, session->ladder)) {
+        return;
+    }
+
+    // dump input and output formats/streams info
+    {
+        std::lock_guard<std::mutex> lk(*print_mutex);
+        transcoder.dump_formats();
+    }
+
+    // run the pipeline till the end of input
+    if (!transcoder.run()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(*print_mutex);
+    if (scheduler) {
+        std::cout << "Session " << session->in_filename << ":\n";
+    }
+    transcoder.print_stats(true);
+
+    session->ok = true;
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [options] <input file> <output file> [<input file> <output file> ...]\n"
+              << "       " << name << " [options] -r <rendition> [-r <rendition> ...] <input file>\n"
+              << "       " << name << " [-s <WxH>] -calibrate <profile> <sample clip>\n"
+              << "Options:\n"
+              << "  -r <WxH:kbps:file> add ladder rendition, e.g. -r 1280x720:2800:out_720.flv\n"
+              << "  -f <format>      output container, default: flv\n"
+              << "  -auto            copy streams FLV can carry, transcode only the rest\n"
+              << "  -aac             transcode every audio stream to AAC, not only ones FLV can't carry\n"
+              << "  -ar <hz>         transcoded audio sample rate, default: 48000\n"
+              << "  -ac <n>          transcoded audio channels, default: 2\n"
+              << "  -ab <bitrate>    transcoded audio bitrate in kbit/s, default: 128\n"
+              << "  -s <WxH>         output video size, default: same as input\n"
+              << "  -b <bitrate>     video bitrate in kbit/s, default: constant quality\n"
+              << "  -crf <n>         x264 constant rate factor, default: 23\n"
+              << "  -preset <name>   x264 preset, default: veryfast\n"
+              << "  -autotune        change x264 preset and threads on the fly to keep up with real time\n"
+              << "  -headroom <x>    autotune: encoder must be this many times faster than real time, default: 1.2\n"
+              << "  -profile <file>  autotune: host profile made by -calibrate, default: x264_<hostname>.profile\n"
+              << "  -calibrate <file> measure speed of every x264 preset on sample clip, save host profile to file\n"
+              << "  -g <frames>      keyframe interval, default: 2 seconds\n"
+              << "  -dt <n>          decoder threads, default: auto\n"
+              << "  -st <n>          scaling threads per rendition, default: 2\n"
+              << "  -sl <n>          slices every scaling thread splits frame into, default: 1\n"
+              << "  -sa <name>       scaling algorithm: neighbor, fast_bilinear, bilinear, area, bicublin,\n"
+              << "                   bicubic, experimental, gauss, lanczos, spline, sinc. default: bicubic\n"
+              << "  -et <n>          encoder threads per rendition, default: auto\n"
+              << "  -cores <n>       cores shared by sessions, 0 for all, default: scheduler is on for several sessions only\n"
+              << "  -q <frames>      queue size between stages, default: 8\n"
+              << "  -stats <ms>      stats print interval, 0 to disable, default: 1000, several sessions print final stats only\n";
+}
+
+bool parse_options(int argc, char** argv, TranscodeOptions* options, std::vector<RenditionOptions>* ladder, std::string* calibrate_profile, int* cores, int* first_arg) {
+    int i = 1;
+
+    // options go first, everything after them is positional arguments
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        const char* name = argv[i];
+
+        // flags, options without value
+        if (strcmp(name, "-auto") == 0) {
+            options->auto_passthrough = true;
+            i--;
+            continue;
+        }
+
+        if (strcmp(name, "-aac") == 0) {
+            options->transcode_audio = true;
+            i--;
+            continue;
+        }
+
+        if (strcmp(name, "-autotune") == 0) {
+            options->autotune = true;
+            i--;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            return false;
+        }
+
+        const char* value = argv[i + 1];
+
+        if (strcmp(name, "-f") == 0) {
+            options->format_name = value;
+        } else if (strcmp(name, "-s") == 0) {
+            if (sscanf(value, "%dx%d", &options->width, &options->height) != 2) {
+                std::cout << "Invalid size " << value << '\n';
+                return false;
+            }
+        } else if (strcmp(name, "-r") == 0) {
+            RenditionOptions rendition;
+            if (!parse_rendition(value, &rendition)) {
+                std::cout << "Invalid rendition " << value << '\n';
+                return false;
+            }
+            ladder->push_back(rendition);
+        } else if (strcmp(name, "-b") == 0) {
+            options->video_bitrate = atoll(value) * 1000;
+        } else if (strcmp(name, "-ar") == 0) {
+            options->audio_sample_rate = atoi(value);
+        } else if (strcmp(name, "-ac") == 0) {
+            options->audio_channels = atoi(value);
+        } else if (strcmp(name, "-ab") == 0) {
+            options->audio_bitrate = atoll(value) * 1000;
+        } else if (strcmp(name, "-crf") == 0) {
+            options->crf = atoi(value);
+        } else if (strcmp(name, "-preset") == 0) {
+            options->x264_preset = value;
+        } else if (strcmp(name, "-headroom") == 0) {
+            options->autotune_headroom = atof(value);
+        } else if (strcmp(name, "-profile") == 0) {
+            options->autotune_profile = value;
+        } else if (strcmp(name, "-calibrate") == 0) {
+            *calibrate_profile = value;
+        } else if (strcmp(name, "-g") == 0) {
+            options->gop_size = atoi(value);
+        } else if (strcmp(name, "-dt") == 0) {
+            options->decode_threads = atoi(value);
+        } else if (strcmp(name, "-st") == 0) {
+            options->scale_threads = atoi(value);
+        } else if (strcmp(name, "-sl") == 0) {
+            options->slice_threads = atoi(value);
+        } else if (strcmp(name, "-sa") == 0) {
+            options->scaler = value;
+        } else if (strcmp(name, "-et") == 0) {
+            options->encode_threads = atoi(value);
+        } else if (strcmp(name, "-cores") == 0) {
+            *cores = atoi(value);
+        } else if (strcmp(name, "-q") == 0) {
+            options->queue_size = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(name, "-stats") == 0) {
+            options->stats_interval_ms = atoi(value);
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            return false;
+        }
+    }
+
+    *first_arg = i;
+    return true;
+}
+
+// rendition format is WxH:kbps:file, kbps 0 means constant quality
+bool parse_rendition(const char* value, RenditionOptions* rendition) {
+    int bitrate_kbps = 0;
+    int filename_offset = 0;
+
+    if (sscanf(value, "%dx%d:%d:%n", &rendition->width, &rendition->height, &bitrate_kbps, &filename_offset) != 3) {
+        return false;
+    }
+
+    if (filename_offset == 0 || value[filename_offset] == '\0') {
+        return false;
+    }
+
+    rendition->video_bitrate = int64_t(bitrate_kbps) * 1000;
+    rendition->filename = value + filename_offset;
+    return true;
+}
+
+// encode first seconds of sample clip with every x264 preset and threads count, save speeds as host profile
+bool calibrate(const char* profile_filename, const char* clip_filename, const TranscodeOptions& options) {
+    const int frames_count = 250;
+
+    X264Calibration calibration;
+    if (!calibration.load(clip_filename, options.width, options.height, frames_count)) {
+        return false;
+    }
+
+    X264Profile profile;
+    if (!calibration.run(std::thread::hardware_concurrency(), &profile)) {
+        return false;
+    }
+
+    if (!profile.save(profile_filename)) {
+        std::cout << "Failed to save profile to " << profile_filename << '\n';
+        return false;
+    }
+
+    std::cout << "Profile saved to " << profile_filename << '\n';
+    return true;
+}
@@ -0,0 +1,152 @@
+/*
+*
+* File: 08-thumbnails.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* libav thumbnails example.
+* make preview sprite sheet (grid of thumbnails, one every N seconds) for every input file and
+* write it to disk as JPEG. only keyframes are decoded: thumbnailer seeks from keyframe to
+* keyframe, so a 2 hours movie costs the same as a 2 minutes clip with the same number of
+* thumbnails. files are processed in parallel on a thread pool, see thumbnailer.hpp/thumbnailer.cpp
+*
+* input file requirements:
+* - video can be encoded with any codec libavcodec can decode
+* - container should be seekable, otherwise file is read till the end (but still only keyframes are decoded)
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+#include "thread_pool.hpp"
+#include "thumbnailer.hpp"
+
+// functions predeclarations
+void print_usage(const char* name);
+bool parse_options(int argc, char** argv, ThumbnailOptions* options, int* jobs, int* first_arg);
+std::string sheet_filename(const char* out_dir, const char* in_filename);
+void make_thumbnails(const ThumbnailOptions* options, const char* in_filename, const char* out_dir, std::mutex* print_mutex, int* failed);
+
+int main(int argc, char** argv) {
+    ThumbnailOptions options;
+    int jobs = std::thread::hardware_concurrency();
+    int first_arg = 0;
+
+    if (!parse_options(argc, argv, &options, &jobs, &first_arg)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // output directory and at least one input file
+    if (argc - first_arg < 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char* out_dir = argv[first_arg];
+
+    std::mutex print_mutex;
+    int failed = 0;
+
+    // one file per task, every task has its own thumbnailer (input, decoder, scaler)
+    {
+        ThreadPool pool(jobs > 0 ? jobs : 1);
+        for (int i = first_arg + 1; i < argc; i++) {
+            pool.submit(std::bind(make_thumbnails, &options, argv[i], out_dir, &print_mutex, &failed));
+        }
+        pool.wait();
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void make_thumbnails(const ThumbnailOptions* options, const char* in_filename, const char* out_dir, std::mutex* print_mutex, int* failed) {
+    std::string out_filename = sheet_filename(out_dir, in_filename);
+
+    Thumbnailer thumbnailer(*options);
+    ThumbnailResult result;
+    bool ok = thumbnailer.make_sprite_sheet(in_filename, out_filename.c_str(), &result);
+
+    std::lock_guard<std::mutex> lk(*print_mutex);
+
+    if (!ok) {
+        std::cout << in_filename << ": failed\n";
+        (*failed)++;
+        return;
+    }
+
+    printf("%s -> %s: %d tiles %dx%d, %d columns, %lld frames decoded, %.2fs\n",
+        in_filename, out_filename.c_str(), result.tiles, result.tile_width, result.tile_height,
+        result.columns, (long long)result.decoded, result.seconds);
+}
+
+// out_dir/<input file name without directory>.jpg
+std::string sheet_filename(const char* out_dir, const char* in_filename) {
+    const char* name = strrchr(in_filename, '/');
+    name = name ? name + 1 : in_filename;
+
+    return std::string(out_dir) + "/" + name + ".jpg";
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [options] <output dir> <input file> [input file ...]\n"
+              << "Options:\n"
+              << "  -i <seconds>     interval between thumbnails, default: 10\n"
+              << "  -n <count>       max thumbnails per file, default: 100\n"
+              << "  -c <columns>     thumbnails per sprite sheet row, default: 10\n"
+              << "  -w <pixels>      thumbnail width, default: 160\n"
+              << "  -q <2-31>        JPEG quantizer, lower is better, default: 5\n"
+              << "  -dt <n>          decoder threads per file, default: 1\n"
+              << "  -j <n>           files processed in parallel, default: number of cores\n";
+}
+
+bool parse_options(int argc, char** argv, ThumbnailOptions* options, int* jobs, int* first_arg) {
+    int i = 1;
+
+    // options go first, everything after them is positional arguments
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        const char* name = argv[i];
+
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            return false;
+        }
+
+        const char* value = argv[i + 1];
+
+        if (strcmp(name, "-i") == 0) {
+            options->interval = atof(value);
+        } else if (strcmp(name, "-n") == 0) {
+            options->max_tiles = atoi(value);
+        } else if (strcmp(name, "-c") == 0) {
+            options->columns = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(name, "-w") == 0) {
+            options->tile_width = atoi(value);
+        } else if (strcmp(name, "-q") == 0) {
+            options->quality = atoi(value);
+        } else if (strcmp(name, "-dt") == 0) {
+            options->decode_threads = atoi(value);
+        } else if (strcmp(name, "-j") == 0) {
+            *jobs = atoi(value);
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            return false;
+        }
+    }
+
+    if (options->interval <= 0 || options->max_tiles < 1 || options->tile_width < 2) {
+        std::cout << "Interval, thumbnails count and width must be positive\n";
+        return false;
+    }
+
+    *first_arg = i;
+    return true;
+}
@@ -0,0 +1,891 @@
+/*
+*
+* File: 09-remux-daemon.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* long running remux daemon example.
+* starting a process per remux job means paying for process startup, libav initialization and
+* allocation of everything for every job, for short clips that's a noticeable share of the job.
+* daemon is started once and takes jobs over a unix domain socket, jobs run on a pool of warm
+* workers: every worker thread keeps its Remuxer (see remuxer.hpp/remuxer.cpp) with packet and
+* AVIOContext buffer allocated by its first job.
+* with -cache outputs are kept in content addressed cache (see output_cache.hpp): the same input
+* remuxed with the same parameters again, under any name, is linked from the cache instead.
+* with -index (or "index" in request) job writes keyframe index sidecar of its input while
+* remuxing it (see keyframe_index.hpp), later seeks in the input don't have to scan it.
+*
+* protocol: one flat JSON object per line both ways. requests:
+*   {"op":"remux","input":"in.ts","output":"out.flv","format":"flv","hash":"full"}
+*     format is optional, hash is "full" or "sampled" (default unless -full-hash), cache key only.
+*     "index":true writes keyframe index to input + ".kfi", "index":"path" to path, "index":false none.
+*     "start" and "end" (seconds, optional) take that range of input only, see remuxer.hpp.
+*     "smart":true makes range frame accurate, partial GOPs at its ends are re-encoded (flv output only)
+*   {"op":"cancel","job":12}
+*   {"op":"stats"}
+* remux request is answered with {"job":12,"state":"queued"}, or "rejected" when the daemon
+* already has as many jobs as it admits. then job's progress lines follow on the same connection
+* ("running" with position, progress and bytes), and the last one: "done" ("cached":true when
+* output came from cache, "keyframes" when index was written), "failed" with "error", or "cancelled". several jobs can be submitted over one connection, lines carry job id.
+* jobs of a connection which is closed are cancelled. lines are queued per connection and written
+* without blocking, progress lines are dropped while a slow client has too much queued.
+* the same binary is a client too (-submit, -cancel), any tool speaking lines works as well:
+*   echo '{"op":"stats"}' | socat - UNIX-CONNECT:/tmp/remuxd.sock
+* -batch runs jobs given on command line the same way, without daemon, lines go to stdout.
+* it's a command line clipper too:
+*   remux_daemon -batch -start 3600 -end 3630 -smart archive.ts clip.flv
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <iostream>
+#include <string>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "thread_pool.hpp"
+#include "remuxer.hpp"
+#include "logger.hpp"
+
+// one client connection, progress of its jobs is queued by worker threads. workers never wait
+// for a client: queue is written as far as socket takes it, the rest by connection thread
+struct Connection {
+    Connection(int fd, bool socket) : fd(fd), socket(socket), outgoing_bytes(0), sent(0), dropped(0), closed(false) {}
+
+    int fd;
+    bool socket;                        // false: stdout of -batch, written by main thread
+    std::mutex send_mutex;              // lines of different jobs must not interleave
+    std::deque<std::string> outgoing;   // under send_mutex from here on
+    size_t outgoing_bytes;
+    size_t sent;                        // of the first outgoing line
+    int64_t dropped;                    // progress lines, client reads too slow
+    bool closed;
+};
+
+struct Job {
+    Job() : id(0), cancel(false) {}
+
+    int64_t id;
+    std::string input;
+    std::string output;
+    RemuxParams params;
+    std::shared_ptr<Connection> connection;
+    std::atomic<bool> cancel;
+};
+
+// daemon state, jobs are admitted and cancelled by connection threads and finished by workers
+std::mutex jobs_mutex;
+std::map<int64_t, std::shared_ptr<Job> > jobs;     // queued and running
+int64_t next_job_id = 1;
+int64_t jobs_done = 0;
+int64_t jobs_failed = 0;
+int64_t jobs_cancelled = 0;
+int64_t jobs_rejected = 0;
+size_t max_jobs = 64;                   // admission limit, queued and running together
+
+RemuxOptions remux_options;
+std::unique_ptr<OutputCache> cache;     // with -cache only
+bool full_hash = false;                 // jobs not telling their hash
+bool index_inputs = false;              // jobs not telling about index write it next to input
+RemuxParams batch_params;               // range and smart cut of -batch jobs
+std::atomic<int> connections(0);
+std::atomic<bool> stopping(false);
+
+// every worker thread keeps its remuxer for all jobs it runs, freed when pool is gone
+thread_local std::unique_ptr<Remuxer> worker_remuxer;
+
+const int ListenBacklog = 16;
+const int PollTimeout = 200;            // ms, how soon threads notice shutdown
+const size_t MaxRequestSize = 64 * 1024;
+const size_t MaxOutgoingSize = 256 * 1024; // queued for a connection, progress lines past it are dropped
+
+// functions predeclarations
+void print_usage(const char* name);
+void on_signal(int signum);
+int serve(const char* socket_path, int workers);
+int batch(char** args, int count, int workers);
+void serve_connection(std::shared_ptr<Connection> connection, ThreadPool* pool);
+void handle_request(const std::string& request, std::shared_ptr<Connection> connection, ThreadPool* pool);
+void run_job(std::shared_ptr<Job> job);
+void cancel_connection_jobs(const Connection* connection);
+bool send_line(Connection* connection, const std::string& line, bool progress = false);
+bool queue_line(Connection* connection, const std::string& line, bool progress);
+bool flush_lines(Connection* connection, bool wait);
+std::string job_line(const Job* job, const char* state, const RemuxResult* result);
+int client(const char* socket_path, const std::string& request);
+int connect_socket(const char* socket_path);
+bool json_field(const std::string& json, const char* name, std::string* value);
+std::string json_string(const std::string& value);
+
+int main(int argc, char** argv) {
+    const char* program = argv[0];
+    int workers = std::thread::hardware_concurrency();
+    LogLevel log_level = LogInfo;
+    const char* cache_dir = NULL;
+    int64_t cache_size = 0;
+    bool batch_mode = false;
+
+    // options go first, everything after them is positional arguments
+    int first_arg = 1;
+    for (; first_arg < argc && argv[first_arg][0] == '-'; first_arg += 2) {
+        const char* name = argv[first_arg];
+
+        // client modes take the rest of arguments
+        if (strcmp(name, "-submit") == 0) {
+            if (argc - first_arg < 4 || argc - first_arg > 5) {
+                print_usage(program);
+                return EXIT_FAILURE;
+            }
+
+            std::string request = "{\"op\":\"remux\",\"input\":" + json_string(argv[first_arg + 2]) +
+                ",\"output\":" + json_string(argv[first_arg + 3]);
+            if (argc - first_arg == 5) {
+                request += ",\"format\":" + json_string(argv[first_arg + 4]);
+            }
+            return client(argv[first_arg + 1], request + "}");
+        }
+
+        if (strcmp(name, "-cancel") == 0 || strcmp(name, "-stats") == 0) {
+            bool cancel = strcmp(name, "-cancel") == 0;
+            if (argc - first_arg != (cancel ? 3 : 2)) {
+                print_usage(program);
+                return EXIT_FAILURE;
+            }
+
+            std::string request = cancel ? "{\"op\":\"cancel\",\"job\":" + std::to_string(atoll(argv[first_arg + 2])) + "}" : "{\"op\":\"stats\"}";
+            return client(argv[first_arg + 1], request);
+        }
+
+        // flags, no value
+        if (strcmp(name, "-batch") == 0 || strcmp(name, "-full-hash") == 0 || strcmp(name, "-index") == 0 || strcmp(name, "-smart") == 0) {
+            batch_mode = batch_mode || strcmp(name, "-batch") == 0;
+            full_hash = full_hash || strcmp(name, "-full-hash") == 0;
+            index_inputs = index_inputs || strcmp(name, "-index") == 0;
+            batch_params.smart_cut = batch_params.smart_cut || strcmp(name, "-smart") == 0;
+            first_arg--;
+            continue;
+        }
+
+        if (first_arg + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            print_usage(program);
+            return EXIT_FAILURE;
+        }
+
+        const char* value = argv[first_arg + 1];
+
+        if (strcmp(name, "-j") == 0) {
+            workers = atoi(value);
+        } else if (strcmp(name, "-q") == 0) {
+            max_jobs = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(name, "-b") == 0) {
+            remux_options.buffer_size = atoi(value) > 0 ? atoi(value) : remux_options.buffer_size;
+        } else if (strcmp(name, "-start") == 0) {
+            batch_params.start = atof(value);
+        } else if (strcmp(name, "-end") == 0) {
+            batch_params.end = atof(value);
+        } else if (strcmp(name, "-crf") == 0) {
+            remux_options.smart_cut_crf = atoi(value);
+        } else if (strcmp(name, "-preset") == 0) {
+            remux_options.smart_cut_preset = value;
+        } else if (strcmp(name, "-cache") == 0) {
+            cache_dir = value;
+        } else if (strcmp(name, "-cache-size") == 0) {
+            cache_size = atoll(value) * 1024 * 1024;
+        } else if (strcmp(name, "-loglevel") == 0) {
+            bool ok = false;
+            log_level = Logger::parse_level(value, &ok);
+            if (!ok) {
+                std::cout << "Unknown log level " << value << '\n';
+                print_usage(program);
+                return EXIT_FAILURE;
+            }
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            print_usage(program);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int args = argc - first_arg;
+    if (batch_mode ? (args < 2 || args % 2 != 0) : args != 1) {
+        print_usage(program);
+        return EXIT_FAILURE;
+    }
+
+    if (cache_dir) {
+        cache.reset(new OutputCache(cache_dir, cache_size));
+        if (!cache->open()) {
+            std::cout << "Could not open cache directory " << cache_dir << ", reason: " << strerror(errno) << '\n';
+            return EXIT_FAILURE;
+        }
+        remux_options.cache = cache.get();
+    }
+
+    // batch prints job lines to stdout, log goes out of their way
+    Logger::start(log_level, stderr);
+    Logger::redirect_av_log();
+
+    workers = workers > 0 ? workers : 1;
+    int ret = batch_mode ? batch(argv + first_arg, args, workers) : serve(argv[first_arg], workers);
+
+    Logger::stop();
+    return ret;
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [options] <socket path>                          run daemon\n"
+              << "       " << name << " -batch [options] <input> <output> [<input> <output> ...]  run jobs, print their progress\n"
+              << "       " << name << " -submit <socket path> <input> <output> [format]  submit job, print its progress\n"
+              << "       " << name << " -cancel <socket path> <job id>                   cancel job\n"
+              << "       " << name << " -stats <socket path>                             print daemon stats\n"
+              << "Options:\n"
+              << "  -j <n>           worker threads, jobs run in parallel, default: number of cores\n"
+              << "  -q <n>           jobs admitted at once, queued and running, default: 64\n"
+              << "  -b <bytes>       output AVIOContext buffer size, default: 65536\n"
+              << "  -cache <dir>     keep outputs in content addressed cache, repeated jobs are linked from it\n"
+              << "  -cache-size <MB> cache size limit, least recently used outputs go first, default: no limit\n"
+              << "  -full-hash       cache key from every byte of input instead of samples, unless job tells\n"
+              << "  -index           write keyframe index next to every input (input.kfi), unless job tells\n"
+              << "  -start <s>       -batch jobs take input from this time, keyframe at or before it\n"
+              << "  -end <s>         -batch jobs take input till this time\n"
+              << "  -smart           -batch jobs cut range frame accurately, re-encoding partial GOPs at its ends, flv only\n"
+              << "  -crf <n>         x264 constant rate factor of re-encoded GOPs, default: 18\n"
+              << "  -preset <p>      x264 preset of re-encoded GOPs, default: veryfast\n"
+              << "  -loglevel <l>    error, warning, info or debug, default: info\n";
+}
+
+void on_signal(int) {
+    stopping.store(true);
+}
+
+int serve(const char* socket_path, int workers) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof sa.sun_path) {
+        Logger::log(LogError, "Socket path %s is too long", socket_path);
+        return EXIT_FAILURE;
+    }
+    strcpy(sa.sun_path, socket_path);
+
+    // socket file left by previous run
+    unlink(socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof sa) != 0 || listen(fd, ListenBacklog) != 0) {
+        Logger::log(LogError, "Could not listen on %s, reason: %s", socket_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    Logger::log(LogInfo, "Listening on %s, %d workers, %d jobs admitted", socket_path, workers, int(max_jobs));
+
+    {
+        ThreadPool pool(workers);
+
+        // every connection is served on its own thread, jobs go to the pool
+        while (!stopping.load()) {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, PollTimeout) <= 0) {
+                continue;
+            }
+
+            int client_fd = accept(fd, NULL, NULL);
+            if (client_fd < 0) {
+                continue;
+            }
+
+            connections++;
+            std::thread(serve_connection, std::make_shared<Connection>(client_fd, true), &pool).detach();
+        }
+
+        Logger::log(LogInfo, "Shutting down, cancelling jobs");
+
+        // running jobs stop at next packet, queued ones finish as cancelled right away
+        {
+            std::lock_guard<std::mutex> lk(jobs_mutex);
+            for (std::map<int64_t, std::shared_ptr<Job> >::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+                it->second->cancel.store(true);
+            }
+        }
+
+        pool.wait();
+    }
+
+    // connection threads see stopping flag within poll timeout
+    while (connections.load() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(PollTimeout));
+    }
+
+    close(fd);
+    unlink(socket_path);
+
+    Logger::log(LogInfo, "Jobs done: %lld, failed: %lld, cancelled: %lld, rejected: %lld",
+        (long long)jobs_done, (long long)jobs_failed, (long long)jobs_cancelled, (long long)jobs_rejected);
+    if (cache) {
+        Logger::log(LogInfo, "Cache hits: %llu, misses: %llu", (unsigned long long)cache->hits(), (unsigned long long)cache->misses());
+    }
+    return EXIT_SUCCESS;
+}
+
+// jobs of command line on the same warm workers and cache as daemon ones, stdout is the connection
+int batch(char** args, int count, int workers) {
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::shared_ptr<Connection> out = std::make_shared<Connection>(STDOUT_FILENO, false);
+
+    {
+        ThreadPool pool(workers);
+
+        for (int i = 0; i < count; i += 2) {
+            std::shared_ptr<Job> job = std::make_shared<Job>();
+            job->input = args[i];
+            job->output = args[i + 1];
+            job->params = batch_params;
+            job->params.full_hash = full_hash;
+            job->params.index_filename = index_inputs ? KeyframeIndex::sidecar_filename(args[i]) : "";
+            job->connection = out;
+
+            std::lock_guard<std::mutex> lk(jobs_mutex);
+            job->id = next_job_id++;
+            jobs[job->id] = job;
+            queue_line(out.get(), job_line(job.get(), "queued", NULL), false);
+            pool.submit(std::bind(run_job, job));
+        }
+
+        // interrupted batch cancels what's left, lines of workers are written from here
+        while (true) {
+            flush_lines(out.get(), true);
+
+            {
+                std::lock_guard<std::mutex> lk(jobs_mutex);
+                if (jobs.empty()) {
+                    break;
+                }
+
+                for (std::map<int64_t, std::shared_ptr<Job> >::iterator it = jobs.begin(); it != jobs.end() && stopping.load(); ++it) {
+                    it->second->cancel.store(true);
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(PollTimeout));
+        }
+
+        pool.wait();
+        flush_lines(out.get(), true);
+    }
+
+    Logger::log(LogInfo, "Jobs done: %lld, failed: %lld, cancelled: %lld",
+        (long long)jobs_done, (long long)jobs_failed, (long long)jobs_cancelled);
+    if (cache) {
+        Logger::log(LogInfo, "Cache hits: %llu, misses: %llu", (unsigned long long)cache->hits(), (unsigned long long)cache->misses());
+    }
+
+    return jobs_failed == 0 && jobs_cancelled == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void serve_connection(std::shared_ptr<Connection> connection, ThreadPool* pool) {
+    std::string pending;
+
+    while (!stopping.load()) {
+        bool queued;
+        {
+            std::lock_guard<std::mutex> lk(connection->send_mutex);
+            queued = !connection->outgoing.empty();
+        }
+
+        // lines socket didn't take when they were queued go as soon as it has room
+        struct pollfd pfd = { connection->fd, short(POLLIN | (queued ? POLLOUT : 0)), 0 };
+        if (poll(&pfd, 1, PollTimeout) <= 0) {
+            continue;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            flush_lines(connection.get(), false);
+        }
+
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+
+        char buf[4096];
+        ssize_t n = recv(connection->fd, buf, sizeof buf, 0);
+        if (n <= 0) {
+            break;
+        }
+
+        pending.append(buf, n);
+
+        size_t line_end;
+        while ((line_end = pending.find('\n')) != std::string::npos) {
+            std::string request = pending.substr(0, line_end);
+            pending.erase(0, line_end + 1);
+
+            if (!request.empty()) {
+                handle_request(request, connection, pool);
+            }
+        }
+
+        if (pending.size() > MaxRequestSize) {
+            send_line(connection.get(), "{\"error\":\"request too long\"}");
+            break;
+        }
+    }
+
+    // nobody to report to anymore, jobs still hold the connection but can't send
+    cancel_connection_jobs(connection.get());
+    int64_t dropped;
+    {
+        std::lock_guard<std::mutex> lk(connection->send_mutex);
+        connection->closed = true;
+        close(connection->fd);
+        dropped = connection->dropped;
+    }
+
+    if (dropped > 0) {
+        Logger::log(LogWarning, "Client read too slow, %lld progress lines dropped", (long long)dropped);
+    }
+
+    connections--;
+}
+
+void handle_request(const std::string& request, std::shared_ptr<Connection> connection, ThreadPool* pool) {
+    std::string op;
+    if (!json_field(request, "op", &op)) {
+        send_line(connection.get(), "{\"error\":\"no op in request\"}");
+        return;
+    }
+
+    if (op == "remux") {
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        if (!json_field(request, "input", &job->input) || !json_field(request, "output", &job->output)) {
+            send_line(connection.get(), "{\"error\":\"remux needs input and output\"}");
+            return;
+        }
+        json_field(request, "format", &job->params.format);
+
+        std::string hash;
+        job->params.full_hash = json_field(request, "hash", &hash) ? hash == "full" : full_hash;
+
+        std::string range;
+        if (json_field(request, "start", &range)) {
+            job->params.start = atof(range.c_str());
+        }
+        if (json_field(request, "end", &range)) {
+            job->params.end = atof(range.c_str());
+        }
+        job->params.smart_cut = json_field(request, "smart", &range) && range == "true";
+
+        std::string index;
+        if (!json_field(request, "index", &index)) {
+            index = index_inputs ? "true" : "false";
+        }
+        job->params.index_filename = index == "true" ? KeyframeIndex::sidecar_filename(job->input.c_str()) : (index == "false" ? "" : index);
+        job->connection = connection;
+
+        // admission: past the limit job is turned down at once instead of waiting in queue. pool
+        // is only there till shutdown, which is checked under the same lock. reply is queued
+        // under it too, so it goes before lines of the job, and written after
+        {
+            std::lock_guard<std::mutex> lk(jobs_mutex);
+            job->id = next_job_id++;
+            if (jobs.size() >= max_jobs || stopping.load()) {
+                jobs_rejected++;
+                queue_line(connection.get(), job_line(job.get(), "rejected", NULL), false);
+            } else {
+                jobs[job->id] = job;
+                queue_line(connection.get(), job_line(job.get(), "queued", NULL), false);
+                pool->submit(std::bind(run_job, job));
+            }
+        }
+
+        flush_lines(connection.get(), false);
+        return;
+    }
+
+    if (op == "cancel") {
+        std::string id;
+        json_field(request, "job", &id);
+
+        std::string reply;
+        {
+            std::lock_guard<std::mutex> lk(jobs_mutex);
+            std::map<int64_t, std::shared_ptr<Job> >::iterator it = jobs.find(atoll(id.c_str()));
+            if (it == jobs.end()) {
+                reply = "{\"job\":" + std::to_string(atoll(id.c_str())) + ",\"error\":\"no such job\"}";
+            } else {
+                it->second->cancel.store(true);
+                reply = job_line(it->second.get(), "cancelling", NULL);
+            }
+        }
+
+        send_line(connection.get(), reply);
+        return;
+    }
+
+    if (op == "stats") {
+        std::string reply;
+        {
+            std::lock_guard<std::mutex> lk(jobs_mutex);
+            reply = "{\"jobs\":" + std::to_string(jobs.size()) + ",\"max_jobs\":" + std::to_string(max_jobs) +
+                ",\"done\":" + std::to_string(jobs_done) + ",\"failed\":" + std::to_string(jobs_failed) +
+                ",\"cancelled\":" + std::to_string(jobs_cancelled) + ",\"rejected\":" + std::to_string(jobs_rejected) +
+                ",\"connections\":" + std::to_string(connections.load());
+        }
+
+        if (cache) {
+            reply += ",\"cache_hits\":" + std::to_string(cache->hits()) + ",\"cache_misses\":" + std::to_string(cache->misses());
+        }
+
+        send_line(connection.get(), reply + "}");
+        return;
+    }
+
+    send_line(connection.get(), "{\"error\":" + json_string("unknown op " + op) + "}");
+}
+
+// on worker thread
+void run_job(std::shared_ptr<Job> job) {
+    if (!worker_remuxer) {
+        worker_remuxer.reset(new Remuxer(remux_options));
+    }
+
+    RemuxResult result;
+    bool ok = false;
+
+    // cancelled while queued: nothing to run
+    if (!job->cancel.load()) {
+        send_line(job->connection.get(), job_line(job.get(), "running", &result));
+
+        Job* j = job.get();
+        ok = worker_remuxer->remux(job->input.c_str(), job->output.c_str(), job->params, &result, &job->cancel,
+            [j](const RemuxResult& progress) { send_line(j->connection.get(), job_line(j, "running", &progress), true); });
+    } else {
+        result.cancelled = true;
+    }
+
+    const char* state = ok ? "done" : (result.cancelled ? "cancelled" : "failed");
+    std::string line = job_line(job.get(), state, &result);
+    if (!ok && !result.cancelled) {
+        line.insert(line.size() - 1, ",\"error\":" + json_string(worker_remuxer->error()));
+    }
+    send_line(job->connection.get(), line);
+
+    if (ok || result.cancelled) {
+        Logger::log(LogInfo, "Job %lld %s -> %s %s%s in %.3f s, job %lld of this worker", (long long)job->id,
+            job->input.c_str(), job->output.c_str(), state, result.cached ? " from cache" : "", result.seconds,
+            (long long)worker_remuxer->jobs());
+    } else {
+        Logger::log(LogWarning, "Job %lld %s -> %s failed: %s", (long long)job->id,
+            job->input.c_str(), job->output.c_str(), worker_remuxer->error().c_str());
+    }
+
+    std::lock_guard<std::mutex> lk(jobs_mutex);
+    jobs.erase(job->id);
+    if (ok) {
+        jobs_done++;
+    } else if (result.cancelled) {
+        jobs_cancelled++;
+    } else {
+        jobs_failed++;
+    }
+}
+
+void cancel_connection_jobs(const Connection* connection) {
+    std::lock_guard<std::mutex> lk(jobs_mutex);
+    for (std::map<int64_t, std::shared_ptr<Job> >::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        if (it->second->connection.get() == connection) {
+            it->second->cancel.store(true);
+        }
+    }
+}
+
+// false when client is gone or progress line is dropped, job goes on anyway unless cancelled
+bool send_line(Connection* connection, const std::string& line, bool progress) {
+    return queue_line(connection, line, progress) && flush_lines(connection, false);
+}
+
+// no I/O, safe under jobs_mutex. replies and job state lines are always queued, a job has a few
+// of them; progress lines are dropped while the client is behind, the next one catches it up
+bool queue_line(Connection* connection, const std::string& line, bool progress) {
+    std::lock_guard<std::mutex> lk(connection->send_mutex);
+    if (connection->closed) {
+        return false;
+    }
+
+    if (progress && connection->outgoing_bytes >= MaxOutgoingSize) {
+        connection->dropped++;
+        return false;
+    }
+
+    connection->outgoing.push_back(line + "\n");
+    connection->outgoing_bytes += line.size() + 1;
+    return true;
+}
+
+// writes queued lines as far as socket takes them without blocking. wait: blocking write() of
+// -batch stdout, from main thread only. false when client is gone
+bool flush_lines(Connection* connection, bool wait) {
+    std::lock_guard<std::mutex> lk(connection->send_mutex);
+    if (connection->closed) {
+        return false;
+    }
+
+    while (!connection->outgoing.empty()) {
+        const std::string& data = connection->outgoing.front();
+
+        ssize_t n;
+        if (connection->socket) {
+            n = send(connection->fd, data.data() + connection->sent, data.size() - connection->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } else if (wait) {
+            n = write(connection->fd, data.data() + connection->sent, data.size() - connection->sent);
+        } else {
+            return true;
+        }
+
+        // socket buffer is full, connection thread writes the rest once it drains
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return true;
+        }
+
+        if (n <= 0) {
+            connection->outgoing.clear();
+            connection->outgoing_bytes = 0;
+            connection->sent = 0;
+            return false;
+        }
+
+        connection->sent += n;
+        if (connection->sent == data.size()) {
+            connection->outgoing_bytes -= data.size();
+            connection->outgoing.pop_front();
+            connection->sent = 0;
+        }
+    }
+
+    return true;
+}
+
+std::string job_line(const Job* job, const char* state, const RemuxResult* result) {
+    std::string line = "{\"job\":" + std::to_string(job->id) + ",\"state\":\"" + state + "\"";
+    if (result) {
+        char numbers[256];
+        snprintf(numbers, sizeof numbers, ",\"position\":%.3f,\"duration\":%.3f,\"progress\":%.3f,\"packets\":%lld,\"bytes_in\":%lld,\"bytes_out\":%lld,\"seconds\":%.3f",
+            result->position, result->duration, result->duration > 0 ? FFMIN(result->position / result->duration, 1.0) : 0.0,
+            (long long)result->packets, (long long)result->bytes_in, (long long)result->bytes_out, result->seconds);
+        line += numbers;
+
+        if (result->cached) {
+            line += ",\"cached\":true";
+        }
+
+        if (result->keyframes > 0) {
+            line += ",\"keyframes\":" + std::to_string(result->keyframes);
+        }
+
+        if (result->reencoded > 0) {
+            line += ",\"reencoded\":" + std::to_string(result->reencoded);
+        }
+    }
+
+    return line + "}";
+}
+
+// sends one request and prints every line of answer till job is over (or the only line for
+// cancel and stats), exit code tells if job was done
+int client(const char* socket_path, const std::string& request) {
+    int fd = connect_socket(socket_path);
+    if (fd < 0) {
+        std::cout << "Could not connect to " << socket_path << ", reason: " << strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
+
+    std::string data = request + "\n";
+    if (send(fd, data.data(), data.size(), MSG_NOSIGNAL) != ssize_t(data.size())) {
+        std::cout << "Could not send request, reason: " << strerror(errno) << '\n';
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    bool remux = request.find("\"op\":\"remux\"") != std::string::npos;
+    std::string pending;
+    int ret = EXIT_FAILURE;
+
+    while (true) {
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof buf, 0);
+        if (n <= 0) {
+            break;
+        }
+
+        pending.append(buf, n);
+
+        size_t line_end;
+        bool over = false;
+        while ((line_end = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, line_end);
+            pending.erase(0, line_end + 1);
+            std::cout << line << std::endl;
+
+            std::string state;
+            json_field(line, "state", &state);
+
+            if (!remux) {
+                ret = line.find("\"error\"") == std::string::npos ? EXIT_SUCCESS : EXIT_FAILURE;
+                over = true;
+            } else if (state == "done" || state == "failed" || state == "cancelled" || state == "rejected" || state.empty()) {
+                ret = state == "done" ? EXIT_SUCCESS : EXIT_FAILURE;
+                over = true;
+            }
+
+            if (over) {
+                break;
+            }
+        }
+
+        if (over) {
+            break;
+        }
+    }
+
+    close(fd);
+    return ret;
+}
+
+int connect_socket(const char* socket_path) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof sa.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&sa, sizeof sa) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+// value of top level field of flat JSON object: string unescaped, number or literal as is.
+// enough for requests of this protocol, not a JSON parser
+bool json_field(const std::string& json, const char* name, std::string* value) {
+    std::string key = std::string("\"") + name + "\"";
+
+    size_t pos = json.find(key);
+    while (pos != std::string::npos) {
+        size_t colon = json.find_first_not_of(" \t", pos + key.size());
+        if (colon != std::string::npos && json[colon] == ':') {
+            break;
+        }
+        pos = json.find(key, pos + 1);    // it was a value, not a key
+    }
+
+    if (pos == std::string::npos) {
+        return false;
+    }
+
+    size_t start = json.find_first_not_of(" \t", json.find(':', pos + key.size()) + 1);
+    if (start == std::string::npos) {
+        return false;
+    }
+
+    value->clear();
+
+    if (json[start] != '"') {
+        size_t end = json.find_first_of(",} \t", start);
+        *value = json.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        return !value->empty();
+    }
+
+    for (size_t i = start + 1; i < json.size(); i++) {
+        char c = json[i];
+        if (c == '"') {
+            return true;
+        }
+
+        if (c != '\\' || i + 1 >= json.size()) {
+            *value += c;
+            continue;
+        }
+
+        c = json[++i];
+        switch (c) {
+            case 'n': *value += '\n'; break;
+            case 't': *value += '\t'; break;
+            case 'r': *value += '\r'; break;
+            case 'b': *value += '\b'; break;
+            case 'f': *value += '\f'; break;
+            case 'u': {
+                // ASCII only, file names in requests are expected to be sent as UTF-8 as is
+                if (i + 4 < json.size()) {
+                    *value += char(strtol(json.substr(i + 1, 4).c_str(), NULL, 16));
+                    i += 4;
+                }
+                break;
+            }
+            default: *value += c; break;     // \" \\ \/
+        }
+    }
+
+    return false; // unterminated string
+}
+
+std::string json_string(const std::string& value) {
+    std::string out = "\"";
+
+    for (size_t i = 0; i < value.size(); i++) {
+        unsigned char c = value[i];
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof escaped, "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+
+    return out + "\"";
+}
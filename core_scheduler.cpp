@@ -0,0 +1,162 @@
+/*
+* File: core_scheduler.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* CPU core budgets for concurrent sessions, see core_scheduler.hpp for description
+*
+*/
+
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "core_scheduler.hpp"
+
+CoreScheduler::CoreScheduler(int cores) :
+    m_next_id(0),
+    m_next_version(1)
+{
+    // only cores process is allowed to run on (taskset, cgroup cpusets), not all cores of the host
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof set, &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &set)) {
+                m_cores.push_back(i);
+            }
+        }
+    }
+
+    if (m_cores.empty()) {
+        m_cores.push_back(0);
+    }
+
+    if (cores > 0 && cores < int(m_cores.size())) {
+        m_cores.resize(cores);
+    }
+}
+
+int CoreScheduler::cores() const {
+    return m_cores.size();
+}
+
+int CoreScheduler::add_session(int weight) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    Session session;
+    session.weight = weight > 0 ? weight : 1;
+    session.version = 0;
+
+    int id = m_next_id++;
+    m_sessions[id] = session;
+    rebalance();
+
+    return id;
+}
+
+void CoreScheduler::remove_session(int session) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    m_sessions.erase(session);
+    rebalance();
+}
+
+uint64_t CoreScheduler::budget(int session, std::vector<int>* cores) const {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    std::map<int, Session>::const_iterator it = m_sessions.find(session);
+    if (it == m_sessions.end()) {
+        if (cores) {
+            *cores = m_cores;
+        }
+        return 0;
+    }
+
+    if (cores) {
+        *cores = it->second.cores;
+    }
+    return it->second.version;
+}
+
+// every session gets at least one core, the rest go one by one to the session with the most
+// weight per core it already has. sessions get blocks of neighbour cores in start order, threads
+// of one session share caches this way. with more sessions than cores they have to share cores
+void CoreScheduler::rebalance() {
+    int cores_count = m_cores.size();
+    int sessions_count = m_sessions.size();
+    if (sessions_count == 0) {
+        return;
+    }
+
+    std::vector<int> counts(sessions_count, 1);
+    std::vector<int> weights;
+    for (std::map<int, Session>::const_iterator it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+        weights.push_back(it->second.weight);
+    }
+
+    for (int left = cores_count - sessions_count; left > 0; left--) {
+        int best = 0;
+        for (int i = 1; i < sessions_count; i++) {
+            if (double(weights[i]) / counts[i] > double(weights[best]) / counts[best]) {
+                best = i;
+            }
+        }
+        counts[best]++;
+    }
+
+    int first = 0;
+    int i = 0;
+    for (std::map<int, Session>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it, i++) {
+        std::vector<int> cores;
+        for (int j = 0; j < counts[i]; j++) {
+            cores.push_back(m_cores[(first + j) % cores_count]);
+        }
+        first += counts[i];
+
+        // threads of sessions whose cores didn't change stay where they are
+        if (cores != it->second.cores) {
+            it->second.cores = cores;
+            it->second.version = m_next_version++;
+        }
+    }
+}
+
+bool CoreScheduler::pin_thread(const std::vector<int>& cores) {
+    if (cores.empty()) {
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cores.size(); i++) {
+        CPU_SET(cores[i], &set);
+    }
+
+    // threads created by this thread from now on (libavcodec and x264 thread pools) inherit the mask
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+}
+
+std::string CoreScheduler::format(const std::vector<int>& cores) {
+    std::string out;
+
+    for (size_t i = 0; i < cores.size(); ) {
+        size_t j = i;
+        while (j + 1 < cores.size() && cores[j + 1] == cores[j] + 1) {
+            j++;
+        }
+
+        char range[32];
+        if (j > i) {
+            snprintf(range, sizeof range, "%s%d-%d", out.empty() ? "" : ",", cores[i], cores[j]);
+        } else {
+            snprintf(range, sizeof range, "%s%d", out.empty() ? "" : ",", cores[i]);
+        }
+        out += range;
+
+        i = j + 1;
+    }
+
+    return out;
+}
@@ -0,0 +1,57 @@
+/*
+* File: core_scheduler.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* process-wide CPU core budgets for concurrent transcoding sessions, threadsafe. left alone,
+* every decoder and x264 instance sizes its thread pool to all cores of the host, with many
+* sessions per host that's many times more busy threads than cores and latency goes wild.
+* scheduler splits available cores between sessions in proportion to their weights, every
+* session gets a block of neighbour cores, sizes its codec threads to that block and pins
+* its threads to it. budgets are recalculated every time session starts or stops, sessions
+* notice the change by budget version and move to their new cores
+*
+*/
+
+#ifndef core_scheduler_hpp
+#define core_scheduler_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+class CoreScheduler {
+public:
+    CoreScheduler(int cores);           // cores to share between sessions, 0 - every core process may run on
+
+    int add_session(int weight);        // returns session id, budgets of all sessions are recalculated
+    void remove_session(int session);   // session cores go to the rest
+
+    // cores session threads should run on, returns budget version, it changes when cores change
+    uint64_t budget(int session, std::vector<int>* cores) const;
+
+    int cores() const;                  // number of cores shared
+
+    static bool pin_thread(const std::vector<int>& cores);  // run calling thread on these cores only
+    static std::string format(const std::vector<int>& cores); // "0-3,8", for logs
+
+private:
+    struct Session {
+        int weight;
+        std::vector<int> cores;
+        uint64_t version;
+    };
+
+    void rebalance();
+
+    std::vector<int> m_cores;           // cpu ids
+    std::map<int, Session> m_sessions;  // by id, which is also start order
+    int m_next_id;
+    uint64_t m_next_version;
+    mutable std::mutex m_mutex;
+};
+
+#endif /* core_scheduler_hpp */
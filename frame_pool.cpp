@@ -0,0 +1,171 @@
+/*
+* File: frame_pool.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* pool of video frame buffers, see frame_pool.hpp for description
+*
+*/
+
+#include <string.h>
+
+extern "C" {
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#include "frame_pool.hpp"
+
+// every line of every plane starts at this boundary, enough for any SIMD code libav has
+const int FramePoolLineAlign = 64;
+
+FramePool::FramePool() :
+    m_allocations(0)
+{
+}
+
+FramePool::~FramePool() {
+    // buffers still referenced by frames are freed when those frames are freed
+    for (size_t i = 0; i < m_pools.size(); i++) {
+        for (int j = 0; j < 4; j++) {
+            av_buffer_pool_uninit(&m_pools[i]->planes[j]);
+        }
+
+        delete m_pools[i];
+    }
+}
+
+uint64_t FramePool::allocations() const {
+    return m_allocations.load();
+}
+
+AVFrame* FramePool::get_frame(int width, int height, AVPixelFormat format) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        return NULL;
+    }
+
+    frame->width = width;
+    frame->height = height;
+    frame->format = format;
+
+    if (get_buffer(frame, width, height) < 0) {
+        av_frame_free(&frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+int FramePool::get_buffer(AVFrame* frame, int alloc_width, int alloc_height) {
+    Pool* pool = find_pool(alloc_width, alloc_height, (AVPixelFormat)frame->format);
+    if (!pool) {
+        return AVERROR(ENOSYS);
+    }
+
+    for (int i = 0; i < 4 && pool->planes[i]; i++) {
+        frame->buf[i] = av_buffer_pool_get(pool->planes[i]);
+        if (!frame->buf[i]) {
+            av_frame_unref(frame);
+            return AVERROR(ENOMEM);
+        }
+
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = pool->linesize[i];
+    }
+
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+int FramePool::get_buffer2(AVCodecContext* ctx, AVFrame* frame, int flags) {
+    FramePool* pool = static_cast<FramePool*>(ctx->opaque);
+
+    // audio and decoders which can't work with user provided buffers go the default way
+    if (!pool || ctx->codec_type != AVMEDIA_TYPE_VIDEO || !(ctx->codec->capabilities & AV_CODEC_CAP_DR1)) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+
+    // decoders write past visible picture (macroblock padding), ask libavcodec how much
+    int width = frame->width;
+    int height = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(ctx, &width, &height, linesize_align);
+
+    int ret = pool->get_buffer(frame, width, height);
+    if (ret == AVERROR(ENOSYS)) { // hardware or paletted pixel format, can't pool that
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+
+    return ret;
+}
+
+void FramePool::attach(AVCodecContext* decoder) {
+    decoder->opaque = this;
+    decoder->get_buffer2 = &FramePool::get_buffer2;
+
+    // with frame threading get_buffer2 is called from decoder threads, pool is threadsafe.
+    // without this flag libavcodec would serialize every call through a single thread
+    decoder->thread_safe_callbacks = 1;
+}
+
+FramePool::Pool* FramePool::find_pool(int width, int height, AVPixelFormat format) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    for (size_t i = 0; i < m_pools.size(); i++) {
+        Pool* pool = m_pools[i];
+        if (pool->width == width && pool->height == height && pool->format == format) {
+            return pool;
+        }
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+        return NULL;
+    }
+
+    Pool* pool = new Pool();
+    pool->width = width;
+    pool->height = height;
+    pool->format = format;
+    memset(pool->planes, 0, sizeof(pool->planes));
+
+    // padding width makes every line length a multiple of line alignment for 8 bit formats,
+    // line sizes are aligned once more below for everything else
+    int ret = av_image_fill_linesizes(pool->linesize, format, FFALIGN(width, FramePoolLineAlign));
+    if (ret < 0) {
+        delete pool;
+        return NULL;
+    }
+
+    for (int i = 0; i < 4 && pool->linesize[i] > 0; i++) {
+        pool->linesize[i] = FFALIGN(pool->linesize[i], FramePoolLineAlign);
+
+        // planes 1 and 2 are chroma planes for yuv formats, they are subsampled vertically
+        int plane_height = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+
+        // a bit of extra space at the end, SIMD code reads past the last line
+        int size = pool->linesize[i] * plane_height + AV_INPUT_BUFFER_PADDING_SIZE;
+
+        pool->planes[i] = av_buffer_pool_init2(size, this, &FramePool::alloc_buffer, NULL);
+        if (!pool->planes[i]) {
+            for (int j = 0; j < i; j++) {
+                av_buffer_pool_uninit(&pool->planes[j]);
+            }
+            delete pool;
+            return NULL;
+        }
+    }
+
+    m_pools.push_back(pool);
+    return pool;
+}
+
+AVBufferRef* FramePool::alloc_buffer(void* opaque, int size) {
+    FramePool* pool = static_cast<FramePool*>(opaque);
+    pool->m_allocations++;
+
+    // av_malloc() alignment matches SIMD code libav was built with
+    return av_buffer_alloc(size);
+}
@@ -0,0 +1,65 @@
+/*
+* File: frame_pool.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* pool of video frame buffers, threadsafe. buffers are grouped by frame geometry (width,
+* height and pixel format), every plane of every geometry has its own AVBufferPool. when
+* last frame referencing a buffer is freed, buffer goes back to the pool instead of being
+* deallocated, so after the first few frames no picture memory is allocated at all.
+* can be plugged into decoder as AVCodecContext.get_buffer2 callback
+*
+*/
+
+#ifndef frame_pool_hpp
+#define frame_pool_hpp
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+}
+
+class FramePool {
+public:
+    FramePool();
+    ~FramePool();
+
+    // allocate frame backed by pooled buffers, returns NULL on failure
+    AVFrame* get_frame(int width, int height, AVPixelFormat format);
+
+    // attach pooled buffers to frame, frame width, height and format must be set. buffers are
+    // big enough for alloc_width x alloc_height picture, decoders need it larger than frame size
+    int get_buffer(AVFrame* frame, int alloc_width, int alloc_height);
+
+    // AVCodecContext.get_buffer2 implementation, codec context opaque must point to FramePool
+    static int get_buffer2(AVCodecContext* ctx, AVFrame* frame, int flags);
+
+    // make decoder take its frames from this pool
+    void attach(AVCodecContext* decoder);
+
+    uint64_t allocations() const;   // number of buffers actually allocated, stops growing in steady state
+
+private:
+    struct Pool {
+        int width;
+        int height;
+        AVPixelFormat format;
+        int linesize[4];
+        AVBufferPool* planes[4];
+    };
+
+    Pool* find_pool(int width, int height, AVPixelFormat format);
+    static AVBufferRef* alloc_buffer(void* opaque, int size);
+
+    std::vector<Pool*> m_pools;
+    std::mutex m_mutex;
+    std::atomic<uint64_t> m_allocations;
+};
+
+#endif /* frame_pool_hpp */
@@ -0,0 +1,85 @@
+/*
+* File: frame_queue.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* bounded blocking queue, threadsafe. used to pass packets and frames between
+* transcoding pipeline stages. producer blocks when queue is full, consumer blocks
+* when queue is empty, this way the slowest stage naturally throttles the others
+*
+*/
+
+#ifndef frame_queue_hpp
+#define frame_queue_hpp
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+template <typename T>
+class FrameQueue {
+public:
+    FrameQueue(size_t capacity) : m_capacity(capacity), m_closed(false) {}
+
+    // blocks while queue is full. returns false if queue was closed, item is not consumed in that case
+    bool push(const T& item) {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        while (m_items.size() >= m_capacity && !m_closed) {
+            m_not_full.wait(lk);
+        }
+
+        if (m_closed) {
+            return false;
+        }
+
+        m_items.push_back(item);
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    // blocks while queue is empty. returns false once queue is closed and fully drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        while (m_items.empty() && !m_closed) {
+            m_not_empty.wait(lk);
+        }
+
+        if (m_items.empty()) {
+            return false;
+        }
+
+        item = m_items.front();
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    // no more items will be pushed, wake up everybody waiting on this queue
+    void close() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_items.size();
+    }
+
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed;
+};
+
+#endif /* frame_queue_hpp */
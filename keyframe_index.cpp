@@ -0,0 +1,307 @@
+/*
+* File: keyframe_index.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* keyframe index sidecar files, see keyframe_index.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "keyframe_index.hpp"
+
+const char KeyframeIndexMagic[8] = { 'K', 'F', 'I', 'N', 'D', 'E', 'X', '2' };
+
+// every audio packet is a keyframe, one entry per second is plenty to seek audio only inputs
+const int64_t AudioEntryDistance = AV_TIME_BASE;
+
+static int64_t mtime_ns(const struct stat& st) {
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static bool pts_less(const KeyframeIndexEntry& entry, int64_t ts) {
+    return entry.pts < ts;
+}
+
+static bool ts_less(int64_t ts, const KeyframeIndexEntry& entry) {
+    return ts < entry.pts;
+}
+
+KeyframeIndexBuilder::KeyframeIndexBuilder() {
+}
+
+void KeyframeIndexBuilder::start(const AVFormatContext* input_ctx) {
+    // vectors keep their capacity, next input of similar length doesn't reallocate
+    m_streams.resize(input_ctx->nb_streams);
+
+    for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+        const AVStream* in_stream = input_ctx->streams[i];
+        StreamEntries& s = m_streams[i];
+
+        memset(&s.stream, 0, sizeof s.stream);
+        s.stream.index = i;
+        s.stream.codec_type = in_stream->codecpar->codec_type;
+        s.stream.time_base_num = in_stream->time_base.num;
+        s.stream.time_base_den = in_stream->time_base.den;
+        s.stream.flags = KeyframeIndexMonotonic;
+        s.entries.clear();
+        s.min_distance = in_stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO ?
+            av_rescale_q(AudioEntryDistance, AV_TIME_BASE_Q, in_stream->time_base) : 0;
+    }
+}
+
+void KeyframeIndexBuilder::add(const AVPacket* packet) {
+    if (packet->stream_index < 0 || packet->stream_index >= int(m_streams.size())) {
+        return;
+    }
+
+    StreamEntries& s = m_streams[packet->stream_index];
+    if (s.stream.codec_type != AVMEDIA_TYPE_VIDEO && s.stream.codec_type != AVMEDIA_TYPE_AUDIO) {
+        return;
+    }
+
+    KeyframeIndexEntry* last = s.entries.empty() ? NULL : &s.entries.back();
+
+    // keyframe is no use without position to seek to and time to find it by
+    if ((packet->flags & AV_PKT_FLAG_KEY) && packet->pos >= 0 && packet->dts != AV_NOPTS_VALUE) {
+        int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+        // timestamps going back (discontinuity, wrap) are kept in file order, search gets linear
+        if (last && pts < last->pts) {
+            s.stream.flags &= ~KeyframeIndexMonotonic;
+        }
+
+        if (!last || pts < last->pts || pts - last->pts >= s.min_distance) {
+            KeyframeIndexEntry entry = { packet->dts, pts, packet->pos, 0, 0 };
+            s.entries.push_back(entry);
+            last = &s.entries.back();
+        }
+    }
+
+    // packets before the first keyframe can't be seeked to, they aren't part of any GOP
+    if (last) {
+        last->gop_packets++;
+        last->gop_bytes = uint32_t(std::min<uint64_t>(uint64_t(last->gop_bytes) + packet->size, UINT32_MAX));
+    }
+}
+
+int64_t KeyframeIndexBuilder::entries() const {
+    int64_t n = 0;
+    for (size_t i = 0; i < m_streams.size(); i++) {
+        n += m_streams[i].entries.size();
+    }
+    return n;
+}
+
+bool KeyframeIndexBuilder::write(const char* filename, const char* in_filename) {
+    struct stat st;
+    if (stat(in_filename, &st) != 0) {
+        return false;
+    }
+
+    KeyframeIndexHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, KeyframeIndexMagic, sizeof header.magic);
+    header.byte_order = KeyframeIndexByteOrder;
+    header.input_size = st.st_size;
+    header.input_mtime = mtime_ns(st);
+
+    // streams without keyframes are left out
+    std::vector<KeyframeIndexStream> streams;
+    uint64_t first_entry = 0;
+    for (size_t i = 0; i < m_streams.size(); i++) {
+        if (m_streams[i].entries.empty()) {
+            continue;
+        }
+
+        KeyframeIndexStream stream = m_streams[i].stream;
+        stream.first_entry = first_entry;
+        stream.entries = m_streams[i].entries.size();
+        first_entry += stream.entries;
+        streams.push_back(stream);
+    }
+    header.streams = streams.size();
+
+    // readers of the old sidecar keep their mapping, new one appears whole
+    std::string tmp = std::string(filename) + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof header, 1, file) == 1 &&
+        (streams.empty() || fwrite(&streams[0], sizeof streams[0], streams.size(), file) == streams.size());
+
+    for (size_t i = 0; i < m_streams.size() && ok; i++) {
+        const std::vector<KeyframeIndexEntry>& entries = m_streams[i].entries;
+        ok = entries.empty() || fwrite(&entries[0], sizeof entries[0], entries.size(), file) == entries.size();
+    }
+
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), filename) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+KeyframeIndex::KeyframeIndex() :
+    m_data(NULL),
+    m_size(0),
+    m_header(NULL),
+    m_streams(NULL),
+    m_entries(NULL)
+{
+}
+
+KeyframeIndex::~KeyframeIndex() {
+    close();
+}
+
+void KeyframeIndex::close() {
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+
+    m_data = NULL;
+    m_size = 0;
+    m_header = NULL;
+    m_streams = NULL;
+    m_entries = NULL;
+}
+
+bool KeyframeIndex::is_open() const {
+    return m_header != NULL;
+}
+
+std::string KeyframeIndex::sidecar_filename(const char* in_filename) {
+    return std::string(in_filename) + ".kfi";
+}
+
+bool KeyframeIndex::open(const char* filename, const char* in_filename) {
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(KeyframeIndexHeader)) {
+        ::close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    m_data = data;
+    m_size = st.st_size;
+
+    const KeyframeIndexHeader* header = (const KeyframeIndexHeader*)m_data;
+    size_t tables = sizeof(KeyframeIndexHeader) + header->streams * sizeof(KeyframeIndexStream);
+
+    if (memcmp(header->magic, KeyframeIndexMagic, sizeof header->magic) != 0 ||
+        header->byte_order != KeyframeIndexByteOrder || tables > m_size)
+    {
+        close();
+        return false;
+    }
+
+    // stale index would send seeks to wrong offsets
+    struct stat in_st;
+    if (in_filename && (stat(in_filename, &in_st) != 0 || in_st.st_size != header->input_size ||
+        mtime_ns(in_st) != header->input_mtime))
+    {
+        close();
+        return false;
+    }
+
+    const KeyframeIndexStream* streams = (const KeyframeIndexStream*)((const char*)m_data + sizeof(KeyframeIndexHeader));
+    uint64_t entries = (m_size - tables) / sizeof(KeyframeIndexEntry);
+    for (uint32_t i = 0; i < header->streams; i++) {
+        if (streams[i].first_entry > entries || streams[i].entries > entries - streams[i].first_entry) {
+            close();
+            return false;
+        }
+    }
+
+    m_header = header;
+    m_streams = streams;
+    m_entries = (const KeyframeIndexEntry*)((const char*)m_data + tables);
+    return true;
+}
+
+const KeyframeIndexStream* KeyframeIndex::stream(int stream_index) const {
+    if (!m_header) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < m_header->streams; i++) {
+        if (m_streams[i].index == stream_index) {
+            return &m_streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+const KeyframeIndexEntry* KeyframeIndex::find(int stream_index, int64_t min_ts, int64_t ts) const {
+    const KeyframeIndexStream* s = stream(stream_index);
+    if (!s || s->entries == 0) {
+        return NULL;
+    }
+
+    const KeyframeIndexEntry* begin = m_entries + s->first_entry;
+    const KeyframeIndexEntry* end = begin + s->entries;
+
+    if (s->flags & KeyframeIndexMonotonic) {
+        const KeyframeIndexEntry* after = std::upper_bound(begin, end, ts, ts_less);
+        if (after != begin && (after - 1)->pts >= min_ts) {
+            return after - 1;
+        }
+
+        const KeyframeIndexEntry* first = std::lower_bound(begin, end, min_ts, pts_less);
+        return first != end ? first : NULL;
+    }
+
+    // timestamps jump somewhere in the input, every entry has to be looked at
+    const KeyframeIndexEntry* before = NULL;
+    const KeyframeIndexEntry* after = NULL;
+    for (const KeyframeIndexEntry* e = begin; e != end; e++) {
+        if (e->pts >= min_ts && e->pts <= ts && (!before || e->pts > before->pts)) {
+            before = e;
+        } else if (e->pts > ts && (!after || e->pts < after->pts)) {
+            after = e;
+        }
+    }
+
+    return before ? before : after;
+}
+
+bool KeyframeIndex::seek(AVFormatContext* ctx, int stream_index, int64_t min_ts, int64_t ts) const {
+    if (!ctx->iformat || (ctx->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+        return false;
+    }
+
+    const KeyframeIndexEntry* entry = find(stream_index, min_ts, ts);
+    if (!entry) {
+        return false;
+    }
+
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html#gaa23f7619d8d4ea0857065d9979c75ac8
+    return av_seek_frame(ctx, -1, entry->pos, AVSEEK_FLAG_BYTE) >= 0;
+}
@@ -0,0 +1,115 @@
+/*
+* File: keyframe_index.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* keyframe index sidecar files. containers without index (MPEG-TS first of all) can only be
+* seeked by bisecting the file with reads, or by reading from the start. KeyframeIndexBuilder
+* collects keyframes from packets a remux pass reads anyway (no extra read) and writes them to
+* a sidecar file: for every stream keyframe DTS, PTS and byte offset in input, and GOP size.
+* KeyframeIndex maps the sidecar into memory and finds keyframe of any time with binary search,
+* seek() then moves demuxer straight to its byte offset.
+*
+* sidecar is native byte order fixed size records, nothing to parse:
+*   KeyframeIndexHeader, KeyframeIndexStream[streams], KeyframeIndexEntry[entries of all streams]
+* index is refused when input size or modification time differ from ones it was built from
+*
+*/
+
+#ifndef keyframe_index_hpp
+#define keyframe_index_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+const uint32_t KeyframeIndexByteOrder = 0x01020304;
+const uint32_t KeyframeIndexMonotonic = 1;     // stream flag: entries are in PTS order, binary search works
+
+struct KeyframeIndexHeader {
+    char magic[8];              // "KFINDEX2"
+    uint32_t byte_order;        // KeyframeIndexByteOrder as written by the builder
+    uint32_t streams;
+    int64_t input_size;         // input the index was built from
+    int64_t input_mtime;        // ns, input rewritten within a second differs too
+};
+
+struct KeyframeIndexStream {
+    int32_t index;              // input stream index
+    int32_t codec_type;         // AVMediaType
+    int32_t time_base_num;
+    int32_t time_base_den;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t first_entry;       // in entries table
+    uint64_t entries;
+};
+
+struct KeyframeIndexEntry {
+    int64_t dts;                // stream time base
+    int64_t pts;                // dts when packet had no pts
+    int64_t pos;                // byte offset of keyframe packet in input
+    uint32_t gop_packets;       // packets of the stream from this entry to the next one
+    uint32_t gop_bytes;
+};
+
+// collects one input's keyframes while it's read, reusable
+class KeyframeIndexBuilder {
+public:
+    KeyframeIndexBuilder();
+
+    void start(const AVFormatContext* input_ctx);
+    void add(const AVPacket* packet);          // input packet, before timestamps are rescaled
+
+    // false if file can't be written, sidecar is replaced as a whole or left as it was
+    bool write(const char* filename, const char* in_filename);
+
+    int64_t entries() const;
+
+private:
+    struct StreamEntries {
+        KeyframeIndexStream stream;
+        std::vector<KeyframeIndexEntry> entries;
+        int64_t min_distance;   // stream time base, entries closer to the last one are not added
+    };
+
+    std::vector<StreamEntries> m_streams;      // by input stream index
+};
+
+// read-only, memory mapped, can be shared by threads
+class KeyframeIndex {
+public:
+    KeyframeIndex();
+    ~KeyframeIndex();
+
+    // in_filename is the input index was built from, NULL to skip the check
+    bool open(const char* filename, const char* in_filename);
+    void close();
+    bool is_open() const;
+
+    const KeyframeIndexStream* stream(int stream_index) const;     // NULL if stream isn't indexed
+
+    // last keyframe with PTS in [min_ts, ts], or first one after min_ts if there's none at or
+    // before ts (same choice as avformat_seek_file()). stream time base, NULL when no keyframe fits
+    const KeyframeIndexEntry* find(int stream_index, int64_t min_ts, int64_t ts) const;
+
+    // byte seek to keyframe find() picks, false if demuxer can't do byte seeks or no keyframe fits.
+    // caller falls back to demuxer's own seek
+    bool seek(AVFormatContext* ctx, int stream_index, int64_t min_ts, int64_t ts) const;
+
+    static std::string sidecar_filename(const char* in_filename);  // in_filename + ".kfi"
+
+private:
+    void* m_data;
+    size_t m_size;
+    const KeyframeIndexHeader* m_header;
+    const KeyframeIndexStream* m_streams;
+    const KeyframeIndexEntry* m_entries;
+};
+
+#endif /* keyframe_index_hpp */
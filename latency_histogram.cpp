@@ -0,0 +1,149 @@
+/*
+* File: latency_histogram.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* latency histogram, see latency_histogram.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string>
+#include <algorithm>
+
+#include "latency_histogram.hpp"
+
+// values below SubBuckets get a bucket each, above that every power of two gets SubBuckets buckets
+const int SubBucketBits = 4;
+const int SubBuckets = 1 << SubBucketBits;
+const int MaxExponent = 42;                 // 2^42 us, ~50 days, larger values go to the last bucket
+const int BucketsCount = SubBuckets + (MaxExponent - SubBucketBits + 1) * SubBuckets;
+
+LatencyHistogram::LatencyHistogram() :
+    m_counts(BucketsCount, 0),
+    m_count(0),
+    m_min(0),
+    m_max(0),
+    m_sum(0)
+{
+}
+
+int LatencyHistogram::buckets_count() {
+    return BucketsCount;
+}
+
+int LatencyHistogram::bucket(int64_t us) {
+    if (us < SubBuckets) {
+        return int(us);
+    }
+
+    int exponent = 63 - __builtin_clzll(uint64_t(us));
+    if (exponent > MaxExponent) {
+        return BucketsCount - 1;
+    }
+
+    // leading one and SubBucketBits bits after it
+    int sub = int(us >> (exponent - SubBucketBits)) & (SubBuckets - 1);
+    return SubBuckets + (exponent - SubBucketBits) * SubBuckets + sub;
+}
+
+int64_t LatencyHistogram::bucket_upper(int index) {
+    if (index < SubBuckets) {
+        return index;
+    }
+
+    int exponent = (index - SubBuckets) / SubBuckets + SubBucketBits;
+    int sub = (index - SubBuckets) % SubBuckets;
+    int shift = exponent - SubBucketBits;
+
+    return ((int64_t(SubBuckets + sub) + 1) << shift) - 1;
+}
+
+void LatencyHistogram::add(int64_t us) {
+    us = std::max(us, int64_t(0));
+
+    m_counts[bucket(us)]++;
+    m_min = m_count == 0 ? us : std::min(m_min, us);
+    m_max = std::max(m_max, us);
+    m_sum += us;
+    m_count++;
+}
+
+int64_t LatencyHistogram::count() const {
+    return m_count;
+}
+
+int64_t LatencyHistogram::min() const {
+    return m_min;
+}
+
+int64_t LatencyHistogram::max() const {
+    return m_max;
+}
+
+double LatencyHistogram::mean() const {
+    return m_count > 0 ? double(m_sum) / m_count : 0;
+}
+
+int64_t LatencyHistogram::percentile(double p) const {
+    if (m_count == 0) {
+        return 0;
+    }
+
+    // rank of the value, 1-based, p99 of 1000 values is the 990th
+    int64_t rank = std::max(int64_t(1), int64_t(p / 100.0 * m_count + 0.5));
+    int64_t seen = 0;
+    for (int i = 0; i < BucketsCount; i++) {
+        seen += m_counts[i];
+        if (seen >= rank) {
+            return std::min(bucket_upper(i), m_max);
+        }
+    }
+
+    return m_max;
+}
+
+// distribution is printed by power of two ranges, 16 buckets each is too much to read
+void LatencyHistogram::print(std::ostream& out, const char* indent) const {
+    char line[128];
+
+    snprintf(line, sizeof line, "%s%lld samples, min %.3f ms, mean %.3f ms, max %.3f ms\n", indent,
+        (long long)m_count, m_min / 1000.0, mean() / 1000.0, m_max / 1000.0);
+    out << line;
+
+    if (m_count == 0) {
+        return;
+    }
+
+    snprintf(line, sizeof line, "%sp50 %.3f ms, p99 %.3f ms, p999 %.3f ms\n", indent,
+        percentile(50) / 1000.0, percentile(99) / 1000.0, percentile(99.9) / 1000.0);
+    out << line;
+
+    std::vector<int64_t> ranges(MaxExponent + 2, 0);
+    for (int i = 0; i < BucketsCount; i++) {
+        int64_t upper = bucket_upper(i);
+        int range = upper > 0 ? 64 - __builtin_clzll(uint64_t(upper)) : 0;
+        ranges[std::min(range, MaxExponent + 1)] += m_counts[i];
+    }
+
+    int64_t most = *std::max_element(ranges.begin(), ranges.end());
+    size_t first = 0;
+    size_t last = ranges.size() - 1;
+    while (ranges[first] == 0) {
+        first++;
+    }
+    while (ranges[last] == 0) {
+        last--;
+    }
+
+    // range n holds values in [2^(n-1), 2^n)
+    for (size_t i = first; i <= last; i++) {
+        double from = i > 0 ? (int64_t(1) << (i - 1)) / 1000.0 : 0;
+        double to = (int64_t(1) << i) / 1000.0;
+        std::string bar(size_t(ranges[i] * 40 / most), '#');
+
+        snprintf(line, sizeof line, "%s%10.3f - %10.3f ms %10lld %s\n", indent, from, to, (long long)ranges[i], bar.c_str());
+        out << line;
+    }
+}
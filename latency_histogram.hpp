@@ -0,0 +1,47 @@
+/*
+* File: latency_histogram.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* latency histogram, non-threadsafe. values (microseconds) go to log-linear buckets: every
+* power of two range is split into 16 buckets, so memory is fixed and percentiles are within
+* ~6% of real values from microseconds to hours
+*
+*/
+
+#ifndef latency_histogram_hpp
+#define latency_histogram_hpp
+
+#include <stdint.h>
+#include <vector>
+#include <ostream>
+
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void add(int64_t us);                   // negative values are counted as 0
+    int64_t count() const;
+    int64_t min() const;
+    int64_t max() const;
+    double mean() const;
+    int64_t percentile(double p) const;     // p in 0..100, upper bound of bucket value falls in
+
+    void print(std::ostream& out, const char* indent) const;   // percentiles and distribution
+
+    // bucket layout, shared with metrics histograms
+    static int buckets_count();
+    static int bucket(int64_t us);
+    static int64_t bucket_upper(int index);     // largest value bucket holds
+
+private:
+
+    std::vector<int64_t> m_counts;
+    int64_t m_count;
+    int64_t m_min;
+    int64_t m_max;
+    int64_t m_sum;
+};
+
+#endif /* latency_histogram_hpp */
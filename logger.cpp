@@ -0,0 +1,241 @@
+/*
+* File: logger.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* asynchronous logger, see logger.hpp for description
+*
+*/
+
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+
+extern "C" {
+    #include <libavutil/log.h>
+}
+
+#include "logger.hpp"
+
+const size_t LogStagingLimit = 1024 * 1024;     // per thread, messages over it are dropped
+const int LogFlushIntervalMs = 50;
+
+// staged lines of one thread. buffers are never freed, lines of threads which are gone still
+// have to be written
+struct LogBuffer {
+    std::mutex mutex;                   // owner thread and flusher only, flusher just swaps buffers
+    std::string lines;
+    std::string thread_name;            // owner thread only
+    std::string av_line;                // libav message collected till newline, owner thread only
+    int av_print_prefix;
+    time_t date_second;                 // date and time of lines logged within this second, owner thread only
+    char date[32];
+    int date_size;
+};
+
+static std::mutex s_mutex;              // buffers list and flusher state
+static std::condition_variable s_cond;
+static std::vector<LogBuffer*> s_buffers;
+static std::thread s_flusher;
+static bool s_stop = false;
+static FILE* s_out = NULL;
+static std::atomic<int> s_level(LogInfo);
+static std::atomic<int64_t> s_dropped(0);
+static thread_local LogBuffer* t_buffer = NULL;
+
+static const char* level_names[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+static LogBuffer* thread_buffer() {
+    if (t_buffer) {
+        return t_buffer;
+    }
+
+    LogBuffer* buffer = new LogBuffer();
+    buffer->thread_name = std::to_string(syscall(SYS_gettid));
+    buffer->av_print_prefix = 1;
+    buffer->date_second = -1;
+    buffer->date_size = 0;
+
+    std::lock_guard<std::mutex> lk(s_mutex);
+    s_buffers.push_back(buffer);
+    t_buffer = buffer;
+
+    return buffer;
+}
+
+static void stage(LogBuffer* buffer, LogLevel level, const char* message, size_t size) {
+    // strip newlines at the end, every message is one line
+    while (size > 0 && (message[size - 1] == '\n' || message[size - 1] == '\r')) {
+        size--;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    // localtime_r() takes a lock and may check timezone file, once a second per thread is enough
+    if (ts.tv_sec != buffer->date_second) {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        buffer->date_size = strftime(buffer->date, sizeof buffer->date, "%Y-%m-%d %H:%M:%S", &tm);
+        buffer->date_second = ts.tv_sec;
+    }
+
+    char prefix[96];
+    memcpy(prefix, buffer->date, buffer->date_size);
+    snprintf(prefix + buffer->date_size, sizeof prefix - buffer->date_size, ".%06ld %s ", ts.tv_nsec / 1000, level_names[level]);
+
+    std::lock_guard<std::mutex> lk(buffer->mutex);
+    if (buffer->lines.size() + size > LogStagingLimit) {
+        s_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    buffer->lines += prefix;
+    buffer->lines += "[" + buffer->thread_name + "] ";
+    buffer->lines.append(message, size);
+    buffer->lines += '\n';
+}
+
+static void flush_buffers() {
+    std::vector<LogBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> lk(s_mutex);
+        buffers = s_buffers;
+    }
+
+    std::string lines;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        std::lock_guard<std::mutex> lk(buffers[i]->mutex);
+        lines += buffers[i]->lines;
+        buffers[i]->lines.clear();
+    }
+
+    int64_t dropped = s_dropped.exchange(0);
+    if (dropped > 0) {
+        lines += "logger: " + std::to_string(dropped) + " messages dropped, staging buffer full\n";
+    }
+
+    // the only place anything is written, on flusher thread
+    if (!lines.empty() && s_out) {
+        fwrite(lines.data(), 1, lines.size(), s_out);
+        fflush(s_out);
+    }
+}
+
+static void flusher() {
+    std::unique_lock<std::mutex> lk(s_mutex);
+    while (!s_stop) {
+        s_cond.wait_for(lk, std::chrono::milliseconds(LogFlushIntervalMs));
+
+        lk.unlock();
+        flush_buffers();
+        lk.lock();
+    }
+}
+
+void Logger::start(LogLevel level, FILE* out) {
+    std::lock_guard<std::mutex> lk(s_mutex);
+    if (s_flusher.joinable()) {
+        return;
+    }
+
+    s_level.store(level);
+    s_out = out;
+    s_stop = false;
+    s_flusher = std::thread(flusher);
+}
+
+void Logger::stop() {
+    {
+        std::lock_guard<std::mutex> lk(s_mutex);
+        if (!s_flusher.joinable()) {
+            return;
+        }
+        s_stop = true;
+        s_cond.notify_all();
+    }
+
+    s_flusher.join();
+    flush_buffers();
+}
+
+bool Logger::enabled(LogLevel level) {
+    return level <= s_level.load(std::memory_order_relaxed);
+}
+
+void Logger::log(LogLevel level, const char* format, ...) {
+    if (!enabled(level)) {
+        return;
+    }
+
+    char message[2048];
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(message, sizeof message, format, args);
+    va_end(args);
+
+    if (size < 0) {
+        return;
+    }
+
+    stage(thread_buffer(), level, message, std::min(size_t(size), sizeof message - 1));
+}
+
+void Logger::set_thread_name(const char* name) {
+    thread_buffer()->thread_name = name;
+}
+
+// libav logs parts of lines (av_dump_format does it a lot), they're collected till newline
+static void av_log_callback(void* avcl, int level, const char* format, va_list args) {
+    if (level > av_log_get_level()) {
+        return;
+    }
+
+    LogBuffer* buffer = thread_buffer();
+
+    char part[2048];
+    av_log_format_line2(avcl, level, format, args, part, sizeof part, &buffer->av_print_prefix);
+    buffer->av_line += part;
+
+    if (buffer->av_line.empty() || buffer->av_line[buffer->av_line.size() - 1] != '\n') {
+        return;
+    }
+
+    LogLevel log_level = level <= AV_LOG_ERROR ? LogError : level <= AV_LOG_WARNING ? LogWarning : level <= AV_LOG_INFO ? LogInfo : LogDebug;
+    stage(buffer, log_level, buffer->av_line.c_str(), buffer->av_line.size());
+    buffer->av_line.clear();
+}
+
+void Logger::redirect_av_log() {
+    static const int av_levels[] = { AV_LOG_ERROR, AV_LOG_WARNING, AV_LOG_INFO, AV_LOG_VERBOSE };
+
+    av_log_set_level(av_levels[s_level.load()]);
+    av_log_set_callback(av_log_callback);
+}
+
+LogLevel Logger::parse_level(const char* name, bool* ok) {
+    *ok = true;
+    if (strcmp(name, "error") == 0) {
+        return LogError;
+    } else if (strcmp(name, "warning") == 0) {
+        return LogWarning;
+    } else if (strcmp(name, "info") == 0) {
+        return LogInfo;
+    } else if (strcmp(name, "debug") == 0) {
+        return LogDebug;
+    }
+
+    *ok = false;
+    return LogInfo;
+}
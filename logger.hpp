@@ -0,0 +1,43 @@
+/*
+* File: logger.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* asynchronous logger. log() formats message into staging buffer of the calling thread and
+* returns, background thread takes full buffers and writes them out, so no pipeline thread
+* ever waits for terminal or disk. staging buffer size is limited, messages over the limit
+* are dropped and counted rather than block. libav messages (av_log, av_dump_format) can be
+* redirected into logger too.
+* every line: time, level, thread name, message. lines are in order per thread, lines of
+* different threads staged between two flushes (50ms) are grouped by thread
+*
+*/
+
+#ifndef logger_hpp
+#define logger_hpp
+
+#include <stdio.h>
+
+enum LogLevel {
+    LogError,
+    LogWarning,
+    LogInfo,
+    LogDebug
+};
+
+class Logger {
+public:
+    static void start(LogLevel level, FILE* out);   // starts flusher thread, out is stderr or log file
+    static void stop();                             // writes whatever is staged, stops flusher
+
+    static bool enabled(LogLevel level);
+    static void log(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+    static void set_thread_name(const char* name);  // shows in lines logged by calling thread
+    static void redirect_av_log();                  // av_log_set_callback(), libav log level follows ours
+
+    static LogLevel parse_level(const char* name, bool* ok);   // error, warning, info, debug
+};
+
+#endif /* logger_hpp */
@@ -0,0 +1,318 @@
+/*
+* File: media_scanner.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* media info scanner, see media_scanner.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fstream>
+
+extern "C" {
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/samplefmt.h>
+}
+
+#include "helpers.hpp"
+#include "media_scanner.hpp"
+
+ScanOptions::ScanOptions() :
+    probesize(1 << 20),
+    analyze_duration(AV_TIME_BASE),
+    full_probe(false)
+{
+}
+
+// string as JSON string literal, quotes included
+static std::string json_string(const char* value) {
+    std::string out = "\"";
+
+    for (const char* c = value; *c; c++) {
+        switch (*c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)*c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof escaped, "\\u%04x", *c);
+                    out += escaped;
+                } else {
+                    out += *c;
+                }
+        }
+    }
+
+    return out + "\"";
+}
+
+// ,"name":value
+static void json_add(std::string* json, const char* name, const std::string& value) {
+    *json += ",\"";
+    *json += name;
+    *json += "\":";
+    *json += value;
+}
+
+static void json_add(std::string* json, const char* name, int64_t value) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "%lld", (long long)value);
+    json_add(json, name, std::string(buf));
+}
+
+static void json_add(std::string* json, const char* name, double value) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "%.3f", value);
+    json_add(json, name, std::string(buf));
+}
+
+// file header, same for media info and errors
+static std::string json_file(const char* path, int64_t size, int64_t mtime) {
+    std::string json = "{\"path\":" + json_string(path);
+    json_add(&json, "size", size);
+    json_add(&json, "mtime", mtime);
+    return json;
+}
+
+MediaScanner::MediaScanner(const ScanOptions& options) :
+    m_options(options)
+{
+    for (int i = 0; i < SCAN_SOURCES; i++) {
+        m_counts[i] = 0;
+    }
+}
+
+uint64_t MediaScanner::count(ScanSource source) const {
+    return m_counts[source].load();
+}
+
+std::string MediaScanner::scan(const char* path, ScanSource* source) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        *source = SCAN_ERROR;
+        m_counts[SCAN_ERROR]++;
+        return json_file(path, -1, -1) + ",\"error\":\"could not stat file\"}";
+    }
+
+    int64_t size = st.st_size;
+    int64_t mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        std::map<std::string, CacheEntry>::const_iterator it = m_cache.find(path);
+        if (it != m_cache.end() && it->second.size == size && it->second.mtime == mtime) {
+            *source = SCAN_CACHE;
+            m_counts[SCAN_CACHE]++;
+            return it->second.json;
+        }
+    }
+
+    // probing runs without lock, that's where the time goes
+    std::string json = probe(path, size, st.st_mtime, source);
+    m_counts[*source]++;
+
+    // unreadable files are cached too, rescan won't try them again till they change
+    CacheEntry entry = { size, mtime, json };
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_cache[path] = entry;
+
+    return json;
+}
+
+std::string MediaScanner::probe(const char* path, int64_t size, int64_t mtime, ScanSource* source) const {
+    std::string json = json_file(path, size, mtime);
+
+    // reads container headers only, streams are known after this for most containers
+    AVFormatContext* ctx = NULL;
+    int ret = avformat_open_input(&ctx, path, NULL, NULL);
+    if (ret < 0) {
+        *source = SCAN_ERROR;
+        json_add(&json, "error", json_string(av_err2str(ret)));
+        return json + "}";
+    }
+
+    *source = SCAN_HEADER;
+
+    if (m_options.full_probe || !headers_complete(ctx)) {
+        // probe only as much as needed to fill the gaps, unlimited probe may read many megabytes
+        if (!m_options.full_probe) {
+            ctx->probesize = m_options.probesize;
+            ctx->max_analyze_duration = m_options.analyze_duration;
+        }
+
+        ret = avformat_find_stream_info(ctx, NULL);
+        if (ret < 0) {
+            *source = SCAN_ERROR;
+            json_add(&json, "error", json_string(av_err2str(ret)));
+            avformat_close_input(&ctx);
+            return json + "}";
+        }
+
+        *source = SCAN_PROBE;
+    }
+
+    json_add(&json, "format", json_string(ctx->iformat->name));
+    json_add(&json, "probe", json_string(*source == SCAN_HEADER ? "header" : "probe"));
+
+    // container duration is calculated by avformat_find_stream_info(), with headers only
+    // streams durations are all we have
+    int64_t duration = ctx->duration;
+    for (unsigned int i = 0; duration == AV_NOPTS_VALUE && i < ctx->nb_streams; i++) {
+        AVStream* st = ctx->streams[i];
+        if (st->duration != AV_NOPTS_VALUE) {
+            duration = av_rescale_q(st->duration, st->time_base, AV_TIME_BASE_Q);
+        }
+    }
+
+    if (duration != AV_NOPTS_VALUE) {
+        json_add(&json, "duration", double(duration) / AV_TIME_BASE);
+    }
+
+    if (ctx->bit_rate > 0) {
+        json_add(&json, "bit_rate", ctx->bit_rate);
+    }
+
+    json += ",\"streams\":[";
+
+    for (unsigned int i = 0; i < ctx->nb_streams; i++) {
+        AVStream* st = ctx->streams[i];
+        AVCodecParameters* par = st->codecpar;
+        const char* type = av_get_media_type_string(par->codec_type);
+
+        std::string stream = "{\"index\":" + std::to_string(i);
+        json_add(&stream, "type", json_string(type ? type : "unknown"));
+        json_add(&stream, "codec", json_string(avcodec_get_name(par->codec_id)));
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            json_add(&stream, "width", int64_t(par->width));
+            json_add(&stream, "height", int64_t(par->height));
+
+            // pixel format is known only if decoder was opened by probe
+            const char* pix_fmt = av_get_pix_fmt_name((AVPixelFormat)par->format);
+            if (pix_fmt) {
+                json_add(&stream, "pix_fmt", json_string(pix_fmt));
+            }
+
+            AVRational fps = st->avg_frame_rate.num > 0 ? st->avg_frame_rate : st->r_frame_rate;
+            if (fps.num > 0 && fps.den > 0) {
+                json_add(&stream, "fps", av_q2d(fps));
+            }
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            json_add(&stream, "sample_rate", int64_t(par->sample_rate));
+            json_add(&stream, "channels", int64_t(par->channels));
+
+            const char* sample_fmt = av_get_sample_fmt_name((AVSampleFormat)par->format);
+            if (sample_fmt) {
+                json_add(&stream, "sample_fmt", json_string(sample_fmt));
+            }
+        }
+
+        if (par->bit_rate > 0) {
+            json_add(&stream, "bit_rate", par->bit_rate);
+        }
+
+        json += (i > 0 ? "," : "") + stream + "}";
+    }
+
+    avformat_close_input(&ctx);
+    return json + "]}";
+}
+
+// headers have everything we print. pixel and sample formats are not required, containers
+// don't store them, it takes a decoder to find out
+bool MediaScanner::headers_complete(AVFormatContext* ctx) {
+    if (ctx->nb_streams == 0) {
+        return false;
+    }
+
+    bool has_duration = ctx->duration != AV_NOPTS_VALUE;
+
+    for (unsigned int i = 0; i < ctx->nb_streams; i++) {
+        AVStream* st = ctx->streams[i];
+        AVCodecParameters* par = st->codecpar;
+
+        if (par->codec_id == AV_CODEC_ID_NONE) {
+            return false;
+        }
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && (par->width <= 0 || par->height <= 0)) {
+            return false;
+        }
+
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO && (par->sample_rate <= 0 || par->channels <= 0)) {
+            return false;
+        }
+
+        has_duration = has_duration || st->duration != AV_NOPTS_VALUE;
+    }
+
+    return has_duration;
+}
+
+// cache file is plain text, one file per line: size, mtime (ns), path and JSON separated by tabs
+bool MediaScanner::load_cache(const char* filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+    std::string line;
+
+    while (std::getline(file, line)) {
+        size_t size_end = line.find('\t');
+        size_t mtime_end = size_end == std::string::npos ? size_end : line.find('\t', size_end + 1);
+        size_t path_end = mtime_end == std::string::npos ? mtime_end : line.find('\t', mtime_end + 1);
+
+        if (path_end == std::string::npos) {
+            continue; // broken line, file will be scanned again
+        }
+
+        CacheEntry entry;
+        entry.size = strtoll(line.c_str(), NULL, 10);
+        entry.mtime = strtoll(line.c_str() + size_end + 1, NULL, 10);
+        entry.json = line.substr(path_end + 1);
+
+        m_cache[line.substr(mtime_end + 1, path_end - mtime_end - 1)] = entry;
+    }
+
+    return true;
+}
+
+bool MediaScanner::save_cache(const char* filename) const {
+    // written next to the old cache and renamed over it, interrupted save doesn't lose the cache
+    std::string tmp_filename = std::string(filename) + ".tmp";
+    std::ofstream file(tmp_filename.c_str(), std::ofstream::out | std::ofstream::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        std::map<std::string, CacheEntry>::const_iterator it = m_cache.begin();
+
+        for (; it != m_cache.end(); ++it) {
+            // such paths would break line format, they are just scanned every time
+            if (it->first.find_first_of("\t\n") != std::string::npos) {
+                continue;
+            }
+
+            file << it->second.size << '\t' << it->second.mtime << '\t' << it->first << '\t' << it->second.json << '\n';
+        }
+    }
+
+    file.close();
+    if (file.fail()) {
+        return false;
+    }
+
+    return rename(tmp_filename.c_str(), filename) == 0;
+}
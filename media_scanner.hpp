@@ -0,0 +1,75 @@
+/*
+* File: media_scanner.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* media info scanner, threadsafe. avformat_find_stream_info() decodes a few seconds of every
+* stream, which is most of the time spent on a file. scanner reads container headers only
+* (avformat_open_input()) and calls avformat_find_stream_info() only when headers miss
+* something (e.g. MPEG-TS has no header at all), with probe size and analyze duration limited.
+* results are kept in a cache keyed by path, size and modification time, unchanged files
+* are not even opened on rescan. cache can be saved to and loaded from a file
+*
+*/
+
+#ifndef media_scanner_hpp
+#define media_scanner_hpp
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+struct ScanOptions {
+    ScanOptions();
+
+    int64_t probesize;          // max bytes read by escalated probe
+    int64_t analyze_duration;   // max stream duration analyzed by escalated probe, in AV_TIME_BASE units
+    bool full_probe;            // always run unlimited avformat_find_stream_info(), old behaviour
+};
+
+// how media info of a file was obtained, counted by scanner
+enum ScanSource {
+    SCAN_CACHE,     // file hasn't changed since last scan
+    SCAN_HEADER,    // container headers had everything
+    SCAN_PROBE,     // headers weren't enough, stream info was probed
+    SCAN_ERROR,     // not a media file or not readable
+    SCAN_SOURCES
+};
+
+class MediaScanner {
+public:
+    MediaScanner(const ScanOptions& options);
+
+    // media info of file as single line JSON object
+    std::string scan(const char* path, ScanSource* source);
+
+    bool load_cache(const char* filename);          // missing cache file is not an error
+    bool save_cache(const char* filename) const;
+
+    uint64_t count(ScanSource source) const;        // files scanned by given source so far
+
+private:
+    struct CacheEntry {
+        int64_t size;
+        int64_t mtime;          // ns, files rewritten within a second differ too
+        std::string json;
+    };
+
+    std::string probe(const char* path, int64_t size, int64_t mtime, ScanSource* source) const;
+    static bool headers_complete(AVFormatContext* ctx);
+
+    ScanOptions m_options;
+
+    std::map<std::string, CacheEntry> m_cache;
+    mutable std::mutex m_mutex;
+    std::atomic<uint64_t> m_counts[SCAN_SOURCES];
+};
+
+#endif /* media_scanner_hpp */
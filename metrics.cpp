@@ -0,0 +1,321 @@
+/*
+* File: metrics.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* metrics and Prometheus export, see metrics.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <iostream>
+#include <algorithm>
+
+#include "metrics.hpp"
+#include "latency_histogram.hpp"
+
+MetricHistogram::MetricHistogram(double unit, int64_t max_value) :
+    m_counts(new std::atomic<int64_t>[LatencyHistogram::buckets_count()]),
+    m_count(0),
+    m_sum(0),
+    m_unit(unit > 0 ? unit : 1),
+    m_max_value(max_value)
+{
+    for (int i = 0; i < LatencyHistogram::buckets_count(); i++) {
+        m_counts[i].store(0);
+    }
+}
+
+void MetricHistogram::observe(int64_t value) {
+    value = value > 0 ? value : 0;
+
+    m_counts[LatencyHistogram::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// fine buckets are summed up to power of two boundaries, 2^n - 1 is always an upper bound of one
+// of them, last one is the first >= max value. boundaries are the same on every scrape whatever
+// values came, Prometheus needs that for quantiles over time. counts are read one by one while
+// being updated, sums are close enough
+void MetricHistogram::render(std::string* out, const std::string& name, const std::string& labels) const {
+    std::string prefix = labels.empty() ? "" : labels + ",";
+
+    char line[512];
+    int64_t cumulative = 0;
+    for (int i = 0; i < LatencyHistogram::buckets_count(); i++) {
+        int64_t upper = LatencyHistogram::bucket_upper(i);
+        cumulative += m_counts[i].load(std::memory_order_relaxed);
+        if (((upper + 1) & upper) != 0) {
+            continue;
+        }
+
+        snprintf(line, sizeof line, "%s_bucket{%sle=\"%.9g\"} %lld\n", name.c_str(), prefix.c_str(),
+            upper / m_unit, (long long)cumulative);
+        *out += line;
+
+        if (upper >= m_max_value) {
+            break;
+        }
+    }
+
+    int64_t count = std::max(m_count.load(std::memory_order_relaxed), cumulative);
+    snprintf(line, sizeof line, "%s_bucket{%sle=\"+Inf\"} %lld\n", name.c_str(), prefix.c_str(), (long long)count);
+    *out += line;
+
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    snprintf(line, sizeof line, "%s_sum%s %.9g\n%s_count%s %lld\n", name.c_str(), braces.c_str(),
+        m_sum.load(std::memory_order_relaxed) / m_unit, name.c_str(), braces.c_str(), (long long)count);
+    *out += line;
+}
+
+Metrics::Entry* Metrics::find(const std::string& name, const std::string& labels, Type type) {
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        if (m_entries[i].name == name && m_entries[i].labels == labels && m_entries[i].type == type) {
+            return &m_entries[i];
+        }
+    }
+    return NULL;
+}
+
+MetricCounter* Metrics::counter(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    Entry* entry = find(name, labels, Counter);
+    if (!entry) {
+        Entry e = { name, help, labels, Counter, std::make_shared<MetricCounter>() };
+        m_entries.push_back(e);
+        entry = &m_entries.back();
+    }
+
+    return static_cast<MetricCounter*>(entry->metric.get());
+}
+
+MetricGauge* Metrics::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    Entry* entry = find(name, labels, Gauge);
+    if (!entry) {
+        Entry e = { name, help, labels, Gauge, std::make_shared<MetricGauge>() };
+        m_entries.push_back(e);
+        entry = &m_entries.back();
+    }
+
+    return static_cast<MetricGauge*>(entry->metric.get());
+}
+
+MetricHistogram* Metrics::histogram(const std::string& name, const std::string& help, const std::string& labels, double unit, int64_t max_value) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    Entry* entry = find(name, labels, Histogram);
+    if (!entry) {
+        Entry e = { name, help, labels, Histogram, std::make_shared<MetricHistogram>(unit, max_value) };
+        m_entries.push_back(e);
+        entry = &m_entries.back();
+    }
+
+    return static_cast<MetricHistogram*>(entry->metric.get());
+}
+
+std::string Metrics::render() const {
+    static const char* types[] = { "counter", "gauge", "histogram" };
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    // metrics of one family must go together, HELP and TYPE once per family
+    std::string out;
+    std::vector<bool> rendered(m_entries.size(), false);
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        if (rendered[i]) {
+            continue;
+        }
+
+        const Entry& family = m_entries[i];
+        out += "# HELP " + family.name + " " + family.help + "\n";
+        out += "# TYPE " + family.name + " " + types[family.type] + "\n";
+
+        for (size_t j = i; j < m_entries.size(); j++) {
+            const Entry& e = m_entries[j];
+            if (rendered[j] || e.name != family.name) {
+                continue;
+            }
+            rendered[j] = true;
+
+            std::string braces = e.labels.empty() ? "" : "{" + e.labels + "}";
+            if (e.type == Counter) {
+                out += e.name + braces + " " + std::to_string(static_cast<MetricCounter*>(e.metric.get())->value()) + "\n";
+            } else if (e.type == Gauge) {
+                out += e.name + braces + " " + std::to_string(static_cast<MetricGauge*>(e.metric.get())->value()) + "\n";
+            } else {
+                static_cast<MetricHistogram*>(e.metric.get())->render(&out, e.name, e.labels);
+            }
+        }
+    }
+
+    return out;
+}
+
+std::string Metrics::label(const std::string& name, const std::string& value) {
+    std::string out = name + "=\"";
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] == '\\' || value[i] == '"') {
+            out += '\\';
+            out += value[i];
+        } else if (value[i] == '\n') {
+            out += "\\n";
+        } else {
+            out += value[i];
+        }
+    }
+    return out + "\"";
+}
+
+MetricsServer::MetricsServer(const Metrics* metrics) :
+    m_metrics(metrics),
+    m_fd(-1),
+    m_stop(false)
+{
+}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+bool MetricsServer::start(const std::string& address) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        m_unix_path = address.substr(5);
+
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sun_family = AF_UNIX;
+        if (m_unix_path.empty() || m_unix_path.size() >= sizeof sa.sun_path) {
+            std::cout << "Invalid metrics socket path " << m_unix_path << '\n';
+            return false;
+        }
+        strcpy(sa.sun_path, m_unix_path.c_str());
+
+        // socket file left by previous run
+        unlink(m_unix_path.c_str());
+
+        m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_fd < 0) {
+            std::cout << "Could not create metrics socket, reason: " << strerror(errno) << '\n';
+            return false;
+        }
+
+        if (bind(m_fd, (struct sockaddr*)&sa, sizeof sa) != 0) {
+            std::cout << "Could not bind metrics socket " << m_unix_path << ", reason: " << strerror(errno) << '\n';
+            close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+    } else {
+        int port = atoi(address.c_str());
+
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(port);
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (port <= 0) {
+            std::cout << "Invalid metrics port " << address << '\n';
+            return false;
+        }
+
+        m_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_fd < 0) {
+            std::cout << "Could not create metrics socket, reason: " << strerror(errno) << '\n';
+            return false;
+        }
+
+        int yes = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        if (bind(m_fd, (struct sockaddr*)&sa, sizeof sa) != 0) {
+            std::cout << "Could not bind metrics port " << address << ", reason: " << strerror(errno) << '\n';
+            close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+    }
+
+    if (listen(m_fd, 8) != 0) {
+        std::cout << "Could not listen for metrics scrapes, reason: " << strerror(errno) << '\n';
+        close(m_fd);
+        m_fd = -1;
+        if (!m_unix_path.empty()) {
+            unlink(m_unix_path.c_str());
+        }
+        return false;
+    }
+
+    m_thread = std::thread(&MetricsServer::serve, this);
+    return true;
+}
+
+void MetricsServer::stop() {
+    if (!m_thread.joinable()) {
+        return;
+    }
+
+    m_stop.store(true);
+    m_thread.join();
+
+    close(m_fd);
+    m_fd = -1;
+
+    if (!m_unix_path.empty()) {
+        unlink(m_unix_path.c_str());
+    }
+}
+
+// one scrape at a time on own thread, rendering takes only registry lock
+void MetricsServer::serve() {
+    while (!m_stop.load()) {
+        struct pollfd pfd = { m_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+
+        int client = accept(m_fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        // request itself doesn't matter, it's read so client doesn't get reset. plain connection
+        // without request (socat, nc) gets metrics after short wait
+        struct pollfd cfd = { client, POLLIN, 0 };
+        if (poll(&cfd, 1, 100) > 0) {
+            char request[4096];
+            if (recv(client, request, sizeof request, 0) < 0) {
+                close(client);
+                continue;
+            }
+        }
+
+        std::string body = m_metrics->render();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+
+        close(client);
+    }
+}
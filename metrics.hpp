@@ -0,0 +1,115 @@
+/*
+* File: metrics.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* always-on metrics: counters, gauges and histograms, exported in Prometheus text format.
+* metrics are updated from hot paths with relaxed atomics only, no locks. registry lock is
+* taken when metric is created and when metrics are rendered, so scraping never blocks
+* pipeline threads. histograms use LatencyHistogram bucket layout (16 buckets per power of
+* two), exported with fixed power of two bucket boundaries up to histogram max value.
+* MetricsServer answers every connection on its port or unix socket with current metrics,
+* as HTTP response, curl and Prometheus scrape it as is
+*
+*/
+
+#ifndef metrics_hpp
+#define metrics_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+class MetricCounter {
+public:
+    MetricCounter() : m_value(0) {}
+
+    void add(int64_t n) { m_value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> m_value;
+};
+
+class MetricGauge {
+public:
+    MetricGauge() : m_value(0) {}
+
+    void set(int64_t value) { m_value.store(value, std::memory_order_relaxed); }
+    void add(int64_t n) { m_value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> m_value;
+};
+
+class MetricHistogram {
+public:
+    // values are divided by unit on export: 1000000 for us -> seconds, values above max are in +Inf only
+    MetricHistogram(double unit, int64_t max_value);
+
+    void observe(int64_t value);            // negative values are counted as 0
+
+    // writes _bucket, _sum and _count lines
+    void render(std::string* out, const std::string& name, const std::string& labels) const;
+
+private:
+    std::unique_ptr<std::atomic<int64_t>[]> m_counts;
+    std::atomic<int64_t> m_count;
+    std::atomic<int64_t> m_sum;
+    double m_unit;
+    int64_t m_max_value;
+};
+
+class Metrics {
+public:
+    // same name and labels give the same metric. labels are rendered as is: stream="a",...
+    MetricCounter* counter(const std::string& name, const std::string& help, const std::string& labels);
+    MetricGauge* gauge(const std::string& name, const std::string& help, const std::string& labels);
+    MetricHistogram* histogram(const std::string& name, const std::string& help, const std::string& labels, double unit, int64_t max_value);
+
+    std::string render() const;             // Prometheus text format
+
+    static std::string label(const std::string& name, const std::string& value);   // name="value", escaped
+
+private:
+    enum Type { Counter, Gauge, Histogram };
+
+    struct Entry {
+        std::string name;
+        std::string help;
+        std::string labels;
+        Type type;
+        std::shared_ptr<void> metric;
+    };
+
+    Entry* find(const std::string& name, const std::string& labels, Type type);
+
+    std::vector<Entry> m_entries;           // families are rendered in order they were created
+    mutable std::mutex m_mutex;
+};
+
+class MetricsServer {
+public:
+    MetricsServer(const Metrics* metrics);
+    ~MetricsServer();
+
+    bool start(const std::string& address); // "<port>" - HTTP on 127.0.0.1, "unix:<path>" - unix socket
+    void stop();
+
+private:
+    void serve();
+
+    const Metrics* m_metrics;
+    int m_fd;
+    std::string m_unix_path;
+    std::thread m_thread;
+    std::atomic<bool> m_stop;
+};
+
+#endif /* metrics_hpp */
@@ -0,0 +1,364 @@
+/*
+* File: output_cache.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* content addressed output cache, see output_cache.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <functional>
+
+#include "output_cache.hpp"
+
+const int SampleBlocks = 16;
+const int64_t SampleBlockSize = 64 * 1024;
+const int64_t HashBufferSize = 1024 * 1024;     // full hash reads this much at a time
+const char* const CacheKeyVersion = "remux-cache-1";
+
+// 64 bit multiply-rotate hash (xxHash64 rounds) over four lanes, so full hash runs at memory speed
+// rather than multiplier latency. not cryptographic: keys find our own outputs, they aren't for trust
+class ContentHash {
+public:
+    ContentHash() : m_pending_size(0), m_length(0) {
+        m_lanes[0] = Seed + Prime1 + Prime2;
+        m_lanes[1] = Seed + Prime2;
+        m_lanes[2] = Seed;
+        m_lanes[3] = Seed - Prime1;
+    }
+
+    void update(const unsigned char* data, size_t size) {
+        m_length += size;
+
+        if (m_pending_size > 0) {
+            size_t n = std::min(size, sizeof m_pending - m_pending_size);
+            memcpy(m_pending + m_pending_size, data, n);
+            m_pending_size += n;
+            data += n;
+            size -= n;
+
+            if (m_pending_size < sizeof m_pending) {
+                return;
+            }
+            stripe(m_pending);
+            m_pending_size = 0;
+        }
+
+        for (; size >= sizeof m_pending; data += sizeof m_pending, size -= sizeof m_pending) {
+            stripe(data);
+        }
+
+        memcpy(m_pending, data, size);
+        m_pending_size = size;
+    }
+
+    void update(const std::string& s) {
+        update((const unsigned char*)s.data(), s.size());
+    }
+
+    // 128 bits, two differently mixed digests of the same state
+    std::string hex() const {
+        uint64_t h = rotl(m_lanes[0], 1) + rotl(m_lanes[1], 7) + rotl(m_lanes[2], 12) + rotl(m_lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ round(0, m_lanes[i])) * Prime1 + Prime4;
+        }
+        h += m_length;
+
+        for (size_t i = 0; i < m_pending_size; i++) {
+            h = rotl(h ^ (m_pending[i] * Prime5), 11) * Prime1;
+        }
+
+        uint64_t h2 = avalanche(h ^ rotl(m_lanes[2], 29) ^ rotl(m_lanes[3], 47));
+        h = avalanche(h);
+
+        char buf[33];
+        snprintf(buf, sizeof buf, "%016llx%016llx", (unsigned long long)h, (unsigned long long)h2);
+        return buf;
+    }
+
+private:
+    static const uint64_t Seed = 0x52454d5558434331ULL;
+    static const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+    static const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static const uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+    static const uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t round(uint64_t lane, uint64_t word) {
+        return rotl(lane + word * Prime2, 31) * Prime1;
+    }
+
+    static uint64_t avalanche(uint64_t h) {
+        h ^= h >> 33;
+        h *= Prime2;
+        h ^= h >> 29;
+        h *= Prime4;
+        h ^= h >> 32;
+        return h;
+    }
+
+    void stripe(const unsigned char* data) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t word;
+            memcpy(&word, data + i * 8, 8);
+            m_lanes[i] = round(m_lanes[i], word);
+        }
+    }
+
+    uint64_t m_lanes[4];
+    unsigned char m_pending[32];
+    size_t m_pending_size;
+    uint64_t m_length;
+};
+
+OutputCache::OutputCache(const std::string& dir, int64_t max_bytes) :
+    m_dir(dir),
+    m_max_bytes(max_bytes),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+bool OutputCache::open() {
+    if (mkdir(m_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    struct stat st;
+    return stat(m_dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+uint64_t OutputCache::hits() const {
+    return m_hits.load();
+}
+
+uint64_t OutputCache::misses() const {
+    return m_misses.load();
+}
+
+std::string OutputCache::entry_filename(const std::string& key) const {
+    return m_dir + "/" + key;
+}
+
+std::string OutputCache::key(const char* in_filename, const std::string& params, bool full_hash) const {
+    int fd = ::open(in_filename, O_RDONLY);
+    if (fd < 0) {
+        return "";
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return "";
+    }
+
+    int64_t size = st.st_size;
+
+    // small files are hashed whole, sampling them would read most of them anyway
+    bool full = full_hash || size <= 2 * SampleBlocks * SampleBlockSize;
+
+    ContentHash hash;
+    hash.update(std::string(CacheKeyVersion) + (full ? " full " : " sampled ") + std::to_string(size) + " " + params + "\n");
+
+    std::vector<unsigned char> buf(full ? HashBufferSize : SampleBlockSize);
+    bool ok = true;
+
+    if (full) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        ssize_t n;
+        while ((n = read(fd, &buf[0], buf.size())) > 0) {
+            hash.update(&buf[0], n);
+        }
+        ok = n == 0;
+    } else {
+        // first and last blocks always, container headers and trailers live there
+        for (int i = 0; i < SampleBlocks && ok; i++) {
+            int64_t offset = (size - SampleBlockSize) * i / (SampleBlocks - 1);
+            ok = pread(fd, &buf[0], SampleBlockSize, offset) == SampleBlockSize;
+            hash.update(&buf[0], SampleBlockSize);
+        }
+    }
+
+    close(fd);
+    return ok ? hash.hex() : "";
+}
+
+// copy on write clone where file system can do it (btrfs, xfs), no data is copied
+static bool reflink(const char* from, const char* to) {
+#ifdef FICLONE
+    int in_fd = open(from, O_RDONLY);
+    if (in_fd < 0) {
+        return false;
+    }
+
+    int out_fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        close(in_fd);
+        return false;
+    }
+
+    bool ok = ioctl(out_fd, FICLONE, in_fd) == 0;
+    close(in_fd);
+    close(out_fd);
+
+    if (!ok) {
+        unlink(to);
+    }
+    return ok;
+#else
+    return false;
+#endif
+}
+
+// data copied by kernel, where there's no reflink: file system can't clone or cache is on another one
+static bool copy_file(const char* from, const char* to) {
+    int in_fd = open(from, O_RDONLY);
+    if (in_fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    int out_fd = fstat(in_fd, &st) == 0 ? open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (out_fd < 0) {
+        close(in_fd);
+        return false;
+    }
+
+    off_t offset = 0;
+    bool ok = true;
+    while (ok && offset < st.st_size) {
+        ok = sendfile(out_fd, in_fd, &offset, st.st_size - offset) > 0;
+    }
+
+    close(in_fd);
+    ok = close(out_fd) == 0 && ok;
+
+    if (!ok) {
+        unlink(to);
+    }
+    return ok;
+}
+
+// temporary name of a thread, concurrent jobs with the same target don't share it
+static std::string thread_tmp(const std::string& filename) {
+    return filename + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+}
+
+bool OutputCache::fetch(const std::string& key, const char* out_filename) {
+    std::string entry = entry_filename(key);
+
+    struct stat st;
+    if (key.empty() || stat(entry.c_str(), &st) != 0) {
+        m_misses++;
+        return false;
+    }
+
+    // output which is there is replaced only by complete copy of the entry
+    std::string tmp = thread_tmp(out_filename);
+    unlink(tmp.c_str());
+
+    if (!reflink(entry.c_str(), tmp.c_str()) && !copy_file(entry.c_str(), tmp.c_str())) {
+        m_misses++;
+        return false;
+    }
+
+    if (rename(tmp.c_str(), out_filename) != 0) {
+        unlink(tmp.c_str());
+        m_misses++;
+        return false;
+    }
+
+    // recently used entries are the last to be trimmed
+    utimes(entry.c_str(), NULL);
+
+    m_hits++;
+    return true;
+}
+
+bool OutputCache::store(const std::string& key, const char* out_filename) {
+    if (key.empty()) {
+        return false;
+    }
+
+    // concurrent jobs with the same key each have their own temporary name, the last rename wins
+    std::string entry = entry_filename(key);
+    std::string tmp = thread_tmp(entry);
+
+    unlink(tmp.c_str());
+    if (!reflink(out_filename, tmp.c_str()) && !copy_file(out_filename, tmp.c_str())) {
+        return false;
+    }
+
+    // entry is a file of its own, output keeps its mode
+    chmod(tmp.c_str(), 0444);
+
+    if (rename(tmp.c_str(), entry.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    if (m_max_bytes > 0) {
+        trim();
+    }
+
+    return true;
+}
+
+// least recently used entries go first. directory is scanned every time, caches of this kind
+// hold thousands of entries, not millions
+void OutputCache::trim() {
+    std::lock_guard<std::mutex> lk(m_trim_mutex);
+
+    DIR* dir = opendir(m_dir.c_str());
+    if (!dir) {
+        return;
+    }
+
+    std::vector<std::pair<time_t, std::pair<int64_t, std::string> > > entries;
+    int64_t total = 0;
+
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        std::string name = de->d_name;
+        if (name[0] == '.' || name.find(".tmp") != std::string::npos) {
+            continue;
+        }
+
+        std::string path = m_dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        entries.push_back(std::make_pair(st.st_mtime, std::make_pair(int64_t(st.st_size), path)));
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() && total > m_max_bytes; i++) {
+        if (unlink(entries[i].second.second.c_str()) == 0) {
+            total -= entries[i].second.first;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/*
+* File: output_cache.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* content addressed cache of finished outputs, threadsafe. key is a fingerprint of input content
+* (not its name) combined with output parameters, so the same source remuxed the same way again
+* (retry, re-publish, copy under another name) is a cache hit. fingerprint is sampled by default:
+* file size and 16 blocks of 64KB spread over the file, which costs the same for any file size
+* but can't see a change between samples; full fingerprint hashes every byte.
+* outputs go into the cache and hits come out of it as reflinks (copy on write clone, where file
+* system can do it, no data is copied) or as plain copies otherwise, also across file systems.
+* never hardlinks: output and entry stay separate files, output keeps its own mode and mtime,
+* and trimmed entry really frees its space. entries are read-only and added with rename(),
+* readers never see half written entry; hit is copied next to output and renamed over it, so
+* output which was there is only replaced by complete one. cache is trimmed to size limit by
+* removing least recently used entries (hits touch entry mtime)
+*
+*/
+
+#ifndef output_cache_hpp
+#define output_cache_hpp
+
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+class OutputCache {
+public:
+    OutputCache(const std::string& dir, int64_t max_bytes);   // max_bytes 0: no limit
+
+    bool open();    // creates cache directory if missing
+
+    // cache key of input content and output parameters, empty if input can't be read
+    std::string key(const char* in_filename, const std::string& params, bool full_hash) const;
+
+    bool fetch(const std::string& key, const char* out_filename);   // false on miss
+    bool store(const std::string& key, const char* out_filename);   // output of finished job
+
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+private:
+    std::string entry_filename(const std::string& key) const;
+    void trim();
+
+    std::string m_dir;
+    int64_t m_max_bytes;
+
+    std::mutex m_trim_mutex;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+};
+
+#endif /* output_cache_hpp */
@@ -0,0 +1,689 @@
+/*
+* File: remuxer.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* remuxing engine, see remuxer.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern "C" {
+    #include <libavutil/time.h>
+}
+
+#include "helpers.hpp"
+#include "remuxer.hpp"
+
+// streams are interleaved loosely, range is over once every stream passes its end, or any one of
+// them passes it by this much (stream which has ended long before doesn't hold reading)
+const int64_t RangeEndSlack = 5 * AV_TIME_BASE;
+
+// demuxer seek target is moved back by this much, doubled every time, till keyframe at or
+// before range start is found
+const int64_t SeekBackStep = 2 * AV_TIME_BASE;
+
+RemuxOptions::RemuxOptions() :
+    buffer_size(65536),
+    progress_interval(500000),
+    cache(NULL),
+    smart_cut_crf(18),
+    smart_cut_preset("veryfast")
+{
+}
+
+RemuxParams::RemuxParams() :
+    format("flv"),
+    full_hash(false),
+    start(0),
+    end(0),
+    smart_cut(false)
+{
+}
+
+std::string RemuxParams::key(const RemuxOptions& options) const {
+    char range[64];
+    snprintf(range, sizeof range, " start=%.6f end=%.6f smart_cut=%d", start, end, int(smart_cut));
+    std::string key = "format=" + format + range;
+
+    // re-encoded range ends differ with encoder settings
+    if (smart_cut) {
+        char encoder[32];
+        snprintf(encoder, sizeof encoder, " crf=%d preset=", options.smart_cut_crf);
+        key += encoder + options.smart_cut_preset;
+    }
+
+    return key;
+}
+
+RemuxResult::RemuxResult() :
+    packets(0),
+    bytes_in(0),
+    bytes_out(0),
+    position(0),
+    duration(0),
+    seconds(0),
+    cancelled(false),
+    cached(false),
+    keyframes(0),
+    reencoded(0)
+{
+}
+
+Remuxer::Remuxer(const RemuxOptions& options) :
+    m_options(options),
+    m_jobs(0),
+    m_packet(av_packet_alloc()),
+    m_write_buffer(NULL),
+    m_write_buffer_size(0),
+    m_input_ctx(NULL),
+    m_output_ctx(NULL),
+    m_output_file(NULL),
+    m_output_created(false),
+    m_indexing(false),
+    m_range_start(AV_NOPTS_VALUE),
+    m_range_end(INT64_MAX),
+    m_offset(0),
+    m_reference_stream(-1),
+    m_seeked(false),
+    m_waiting_keyframe(false),
+    m_streams_ended(0),
+    m_cutting(false),
+    m_holding(false),
+    m_bytes_out(0)
+{
+}
+
+Remuxer::~Remuxer() {
+    close();
+    av_packet_free(&m_packet);
+    av_freep(&m_write_buffer);
+}
+
+const std::string& Remuxer::error() const {
+    return m_error;
+}
+
+int64_t Remuxer::jobs() const {
+    return m_jobs;
+}
+
+bool Remuxer::fail(const std::string& message) {
+    m_error = message;
+    return false;
+}
+
+// everything per job goes, reused buffers stay
+void Remuxer::close() {
+    if (m_output_ctx) {
+        if (m_output_ctx->pb) {
+            // buffer may have been reallocated by libav, whatever it is now is ours to reuse
+            m_write_buffer = m_output_ctx->pb->buffer;
+            m_write_buffer_size = m_output_ctx->pb->buffer_size;
+            avio_context_free(&m_output_ctx->pb);
+        }
+
+        avformat_free_context(m_output_ctx);
+        m_output_ctx = NULL;
+    }
+
+    if (m_output_file) {
+        fclose(m_output_file);
+        m_output_file = NULL;
+    }
+
+    if (m_input_ctx) {
+        avformat_close_input(&m_input_ctx);
+    }
+
+    m_seek_index.close();
+    m_smart_cut.close();
+
+    for (size_t i = 0; i < m_held.size(); i++) {
+        av_packet_free(&m_held[i]);
+    }
+    m_held.clear();
+
+    for (size_t i = 0; i < m_cut_packets.size(); i++) {
+        av_packet_free(&m_cut_packets[i]);
+    }
+    m_cut_packets.clear();
+
+    av_packet_unref(m_packet);
+    m_bytes_out = 0;
+}
+
+bool Remuxer::remux(const char* in_filename, const char* out_filename, const RemuxParams& params,
+    RemuxResult* result, const std::atomic<bool>* cancel, const RemuxProgress& progress)
+{
+    int64_t t0 = av_gettime_relative();
+
+    close();
+    m_error.clear();
+    m_output_created = false;
+    m_jobs++;
+    *result = RemuxResult();
+
+    // sidecar which is there and matches input isn't built again, range job sees a part of input only
+    KeyframeIndex index;
+    m_indexing = !params.index_filename.empty() && params.start <= 0 && params.end <= 0 &&
+        !index.open(params.index_filename.c_str(), in_filename);
+    index.close();
+
+    // fingerprint costs a few reads (or one pass with full hash), hit is a link. job building
+    // index has to read input anyway, its output goes to cache all the same
+    std::string cache_key;
+    if (m_options.cache) {
+        cache_key = m_options.cache->key(in_filename, params.key(m_options), params.full_hash);
+        if (!m_indexing && m_options.cache->fetch(cache_key, out_filename)) {
+            struct stat st;
+            result->bytes_out = stat(out_filename, &st) == 0 ? st.st_size : 0;
+            result->cached = true;
+            result->seconds = (av_gettime_relative() - t0) / 1000000.0;
+            return true;
+        }
+    }
+
+    bool ok = open_input(in_filename) && seek_input(in_filename, params) && open_output(out_filename, params.format) &&
+        remux_packets(result, cancel, progress) && close_output();
+
+    result->bytes_in = m_input_ctx && m_input_ctx->pb ? m_input_ctx->pb->bytes_read : 0;
+    result->bytes_out = m_bytes_out;
+    result->reencoded = m_smart_cut.reencoded();
+    result->seconds = (av_gettime_relative() - t0) / 1000000.0;
+
+    close();
+
+    // half written file must not be taken for a result, file which was there before job is left alone
+    if (!ok && m_output_created) {
+        unlink(out_filename);
+    }
+
+    // not being able to cache output doesn't make job fail
+    if (ok && m_options.cache) {
+        m_options.cache->store(cache_key, out_filename);
+    }
+
+    // neither does not being able to write index
+    if (ok && m_indexing && m_index.write(params.index_filename.c_str(), in_filename)) {
+        result->keyframes = m_index.entries();
+    }
+
+    return ok;
+}
+
+bool Remuxer::open_input(const char* filename) {
+    int ret = avformat_open_input(&m_input_ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        return fail(std::string("Could not open input file ") + filename + ", reason: " + av_err2str(ret));
+    }
+
+    ret = avformat_find_stream_info(m_input_ctx, NULL);
+    if (ret < 0) {
+        return fail(std::string("Failed to retrieve input stream information from ") + filename + ", reason: " + av_err2str(ret));
+    }
+
+    if (m_indexing) {
+        m_index.start(m_input_ctx);
+    }
+
+    return true;
+}
+
+// puts input at keyframe at or before range start. sidecar index seek is a binary search in
+// memory and one read, demuxer seek uses container index when there is one and bisects the file
+// otherwise (MPEG-TS), reading a few packets per step. input which can't seek is read from the
+// start, range then begins with the first keyframe at or after its start
+bool Remuxer::seek_input(const char* filename, const RemuxParams& params) {
+    int64_t input_start = m_input_ctx->start_time != AV_NOPTS_VALUE ? m_input_ctx->start_time : 0;
+
+    m_range_start = params.start > 0 ? input_start + int64_t(params.start * AV_TIME_BASE) : AV_NOPTS_VALUE;
+    m_range_end = params.end > 0 ? input_start + int64_t(params.end * AV_TIME_BASE) : INT64_MAX;
+    m_offset = 0;
+    m_seeked = false;
+    m_cutting = params.smart_cut && (m_range_start != AV_NOPTS_VALUE || m_range_end != INT64_MAX);
+    m_waiting_keyframe = m_range_start != AV_NOPTS_VALUE && !m_cutting;
+    m_holding = m_range_start != AV_NOPTS_VALUE && m_cutting;
+    m_ended.assign(m_input_ctx->nb_streams, 0);
+    m_streams_ended = 0;
+
+    if (m_range_end <= (m_range_start != AV_NOPTS_VALUE ? m_range_start : input_start)) {
+        return fail("Range end is not after its start");
+    }
+
+    m_reference_stream = av_find_best_stream(m_input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (m_reference_stream < 0) {
+        m_reference_stream = av_find_best_stream(m_input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    }
+
+    if (m_cutting && (m_reference_stream < 0 || m_input_ctx->streams[m_reference_stream]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)) {
+        return fail("Smart cut needs video stream");
+    }
+
+    // parameter sets of re-encoded and copied parts differ, only flv muxer switches between them
+    if (m_cutting && params.format != "flv") {
+        return fail("Smart cut needs flv output, " + params.format + " can't switch parameter sets mid-stream");
+    }
+
+    if (m_range_start == AV_NOPTS_VALUE) {
+        return true;
+    }
+
+    if (m_reference_stream < 0) {
+        return fail("No audio or video stream to begin range with");
+    }
+
+    AVStream* stream = m_input_ctx->streams[m_reference_stream];
+    int64_t ts = av_rescale_q(m_range_start, AV_TIME_BASE_Q, stream->time_base);
+
+    // sidecar has keyframes only, entry it seeks to is the keyframe itself
+    if (m_seek_index.open(KeyframeIndex::sidecar_filename(filename).c_str(), filename)) {
+        const KeyframeIndexEntry* entry = m_seek_index.find(m_reference_stream, INT64_MIN, ts);
+        if (entry && entry->pts <= ts && m_seek_index.seek(m_input_ctx, m_reference_stream, INT64_MIN, ts)) {
+            m_seeked = true;
+            return true;
+        }
+    }
+
+    // demuxer seek of container without index (MPEG-TS bisects the file by DTS of any packet)
+    // lands at or before target, but not necessarily before the keyframe range needs: first
+    // reference keyframe after it is checked, target is moved back till it's not after start
+    int64_t stream_start = av_rescale_q(input_start, AV_TIME_BASE_Q, stream->time_base);
+    int64_t step = av_rescale_q(SeekBackStep, AV_TIME_BASE_Q, stream->time_base);
+    int64_t target = ts;
+
+    while (true) {
+        // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html#ga3b40fc8d2fda6992ae6ea2567d71ba30
+        if (avformat_seek_file(m_input_ctx, m_reference_stream, INT64_MIN, target, target, 0) < 0) {
+            return true;    // can't seek, input is read from where it is
+        }
+
+        int64_t pts = first_keyframe_pts();
+        if (pts != AV_NOPTS_VALUE && pts <= ts) {
+            // the same target lands at the same place, packets read while checking are read again
+            m_seeked = avformat_seek_file(m_input_ctx, m_reference_stream, INT64_MIN, target, target, 0) >= 0;
+            return m_seeked || fail("Could not seek input back to range start");
+        }
+
+        // first keyframe of input is after range start, range begins with it
+        if (target <= stream_start) {
+            break;
+        }
+
+        target = FFMAX(target - step, stream_start);
+        step *= 2;
+    }
+
+    if (avformat_seek_file(m_input_ctx, m_reference_stream, INT64_MIN, stream_start, stream_start, 0) < 0) {
+        return fail("Could not seek input back to its start");
+    }
+
+    return true;
+}
+
+// pts of the first reference stream keyframe from where input is now, AV_NOPTS_VALUE when
+// there's none. packets read are dropped, caller seeks back
+int64_t Remuxer::first_keyframe_pts() {
+    while (av_read_frame(m_input_ctx, m_packet) >= 0) {
+        bool keyframe = m_packet->stream_index == m_reference_stream && (m_packet->flags & AV_PKT_FLAG_KEY);
+        int64_t pts = m_packet->pts != AV_NOPTS_VALUE ? m_packet->pts : m_packet->dts;
+        av_packet_unref(m_packet);
+
+        if (keyframe && pts != AV_NOPTS_VALUE) {
+            return pts;
+        }
+    }
+
+    return AV_NOPTS_VALUE;
+}
+
+// whether packet belongs to the range, done is set when there's nothing more to read. range
+// begins with keyframe of reference stream, packets of other streams older than it are dropped.
+// range ends in decode order, so every packet taken can be decoded. with smart cut reference
+// stream is cut by SmartCut and other streams are cut at range start exactly
+bool Remuxer::in_range(const AVPacket* packet, bool* done) {
+    if (m_cutting && packet->stream_index == m_reference_stream) {
+        return true;
+    }
+
+    AVStream* stream = m_input_ctx->streams[packet->stream_index];
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (ts == AV_NOPTS_VALUE) {
+        return !m_waiting_keyframe;
+    }
+
+    ts = av_rescale_q(ts, stream->time_base, AV_TIME_BASE_Q);
+
+    if (m_waiting_keyframe) {
+        int64_t pts = packet->pts != AV_NOPTS_VALUE ? av_rescale_q(packet->pts, stream->time_base, AV_TIME_BASE_Q) : ts;
+        if (packet->stream_index != m_reference_stream || !(packet->flags & AV_PKT_FLAG_KEY) ||
+            (!m_seeked && pts < m_range_start))
+        {
+            return false;
+        }
+
+        m_offset = ts;
+        m_waiting_keyframe = false;
+    }
+
+    if (m_range_start != AV_NOPTS_VALUE && ts < (m_cutting ? m_range_start : m_offset)) {
+        return false;
+    }
+
+    if (ts >= m_range_end) {
+        *done = stream_ended(packet->stream_index) || ts >= m_range_end + RangeEndSlack;
+        return false;
+    }
+
+    return true;
+}
+
+// true when every output stream has ended
+bool Remuxer::stream_ended(int stream_index) {
+    if (!m_ended[stream_index]) {
+        m_ended[stream_index] = 1;
+        m_streams_ended++;
+    }
+
+    return m_streams_ended >= int(m_output_ctx->nb_streams);
+}
+
+bool Remuxer::open_output(const char* filename, const std::string& format) {
+    int ret = avformat_alloc_output_context2(&m_output_ctx, NULL, format.c_str(), filename);
+    if (ret < 0 || !m_output_ctx) {
+        return fail("Could not create " + format + " output context, reason: " + av_err2str(ret));
+    }
+
+    // audio and video streams only, the rest is dropped
+    m_streams_map.assign(m_input_ctx->nb_streams, -1);
+    for (unsigned int i = 0; i < m_input_ctx->nb_streams; i++) {
+        AVCodecParameters* in_codecpar = m_input_ctx->streams[i]->codecpar;
+        if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO && in_codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+            continue;
+        }
+
+        AVStream* out_stream = avformat_new_stream(m_output_ctx, NULL);
+        if (!out_stream) {
+            return fail("Failed allocating output stream");
+        }
+
+        ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
+        if (ret < 0) {
+            return fail(std::string("Failed to copy codec parameters, reason: ") + av_err2str(ret));
+        }
+
+        // set stream codec tag to 0, for libav to detect automatically
+        out_stream->codecpar->codec_tag = 0;
+        m_streams_map[i] = out_stream->index;
+    }
+
+    // re-encoded range start goes first, output header gets its parameter sets
+    if (m_cutting) {
+        AVStream* in_stream = m_input_ctx->streams[m_reference_stream];
+        int64_t start = m_range_start != AV_NOPTS_VALUE ? av_rescale_q(m_range_start, AV_TIME_BASE_Q, in_stream->time_base) : AV_NOPTS_VALUE;
+        int64_t end = m_range_end != INT64_MAX ? av_rescale_q(m_range_end, AV_TIME_BASE_Q, in_stream->time_base) : INT64_MAX;
+        if (!m_smart_cut.open(in_stream, start, end, m_seeked, m_options.smart_cut_crf, m_options.smart_cut_preset) ||
+            !m_smart_cut.set_output_extradata(m_output_ctx->streams[m_streams_map[m_reference_stream]]->codecpar))
+        {
+            return fail(m_smart_cut.error());
+        }
+    }
+
+    // output is replaced, never rewritten in place: file which is there may be read-only
+    unlink(filename);
+
+    m_output_file = fopen(filename, "wb");
+    if (!m_output_file) {
+        return fail(std::string("Could not open output file ") + filename + ", reason: " + strerror(errno));
+    }
+    m_output_created = true;
+
+    // first job allocates the buffer, the rest reuse it
+    if (!m_write_buffer) {
+        m_write_buffer = (unsigned char*)av_malloc(m_options.buffer_size);
+        m_write_buffer_size = m_options.buffer_size;
+        if (!m_write_buffer) {
+            return fail("Could not allocate write buffer for AVIOContext");
+        }
+    }
+
+    m_output_ctx->pb = avio_alloc_context(m_write_buffer, m_write_buffer_size, 1, this, NULL, &write_callback, &seek_callback);
+    if (!m_output_ctx->pb) {
+        return fail("Could not allocate output AVIOContext");
+    }
+    m_output_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga18b7b10bb5b94c4842de18166bc677cb
+    ret = avformat_write_header(m_output_ctx, NULL);
+    if (ret < 0) {
+        return fail(std::string("Failed to write output file header to ") + filename + ", reason: " + av_err2str(ret));
+    }
+
+    return true;
+}
+
+bool Remuxer::remux_packets(RemuxResult* result, const std::atomic<bool>* cancel, const RemuxProgress& progress) {
+    if (m_input_ctx->duration != AV_NOPTS_VALUE && m_input_ctx->duration > 0) {
+        int64_t input_start = m_input_ctx->start_time != AV_NOPTS_VALUE ? m_input_ctx->start_time : 0;
+        int64_t end = FFMIN(input_start + m_input_ctx->duration, m_range_end);
+        int64_t start = m_range_start != AV_NOPTS_VALUE ? m_range_start : input_start;
+        result->duration = FFMAX(end - start, 0) / double(AV_TIME_BASE);
+    }
+
+    bool ranged = m_range_start != AV_NOPTS_VALUE || m_range_end != INT64_MAX;
+
+    int64_t last_progress = av_gettime_relative();
+
+    while (1) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            result->cancelled = true;
+            return fail("Cancelled");
+        }
+
+        int ret = av_read_frame(m_input_ctx, m_packet);
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+
+        if (ret < 0) {
+            return fail(std::string("Failed to read packet from input, reason: ") + av_err2str(ret));
+        }
+
+        // streams which are dropped are indexed too, index is of input
+        if (m_indexing) {
+            m_index.add(m_packet);
+        }
+
+        if (m_packet->stream_index >= int(m_streams_map.size()) || m_streams_map[m_packet->stream_index] < 0) {
+            av_packet_unref(m_packet);
+            continue;
+        }
+
+        bool done = false;
+        if (ranged && !in_range(m_packet, &done)) {
+            av_packet_unref(m_packet);
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        // reference stream of smart cut goes through the cutter, which holds a GOP at a time
+        if (m_cutting && m_packet->stream_index == m_reference_stream) {
+            bool ok = m_smart_cut.add(m_packet, &m_cut_packets);
+            av_packet_unref(m_packet);
+
+            if (!ok) {
+                return fail(m_smart_cut.error());
+            }
+
+            if (!write_cut_packets(result)) {
+                return false;
+            }
+
+            if (m_smart_cut.done() && stream_ended(m_reference_stream)) {
+                break;
+            }
+        } else if (m_holding) {
+            AVPacket* held = av_packet_clone(m_packet);
+            av_packet_unref(m_packet);
+            if (!held) {
+                return fail("Could not allocate packet");
+            }
+
+            m_held.push_back(held);
+        } else if (!write_packet(m_packet, result)) {
+            return false;
+        }
+
+        int64_t now = av_gettime_relative();
+        if (progress && now - last_progress >= m_options.progress_interval) {
+            result->bytes_in = m_input_ctx->pb->bytes_read;
+            result->bytes_out = m_bytes_out;
+            progress(*result);
+            last_progress = now;
+        }
+    }
+
+    // GOP cutter still holds is cut at the end of input
+    if (m_cutting) {
+        if (!m_smart_cut.finish(&m_cut_packets)) {
+            return fail(m_smart_cut.error());
+        }
+
+        if (!write_cut_packets(result)) {
+            return false;
+        }
+
+        // no video in range at all, other streams start at requested time
+        if (m_holding) {
+            m_offset = m_range_start;
+            if (!release_held(result)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// input packet of mapped stream, rebased to range start and rescaled to output time base
+bool Remuxer::write_packet(AVPacket* packet, RemuxResult* result) {
+    AVStream* in_stream = m_input_ctx->streams[packet->stream_index];
+    AVStream* out_stream = m_output_ctx->streams[m_streams_map[packet->stream_index]];
+    packet->stream_index = out_stream->index;
+
+    // range starts from 0
+    if (m_offset != 0) {
+        int64_t offset = av_rescale_q(m_offset, AV_TIME_BASE_Q, in_stream->time_base);
+        packet->pts = packet->pts != AV_NOPTS_VALUE ? packet->pts - offset : AV_NOPTS_VALUE;
+        packet->dts = packet->dts != AV_NOPTS_VALUE ? packet->dts - offset : AV_NOPTS_VALUE;
+    }
+
+    AVRounding avr = AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+    packet->pts = av_rescale_q_rnd(packet->pts, in_stream->time_base, out_stream->time_base, avr);
+    packet->dts = av_rescale_q_rnd(packet->dts, in_stream->time_base, out_stream->time_base, avr);
+    packet->duration = av_rescale_q(packet->duration, in_stream->time_base, out_stream->time_base);
+    packet->pos = -1;
+
+    if (packet->dts != AV_NOPTS_VALUE) {
+        result->position = packet->dts * av_q2d(out_stream->time_base);
+    }
+
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga37352ed2c63493c38219d935e71db6c1
+    int ret = av_interleaved_write_frame(m_output_ctx, packet);
+    if (ret < 0) {
+        return fail(std::string("Failed to write packet to output, reason: ") + av_err2str(ret));
+    }
+
+    result->packets++;
+    return true;
+}
+
+// packets smart cut has let go of. the first of them resolves range start: re-encoded frames
+// keep source reorder delay, so their DTS may be a little before start and range starts there
+bool Remuxer::write_cut_packets(RemuxResult* result) {
+    bool ok = true;
+
+    if (m_holding && !m_cut_packets.empty()) {
+        AVStream* stream = m_input_ctx->streams[m_reference_stream];
+        int64_t dts = m_cut_packets[0]->dts;
+        m_offset = dts != AV_NOPTS_VALUE ? FFMIN(m_range_start, av_rescale_q(dts, stream->time_base, AV_TIME_BASE_Q)) : m_range_start;
+        ok = release_held(result);
+    }
+
+    for (size_t i = 0; i < m_cut_packets.size(); i++) {
+        ok = ok && write_packet(m_cut_packets[i], result);
+        av_packet_free(&m_cut_packets[i]);
+    }
+    m_cut_packets.clear();
+
+    return ok;
+}
+
+// packets of other streams which waited till range start was resolved
+bool Remuxer::release_held(RemuxResult* result) {
+    m_holding = false;
+
+    bool ok = true;
+    for (size_t i = 0; i < m_held.size(); i++) {
+        ok = ok && write_packet(m_held[i], result);
+        av_packet_free(&m_held[i]);
+    }
+    m_held.clear();
+
+    return ok;
+}
+
+bool Remuxer::close_output() {
+    //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga7f14007e7dc8f481f054b21614dfec13
+    int ret = av_write_trailer(m_output_ctx);
+    if (ret < 0) {
+        return fail(std::string("Failed to write trailer to output, reason: ") + av_err2str(ret));
+    }
+
+    avio_flush(m_output_ctx->pb);
+    if (m_output_ctx->pb->error < 0) {
+        return fail(std::string("Failed to write output, reason: ") + av_err2str(m_output_ctx->pb->error));
+    }
+
+    FILE* file = m_output_file;
+    m_output_file = NULL;
+    if (fclose(file) != 0) {
+        return fail(std::string("Failed to close output file, reason: ") + strerror(errno));
+    }
+
+    return true;
+}
+
+int Remuxer::write_callback(void* opaque, uint8_t* buf, int buf_size) {
+    Remuxer* remuxer = reinterpret_cast<Remuxer*>(opaque);
+
+    if (fwrite(buf, 1, buf_size, remuxer->m_output_file) != size_t(buf_size)) {
+        return AVERROR(EIO);
+    }
+
+    remuxer->m_bytes_out += buf_size;
+    return buf_size;
+}
+
+// muxers seek back on trailer to update header (FLV duration and file size, MP4 moov offsets)
+int64_t Remuxer::seek_callback(void* opaque, int64_t offset, int whence) {
+    Remuxer* remuxer = reinterpret_cast<Remuxer*>(opaque);
+
+    if (whence & AVSEEK_SIZE) {
+        return AVERROR(ENOSYS);
+    }
+
+    if (fseeko(remuxer->m_output_file, offset, whence & ~AVSEEK_FORCE) != 0) {
+        return AVERROR(EIO);
+    }
+
+    return ftello(remuxer->m_output_file);
+}
@@ -0,0 +1,158 @@
+/*
+* File: remuxer.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* remuxing engine for long running processes (see 09-remux-daemon.cpp). same remuxing as in
+* 01-remuxing.cpp, but one Remuxer is meant to do many jobs: packet, streams map and output
+* AVIOContext buffer are allocated once and reused, libav format contexts can't be reused and
+* are made per job. job can be cancelled from another thread, progress is reported from the
+* job's own thread. errors are kept for the caller instead of being printed.
+* with output cache (see output_cache.hpp) job whose input content and parameters were remuxed
+* before is answered from the cache without remuxing, finished outputs are added to it.
+* job can write keyframe index sidecar of its input (see keyframe_index.hpp) from packets it
+* reads anyway.
+* job can take a time range of input only: input is seeked to keyframe at or before range start
+* (by sidecar index when there is one, else by demuxer, which uses container index or bisects
+* the file), reading stops at range end and timestamps are rebased to start from 0. input is
+* read in proportion to the range, not to the file.
+* range is keyframe aligned unless smart cut is asked for: then partial GOPs at range ends are
+* re-encoded and range is frame accurate (see smart_cut.hpp), the rest is copied as before.
+* one Remuxer does one job at a time, use several of them to remux in parallel
+*
+*/
+
+#ifndef remuxer_hpp
+#define remuxer_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#include "output_cache.hpp"
+#include "keyframe_index.hpp"
+#include "smart_cut.hpp"
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+struct RemuxOptions {
+    RemuxOptions();
+
+    int buffer_size;            // output AVIOContext buffer size
+    int64_t progress_interval;  // us between progress reports
+    OutputCache* cache;         // shared by remuxers, NULL: every job is remuxed
+    int smart_cut_crf;          // x264 constant rate factor of re-encoded range ends
+    std::string smart_cut_preset; // x264 preset of re-encoded range ends
+};
+
+// what one job asks for
+struct RemuxParams {
+    RemuxParams();
+
+    std::string format;         // output container, flv unless set
+    bool full_hash;             // cache key from every byte of input, not from samples
+    std::string index_filename; // keyframe index sidecar of input to write, empty: none
+    double start;               // seconds from input start, range begins at keyframe at or before it, 0: from the start
+    double end;                 // seconds from input start, 0: till the end. index isn't written for range
+    bool smart_cut;             // frame accurate range, H.264 video only
+
+    // everything that changes output, for cache key. options give encoder settings of smart cut
+    std::string key(const RemuxOptions& options) const;
+};
+
+// what was done, also passed to progress callback while job runs
+struct RemuxResult {
+    RemuxResult();
+
+    int64_t packets;            // packets written
+    int64_t bytes_in;           // bytes read from input, seeks included
+    int64_t bytes_out;          // bytes written to output
+    double position;            // seconds, timestamp of last packet written
+    double duration;            // seconds, input (or range) duration, 0 when unknown
+    double seconds;             // time spent on the job
+    bool cancelled;
+    bool cached;                // output came from cache, counters other than bytes_out are 0
+    int64_t keyframes;          // entries in keyframe index written by the job
+    int64_t reencoded;          // frames re-encoded by smart cut
+};
+
+// called from job thread every progress_interval, job goes on
+typedef std::function<void(const RemuxResult& progress)> RemuxProgress;
+
+class Remuxer {
+public:
+    Remuxer(const RemuxOptions& options);
+    ~Remuxer();
+
+    // remux in_filename into out_filename. job is cancelled as soon as *cancel is set (may be NULL),
+    // output of failed or cancelled job is removed
+    bool remux(const char* in_filename, const char* out_filename, const RemuxParams& params,
+        RemuxResult* result, const std::atomic<bool>* cancel, const RemuxProgress& progress);
+
+    const std::string& error() const;   // why last job failed
+
+    int64_t jobs() const;               // jobs done by this remuxer, for reuse stats
+
+private:
+    bool open_input(const char* filename);
+    bool seek_input(const char* filename, const RemuxParams& params);
+    int64_t first_keyframe_pts();
+    bool in_range(const AVPacket* packet, bool* done);
+    bool stream_ended(int stream_index);
+    bool write_packet(AVPacket* packet, RemuxResult* result);
+    bool write_cut_packets(RemuxResult* result);
+    bool release_held(RemuxResult* result);
+    bool open_output(const char* filename, const std::string& format);
+    bool remux_packets(RemuxResult* result, const std::atomic<bool>* cancel, const RemuxProgress& progress);
+    bool close_output();
+    void close();
+    bool fail(const std::string& message);
+
+    static int write_callback(void* opaque, uint8_t* buf, int buf_size);
+    static int64_t seek_callback(void* opaque, int64_t offset, int whence);
+
+    RemuxOptions m_options;
+    std::string m_error;
+    int64_t m_jobs;
+
+    // reused by every job
+    AVPacket* m_packet;
+    std::vector<int> m_streams_map;     // input stream -> output stream, -1 for dropped
+    unsigned char* m_write_buffer;
+    int m_write_buffer_size;
+    KeyframeIndexBuilder m_index;
+
+    // per job
+    AVFormatContext* m_input_ctx;
+    AVFormatContext* m_output_ctx;
+    FILE* m_output_file;
+    bool m_output_created;              // output file was opened by this job
+    bool m_indexing;                    // keyframe index of input is built by this job
+    KeyframeIndex m_seek_index;         // sidecar of input, open when job has range start and there is one
+
+    // range, AV_TIME_BASE
+    int64_t m_range_start;              // AV_NOPTS_VALUE: from the start
+    int64_t m_range_end;                // INT64_MAX: till the end
+    int64_t m_offset;                   // subtracted from timestamps, dts of the keyframe range begins with
+    int m_reference_stream;             // range begins with its keyframe, video unless there's none
+    bool m_seeked;                      // input is at reference keyframe at or before range start
+    bool m_waiting_keyframe;
+    std::vector<char> m_ended;          // by input stream, stream has packets past range end
+    int m_streams_ended;
+
+    // smart cut, reference stream goes through m_smart_cut
+    SmartCut m_smart_cut;
+    bool m_cutting;
+    bool m_holding;                     // range start isn't resolved yet, other streams wait in m_held
+    std::vector<AVPacket*> m_held;
+    std::vector<AVPacket*> m_cut_packets;
+    int64_t m_bytes_out;
+};
+
+#endif /* remuxer_hpp */
@@ -0,0 +1,259 @@
+/*
+* File: slice_scaler.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* slice-parallel scaler, see slice_scaler.hpp for description
+*
+*/
+
+#include <string.h>
+#include <algorithm>
+#include <functional>
+
+extern "C" {
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/mathematics.h>
+}
+
+#include "slice_scaler.hpp"
+
+// filter_size is number of input rows swscale filter covers when picture isn't downscaled,
+// same numbers as in libswscale/utils.c
+struct ScalerAlgorithm {
+    const char* name;
+    int flags;
+    int filter_size;
+};
+
+static const ScalerAlgorithm ScalerAlgorithms[] = {
+    { "neighbor",       SWS_POINT,          1 },
+    { "fast_bilinear",  SWS_FAST_BILINEAR,  2 },
+    { "bilinear",       SWS_BILINEAR,       2 },
+    { "area",           SWS_AREA,           2 },
+    { "bicublin",       SWS_BICUBLIN,       4 },
+    { "bicubic",        SWS_BICUBIC,        4 },
+    { "experimental",   SWS_X,              8 },
+    { "gauss",          SWS_GAUSS,          8 },
+    { "lanczos",        SWS_LANCZOS,        6 },
+    { "spline",         SWS_SPLINE,         20 },
+    { "sinc",           SWS_SINC,           20 }
+};
+
+static const int ScalerAlgorithmsCount = sizeof(ScalerAlgorithms) / sizeof(ScalerAlgorithms[0]);
+
+static int filter_size(int flags) {
+    for (int i = 0; i < ScalerAlgorithmsCount; i++) {
+        if (flags & ScalerAlgorithms[i].flags) {
+            return ScalerAlgorithms[i].filter_size;
+        }
+    }
+
+    return 20; // unknown algorithm, assume the widest one
+}
+
+// planes 1 and 2 are chroma planes, they may be subsampled vertically
+static int plane_shift(const AVPixFmtDescriptor* desc, int plane) {
+    return (plane == 1 || plane == 2) ? desc->log2_chroma_h : 0;
+}
+
+SliceScaler::SliceScaler(int threads, int flags) :
+    m_threads(threads > 1 ? threads : 1),
+    m_flags(flags),
+    m_src_w(0), m_src_h(0), m_src_format(AV_PIX_FMT_NONE),
+    m_dst_w(0), m_dst_h(0), m_dst_format(AV_PIX_FMT_NONE),
+    m_pool(NULL)
+{
+    if (m_threads > 1) {
+        m_pool = new ThreadPool(m_threads - 1);
+    }
+}
+
+SliceScaler::~SliceScaler() {
+    clear();
+    delete m_pool;
+}
+
+int SliceScaler::slices() const {
+    return m_slices.size();
+}
+
+int SliceScaler::flags_by_name(const char* name) {
+    for (int i = 0; i < ScalerAlgorithmsCount; i++) {
+        if (strcmp(name, ScalerAlgorithms[i].name) == 0) {
+            return ScalerAlgorithms[i].flags;
+        }
+    }
+
+    return -1;
+}
+
+bool SliceScaler::scale(const AVFrame* in, AVFrame* out) {
+    bool same_geometry = in->width == m_src_w && in->height == m_src_h && in->format == m_src_format &&
+        out->width == m_dst_w && out->height == m_dst_h && out->format == m_dst_format;
+
+    // contexts are recreated only if frame parameters change
+    if (!same_geometry && !configure(in, out)) {
+        return false;
+    }
+
+    // helper threads take all slices but the last one, calling thread would just wait otherwise
+    for (size_t i = 0; i + 1 < m_slices.size(); i++) {
+        m_pool->submit(std::bind(&SliceScaler::scale_slice, this, &m_slices[i], in, out));
+    }
+
+    scale_slice(&m_slices.back(), in, out);
+
+    if (m_pool) {
+        m_pool->wait();
+    }
+
+    return true;
+}
+
+bool SliceScaler::configure(const AVFrame* in, const AVFrame* out) {
+    clear();
+
+    m_src_w = in->width;
+    m_src_h = in->height;
+    m_src_format = in->format;
+    m_dst_w = out->width;
+    m_dst_h = out->height;
+    m_dst_format = out->format;
+
+    const AVPixFmtDescriptor* src_desc = av_pix_fmt_desc_get((AVPixelFormat)m_src_format);
+    const AVPixFmtDescriptor* dst_desc = av_pix_fmt_desc_get((AVPixelFormat)m_dst_format);
+    if (!src_desc || !dst_desc) {
+        clear();
+        return false;
+    }
+
+    // hardware frames have no rows to cut, paletted ones are rare enough not to bother
+    bool sliceable = m_threads > 1 && !((src_desc->flags | dst_desc->flags) & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL));
+
+    if (sliceable) {
+        // every src_period input rows map exactly to dst_period output rows, e.g. 3 -> 2 for
+        // 1080p -> 720p. slice cut at such a point sees the same filter phases as whole frame
+        int grid = av_gcd(m_src_h, m_dst_h);
+        int src_period = m_src_h / grid;
+        int dst_period = m_dst_h / grid;
+
+        // cuts must also fall on chroma rows in both pictures
+        int src_sub = 1 << src_desc->log2_chroma_h;
+        int dst_sub = 1 << dst_desc->log2_chroma_h;
+        int periods = 1;
+        while ((periods * src_period) % src_sub || (periods * dst_period) % dst_sub) {
+            periods++;
+        }
+
+        int unit_src = periods * src_period;
+        int unit_dst = periods * dst_period;
+        int units = grid % periods == 0 ? grid / periods : 0;
+
+        // how far filter reaches from output row in input rows, downscaling stretches filter.
+        // chroma filter works on chroma rows, so it reaches src_sub times further in luma rows
+        int downscale = std::max(1, (m_src_h + m_dst_h - 1) / m_dst_h);
+        int reach = (filter_size(m_flags) / 2 * downscale + 2) * src_sub;
+        int margin = (reach + unit_src - 1) / unit_src;
+
+        int count = std::min(m_threads, units);
+        for (int i = 0; count > 1 && i < count; i++) {
+            int first = units * i / count;
+            int last = units * (i + 1) / count;
+            int margin_first = std::max(0, first - margin);
+            int margin_last = std::min(units, last + margin);
+
+            bool ok = add_slice(margin_first * unit_src, (margin_last - margin_first) * unit_src,
+                first * unit_dst, (last - first) * unit_dst,
+                (first - margin_first) * unit_dst, (margin_last - margin_first) * unit_dst);
+
+            if (!ok) {
+                clear();
+                return false;
+            }
+        }
+    }
+
+    // sizes don't line up or single thread, whole frame is one slice written straight to output
+    if (m_slices.empty() && !add_slice(0, m_src_h, 0, m_dst_h, 0, 0)) {
+        clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool SliceScaler::add_slice(int src_y, int src_h, int dst_y, int dst_h, int skip, int scratch_h) {
+    Slice slice;
+    slice.src_y = src_y;
+    slice.src_h = src_h;
+    slice.dst_y = dst_y;
+    slice.dst_h = dst_h;
+    slice.skip = skip;
+    slice.scratch = NULL;
+
+    slice.sws_ctx = sws_getContext(m_src_w, src_h, (AVPixelFormat)m_src_format,
+        m_dst_w, scratch_h > 0 ? scratch_h : dst_h, (AVPixelFormat)m_dst_format,
+        m_flags, NULL, NULL, NULL);
+
+    if (!slice.sws_ctx) {
+        return false;
+    }
+
+    if (scratch_h > 0) {
+        slice.scratch = av_frame_alloc();
+        if (slice.scratch) {
+            slice.scratch->width = m_dst_w;
+            slice.scratch->height = scratch_h;
+            slice.scratch->format = m_dst_format;
+        }
+
+        if (!slice.scratch || av_frame_get_buffer(slice.scratch, 32) < 0) {
+            av_frame_free(&slice.scratch);
+            sws_freeContext(slice.sws_ctx);
+            return false;
+        }
+    }
+
+    m_slices.push_back(slice);
+    return true;
+}
+
+void SliceScaler::scale_slice(Slice* slice, const AVFrame* in, AVFrame* out) {
+    const AVPixFmtDescriptor* src_desc = av_pix_fmt_desc_get((AVPixelFormat)m_src_format);
+    const AVPixFmtDescriptor* dst_desc = av_pix_fmt_desc_get((AVPixelFormat)m_dst_format);
+
+    // slice context sees its first input row as the top of the picture
+    const uint8_t* src[4] = { NULL, NULL, NULL, NULL };
+    for (int p = 0; p < av_pix_fmt_count_planes((AVPixelFormat)m_src_format); p++) {
+        src[p] = in->data[p] + (slice->src_y >> plane_shift(src_desc, p)) * in->linesize[p];
+    }
+
+    if (!slice->scratch) {
+        sws_scale(slice->sws_ctx, src, in->linesize, 0, slice->src_h, out->data, out->linesize);
+        return;
+    }
+
+    sws_scale(slice->sws_ctx, src, in->linesize, 0, slice->src_h, slice->scratch->data, slice->scratch->linesize);
+
+    // margins are already scaled by neighbour slices, only inner rows go to the output
+    for (int p = 0; p < av_pix_fmt_count_planes((AVPixelFormat)m_dst_format); p++) {
+        int shift = plane_shift(dst_desc, p);
+
+        av_image_copy_plane(out->data[p] + (slice->dst_y >> shift) * out->linesize[p], out->linesize[p],
+            slice->scratch->data[p] + (slice->skip >> shift) * slice->scratch->linesize[p], slice->scratch->linesize[p],
+            av_image_get_linesize((AVPixelFormat)m_dst_format, m_dst_w, p), slice->dst_h >> shift);
+    }
+}
+
+void SliceScaler::clear() {
+    for (size_t i = 0; i < m_slices.size(); i++) {
+        sws_freeContext(m_slices[i].sws_ctx);
+        av_frame_free(&m_slices[i].scratch);
+    }
+
+    m_slices.clear();
+    m_src_w = m_src_h = m_dst_w = m_dst_h = 0;
+}
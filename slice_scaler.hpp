@@ -0,0 +1,73 @@
+/*
+* File: slice_scaler.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* slice-parallel scaler and pixel format converter. single sws_scale() call per frame runs
+* on one core, which is too slow for 4K. here frame is cut into horizontal slices, every
+* slice has its own swscale context and slices are scaled in parallel on a thread pool.
+*
+* scaling filter of every output row reads several input rows around it, so slice can't be
+* scaled on its own: rows near slice edges would see picture edge instead of neighbour slice
+* rows. every slice is scaled together with a margin of extra rows above and below it into
+* a scratch picture, and only the inner rows are copied to the output. slice boundaries are
+* placed where input and output row grids line up (and on chroma row boundaries), so filter
+* positions inside slice are the same as with whole frame scaling. if sizes never line up
+* (e.g. 1080 -> 719) frame is scaled in one piece
+*
+*/
+
+#ifndef slice_scaler_hpp
+#define slice_scaler_hpp
+
+#include <vector>
+
+extern "C" {
+    #include <libavutil/frame.h>
+    #include <libswscale/swscale.h>
+}
+
+#include "thread_pool.hpp"
+
+class SliceScaler {
+public:
+    SliceScaler(int threads, int flags);
+    ~SliceScaler();
+
+    // scale and convert whole picture, out must have its buffers allocated already
+    bool scale(const AVFrame* in, AVFrame* out);
+
+    int slices() const;     // number of slices current geometry is split into
+
+    // swscale flags for algorithm name (bilinear, bicubic, lanczos...), -1 if name is unknown
+    static int flags_by_name(const char* name);
+
+private:
+    struct Slice {
+        SwsContext* sws_ctx;
+        int src_y;          // first input row scaled, margin included
+        int src_h;          // input rows scaled, margin included
+        int dst_y;          // first output row written to the output picture
+        int dst_h;          // output rows written to the output picture
+        int skip;           // margin rows on top of scratch picture which are thrown away
+        AVFrame* scratch;   // slice output with margins, NULL if slice is the whole frame
+    };
+
+    bool configure(const AVFrame* in, const AVFrame* out);
+    bool add_slice(int src_y, int src_h, int dst_y, int dst_h, int skip, int scratch_h);
+    void scale_slice(Slice* slice, const AVFrame* in, AVFrame* out);
+    void clear();
+
+    int m_threads;
+    int m_flags;
+
+    // geometry slices are made for
+    int m_src_w, m_src_h, m_src_format;
+    int m_dst_w, m_dst_h, m_dst_format;
+
+    std::vector<Slice> m_slices;
+    ThreadPool* m_pool;     // helper threads, calling thread scales one slice itself. NULL if single threaded
+};
+
+#endif /* slice_scaler_hpp */
@@ -0,0 +1,454 @@
+/*
+* File: smart_cut.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* frame accurate cut of H.264 stream, see smart_cut.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+    #include <libavutil/opt.h>
+}
+
+#include "helpers.hpp"
+#include "smart_cut.hpp"
+
+// x264 profile for source SPS profile_idc, NULL lets x264 pick the one its settings need
+static const char* x264_profile_name(int profile) {
+    switch (profile & ~(FF_PROFILE_H264_CONSTRAINED | FF_PROFILE_H264_INTRA)) {
+        case FF_PROFILE_H264_BASELINE: return "baseline";
+        case FF_PROFILE_H264_MAIN: return "main";
+        case FF_PROFILE_H264_HIGH: return "high";
+        case FF_PROFILE_H264_HIGH_10: return "high10";
+        case FF_PROFILE_H264_HIGH_422: return "high422";
+        case FF_PROFILE_H264_HIGH_444_PREDICTIVE: return "high444";
+        default: return NULL;
+    }
+}
+
+SmartCut::SmartCut() :
+    m_stream(NULL),
+    m_start(AV_NOPTS_VALUE),
+    m_end(INT64_MAX),
+    m_seeked(false),
+    m_crf(18),
+    m_decoder(NULL),
+    m_encoder(NULL),
+    m_frame(NULL),
+    m_packet(NULL),
+    m_started(false),
+    m_head(false),
+    m_done(false),
+    m_gop_min_pts(INT64_MAX),
+    m_gop_max_pts(INT64_MIN),
+    m_first_encoded(false),
+    m_reencoded(0),
+    m_copied(0)
+{
+}
+
+SmartCut::~SmartCut() {
+    close();
+}
+
+void SmartCut::close() {
+    clear_gop();
+
+    avcodec_free_context(&m_decoder);
+    avcodec_free_context(&m_encoder);
+    av_frame_free(&m_frame);
+    av_packet_free(&m_packet);
+
+    m_stream = NULL;
+    m_started = false;
+    m_head = false;
+    m_done = false;
+    m_source_extradata.clear();
+    m_encoder_extradata.clear();
+    m_output_extradata.clear();
+    m_reencoded = 0;
+    m_copied = 0;
+}
+
+const std::string& SmartCut::error() const {
+    return m_error;
+}
+
+bool SmartCut::done() const {
+    return m_done;
+}
+
+int64_t SmartCut::reencoded() const {
+    return m_reencoded;
+}
+
+int64_t SmartCut::copied() const {
+    return m_copied;
+}
+
+bool SmartCut::fail(const std::string& message) {
+    m_error = message;
+    return false;
+}
+
+bool SmartCut::open(const AVStream* stream, int64_t start, int64_t end, bool seeked, int crf, const std::string& preset) {
+    close();
+
+    m_stream = stream;
+    m_start = start;
+    m_end = end;
+    m_seeked = seeked;
+    m_crf = crf;
+    m_preset = preset;
+    m_error.clear();
+
+    const AVCodecParameters* par = stream->codecpar;
+    if (par->codec_id != AV_CODEC_ID_H264) {
+        return fail(std::string("Smart cut needs H.264 video, input has ") + avcodec_get_name(par->codec_id));
+    }
+
+    m_source_extradata.assign(par->extradata, par->extradata + par->extradata_size);
+    m_output_extradata = m_source_extradata;
+
+    m_frame = av_frame_alloc();
+    m_packet = av_packet_alloc();
+    if (!m_frame || !m_packet) {
+        return fail("Could not allocate frame and packet for smart cut");
+    }
+
+    if (!open_decoder()) {
+        return false;
+    }
+
+    // extradata of re-encoded parts has to be known before output header is written, encoder
+    // made with the same settings for every part gives the same SPS/PPS
+    if (!open_encoder()) {
+        return false;
+    }
+    m_encoder_extradata.assign(m_encoder->extradata, m_encoder->extradata + m_encoder->extradata_size);
+    avcodec_free_context(&m_encoder);
+
+    return true;
+}
+
+bool SmartCut::set_output_extradata(AVCodecParameters* par) {
+    // range starting exactly on keyframe begins with copied GOP, its first packet switches back
+    if (m_start == AV_NOPTS_VALUE || m_encoder_extradata.empty()) {
+        return true;
+    }
+
+    av_freep(&par->extradata);
+    par->extradata_size = 0;
+
+    par->extradata = (uint8_t*)av_mallocz(m_encoder_extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!par->extradata) {
+        return fail("Could not allocate output extradata");
+    }
+
+    memcpy(par->extradata, &m_encoder_extradata[0], m_encoder_extradata.size());
+    par->extradata_size = m_encoder_extradata.size();
+    m_output_extradata = m_encoder_extradata;
+    return true;
+}
+
+bool SmartCut::open_decoder() {
+    AVCodec* codec = avcodec_find_decoder(m_stream->codecpar->codec_id);
+    if (!codec) {
+        return fail("Could not find H.264 decoder");
+    }
+
+    m_decoder = avcodec_alloc_context3(codec);
+    if (!m_decoder) {
+        return fail("Could not allocate decoder context");
+    }
+
+    int ret = avcodec_parameters_to_context(m_decoder, m_stream->codecpar);
+    if (ret < 0) {
+        return fail(std::string("Failed to copy codec parameters to decoder, reason: ") + av_err2str(ret));
+    }
+
+    // decoded frames carry timestamps in input stream time base
+    m_decoder->pkt_timebase = m_stream->time_base;
+    m_decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    ret = avcodec_open2(m_decoder, codec, NULL);
+    if (ret < 0) {
+        return fail(std::string("Could not open decoder, reason: ") + av_err2str(ret));
+    }
+
+    return true;
+}
+
+// settings from source SPS, so re-encoded frames are decoded the same way as copied ones
+bool SmartCut::open_encoder() {
+    const AVCodecParameters* par = m_stream->codecpar;
+
+    AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        return fail("Could not find libx264 encoder");
+    }
+
+    m_encoder = avcodec_alloc_context3(codec);
+    if (!m_encoder) {
+        return fail("Could not allocate encoder context");
+    }
+
+    AVCodecContext* enc = m_encoder;
+    enc->width = par->width;
+    enc->height = par->height;
+    enc->pix_fmt = par->format != AV_PIX_FMT_NONE ? AVPixelFormat(par->format) : AV_PIX_FMT_YUV420P;
+    enc->sample_aspect_ratio = par->sample_aspect_ratio;
+    enc->color_range = par->color_range;
+    enc->color_primaries = par->color_primaries;
+    enc->color_trc = par->color_trc;
+    enc->colorspace = par->color_space;
+    enc->chroma_sample_location = par->chroma_location;
+    enc->field_order = par->field_order;
+    enc->level = par->level;
+
+    AVRational frame_rate = m_stream->avg_frame_rate;
+    enc->framerate = frame_rate.num > 0 && frame_rate.den > 0 ? frame_rate : av_make_q(25, 1);
+
+    // keep input time base, this way frame timestamps pass through encoder untouched
+    enc->time_base = m_stream->time_base;
+
+    // no reordering: DTS of re-encoded frames can be put wherever copied GOPs leave room
+    enc->max_b_frames = 0;
+
+    const char* profile = x264_profile_name(par->profile);
+    if (profile) {
+        av_opt_set(enc->priv_data, "profile", profile, 0);
+    }
+    av_opt_set(enc->priv_data, "preset", m_preset.c_str(), 0);
+    av_opt_set_int(enc->priv_data, "crf", m_crf, 0);
+
+    // flv wants sps/pps in stream header, copied packets don't carry them either
+    enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    int ret = avcodec_open2(enc, codec, NULL);
+    if (ret < 0) {
+        return fail(std::string("Could not open libx264 encoder, reason: ") + av_err2str(ret));
+    }
+
+    return true;
+}
+
+bool SmartCut::add(const AVPacket* packet, std::vector<AVPacket*>* out) {
+    if (m_done) {
+        return true;
+    }
+
+    bool keyframe = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+
+    // nothing before the first keyframe can be decoded
+    if (!m_started) {
+        if (!keyframe) {
+            return true;
+        }
+
+        m_started = true;
+        m_head = m_start != AV_NOPTS_VALUE;
+    } else if (keyframe) {
+        if (!flush_gop(packet, out)) {
+            return false;
+        }
+
+        if (m_done) {
+            return true;
+        }
+    }
+
+    AVPacket* held = av_packet_clone(packet);
+    if (!held) {
+        return fail("Could not allocate packet for smart cut");
+    }
+    m_gop.push_back(held);
+
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    if (pts != AV_NOPTS_VALUE) {
+        m_gop_min_pts = FFMIN(m_gop_min_pts, pts);
+        m_gop_max_pts = FFMAX(m_gop_max_pts, pts);
+    }
+
+    // PTS is never before DTS, every packet after this one is past range end too: GOP held
+    // has all frames range needs
+    if (packet->dts != AV_NOPTS_VALUE && packet->dts >= m_end) {
+        return flush_gop(NULL, out);
+    }
+
+    return true;
+}
+
+bool SmartCut::finish(std::vector<AVPacket*>* out) {
+    if (m_done) {
+        return true;
+    }
+
+    bool ok = flush_gop(NULL, out);
+    m_done = true;
+    return ok;
+}
+
+// GOP held is complete: copied when range covers it, cut and re-encoded when range starts or
+// ends inside it
+bool SmartCut::flush_gop(const AVPacket* next_keyframe, std::vector<AVPacket*>* out) {
+    if (m_gop.empty()) {
+        return true;
+    }
+
+    // demuxer seek landed more than a GOP before range start (or input isn't seekable)
+    if (m_head && m_gop_max_pts < m_start) {
+        clear_gop();
+        return true;
+    }
+
+    // frames from range start to this keyframe were never read, output would silently miss them
+    if (m_head && m_seeked && m_gop_min_pts > m_start) {
+        return fail("Smart cut input begins after range start, seek missed its keyframe");
+    }
+
+    bool head = m_head && m_gop_min_pts < m_start;
+    bool tail = m_end != INT64_MAX && m_gop_max_pts >= m_end;
+    m_head = false;
+    m_done = tail;
+
+    bool ok = true;
+    if (tail && m_gop_min_pts >= m_end) {
+        // range ended right before this GOP
+    } else if (!head && !tail) {
+        ok = copy_gop(out);
+    } else {
+        // re-encoded head ends right before DTS of the next GOP, which is copied, re-encoded tail
+        // starts at DTS of keyframe it replaces: both keep source reorder delay
+        const AVPacket* keyframe = tail ? m_gop[0] : next_keyframe;
+        int64_t delay = 0;
+        if (keyframe && keyframe->pts != AV_NOPTS_VALUE && keyframe->dts != AV_NOPTS_VALUE) {
+            delay = FFMAX(keyframe->pts - keyframe->dts, 0);
+        }
+
+        ok = reencode_gop(head ? m_start : INT64_MIN, tail ? m_end : INT64_MAX, delay, out);
+    }
+
+    clear_gop();
+    return ok;
+}
+
+bool SmartCut::copy_gop(std::vector<AVPacket*>* out) {
+    switch_extradata(m_gop[0], m_source_extradata);
+
+    for (size_t i = 0; i < m_gop.size(); i++) {
+        out->push_back(m_gop[i]);
+        m_gop[i] = NULL;
+    }
+
+    m_copied += m_gop.size();
+    return true;
+}
+
+// frames with PTS in [from, to) are decoded from the GOP and encoded again
+bool SmartCut::reencode_gop(int64_t from, int64_t to, int64_t delay, std::vector<AVPacket*>* out) {
+    if (!open_encoder()) {
+        return false;
+    }
+
+    avcodec_flush_buffers(m_decoder);
+    m_first_encoded = true;
+
+    std::vector<AVPacket*> segment;
+    bool ok = true;
+
+    // the last round drains decoder
+    for (size_t i = 0; i <= m_gop.size() && ok; i++) {
+        int ret = avcodec_send_packet(m_decoder, i < m_gop.size() ? m_gop[i] : NULL);
+        if (ret < 0) {
+            ok = fail(std::string("Failed to decode packet for smart cut, reason: ") + av_err2str(ret));
+            break;
+        }
+
+        while (ok && avcodec_receive_frame(m_decoder, m_frame) >= 0) {
+            int64_t pts = m_frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE && pts >= from && pts < to) {
+                // re-encoded part begins with keyframe, the rest is up to x264
+                m_frame->pts = pts;
+                m_frame->pict_type = m_first_encoded ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+                m_first_encoded = false;
+
+                ok = encode_frame(m_frame, &segment);
+                m_reencoded++;
+            }
+
+            av_frame_unref(m_frame);
+        }
+    }
+
+    ok = ok && encode_frame(NULL, &segment);
+
+    if (ok && !segment.empty()) {
+        m_encoder_extradata.assign(m_encoder->extradata, m_encoder->extradata + m_encoder->extradata_size);
+        switch_extradata(segment[0], m_encoder_extradata);
+    }
+
+    for (size_t i = 0; i < segment.size(); i++) {
+        if (!ok) {
+            av_packet_free(&segment[i]);
+            continue;
+        }
+
+        segment[i]->dts = segment[i]->pts - delay;
+        segment[i]->stream_index = m_stream->index;
+        segment[i]->pos = -1;
+        out->push_back(segment[i]);
+    }
+
+    avcodec_free_context(&m_encoder);
+    return ok;
+}
+
+// NULL frame flushes encoder
+bool SmartCut::encode_frame(AVFrame* frame, std::vector<AVPacket*>* segment) {
+    int ret = avcodec_send_frame(m_encoder, frame);
+    if (ret < 0) {
+        return fail(std::string("Failed to encode frame for smart cut, reason: ") + av_err2str(ret));
+    }
+
+    while (avcodec_receive_packet(m_encoder, m_packet) >= 0) {
+        AVPacket* packet = av_packet_alloc();
+        if (!packet) {
+            av_packet_unref(m_packet);
+            return fail("Could not allocate packet for smart cut");
+        }
+
+        av_packet_move_ref(packet, m_packet);
+        segment->push_back(packet);
+    }
+
+    return true;
+}
+
+// flv muxer writes new extradata from packet side data as a new sequence header
+void SmartCut::switch_extradata(AVPacket* packet, const std::vector<uint8_t>& extradata) {
+    if (extradata.empty() || extradata == m_output_extradata) {
+        return;
+    }
+
+    uint8_t* data = av_packet_new_side_data(packet, AV_PKT_DATA_NEW_EXTRADATA, extradata.size());
+    if (data) {
+        memcpy(data, &extradata[0], extradata.size());
+        m_output_extradata = extradata;
+    }
+}
+
+void SmartCut::clear_gop() {
+    for (size_t i = 0; i < m_gop.size(); i++) {
+        av_packet_free(&m_gop[i]);
+    }
+
+    m_gop.clear();
+    m_gop_min_pts = INT64_MAX;
+    m_gop_max_pts = INT64_MIN;
+}
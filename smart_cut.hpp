@@ -0,0 +1,105 @@
+/*
+* File: smart_cut.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* frame accurate cut of H.264 stream without transcoding all of it. stream copy can only cut
+* at keyframes, so range would begin up to a GOP before requested start. SmartCut decodes and
+* re-encodes with x264 only the partial GOPs at the range start and end, whole GOPs between
+* them are copied as they are. cost is two GOPs of encoding per cut, whatever the range length.
+*
+* encoder is set up from the source SPS: profile, level, picture size, pixel format, aspect
+* ratio and colour description, so re-encoded frames fit between copied ones. B-frames are off
+* in re-encoded parts, their DTS are placed right before (range start) or right after (range
+* end) DTS of copied GOPs. where parameter sets still differ, packets switching between source
+* and re-encoded parts carry new extradata as side data, same as Transcoder does after
+* reopening encoder.
+*
+* output has to be FLV: it's the only muxer here that writes new extradata as a new sequence
+* header. MP4 keeps one sample description for the whole track, and MPEG-TS needs Annex B
+* while copied packets are AVCC, so mixed parts would not decode there.
+*
+* GOPs are expected to be closed (x264 default): frames of copied GOP must not reference
+* frames of GOP before it, which is re-encoded
+*
+*/
+
+#ifndef smart_cut_hpp
+#define smart_cut_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+}
+
+class SmartCut {
+public:
+    SmartCut();
+    ~SmartCut();
+
+    // stream is input video stream, start and end are in its time base (AV_NOPTS_VALUE and
+    // INT64_MAX: stream is not cut on that side). seeked: input was moved to keyframe at or
+    // before start, the first GOP must cover it. output is FLV
+    bool open(const AVStream* stream, int64_t start, int64_t end, bool seeked, int crf, const std::string& preset);
+    void close();
+
+    // output stream starts with extradata of whatever comes first, re-encoded or copied part
+    bool set_output_extradata(AVCodecParameters* par);
+
+    // input packet of the stream, in decode order. packets ready to be written are appended
+    // to out, with input time base and timestamps, caller frees them
+    bool add(const AVPacket* packet, std::vector<AVPacket*>* out);
+    bool finish(std::vector<AVPacket*>* out);   // end of input, GOP still held is cut
+
+    bool done() const;                          // range end is written, stream needs nothing more
+    const std::string& error() const;
+
+    int64_t reencoded() const;                  // frames re-encoded
+    int64_t copied() const;                     // packets copied
+
+private:
+    bool open_decoder();
+    bool open_encoder();
+    bool flush_gop(const AVPacket* next_keyframe, std::vector<AVPacket*>* out);
+    bool copy_gop(std::vector<AVPacket*>* out);
+    bool reencode_gop(int64_t from, int64_t to, int64_t delay, std::vector<AVPacket*>* out);
+    bool encode_frame(AVFrame* frame, std::vector<AVPacket*>* segment);
+    void switch_extradata(AVPacket* packet, const std::vector<uint8_t>& extradata);
+    void clear_gop();
+    bool fail(const std::string& message);
+
+    const AVStream* m_stream;
+    int64_t m_start;
+    int64_t m_end;
+    bool m_seeked;
+    int m_crf;
+    std::string m_preset;
+    std::string m_error;
+
+    AVCodecContext* m_decoder;
+    AVCodecContext* m_encoder;              // per re-encoded part, x264 can't be restarted after flush
+    AVFrame* m_frame;
+    AVPacket* m_packet;
+
+    bool m_started;                         // first keyframe seen
+    bool m_head;                            // GOP held is the first one
+    bool m_done;
+    std::vector<AVPacket*> m_gop;           // held till it's known whether range ends in it
+    int64_t m_gop_min_pts;
+    int64_t m_gop_max_pts;
+    bool m_first_encoded;                   // next frame sent to encoder starts the part
+
+    std::vector<uint8_t> m_source_extradata;
+    std::vector<uint8_t> m_encoder_extradata;
+    std::vector<uint8_t> m_output_extradata;   // what decoder of output has now
+
+    int64_t m_reencoded;
+    int64_t m_copied;
+};
+
+#endif /* smart_cut_hpp */
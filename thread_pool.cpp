@@ -0,0 +1,83 @@
+/*
+* File: thread_pool.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* simple fixed size thread pool, threadsafe
+*
+*/
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(size_t threads) :
+    m_active(0), m_stop(false)
+{
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        m_workers.push_back(std::thread(&ThreadPool::worker, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_stop = true;
+    }
+
+    m_task_cond.notify_all();
+
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        m_workers[i].join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return m_workers.size();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_tasks.push_back(task);
+    m_task_cond.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (!m_tasks.empty() || m_active > 0) {
+        m_idle_cond.wait(lk);
+    }
+}
+
+void ThreadPool::worker() {
+    while (1) {
+        std::function<void()> task;
+
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            while (m_tasks.empty() && !m_stop) {
+                m_task_cond.wait(lk);
+            }
+
+            // pending tasks are still executed on shutdown
+            if (m_tasks.empty()) {
+                return;
+            }
+
+            task = m_tasks.front();
+            m_tasks.pop_front();
+            m_active++;
+        }
+
+        task();
+
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_active--;
+        if (m_tasks.empty() && m_active == 0) {
+            m_idle_cond.notify_all();
+        }
+    }
+}
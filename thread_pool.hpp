@@ -0,0 +1,43 @@
+/*
+* File: thread_pool.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* simple fixed size thread pool, threadsafe
+*
+*/
+
+#ifndef thread_pool_hpp
+#define thread_pool_hpp
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+class ThreadPool {
+public:
+    ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    size_t size() const;                        // return number of worker threads
+    void submit(std::function<void()> task);    // queue task for execution on any free worker
+    void wait();                                // block till all submitted tasks are finished
+
+private:
+    void worker();
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()> > m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_task_cond;
+    std::condition_variable m_idle_cond;
+    size_t m_active;
+    bool m_stop;
+};
+
+#endif /* thread_pool_hpp */
@@ -0,0 +1,53 @@
+/*
+* File: thread_usage.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* per thread cpu time and context switches, see thread_usage.hpp for description
+*
+*/
+
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "thread_usage.hpp"
+
+// kernel limit, including terminating zero
+const int ThreadNameSize = 16;
+
+ThreadUsage ThreadUsage::current() {
+    ThreadUsage usage;
+
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        usage.cpu_us = int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+        usage.voluntary_switches = ru.ru_nvcsw;
+        usage.involuntary_switches = ru.ru_nivcsw;
+    }
+
+    return usage;
+}
+
+ThreadUsage operator-(const ThreadUsage& a, const ThreadUsage& b) {
+    ThreadUsage usage;
+    usage.cpu_us = a.cpu_us - b.cpu_us;
+    usage.voluntary_switches = a.voluntary_switches - b.voluntary_switches;
+    usage.involuntary_switches = a.involuntary_switches - b.involuntary_switches;
+    return usage;
+}
+
+void set_thread_name(const char* name) {
+    // longer names are refused, not truncated
+    char short_name[ThreadNameSize];
+    strncpy(short_name, name, sizeof short_name - 1);
+    short_name[sizeof short_name - 1] = '\0';
+
+    pthread_setname_np(pthread_self(), short_name);
+}
@@ -0,0 +1,34 @@
+/*
+* File: thread_usage.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* cpu time and context switches of the calling thread. both are counted by kernel per thread
+* (CLOCK_THREAD_CPUTIME_ID, getrusage(RUSAGE_THREAD)), so only the thread itself can sample them:
+* pipeline threads sample themselves every now and then and keep the numbers where others can see.
+* voluntary switches are mostly waits (ring buffer, socket, disk), involuntary ones mean thread
+* was runnable but cpu was given to someone else
+*
+*/
+
+#ifndef thread_usage_hpp
+#define thread_usage_hpp
+
+#include <stdint.h>
+
+struct ThreadUsage {
+    ThreadUsage() : cpu_us(0), voluntary_switches(0), involuntary_switches(0) {}
+
+    int64_t cpu_us;
+    int64_t voluntary_switches;
+    int64_t involuntary_switches;
+
+    static ThreadUsage current();   // of calling thread, since it started
+};
+
+ThreadUsage operator-(const ThreadUsage& a, const ThreadUsage& b);
+
+void set_thread_name(const char* name);    // shows in top -H, gdb and perf, first 15 chars only
+
+#endif /* thread_usage_hpp */
@@ -0,0 +1,423 @@
+/*
+* File: thumbnailer.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* sprite sheet generator, see thumbnailer.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+extern "C" {
+    #include <libavutil/imgutils.h>
+    #include <libavutil/time.h>
+}
+
+#include "helpers.hpp"
+#include "thumbnailer.hpp"
+
+// JPEG encoder takes full range yuv, scaler converts limited range input on the way
+const AVPixelFormat ThumbnailPixelFormat = AV_PIX_FMT_YUVJ420P;
+
+ThumbnailOptions::ThumbnailOptions() :
+    interval(10.0),
+    max_tiles(100),
+    columns(10),
+    tile_width(160),
+    quality(5),
+    decode_threads(1),
+    use_index(true)
+{
+}
+
+ThumbnailResult::ThumbnailResult() :
+    tiles(0),
+    columns(0),
+    tile_width(0),
+    tile_height(0),
+    decoded(0),
+    seconds(0)
+{
+}
+
+Thumbnailer::Thumbnailer(const ThumbnailOptions& options) :
+    m_options(options),
+    m_input_ctx(NULL),
+    m_decoder(NULL),
+    m_sws_ctx(NULL),
+    m_video_stream(-1),
+    m_last_keyframe(AV_NOPTS_VALUE),
+    m_decoded(0),
+    m_tile_width(0),
+    m_tile_height(0)
+{
+}
+
+Thumbnailer::~Thumbnailer() {
+    close();
+}
+
+void Thumbnailer::close() {
+    for (size_t i = 0; i < m_tiles.size(); i++) {
+        av_frame_free(&m_tiles[i]);
+    }
+    m_tiles.clear();
+
+    sws_freeContext(m_sws_ctx);
+    m_sws_ctx = NULL;
+
+    avcodec_free_context(&m_decoder);
+    m_index.close();
+
+    if (m_input_ctx) {
+        avformat_close_input(&m_input_ctx);
+    }
+
+    m_video_stream = -1;
+    m_last_keyframe = AV_NOPTS_VALUE;
+    m_decoded = 0;
+    m_tile_width = 0;
+    m_tile_height = 0;
+}
+
+bool Thumbnailer::make_sprite_sheet(const char* in_filename, const char* out_filename, ThumbnailResult* result) {
+    int64_t t0 = av_gettime_relative();
+
+    close();
+    m_in_filename = in_filename;
+
+    if (!open_input(in_filename) || !open_decoder()) {
+        close();
+        return false;
+    }
+
+    AVStream* stream = m_input_ctx->streams[m_video_stream];
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    int64_t step = av_rescale_q(int64_t(m_options.interval * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+    if (step <= 0) {
+        step = 1;
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    bool ok = true;
+
+    // one seek and one decoded keyframe per thumbnail, no matter how long the file is
+    for (int i = 0; i < m_options.max_tiles && ok; i++) {
+        if (!decode_keyframe(start + step * i, frame)) {
+            break; // end of file
+        }
+
+        ok = add_tile(frame);
+        av_frame_unref(frame);
+    }
+
+    av_frame_free(&frame);
+
+    if (ok && m_tiles.empty()) {
+        std::cout << "No keyframes decoded from " << in_filename << '\n';
+        ok = false;
+    }
+
+    if (ok) {
+        ok = write_sheet(out_filename);
+    }
+
+    if (ok && result) {
+        result->tiles = m_tiles.size();
+        result->columns = FFMIN(m_options.columns, int(m_tiles.size()));
+        result->tile_width = m_tile_width;
+        result->tile_height = m_tile_height;
+        result->decoded = m_decoded;
+        result->seconds = (av_gettime_relative() - t0) / 1000000.0;
+    }
+
+    close();
+    return ok;
+}
+
+bool Thumbnailer::open_input(const char* filename) {
+    int ret = avformat_open_input(&m_input_ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open input file " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    ret = avformat_find_stream_info(m_input_ctx, NULL);
+    if (ret < 0) {
+        std::cout << "Failed to retrieve input stream information from " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    m_video_stream = av_find_best_stream(m_input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (m_video_stream < 0) {
+        std::cout << "Could not find video stream in " << filename << ", reason: " << av_err2str(m_video_stream) << '\n';
+        return false;
+    }
+
+    // demuxer doesn't have to parse packets of other streams at all
+    for (unsigned int i = 0; i < m_input_ctx->nb_streams; i++) {
+        if (int(i) != m_video_stream) {
+            m_input_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    // sidecar which is missing or doesn't match input is no error, demuxer seeks on its own
+    if (m_options.use_index) {
+        m_index.open(KeyframeIndex::sidecar_filename(filename).c_str(), filename);
+    }
+
+    return true;
+}
+
+bool Thumbnailer::open_decoder() {
+    AVStream* stream = m_input_ctx->streams[m_video_stream];
+
+    AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!codec) {
+        std::cout << "Could not find decoder for " << avcodec_get_name(stream->codecpar->codec_id) << " in " << m_in_filename << '\n';
+        return false;
+    }
+
+    m_decoder = avcodec_alloc_context3(codec);
+    if (!m_decoder) {
+        std::cout << "Could not allocate decoder context\n";
+        return false;
+    }
+
+    int ret = avcodec_parameters_to_context(m_decoder, stream->codecpar);
+    if (ret < 0) {
+        std::cout << "Failed to copy codec parameters to decoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    // decoder drops everything but keyframes. frame threading only adds delay here, keyframes
+    // don't depend on each other, files are processed in parallel instead
+    m_decoder->skip_frame = AVDISCARD_NONKEY;
+    m_decoder->pkt_timebase = stream->time_base;
+    m_decoder->thread_count = m_options.decode_threads;
+    m_decoder->thread_type = FF_THREAD_SLICE;
+
+    ret = avcodec_open2(m_decoder, codec, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open decoder for " << m_in_filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+// decode first keyframe at or after target which comes after last used keyframe. returns false at the end of file
+bool Thumbnailer::decode_keyframe(int64_t target, AVFrame* frame) {
+    int64_t min_ts = m_last_keyframe != AV_NOPTS_VALUE ? m_last_keyframe + 1 : INT64_MIN;
+
+    // demuxer picks keyframe closest to target, but never the one we've already used. streams
+    // which can't seek (pipes, some raw formats) are read forward till the target instead
+    bool seeked = m_index.seek(m_input_ctx, m_video_stream, min_ts, target) ||
+        avformat_seek_file(m_input_ctx, m_video_stream, min_ts, target, INT64_MAX, 0) >= 0;
+    avcodec_flush_buffers(m_decoder);
+
+    AVPacket packet;
+    while (av_read_frame(m_input_ctx, &packet) >= 0) {
+        int64_t ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+
+        // non-key packets are not even sent to decoder, it would discard them anyway
+        bool wanted = packet.stream_index == m_video_stream && (packet.flags & AV_PKT_FLAG_KEY) &&
+            (m_last_keyframe == AV_NOPTS_VALUE || ts == AV_NOPTS_VALUE || ts > m_last_keyframe) &&
+            (seeked || ts == AV_NOPTS_VALUE || ts >= target);
+
+        if (!wanted) {
+            av_packet_unref(&packet);
+            continue;
+        }
+
+        int ret = avcodec_send_packet(m_decoder, &packet);
+        av_packet_unref(&packet);
+
+        if (ret < 0) { // broken keyframe, try the next one
+            continue;
+        }
+
+        if (receive_keyframe(frame)) {
+            m_last_keyframe = ts;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// decoders with frame reordering hold keyframe back waiting for more packets, next packet
+// is a long way off, so decoder is drained right away. flush_buffers() resets it before next seek
+bool Thumbnailer::receive_keyframe(AVFrame* frame) {
+    int ret = avcodec_receive_frame(m_decoder, frame);
+    if (ret == AVERROR(EAGAIN)) {
+        avcodec_send_packet(m_decoder, NULL);
+        ret = avcodec_receive_frame(m_decoder, frame);
+    }
+
+    if (ret < 0) {
+        avcodec_flush_buffers(m_decoder);
+        return false;
+    }
+
+    m_decoded++;
+    return true;
+}
+
+bool Thumbnailer::add_tile(AVFrame* frame) {
+    // first keyframe decides tile size: given width, height by display aspect ratio, both even for yuv420
+    if (m_tile_width == 0) {
+        AVRational sar = av_guess_sample_aspect_ratio(m_input_ctx, m_input_ctx->streams[m_video_stream], frame);
+        if (sar.num <= 0 || sar.den <= 0) {
+            sar = av_make_q(1, 1);
+        }
+
+        m_tile_width = FFALIGN(m_options.tile_width, 2);
+        m_tile_height = FFALIGN(int(av_rescale(m_tile_width, int64_t(frame->height) * sar.den, int64_t(frame->width) * sar.num)), 2);
+        if (m_tile_height <= 0) {
+            m_tile_height = 2;
+        }
+    }
+
+    AVFrame* tile = av_frame_alloc();
+    tile->width = m_tile_width;
+    tile->height = m_tile_height;
+    tile->format = ThumbnailPixelFormat;
+
+    int ret = av_frame_get_buffer(tile, 32);
+    if (ret < 0) {
+        std::cout << "Could not allocate thumbnail, reason: " << av_err2str(ret) << '\n';
+        av_frame_free(&tile);
+        return false;
+    }
+
+    // cached context is recreated only if input frame parameters change
+    m_sws_ctx = sws_getCachedContext(m_sws_ctx,
+        frame->width, frame->height, (AVPixelFormat)frame->format,
+        tile->width, tile->height, ThumbnailPixelFormat,
+        SWS_BICUBIC, NULL, NULL, NULL);
+
+    if (!m_sws_ctx) {
+        std::cout << "Could not create scaler context\n";
+        av_frame_free(&tile);
+        return false;
+    }
+
+    sws_scale(m_sws_ctx, frame->data, frame->linesize, 0, frame->height, tile->data, tile->linesize);
+    m_tiles.push_back(tile);
+    return true;
+}
+
+bool Thumbnailer::write_sheet(const char* filename) {
+    int columns = FFMIN(m_options.columns, int(m_tiles.size()));
+    int rows = (m_tiles.size() + columns - 1) / columns;
+
+    AVFrame* sheet = av_frame_alloc();
+    sheet->width = columns * m_tile_width;
+    sheet->height = rows * m_tile_height;
+    sheet->format = ThumbnailPixelFormat;
+
+    int ret = av_frame_get_buffer(sheet, 32);
+    if (ret < 0) {
+        std::cout << "Could not allocate sprite sheet, reason: " << av_err2str(ret) << '\n';
+        av_frame_free(&sheet);
+        return false;
+    }
+
+    // black background for empty cells of the last row
+    memset(sheet->data[0], 0, sheet->linesize[0] * sheet->height);
+    memset(sheet->data[1], 128, sheet->linesize[1] * (sheet->height / 2));
+    memset(sheet->data[2], 128, sheet->linesize[2] * (sheet->height / 2));
+
+    for (size_t i = 0; i < m_tiles.size(); i++) {
+        AVFrame* tile = m_tiles[i];
+        int x = (i % columns) * m_tile_width;
+        int y = (i / columns) * m_tile_height;
+
+        // planes 1 and 2 are chroma planes, half size in both directions for yuv420
+        for (int p = 0; p < 3; p++) {
+            int shift = p == 0 ? 0 : 1;
+            av_image_copy_plane(sheet->data[p] + (y >> shift) * sheet->linesize[p] + (x >> shift), sheet->linesize[p],
+                tile->data[p], tile->linesize[p], m_tile_width >> shift, m_tile_height >> shift);
+        }
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    bool ok = encode_picture(sheet, &packet);
+    av_frame_free(&sheet);
+
+    if (!ok) {
+        return false;
+    }
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        std::cout << "Could not open output file " << filename << '\n';
+        av_packet_unref(&packet);
+        return false;
+    }
+
+    ok = fwrite(packet.data, 1, packet.size, file) == size_t(packet.size);
+    ok = fclose(file) == 0 && ok;
+    av_packet_unref(&packet);
+
+    if (!ok) {
+        std::cout << "Failed to write sprite sheet to " << filename << '\n';
+    }
+
+    return ok;
+}
+
+// encode single picture to JPEG
+bool Thumbnailer::encode_picture(AVFrame* picture, AVPacket* packet) {
+    AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec) {
+        std::cout << "Could not find JPEG encoder\n";
+        return false;
+    }
+
+    AVCodecContext* encoder = avcodec_alloc_context3(codec);
+    if (!encoder) {
+        std::cout << "Could not allocate encoder context\n";
+        return false;
+    }
+
+    // fixed quantizer, there's no bitrate to speak of for a single picture
+    encoder->width = picture->width;
+    encoder->height = picture->height;
+    encoder->pix_fmt = (AVPixelFormat)picture->format;
+    encoder->time_base = av_make_q(1, 1);
+    encoder->flags |= AV_CODEC_FLAG_QSCALE;
+    encoder->global_quality = FF_QP2LAMBDA * m_options.quality;
+    picture->quality = encoder->global_quality;
+    picture->pts = 0;
+
+    int ret = avcodec_open2(encoder, codec, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open JPEG encoder, reason: " << av_err2str(ret) << '\n';
+        avcodec_free_context(&encoder);
+        return false;
+    }
+
+    ret = avcodec_send_frame(encoder, picture);
+    if (ret >= 0) {
+        ret = avcodec_receive_packet(encoder, packet);
+    }
+
+    avcodec_free_context(&encoder);
+
+    if (ret < 0) {
+        std::cout << "Failed to encode sprite sheet, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    return true;
+}
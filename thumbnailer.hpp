@@ -0,0 +1,90 @@
+/*
+* File: thumbnailer.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* sprite sheet (thumbnails grid) generator. instead of decoding the whole file, thumbnailer
+* seeks from keyframe to keyframe and decodes keyframes only (skip_frame = AVDISCARD_NONKEY),
+* so cost depends on number of thumbnails, not on file duration. keyframes are scaled into
+* tiles and tiles are put into one JPEG image, row by row.
+* when input has keyframe index sidecar (see keyframe_index.hpp) seeks go straight to keyframe
+* offsets from it, demuxers of containers without index (MPEG-TS) would bisect the file instead.
+* one Thumbnailer handles one file at a time, use several of them to process files in parallel
+*
+*/
+
+#ifndef thumbnailer_hpp
+#define thumbnailer_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "keyframe_index.hpp"
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libswscale/swscale.h>
+}
+
+struct ThumbnailOptions {
+    ThumbnailOptions();
+
+    double interval;        // seconds between thumbnails, nearest keyframe is taken
+    int max_tiles;          // max thumbnails per sprite sheet
+    int columns;            // tiles per sprite sheet row
+    int tile_width;         // tile width in pixels, height follows input aspect ratio
+    int quality;            // JPEG quantizer, 2 (best) - 31 (worst)
+    int decode_threads;     // decoder threads per file
+    bool use_index;         // seek by input.kfi sidecar when there is one
+};
+
+// what was done with one file
+struct ThumbnailResult {
+    ThumbnailResult();
+
+    int tiles;              // thumbnails in the sheet
+    int columns;
+    int tile_width;
+    int tile_height;
+    int64_t decoded;        // frames decoded, equals tiles unless seeking isn't possible
+    double seconds;         // time spent on the file
+};
+
+class Thumbnailer {
+public:
+    Thumbnailer(const ThumbnailOptions& options);
+    ~Thumbnailer();
+
+    // make sprite sheet of in_filename and write it to out_filename as JPEG
+    bool make_sprite_sheet(const char* in_filename, const char* out_filename, ThumbnailResult* result);
+
+private:
+    bool open_input(const char* filename);
+    bool open_decoder();
+    bool decode_keyframe(int64_t target, AVFrame* frame);
+    bool receive_keyframe(AVFrame* frame);
+    bool add_tile(AVFrame* frame);
+    bool write_sheet(const char* filename);
+    bool encode_picture(AVFrame* picture, AVPacket* packet);
+    void close();
+
+    ThumbnailOptions m_options;
+    std::string m_in_filename;
+
+    AVFormatContext* m_input_ctx;
+    AVCodecContext* m_decoder;
+    SwsContext* m_sws_ctx;
+    int m_video_stream;
+    KeyframeIndex m_index;          // not open when input has no sidecar
+
+    int64_t m_last_keyframe;        // timestamp of last used keyframe, in stream time base
+    int64_t m_decoded;
+    int m_tile_width;
+    int m_tile_height;
+    std::vector<AVFrame*> m_tiles;  // scaled thumbnails, waiting to be put into the sheet
+};
+
+#endif /* thumbnailer_hpp */
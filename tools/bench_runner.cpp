@@ -0,0 +1,717 @@
+/*
+*
+* File: tools/bench_runner.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* end-to-end benchmark of remuxing examples: remux, read_from_memory, write_to_memory and
+* srt_to_flv. inputs are made by gen_media (same seed every time, so every run remuxes the
+* same bytes), every example runs over every input and, where it has one, every AVIOContext
+* buffer size. srt_to_flv gets its input from SRT client built into the runner.
+* transcode runs over inputs with several audio tracks instead, every track re-encoded, and
+* CPU time per audio stream is taken from its final stats.
+*
+* every case runs a few times, median run by wall time is reported:
+* - MB/s and packets/s of input
+* - CPU time (user + system) and peak RSS, from wait4() rusage
+* - read and write syscalls, syscr/syscw from /proc/<pid>/io of the finished process
+*
+* results are written as JSON, one case per line, so files diff nicely and can be collected
+* for trend tracking. with -baseline, results are compared to earlier ones: case which lost
+* more than -threshold percent of MB/s or got that much more CPU time is a regression, and
+* runner exits with failure
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavutil/time.h>
+}
+
+#include <srt/srt.h>
+
+#include "../helpers.hpp"
+#include "tool_helpers.hpp"
+
+struct BenchOptions {
+    BenchOptions();
+
+    std::string bin_dir;            // where example binaries and gen_media are
+    std::string data_dir;           // generated inputs and outputs
+    double duration;                // generated inputs duration, seconds
+    int runs;                       // runs per case, median is reported
+    std::vector<int> buffers;       // AVIOContext buffer sizes for examples that have one
+    std::vector<std::string> modes; // examples to run
+    double threshold;               // regression threshold, percent
+    std::string baseline;           // earlier results to compare with, empty - no comparison
+    std::string output;             // results file
+    int srt_port;
+    double srt_rate;                // SRT send rate, Mbit/s
+};
+
+BenchOptions::BenchOptions() :
+    bin_dir("."),
+    data_dir("bench_data"),
+    duration(30),
+    runs(3),
+    threshold(10),
+    output("bench_results.json"),
+    srt_port(9000),
+    srt_rate(200)
+{
+    buffers.push_back(4096);
+    buffers.push_back(8192);
+    buffers.push_back(65536);
+
+    modes.push_back("remux");
+    modes.push_back("read_from_memory");
+    modes.push_back("write_to_memory");
+    modes.push_back("srt_to_flv");
+    modes.push_back("transcode");
+}
+
+// generated input, gen_media options make the difference
+struct BenchInput {
+    std::string name;
+    std::string args;
+    int audio_tracks;
+    std::string filename;
+    int64_t size;
+    int64_t packets;
+};
+
+// what one run of an example cost
+struct Measurement {
+    bool ok;
+    double wall_s;
+    double cpu_s;
+    int64_t peak_rss_kb;
+    int64_t read_syscalls;
+    int64_t write_syscalls;
+    double audio_ms_per_s;          // transcode: audio thread ms per second of audio of one stream, -1 - not reported
+};
+
+struct BenchResult {
+    std::string mode;
+    std::string input;
+    int buffer;                     // 0 - example has no buffer size option
+    int audio_streams;              // transcode: audio streams re-encoded, 0 for the rest
+    Measurement m;
+    double mb_per_s;
+    double packets_per_s;
+};
+
+// functions predeclarations
+void print_usage(const char* name);
+bool parse_options(int argc, char** argv, BenchOptions* options);
+bool prepare_input(const BenchOptions& options, BenchInput* input);
+int64_t count_packets(const char* filename);
+bool run_case(const BenchOptions& options, const BenchInput& input, const std::string& mode, int buffer, Measurement* result);
+pid_t spawn(const std::vector<std::string>& args, const std::string& out_filename = "");
+Measurement finish(pid_t pid, int64_t start_time);
+double audio_cost(const std::string& stats_filename);
+bool send_srt(const BenchOptions& options, const char* filename);
+bool write_results(const BenchOptions& options, const std::vector<BenchResult>& results);
+bool compare_with_baseline(const BenchOptions& options, const std::vector<BenchResult>& results);
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+
+    if (!parse_options(argc, argv, &options)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    mkdir(options.data_dir.c_str(), 0755);
+
+    // seed is fixed, inputs are the same on every host and every run. transcode gets inputs
+    // of its own: small picture, several audio tracks, so audio is a visible share of the job
+    std::vector<BenchInput> inputs;
+    std::vector<BenchInput> audio_inputs;
+    struct InputSpec {
+        const char* name;
+        const char* args;
+        int audio_tracks;
+    };
+    const InputSpec specs[] = {
+        { "sd",      "-s 640x360 -b 1000 -g 50", 1 },
+        { "hd",      "-s 1280x720 -b 4000 -g 50", 1 },
+        { "fhd",     "-s 1920x1080 -b 8000 -g 50", 1 },
+        { "hd_disc", "-s 1280x720 -b 4000 -g 50 -disc 10 -jump 5000", 1 },
+    };
+    const InputSpec audio_specs[] = {
+        { "sd_2a",   "-s 640x360 -b 1000 -g 50 -a 2", 2 },
+        { "sd_6a",   "-s 640x360 -b 1000 -g 50 -a 6", 6 },
+    };
+
+    bool transcode = std::find(options.modes.begin(), options.modes.end(), "transcode") != options.modes.end();
+    size_t specs_count = sizeof specs / sizeof specs[0];
+    size_t audio_specs_count = transcode ? sizeof audio_specs / sizeof audio_specs[0] : 0;
+
+    for (size_t i = 0; i < specs_count + audio_specs_count; i++) {
+        const InputSpec& spec = i < specs_count ? specs[i] : audio_specs[i - specs_count];
+
+        BenchInput input;
+        input.name = spec.name;
+        input.args = spec.args;
+        input.audio_tracks = spec.audio_tracks;
+        input.size = 0;
+        input.packets = 0;
+
+        if (!prepare_input(options, &input)) {
+            return EXIT_FAILURE;
+        }
+        (i < specs_count ? inputs : audio_inputs).push_back(input);
+    }
+
+    // srt_to_flv is killed by signal if sender fails, runner must not go down with broken pipe
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<BenchResult> results;
+
+    for (size_t i = 0; i < options.modes.size(); i++) {
+        const std::string& mode = options.modes[i];
+        const std::vector<BenchInput>& mode_inputs = mode == "transcode" ? audio_inputs : inputs;
+
+        // plain remux reads and writes files with avio_open(), transcode with its own muxers,
+        // they have no buffer size option
+        std::vector<int> buffers = mode == "remux" || mode == "transcode" ? std::vector<int>(1, 0) : options.buffers;
+
+        for (size_t j = 0; j < mode_inputs.size(); j++) {
+            for (size_t k = 0; k < buffers.size(); k++) {
+                std::vector<Measurement> runs;
+                for (int run = 0; run < options.runs; run++) {
+                    Measurement m;
+                    if (!run_case(options, mode_inputs[j], mode, buffers[k], &m)) {
+                        std::cout << "Failed to run " << mode << " on " << mode_inputs[j].name << '\n';
+                        return EXIT_FAILURE;
+                    }
+                    runs.push_back(m);
+                }
+
+                // median run by wall time, peak RSS is the worst of all runs
+                std::vector<std::pair<double, size_t> > order;
+                int64_t peak_rss_kb = 0;
+                for (size_t r = 0; r < runs.size(); r++) {
+                    order.push_back(std::make_pair(runs[r].wall_s, r));
+                    peak_rss_kb = std::max(peak_rss_kb, runs[r].peak_rss_kb);
+                }
+                std::sort(order.begin(), order.end());
+
+                BenchResult result;
+                result.mode = mode;
+                result.input = mode_inputs[j].name;
+                result.buffer = buffers[k];
+                result.audio_streams = mode == "transcode" ? mode_inputs[j].audio_tracks : 0;
+                result.m = runs[order[order.size() / 2].second];
+                result.m.peak_rss_kb = peak_rss_kb;
+                result.mb_per_s = result.m.wall_s > 0 ? mode_inputs[j].size / result.m.wall_s / 1000000.0 : 0;
+                result.packets_per_s = result.m.wall_s > 0 ? mode_inputs[j].packets / result.m.wall_s : 0;
+                results.push_back(result);
+
+                printf("%-18s %-8s buffer %6d: %8.1f MB/s %10.0f packets/s  cpu %6.3fs  rss %7lld KB  syscalls r %lld w %lld",
+                    mode.c_str(), mode_inputs[j].name.c_str(), buffers[k], result.mb_per_s, result.packets_per_s,
+                    result.m.cpu_s, (long long)result.m.peak_rss_kb,
+                    (long long)result.m.read_syscalls, (long long)result.m.write_syscalls);
+                if (result.audio_streams > 0) {
+                    printf("  audio %d x %.2f ms/s", result.audio_streams, result.m.audio_ms_per_s);
+                }
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (!write_results(options, results)) {
+        return EXIT_FAILURE;
+    }
+
+    if (!options.baseline.empty() && !compare_with_baseline(options, results)) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// generate input unless it's already there, gen_media output depends on options only
+bool prepare_input(const BenchOptions& options, BenchInput* input) {
+    char duration[32];
+    snprintf(duration, sizeof duration, "%g", options.duration);
+
+    input->filename = options.data_dir + "/" + input->name + "_" + duration + "s.ts";
+
+    struct stat st;
+    if (stat(input->filename.c_str(), &st) != 0) {
+        std::cout << "Generating " << input->filename << '\n';
+
+        std::vector<std::string> args;
+        args.push_back(options.bin_dir + "/gen_media");
+        args.push_back("-d");
+        args.push_back(duration);
+
+        std::istringstream spec(input->args);
+        std::string arg;
+        while (spec >> arg) {
+            args.push_back(arg);
+        }
+        args.push_back(input->filename);
+
+        pid_t pid = spawn(args);
+        if (pid < 0 || !finish(pid, av_gettime_relative()).ok || stat(input->filename.c_str(), &st) != 0) {
+            std::cout << "Failed to generate " << input->filename << '\n';
+            unlink(input->filename.c_str());
+            return false;
+        }
+    }
+
+    input->size = st.st_size;
+    input->packets = count_packets(input->filename.c_str());
+    return input->packets > 0;
+}
+
+int64_t count_packets(const char* filename) {
+    AVFormatContext* ctx = NULL;
+    int ret = avformat_open_input(&ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open input file " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return 0;
+    }
+
+    int64_t packets = 0;
+    AVPacket packet;
+    while (av_read_frame(ctx, &packet) >= 0) {
+        packets++;
+        av_packet_unref(&packet);
+    }
+
+    avformat_close_input(&ctx);
+    return packets;
+}
+
+bool run_case(const BenchOptions& options, const BenchInput& input, const std::string& mode, int buffer, Measurement* result) {
+    std::string output = options.data_dir + "/out_" + mode + ".flv";
+    char buffer_size[16];
+    snprintf(buffer_size, sizeof buffer_size, "%d", buffer);
+
+    std::vector<std::string> args;
+    args.push_back(options.bin_dir + "/" + mode);
+
+    // every audio track is re-encoded, not only ones FLV can't carry, into MPEG-TS: FLV has room
+    // for one audio stream only. video is made as cheap as x264 goes, it's not what this case
+    // measures. final stats go to a file, to be read back
+    std::string stats_filename;
+    if (mode == "transcode") {
+        output = options.data_dir + "/out_transcode.ts";
+        stats_filename = options.data_dir + "/out_transcode.log";
+        args.push_back("-f");
+        args.push_back("mpegts");
+        args.push_back("-aac");
+        args.push_back("-preset");
+        args.push_back("ultrafast");
+        args.push_back("-stats");
+        args.push_back("0");
+    }
+
+    if (mode == "srt_to_flv") {
+        char port[16];
+        snprintf(port, sizeof port, "%d", options.srt_port);
+        args.push_back("127.0.0.1");
+        args.push_back(port);
+    } else {
+        args.push_back(input.filename);
+    }
+
+    args.push_back(output);
+    if (buffer > 0) {
+        args.push_back(buffer_size);
+    }
+
+    int64_t start_time = av_gettime_relative();
+    pid_t pid = spawn(args, stats_filename);
+    if (pid < 0) {
+        return false;
+    }
+
+    // srt_to_flv is the server, runner plays the client sending input file
+    if (mode == "srt_to_flv" && !send_srt(options, input.filename.c_str())) {
+        kill(pid, SIGKILL);
+        finish(pid, start_time);
+        return false;
+    }
+
+    *result = finish(pid, start_time);
+    if (result->ok && !stats_filename.empty()) {
+        result->audio_ms_per_s = audio_cost(stats_filename);
+        if (result->audio_ms_per_s < 0) {
+            std::cout << "No audio cost in final stats of " << mode << ", see " << stats_filename << '\n';
+            return false;
+        }
+    }
+
+    return result->ok;
+}
+
+// audio thread time per second of audio of one stream, from transcoder final stats:
+// "audio per stream: <ms> ms per second of audio". -1 if it's not there
+double audio_cost(const std::string& stats_filename) {
+    std::ifstream file(stats_filename.c_str());
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t pos = line.find("audio per stream:");
+        double ms = 0;
+        if (pos != std::string::npos && sscanf(line.c_str() + pos, "audio per stream: %lf", &ms) == 1) {
+            return ms;
+        }
+    }
+
+    return -1;
+}
+
+// start process with output silenced, examples print a lot and terminal must not be what we
+// measure. out_filename gets standard output instead, when given
+pid_t spawn(const std::vector<std::string>& args, const std::string& out_filename) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cout << "Could not fork\n";
+        return -1;
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        int out_fd = out_filename.empty() ? null_fd : open(out_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(out_fd >= 0 ? out_fd : null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+
+        std::vector<char*> argv;
+        for (size_t i = 0; i < args.size(); i++) {
+            argv.push_back(const_cast<char*>(args[i].c_str()));
+        }
+        argv.push_back(NULL);
+
+        execv(argv[0], &argv[0]);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// wait for process to exit and collect its costs
+Measurement finish(pid_t pid, int64_t start_time) {
+    Measurement m = { false, 0, 0, 0, -1, -1, -1 };
+
+    // process is left a zombie, its /proc/<pid>/io is still there to read
+    siginfo_t info;
+    memset(&info, 0, sizeof info);
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == 0) {
+        m.wall_s = (av_gettime_relative() - start_time) / 1000000.0;
+
+        char path[64];
+        snprintf(path, sizeof path, "/proc/%d/io", int(pid));
+        std::ifstream io(path);
+        std::string name;
+        int64_t value;
+        while (io >> name >> value) {
+            if (name == "syscr:") {
+                m.read_syscalls = value;
+            } else if (name == "syscw:") {
+                m.write_syscalls = value;
+            }
+        }
+    }
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof usage);
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        return m;
+    }
+
+    m.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    m.cpu_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+    m.peak_rss_kb = usage.ru_maxrss;
+
+    return m;
+}
+
+// send file to srt_to_flv in live mode, paced to srt_rate. live mode drops what receiver can't
+// take in time, unpaced sender would measure packet loss instead of remuxing
+bool send_srt(const BenchOptions& options, const char* filename) {
+    std::ifstream file(filename, std::ifstream::binary | std::ifstream::in);
+    if (!file.is_open()) {
+        std::cout << "Could not open input file " << filename << '\n';
+        return false;
+    }
+
+    srt_startup();
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(options.srt_port);
+    inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+
+    // server needs a moment to start listening
+    SRTSOCKET sock = SRT_INVALID_SOCK;
+    for (int attempt = 0; attempt < 50; attempt++) {
+        sock = srt_create_socket();
+        if (srt_connect(sock, (struct sockaddr*)&sa, sizeof sa) != SRT_ERROR) {
+            break;
+        }
+
+        srt_close(sock);
+        sock = SRT_INVALID_SOCK;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    if (sock == SRT_INVALID_SOCK) {
+        std::cout << "Could not connect to srt_to_flv, reason: " << srt_getlasterror_str() << '\n';
+        srt_cleanup();
+        return false;
+    }
+
+    double bytes_per_us = options.srt_rate * 1000000.0 / 8 / 1000000.0;
+    int64_t start_time = av_gettime_relative();
+    int64_t sent = 0;
+    bool ok = true;
+
+    char msg[SrtMessageSize];
+    while (file.read(msg, sizeof msg) || file.gcount() > 0) {
+        int size = file.gcount();
+        if (srt_sendmsg(sock, msg, size, -1, 1) == SRT_ERROR) {
+            std::cout << "Failed to send to srt_to_flv, reason: " << srt_getlasterror_str() << '\n';
+            ok = false;
+            break;
+        }
+        sent += size;
+
+        int64_t ahead_us = int64_t(sent / bytes_per_us) - (av_gettime_relative() - start_time);
+        if (ahead_us > 1000) {
+            std::this_thread::sleep_for(std::chrono::microseconds(ahead_us));
+        }
+    }
+
+    // let receiver take the tail before connection goes down, srt_to_flv stops when it does
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    srt_close(sock);
+    srt_cleanup();
+
+    return ok;
+}
+
+bool write_results(const BenchOptions& options, const std::vector<BenchResult>& results) {
+    std::ofstream file(options.output.c_str(), std::ofstream::out | std::ofstream::trunc);
+    if (!file.is_open()) {
+        std::cout << "Could not open " << options.output << " for writing\n";
+        return false;
+    }
+
+    char host[256] = "unknown";
+    gethostname(host, sizeof host - 1);
+
+    file << "{\"host\":\"" << host << "\",\"time\":" << (long long)time(NULL)
+         << ",\"duration\":" << options.duration << ",\"runs\":" << options.runs << ",\"results\":[\n";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        char line[512];
+        snprintf(line, sizeof line,
+            "{\"mode\":\"%s\",\"input\":\"%s\",\"buffer\":%d,\"mb_per_s\":%.3f,\"packets_per_s\":%.1f,"
+            "\"wall_s\":%.4f,\"cpu_s\":%.4f,\"peak_rss_kb\":%lld,\"read_syscalls\":%lld,\"write_syscalls\":%lld",
+            r.mode.c_str(), r.input.c_str(), r.buffer, r.mb_per_s, r.packets_per_s, r.m.wall_s, r.m.cpu_s,
+            (long long)r.m.peak_rss_kb, (long long)r.m.read_syscalls, (long long)r.m.write_syscalls);
+        file << line;
+
+        // CPU of one audio stream, ms of audio thread time per second of audio
+        if (r.audio_streams > 0) {
+            snprintf(line, sizeof line, ",\"audio_streams\":%d,\"audio_ms_per_s\":%.3f", r.audio_streams, r.m.audio_ms_per_s);
+            file << line;
+        }
+
+        file << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    file << "]}\n";
+    file.close();
+
+    if (file.fail()) {
+        std::cout << "Failed to write " << options.output << '\n';
+        return false;
+    }
+
+    std::cout << "Results written to " << options.output << '\n';
+    return true;
+}
+
+// value of "name": in JSON line written by write_results(), not a JSON parser
+static std::string json_field(const std::string& line, const char* name) {
+    std::string key = std::string("\"") + name + "\":";
+    size_t pos = line.find(key);
+    if (pos == std::string::npos) {
+        return "";
+    }
+
+    pos += key.size();
+    if (line[pos] == '"') {
+        return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+    }
+
+    return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+bool compare_with_baseline(const BenchOptions& options, const std::vector<BenchResult>& results) {
+    std::ifstream file(options.baseline.c_str());
+    if (!file.is_open()) {
+        std::cout << "No baseline " << options.baseline << ", nothing to compare with\n";
+        return true;
+    }
+
+    // case key is mode/input/buffer, value is MB/s and CPU time, and audio cost of transcode
+    std::map<std::string, std::pair<double, double> > baseline;
+    std::map<std::string, double> audio_baseline;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.find("\"mode\":") == std::string::npos) {
+            continue;
+        }
+
+        std::string key = json_field(line, "mode") + "/" + json_field(line, "input") + "/" + json_field(line, "buffer");
+        baseline[key] = std::make_pair(atof(json_field(line, "mb_per_s").c_str()), atof(json_field(line, "cpu_s").c_str()));
+        audio_baseline[key] = atof(json_field(line, "audio_ms_per_s").c_str());
+    }
+
+    int regressions = 0;
+    printf("compared with %s, threshold %.1f%%\n", options.baseline.c_str(), options.threshold);
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        char key[256];
+        snprintf(key, sizeof key, "%s/%s/%d", r.mode.c_str(), r.input.c_str(), r.buffer);
+
+        std::map<std::string, std::pair<double, double> >::const_iterator it = baseline.find(key);
+        if (it == baseline.end() || it->second.first <= 0 || it->second.second <= 0) {
+            printf("  %-40s no baseline\n", key);
+            continue;
+        }
+
+        double speed_change = 100.0 * (r.mb_per_s - it->second.first) / it->second.first;
+        double cpu_change = 100.0 * (r.m.cpu_s - it->second.second) / it->second.second;
+        bool regression = speed_change < -options.threshold || cpu_change > options.threshold;
+
+        // one audio stream getting more expensive is a regression even when video hides it
+        std::string audio;
+        double audio_before = audio_baseline[key];
+        if (r.audio_streams > 0 && audio_before > 0) {
+            double audio_change = 100.0 * (r.m.audio_ms_per_s - audio_before) / audio_before;
+            regression = regression || audio_change > options.threshold;
+
+            char change[64];
+            snprintf(change, sizeof change, "  audio %+6.1f%%", audio_change);
+            audio = change;
+        }
+        regressions += regression;
+
+        printf("  %-40s MB/s %+6.1f%%  cpu %+6.1f%%%s%s\n", key, speed_change, cpu_change, audio.c_str(), regression ? "  REGRESSION" : "");
+    }
+
+    if (regressions > 0) {
+        printf("%d regressions\n", regressions);
+        return false;
+    }
+
+    return true;
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [options]\n"
+              << "Options:\n"
+              << "  -bin <dir>       example binaries and gen_media directory, default: .\n"
+              << "  -data <dir>      generated inputs and outputs directory, default: bench_data\n"
+              << "  -d <seconds>     generated inputs duration, default: 30\n"
+              << "  -runs <n>        runs per case, median is reported, default: 3\n"
+              << "  -buffers <list>  AVIOContext buffer sizes, comma separated, default: 4096,8192,65536\n"
+              << "  -modes <list>    examples to run, comma separated, default: remux,read_from_memory,write_to_memory,srt_to_flv,transcode\n"
+              << "  -baseline <file> results to compare with, default: no comparison\n"
+              << "  -threshold <pct> MB/s drop or CPU time growth counted as regression, default: 10\n"
+              << "  -o <file>        results file, default: bench_results.json\n"
+              << "  -port <n>        SRT port for srt_to_flv, default: 9000\n"
+              << "  -srt_rate <mbps> SRT send rate, default: 200\n";
+}
+
+static std::vector<std::string> split(const char* value) {
+    std::vector<std::string> items;
+    std::istringstream list(value);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+bool parse_options(int argc, char** argv, BenchOptions* options) {
+    for (int i = 1; i < argc; i += 2) {
+        const char* name = argv[i];
+
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            return false;
+        }
+
+        const char* value = argv[i + 1];
+
+        if (strcmp(name, "-bin") == 0) {
+            options->bin_dir = value;
+        } else if (strcmp(name, "-data") == 0) {
+            options->data_dir = value;
+        } else if (strcmp(name, "-d") == 0) {
+            options->duration = atof(value) > 0 ? atof(value) : options->duration;
+        } else if (strcmp(name, "-runs") == 0) {
+            options->runs = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(name, "-buffers") == 0) {
+            std::vector<std::string> items = split(value);
+            options->buffers.clear();
+            for (size_t j = 0; j < items.size(); j++) {
+                options->buffers.push_back(atoi(items[j].c_str()));
+            }
+        } else if (strcmp(name, "-modes") == 0) {
+            options->modes = split(value);
+        } else if (strcmp(name, "-baseline") == 0) {
+            options->baseline = value;
+        } else if (strcmp(name, "-threshold") == 0) {
+            options->threshold = atof(value);
+        } else if (strcmp(name, "-o") == 0) {
+            options->output = value;
+        } else if (strcmp(name, "-port") == 0) {
+            options->srt_port = atoi(value);
+        } else if (strcmp(name, "-srt_rate") == 0) {
+            options->srt_rate = atof(value) > 0 ? atof(value) : options->srt_rate;
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            return false;
+        }
+    }
+
+    return true;
+}
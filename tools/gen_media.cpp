@@ -0,0 +1,591 @@
+/*
+*
+* File: tools/gen_media.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* synthetic media generator.
+* encodes generated video (moving gradient, bouncing box and noise, so x264 has something to
+* work on) with x264 and generated audio (one tone per track) with fdk-aac, and writes them
+* to MPEG-TS, MP4 or FLV file. duration, size, frame rate, bitrate, GOP size, number of audio
+* tracks and timestamp discontinuities are all options, so benchmarks can make the inputs
+* they need on any machine instead of relying on test_x264.mp4 being around.
+*
+* output is deterministic: pictures and samples come from our own PRNG seeded with -seed,
+* x264 runs with fixed number of threads (x264 output depends on it) and muxer is bitexact,
+* same options give byte-identical files on every run and every host with the same libraries
+*
+* discontinuities: every -disc seconds timestamps of all streams jump forward by -jump ms,
+* the way they do in broadcast MPEG-TS when encoder restarts or splicer switches sources
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+    #include <libavutil/channel_layout.h>
+}
+
+#include "../helpers.hpp"
+#include "tool_helpers.hpp"
+
+struct GenOptions {
+    GenOptions();
+
+    std::string format_name;    // output container, empty - guessed from output filename
+    double duration;            // seconds
+    int width;
+    int height;
+    int fps;
+    int64_t video_bitrate;      // bits/s
+    int gop_size;               // keyframe interval in frames, 0 - 2 seconds worth of frames
+    std::string x264_preset;
+    int x264_threads;           // fixed, x264 output depends on number of threads
+    int audio_tracks;
+    int64_t audio_bitrate;      // bits/s, per track
+    double disc_interval;       // seconds between timestamp discontinuities, 0 - none
+    int64_t disc_jump_ms;       // how far timestamps jump forward on every discontinuity
+    uint64_t seed;
+};
+
+GenOptions::GenOptions() :
+    duration(10),
+    width(1280),
+    height(720),
+    fps(25),
+    video_bitrate(2000000),
+    gop_size(0),
+    x264_preset("veryfast"),
+    x264_threads(4),
+    audio_tracks(1),
+    audio_bitrate(128000),
+    disc_interval(0),
+    disc_jump_ms(10000),
+    seed(1)
+{
+}
+
+// one generated stream: encoder, its output stream and generator state
+struct GenStream {
+    GenStream();
+
+    AVCodecContext* encoder;
+    AVStream* stream;
+    AVFrame* frame;
+    int64_t next_pts;       // in encoder time base
+    Random random;
+    int box_x;              // video: bouncing box position and velocity
+    int box_y;
+    int box_dx;
+    int box_dy;
+    double tone;            // audio: tone frequency and phase
+    double phase;
+    uint64_t frames;
+};
+
+GenStream::GenStream() :
+    encoder(NULL),
+    stream(NULL),
+    frame(NULL),
+    next_pts(0),
+    box_x(0),
+    box_y(0),
+    box_dx(0),
+    box_dy(0),
+    tone(0),
+    phase(0),
+    frames(0)
+{
+}
+
+// functions predeclarations
+void print_usage(const char* name);
+bool parse_options(int argc, char** argv, GenOptions* options, int* first_arg);
+bool add_video_stream(AVFormatContext* output_ctx, const GenOptions& options, GenStream* gs);
+bool add_audio_stream(AVFormatContext* output_ctx, const GenOptions& options, int track, GenStream* gs);
+void fill_video_frame(GenStream* gs);
+void fill_audio_frame(GenStream* gs);
+bool encode(AVFormatContext* output_ctx, GenStream* gs, AVFrame* frame, const GenOptions& options, uint64_t* packets);
+void free_stream(GenStream* gs);
+
+int main(int argc, char** argv) {
+    GenOptions options;
+    int first_arg = 0;
+
+    if (!parse_options(argc, argv, &options, &first_arg) || argc - first_arg != 1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char* out_filename = argv[first_arg];
+    const char* format_name = options.format_name.empty() ? NULL : options.format_name.c_str();
+
+    AVFormatContext* output_ctx = NULL;
+    int ret = avformat_alloc_output_context2(&output_ctx, NULL, format_name, out_filename);
+    if (ret < 0 || !output_ctx) {
+        std::cout << "Could not create output context for " << out_filename << ", reason: " << av_err2str(ret) << '\n';
+        return EXIT_FAILURE;
+    }
+
+    // no library versions or creation times in the file, same options give the same bytes
+    output_ctx->flags |= AVFMT_FLAG_BITEXACT;
+
+    std::vector<GenStream> streams(1 + options.audio_tracks);
+    bool ok = add_video_stream(output_ctx, options, &streams[0]);
+    for (int i = 0; ok && i < options.audio_tracks; i++) {
+        ok = add_audio_stream(output_ctx, options, i, &streams[i + 1]);
+    }
+
+    if (ok) {
+        av_dump_format(output_ctx, 0, out_filename, 1);
+
+        if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
+            ret = avio_open(&output_ctx->pb, out_filename, AVIO_FLAG_WRITE);
+            if (ret < 0) {
+                std::cout << "Could not open output file " << out_filename << ", reason: " << av_err2str(ret) << '\n';
+                ok = false;
+            }
+        }
+    }
+
+    if (ok) {
+        ret = avformat_write_header(output_ctx, NULL);
+        if (ret < 0) {
+            std::cout << "Error occurred when writing header to output file, reason: " << av_err2str(ret) << '\n';
+            ok = false;
+        }
+    }
+
+    int64_t start_time = av_gettime_relative();
+    uint64_t packets = 0;
+
+    // streams are generated in presentation order: next frame always comes from the stream
+    // which is furthest behind, muxer gets nicely interleaved packets this way
+    while (ok) {
+        GenStream* next = NULL;
+        for (size_t i = 0; i < streams.size(); i++) {
+            GenStream* gs = &streams[i];
+            if (av_compare_ts(gs->next_pts, gs->encoder->time_base, int64_t(options.duration * 1000), av_make_q(1, 1000)) >= 0) {
+                continue; // this one is done
+            }
+
+            if (!next || av_compare_ts(gs->next_pts, gs->encoder->time_base, next->next_pts, next->encoder->time_base) < 0) {
+                next = gs;
+            }
+        }
+
+        if (!next) {
+            break;
+        }
+
+        ret = av_frame_make_writable(next->frame);
+        if (ret < 0) {
+            std::cout << "Could not make frame writable, reason: " << av_err2str(ret) << '\n';
+            ok = false;
+            break;
+        }
+
+        if (next->encoder->codec_type == AVMEDIA_TYPE_VIDEO) {
+            fill_video_frame(next);
+        } else {
+            fill_audio_frame(next);
+        }
+
+        ok = encode(output_ctx, next, next->frame, options, &packets);
+    }
+
+    // flush encoders, NULL frame tells encoder there's no more input
+    for (size_t i = 0; ok && i < streams.size(); i++) {
+        ok = encode(output_ctx, &streams[i], NULL, options, &packets);
+    }
+
+    if (ok) {
+        ret = av_write_trailer(output_ctx);
+        if (ret < 0) {
+            std::cout << "Failed to write trailer to output, reason: " << av_err2str(ret) << '\n';
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+        int64_t size = output_ctx->pb ? avio_size(output_ctx->pb) : 0;
+        printf("%s: %llu video frames, %d audio tracks, %llu packets, %lld bytes in %.1fs\n", out_filename,
+            (unsigned long long)streams[0].frames, options.audio_tracks, (unsigned long long)packets, (long long)size, elapsed);
+    }
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        free_stream(&streams[i]);
+    }
+
+    if (output_ctx->pb && !(output_ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&output_ctx->pb);
+    }
+    avformat_free_context(output_ctx);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool add_video_stream(AVFormatContext* output_ctx, const GenOptions& options, GenStream* gs) {
+    AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        std::cout << "Could not find libx264 encoder\n";
+        return false;
+    }
+
+    gs->encoder = avcodec_alloc_context3(codec);
+    if (!gs->encoder) {
+        std::cout << "Could not allocate encoder context\n";
+        return false;
+    }
+
+    AVCodecContext* enc = gs->encoder;
+    enc->width = options.width;
+    enc->height = options.height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = av_make_q(1, options.fps);
+    enc->framerate = av_make_q(options.fps, 1);
+    enc->flags |= AV_CODEC_FLAG_BITEXACT;
+
+    // fixed GOP: no scene cut keyframes, so keyframes are exactly where asked
+    enc->gop_size = options.gop_size > 0 ? options.gop_size : options.fps * 2;
+    enc->keyint_min = enc->gop_size;
+    av_opt_set(enc->priv_data, "x264-params", "scenecut=0", 0);
+
+    // constrained bitrate, so -b is what the file really has
+    enc->bit_rate = options.video_bitrate;
+    enc->rc_max_rate = options.video_bitrate;
+    enc->rc_buffer_size = options.video_bitrate * 2;
+
+    enc->thread_count = options.x264_threads;
+    av_opt_set(enc->priv_data, "preset", options.x264_preset.c_str(), 0);
+
+    if (output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    int ret = avcodec_open2(enc, codec, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open libx264 encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    gs->frame = av_frame_alloc();
+    if (!gs->frame) {
+        std::cout << "Could not allocate frame\n";
+        return false;
+    }
+
+    gs->frame->width = enc->width;
+    gs->frame->height = enc->height;
+    gs->frame->format = enc->pix_fmt;
+
+    ret = av_frame_get_buffer(gs->frame, 32);
+    if (ret < 0) {
+        std::cout << "Could not allocate frame buffer, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    gs->stream = avformat_new_stream(output_ctx, NULL);
+    if (!gs->stream) {
+        std::cout << "Failed allocating output stream\n";
+        return false;
+    }
+
+    ret = avcodec_parameters_from_context(gs->stream->codecpar, enc);
+    if (ret < 0) {
+        std::cout << "Failed to copy encoder parameters to output stream, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    gs->stream->time_base = enc->time_base;
+    gs->stream->avg_frame_rate = enc->framerate;
+
+    gs->random = Random(options.seed);
+    gs->box_x = gs->random.next() % (enc->width / 2);
+    gs->box_y = gs->random.next() % (enc->height / 2);
+    gs->box_dx = 2 + gs->random.next() % 8;
+    gs->box_dy = 2 + gs->random.next() % 8;
+
+    return true;
+}
+
+bool add_audio_stream(AVFormatContext* output_ctx, const GenOptions& options, int track, GenStream* gs) {
+    AVCodec* codec = avcodec_find_encoder_by_name("libfdk_aac");
+    if (!codec) {
+        std::cout << "Could not find libfdk_aac encoder\n";
+        return false;
+    }
+
+    gs->encoder = avcodec_alloc_context3(codec);
+    if (!gs->encoder) {
+        std::cout << "Could not allocate encoder context\n";
+        return false;
+    }
+
+    AVCodecContext* enc = gs->encoder;
+    enc->sample_rate = 48000;
+    enc->channel_layout = AV_CH_LAYOUT_STEREO;
+    enc->channels = 2;
+    enc->sample_fmt = AV_SAMPLE_FMT_S16;
+    enc->bit_rate = options.audio_bitrate;
+    enc->time_base = av_make_q(1, enc->sample_rate);
+    enc->flags |= AV_CODEC_FLAG_BITEXACT;
+
+    if (output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    int ret = avcodec_open2(enc, codec, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open libfdk_aac encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    gs->frame = av_frame_alloc();
+    if (!gs->frame) {
+        std::cout << "Could not allocate frame\n";
+        return false;
+    }
+
+    gs->frame->nb_samples = enc->frame_size;
+    gs->frame->format = enc->sample_fmt;
+    gs->frame->channel_layout = enc->channel_layout;
+    gs->frame->sample_rate = enc->sample_rate;
+
+    ret = av_frame_get_buffer(gs->frame, 0);
+    if (ret < 0) {
+        std::cout << "Could not allocate frame buffer, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    gs->stream = avformat_new_stream(output_ctx, NULL);
+    if (!gs->stream) {
+        std::cout << "Failed allocating output stream\n";
+        return false;
+    }
+
+    ret = avcodec_parameters_from_context(gs->stream->codecpar, enc);
+    if (ret < 0) {
+        std::cout << "Failed to copy encoder parameters to output stream, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    gs->stream->time_base = enc->time_base;
+
+    // every track sounds different, tracks are easy to tell apart when checking output
+    gs->random = Random(options.seed + track + 1);
+    gs->tone = 220.0 * (track + 1) + gs->random.next() % 100;
+
+    return true;
+}
+
+// diagonal gradient moving one way, bright box bouncing around and some noise on top
+void fill_video_frame(GenStream* gs) {
+    AVFrame* frame = gs->frame;
+    int n = gs->frames;
+    int box_w = frame->width / 8;
+    int box_h = frame->height / 8;
+
+    gs->box_x += gs->box_dx;
+    gs->box_y += gs->box_dy;
+    if (gs->box_x < 0 || gs->box_x + box_w > frame->width) {
+        gs->box_dx = -gs->box_dx;
+        gs->box_x += 2 * gs->box_dx;
+    }
+    if (gs->box_y < 0 || gs->box_y + box_h > frame->height) {
+        gs->box_dy = -gs->box_dy;
+        gs->box_y += 2 * gs->box_dy;
+    }
+
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t* row = frame->data[0] + y * frame->linesize[0];
+        bool box_row = y >= gs->box_y && y < gs->box_y + box_h;
+
+        for (int x = 0; x < frame->width; x++) {
+            int value = (x + 2 * y + 4 * n) & 0xff;
+            if (box_row && x >= gs->box_x && x < gs->box_x + box_w) {
+                value = 235;
+            }
+
+            value += int(gs->random.next() & 15) - 8;
+            row[x] = value < 16 ? 16 : (value > 235 ? 235 : value);
+        }
+    }
+
+    for (int y = 0; y < frame->height / 2; y++) {
+        uint8_t* u = frame->data[1] + y * frame->linesize[1];
+        uint8_t* v = frame->data[2] + y * frame->linesize[2];
+
+        for (int x = 0; x < frame->width / 2; x++) {
+            u[x] = 128 + ((x + n) & 63) - 32;
+            v[x] = 128 + ((y - n) & 63) - 32;
+        }
+    }
+
+    frame->pts = gs->next_pts;
+    gs->next_pts++;
+    gs->frames++;
+}
+
+// tone with a bit of noise, same samples in both channels
+void fill_audio_frame(GenStream* gs) {
+    AVFrame* frame = gs->frame;
+    int16_t* samples = (int16_t*)frame->data[0];
+    double step = 2 * M_PI * gs->tone / frame->sample_rate;
+
+    for (int i = 0; i < frame->nb_samples; i++) {
+        int value = int(sin(gs->phase) * 8000) + int(gs->random.next() & 255) - 128;
+        samples[2 * i] = value;
+        samples[2 * i + 1] = value;
+
+        gs->phase += step;
+        if (gs->phase > 2 * M_PI) {
+            gs->phase -= 2 * M_PI;
+        }
+    }
+
+    frame->pts = gs->next_pts;
+    gs->next_pts += frame->nb_samples;
+    gs->frames++;
+}
+
+// send frame to encoder (NULL flushes it) and write every packet it has ready
+bool encode(AVFormatContext* output_ctx, GenStream* gs, AVFrame* frame, const GenOptions& options, uint64_t* packets) {
+    int ret = avcodec_send_frame(gs->encoder, frame);
+    if (ret < 0) {
+        std::cout << "Failed to send frame to encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    while (1) {
+        ret = avcodec_receive_packet(gs->encoder, &packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+
+        if (ret < 0) {
+            std::cout << "Failed to encode frame, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        packet.stream_index = gs->stream->index;
+        av_packet_rescale_ts(&packet, gs->encoder->time_base, gs->stream->time_base);
+
+        // every stream jumps when its own packets cross discontinuity point. offset is chosen
+        // by dts, pts of the same packet moves by the same amount and dts stay increasing
+        if (options.disc_interval > 0 && packet.dts != AV_NOPTS_VALUE) {
+            int64_t count = int64_t(floor(packet.dts * av_q2d(gs->stream->time_base) / options.disc_interval));
+            if (count > 0) {
+                int64_t offset = av_rescale_q(count * options.disc_jump_ms, av_make_q(1, 1000), gs->stream->time_base);
+                packet.dts += offset;
+                if (packet.pts != AV_NOPTS_VALUE) {
+                    packet.pts += offset;
+                }
+            }
+        }
+
+        // https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga37352ed2c63493c38219d935e71db6c1
+        ret = av_interleaved_write_frame(output_ctx, &packet);
+        av_packet_unref(&packet);
+
+        if (ret < 0) {
+            std::cout << "Error muxing packet, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        (*packets)++;
+    }
+}
+
+void free_stream(GenStream* gs) {
+    avcodec_free_context(&gs->encoder);
+    av_frame_free(&gs->frame);
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [options] <output file>\n"
+              << "Options:\n"
+              << "  -f <format>      container: mpegts, mp4, flv, default: guessed from output file name\n"
+              << "  -d <seconds>     duration, default: 10\n"
+              << "  -s <WxH>         video size, default: 1280x720\n"
+              << "  -r <fps>         frame rate, default: 25\n"
+              << "  -b <bitrate>     video bitrate in kbit/s, default: 2000\n"
+              << "  -g <frames>      keyframe interval, default: 2 seconds\n"
+              << "  -preset <name>   x264 preset, default: veryfast\n"
+              << "  -t <n>           x264 threads, output depends on it, default: 4\n"
+              << "  -a <n>           audio tracks, 0 for none, default: 1\n"
+              << "  -ab <bitrate>    audio bitrate per track in kbit/s, default: 128\n"
+              << "  -disc <seconds>  timestamp discontinuity every that many seconds, default: none\n"
+              << "  -jump <ms>       how far timestamps jump forward on discontinuity, default: 10000\n"
+              << "  -seed <n>        seed for generated pictures and sound, default: 1\n";
+}
+
+bool parse_options(int argc, char** argv, GenOptions* options, int* first_arg) {
+    int i = 1;
+
+    // options go first, everything after them is positional arguments
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        const char* name = argv[i];
+
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            return false;
+        }
+
+        const char* value = argv[i + 1];
+
+        if (strcmp(name, "-f") == 0) {
+            options->format_name = value;
+        } else if (strcmp(name, "-d") == 0) {
+            options->duration = atof(value);
+        } else if (strcmp(name, "-s") == 0) {
+            if (sscanf(value, "%dx%d", &options->width, &options->height) != 2 || options->width < 16 || options->height < 16) {
+                std::cout << "Invalid size " << value << '\n';
+                return false;
+            }
+        } else if (strcmp(name, "-r") == 0) {
+            options->fps = atoi(value) > 0 ? atoi(value) : 25;
+        } else if (strcmp(name, "-b") == 0) {
+            options->video_bitrate = atoll(value) * 1000;
+        } else if (strcmp(name, "-g") == 0) {
+            options->gop_size = atoi(value);
+        } else if (strcmp(name, "-preset") == 0) {
+            options->x264_preset = value;
+        } else if (strcmp(name, "-t") == 0) {
+            options->x264_threads = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(name, "-a") == 0) {
+            options->audio_tracks = atoi(value) > 0 ? atoi(value) : 0;
+        } else if (strcmp(name, "-ab") == 0) {
+            options->audio_bitrate = atoll(value) * 1000;
+        } else if (strcmp(name, "-disc") == 0) {
+            options->disc_interval = atof(value);
+        } else if (strcmp(name, "-jump") == 0) {
+            options->disc_jump_ms = atoll(value);
+        } else if (strcmp(name, "-seed") == 0) {
+            options->seed = strtoull(value, NULL, 10);
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            return false;
+        }
+    }
+
+    *first_arg = i;
+    return true;
+}
@@ -0,0 +1,448 @@
+/*
+*
+* File: tools/srt_loadgen.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* SRT load generator for multi-stream ingest benchmarking.
+* opens up to -n SRT caller connections to srt_to_flv (or any other SRT listener), every one
+* with its own stream id ("loadgen-<n>"), and sends the same MPEG-TS file over all of them,
+* paced at real time (or -speed times that). streams are added one by one, every -step seconds,
+* so server load grows in steps and it's easy to see at which step it gave up.
+*
+* real encoders and network don't deliver smooth streams: with -burst, data is sent in bursts,
+* everything due for -burst milliseconds at once, and -jitter varies burst intervals randomly
+* (seeded, same -seed gives the same bursts on every run).
+*
+* every second sender side SRT stats of all streams are checked: packets receiver reported lost
+* or sender had to drop (too late to be played) mean server didn't keep up. server which stops
+* reading its sockets (srt_to_flv does that when ring buffer is full and remuxing can't keep up)
+* makes SRT flow control hold data in sender buffer, more than -backlog milliseconds of it is
+* counted as a stall. capacity is the last number of concurrent streams that ran a full step
+* without loss or stalls.
+*
+* file is sent once, it's not looped, make it long enough with gen_media:
+*   ./gen_media -f mpegts -d 120 -a 1 load.ts
+*   ./srt_to_flv 127.0.0.1 9000 out.flv 8192 8 &
+*   ./srt_loadgen -n 8 -step 10 127.0.0.1 9000 load.ts
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavutil/time.h>
+}
+
+#include <srt/srt.h>
+
+#include "../helpers.hpp"
+#include "tool_helpers.hpp"
+
+struct LoadOptions {
+    LoadOptions();
+
+    int streams;                // streams at the end of ramp
+    int start_streams;          // streams started at once
+    double step;                // seconds between adding streams
+    double speed;               // send rate, multiple of real time
+    int burst_ms;               // send window, 0 - smooth pacing
+    double jitter;              // burst interval variation, percent
+    int latency_ms;             // SRT latency
+    int64_t loss_limit;         // lost and dropped packets per stream tolerated
+    int backlog_ms;             // data in sender buffer counted as stall
+    uint64_t seed;
+};
+
+LoadOptions::LoadOptions() :
+    streams(8),
+    start_streams(1),
+    step(10),
+    speed(1),
+    burst_ms(0),
+    jitter(0),
+    latency_ms(120),
+    loss_limit(0),
+    backlog_ms(1000),
+    seed(1)
+{
+}
+
+// one SRT caller connection, sender thread writes, monitor reads
+struct LoadStream {
+    LoadStream() : socket(SRT_INVALID_SOCK), sent(0), done(false), closed(false),
+        lost(0), dropped(0), retransmitted(0), max_backlog_ms(0), failed(false) {}
+
+    std::string stream_id;
+    SRTSOCKET socket;
+    std::thread thread;
+    std::atomic<int64_t> sent;          // bytes
+    std::atomic<bool> done;             // whole file sent or connection gone
+    std::atomic<bool> closed;           // connection closed by server
+
+    // monitor side
+    int64_t lost;
+    int64_t dropped;
+    int64_t retransmitted;
+    int max_backlog_ms;
+    bool failed;
+};
+
+// functions predeclarations
+void print_usage(const char* name);
+bool parse_options(int argc, char** argv, LoadOptions* options, int* first_arg);
+bool load_file(const char* filename, std::vector<char>* data);
+double file_duration(const char* filename);
+SRTSOCKET connect_stream(const LoadOptions& options, const char* host, const char* port, const std::string& stream_id);
+void send_stream(const LoadOptions& options, const std::vector<char>* data, double bytes_per_us, Random random, LoadStream* stream);
+
+int main(int argc, char** argv) {
+    LoadOptions options;
+    int first_arg = 0;
+
+    if (!parse_options(argc, argv, &options, &first_arg) || argc - first_arg != 3) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char* host = argv[first_arg];
+    const char* port = argv[first_arg + 1];
+    const char* in_filename = argv[first_arg + 2];
+
+    // file is read once and shared by all streams, disk must not be what limits the load
+    std::vector<char> data;
+    if (!load_file(in_filename, &data)) {
+        return EXIT_FAILURE;
+    }
+
+    double duration = file_duration(in_filename);
+    if (duration <= 0) {
+        std::cout << "Could not find out duration of " << in_filename << '\n';
+        return EXIT_FAILURE;
+    }
+
+    double bytes_per_us = data.size() / (duration * 1000000.0) * options.speed;
+    printf("%s: %.1f MB, %.1f s, %.2f Mbit/s per stream\n", in_filename, data.size() / 1000000.0,
+        duration, bytes_per_us * 8);
+
+    signal(SIGPIPE, SIG_IGN);
+    srt_startup();
+
+    std::vector<LoadStream*> streams;
+    for (int i = 0; i < options.streams; i++) {
+        streams.push_back(new LoadStream());
+        streams[i]->stream_id = "loadgen-" + std::to_string(i);
+    }
+
+    int64_t start_time = av_gettime_relative();
+    int64_t step_us = int64_t(options.step * 1000000);
+    int started = 0;
+    int sustained = 0;          // streams which ran a full step without trouble
+    int failed_at = 0;          // streams running when trouble started, 0 - no trouble
+
+    for (int64_t second = 1; ; second++) {
+        // ramp: -start streams at once, then one more every -step seconds
+        int due = options.start_streams + int((av_gettime_relative() - start_time) / step_us);
+        due = std::min(due, options.streams);
+
+        if (due > started) {
+            // whole step passed with this many streams and nothing went wrong
+            if (started > 0 && failed_at == 0) {
+                sustained = started;
+            }
+
+            for (; started < due; started++) {
+                LoadStream* stream = streams[started];
+                stream->socket = connect_stream(options, host, port, stream->stream_id);
+                if (stream->socket == SRT_INVALID_SOCK) {
+                    stream->done = true;
+                    stream->failed = true;
+                    if (failed_at == 0) {
+                        failed_at = started + 1;
+                    }
+                    continue;
+                }
+
+                Random random(options.seed + started);
+                stream->thread = std::thread(send_stream, std::cref(options), &data, bytes_per_us, random, stream);
+            }
+        }
+
+        // wait till next second
+        int64_t next_time = start_time + second * 1000000;
+        int64_t now = av_gettime_relative();
+        if (next_time > now) {
+            std::this_thread::sleep_for(std::chrono::microseconds(next_time - now));
+        }
+
+        int running = 0;
+        int64_t sent = 0;
+        int64_t lost = 0;
+        int64_t dropped = 0;
+        int64_t retransmitted = 0;
+        int max_backlog_ms = 0;
+
+        for (int i = 0; i < started; i++) {
+            LoadStream* stream = streams[i];
+            sent += stream->sent.load();
+
+            if (stream->done.load()) {
+                continue;
+            }
+            running++;
+
+            SRT_TRACEBSTATS perf;
+            memset(&perf, 0, sizeof perf);
+            if (srt_bstats(stream->socket, &perf, 0) == SRT_ERROR) {
+                continue;
+            }
+
+            stream->lost = perf.pktSndLossTotal;
+            stream->dropped = perf.pktSndDropTotal;
+            stream->retransmitted = perf.pktRetransTotal;
+            stream->max_backlog_ms = std::max(stream->max_backlog_ms, perf.msSndBuf);
+
+            lost += stream->lost;
+            dropped += stream->dropped;
+            retransmitted += stream->retransmitted;
+            max_backlog_ms = std::max(max_backlog_ms, perf.msSndBuf);
+
+            if (!stream->failed && (stream->lost + stream->dropped > options.loss_limit || perf.msSndBuf > options.backlog_ms)) {
+                stream->failed = true;
+                printf("%s: %s at %d streams (lost %lld, dropped %lld, send buffer %d ms)\n",
+                    stream->stream_id.c_str(), perf.msSndBuf > options.backlog_ms ? "stalled" : "losing packets",
+                    started, (long long)stream->lost, (long long)stream->dropped, perf.msSndBuf);
+
+                if (failed_at == 0) {
+                    failed_at = started;
+                }
+            }
+        }
+
+        printf("%4llds  streams %3d  sent %8.1f MB  lost %6lld  dropped %6lld  retransmitted %6lld  send buffer %5d ms\n",
+            (long long)second, running, sent / 1000000.0, (long long)lost, (long long)dropped,
+            (long long)retransmitted, max_backlog_ms);
+        fflush(stdout);
+
+        // keep ramping even after trouble: server waits for all its clients before it exits
+        if (started == options.streams && running == 0) {
+            break;
+        }
+    }
+
+    if (failed_at == 0) {
+        sustained = started;
+    }
+
+    std::cout << "------------------------------------------------------------------------\n";
+    for (int i = 0; i < started; i++) {
+        LoadStream* stream = streams[i];
+        if (stream->thread.joinable()) {
+            stream->thread.join();
+        }
+
+        printf("%-12s sent %8.1f MB  lost %6lld  dropped %6lld  retransmitted %6lld  max send buffer %5d ms%s\n",
+            stream->stream_id.c_str(), stream->sent.load() / 1000000.0, (long long)stream->lost,
+            (long long)stream->dropped, (long long)stream->retransmitted, stream->max_backlog_ms,
+            stream->closed.load() ? "  closed by server" : "");
+    }
+
+    if (failed_at > 0) {
+        printf("Trouble started at %d concurrent streams, sustained: %d\n", failed_at, sustained);
+    } else {
+        printf("Sustained all %d concurrent streams\n", sustained);
+    }
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        delete streams[i];
+    }
+
+    srt_cleanup();
+
+    return EXIT_SUCCESS;
+}
+
+bool load_file(const char* filename, std::vector<char>* data) {
+    std::ifstream file(filename, std::ifstream::binary | std::ifstream::in);
+    if (!file.is_open()) {
+        std::cout << "Could not open input file " << filename << '\n';
+        return false;
+    }
+
+    file.seekg(0, std::ios::end);
+    data->resize(file.tellg());
+    file.seekg(0, std::ios::beg);
+
+    if (data->empty() || !file.read(&(*data)[0], data->size())) {
+        std::cout << "Could not read input file " << filename << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+// duration from libavformat, bytes / duration is the rate stream has to be sent at to be real time
+double file_duration(const char* filename) {
+    AVFormatContext* input_ctx = NULL;
+    int ret = avformat_open_input(&input_ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open input file " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return 0;
+    }
+
+    double duration = 0;
+    if (avformat_find_stream_info(input_ctx, NULL) >= 0 && input_ctx->duration > 0) {
+        duration = input_ctx->duration / double(AV_TIME_BASE);
+    }
+
+    avformat_close_input(&input_ctx);
+    return duration;
+}
+
+SRTSOCKET connect_stream(const LoadOptions& options, const char* host, const char* port, const std::string& stream_id) {
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(atoi(port));
+    if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+        std::cout << "Invalid host " << host << '\n';
+        return SRT_INVALID_SOCK;
+    }
+
+    SRTSOCKET sock = srt_create_socket();
+    if (sock == SRT_INVALID_SOCK) {
+        std::cout << "Could not create SRT socket, reason: " << srt_getlasterror_str() << '\n';
+        return SRT_INVALID_SOCK;
+    }
+
+    // stream id and latency go to server in handshake, they must be set before connecting
+    srt_setsockflag(sock, SRTO_STREAMID, stream_id.c_str(), stream_id.size());
+    srt_setsockflag(sock, SRTO_LATENCY, &options.latency_ms, sizeof options.latency_ms);
+
+    if (srt_connect(sock, (struct sockaddr*)&sa, sizeof sa) == SRT_ERROR) {
+        std::cout << stream_id << ": could not connect, reason: " << srt_getlasterror_str() << '\n';
+        srt_close(sock);
+        return SRT_INVALID_SOCK;
+    }
+
+    return sock;
+}
+
+// sends the whole file once. every burst sends everything that is due by its time, without
+// -burst bursts are 1ms apart, which is as smooth as sleeping gets
+void send_stream(const LoadOptions& options, const std::vector<char>* data, double bytes_per_us, Random random, LoadStream* stream) {
+    int64_t interval_us = options.burst_ms > 0 ? options.burst_ms * 1000 : 1000;
+    int64_t start_time = av_gettime_relative();
+    int64_t burst_time = 0;
+    size_t offset = 0;
+
+    while (offset < data->size()) {
+        int64_t now = av_gettime_relative() - start_time;
+        if (burst_time > now) {
+            std::this_thread::sleep_for(std::chrono::microseconds(burst_time - now));
+        }
+
+        // burst interval +- jitter percent
+        double variation = options.jitter / 100.0 * (random.next() / 2147483647.5 - 1.0);
+        int64_t interval = std::max(int64_t(1000), int64_t(interval_us * (1.0 + variation)));
+
+        // everything due till next burst goes at once
+        size_t due = std::min(data->size(), size_t((burst_time + interval) * bytes_per_us));
+        while (offset < due) {
+            int size = std::min(data->size() - offset, size_t(SrtMessageSize));
+            if (srt_sendmsg(stream->socket, &(*data)[offset], size, -1, 1) == SRT_ERROR) {
+                // srt_to_flv closes connection when it has had enough
+                stream->closed = true;
+                break;
+            }
+            offset += size;
+            stream->sent += size;
+        }
+
+        if (stream->closed.load()) {
+            break;
+        }
+
+        burst_time += interval;
+    }
+
+    // let receiver take the tail before connection goes down
+    if (!stream->closed.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    stream->done = true;
+    srt_close(stream->socket);
+}
+
+void print_usage(const char* name) {
+    std::cout << "Usage: " << name << " [options] <host> <port> <ts file>\n"
+              << "Options:\n"
+              << "  -n <streams>     concurrent streams at the end of ramp, default: 8\n"
+              << "  -start <n>       streams started at once, default: 1\n"
+              << "  -step <seconds>  time between adding streams, default: 10\n"
+              << "  -speed <x>       send rate, multiple of real time, default: 1\n"
+              << "  -burst <ms>      send data in bursts this far apart, default: smooth\n"
+              << "  -jitter <pct>    random variation of burst intervals, default: 0\n"
+              << "  -latency <ms>    SRT latency, default: 120\n"
+              << "  -loss <packets>  lost and dropped packets per stream tolerated, default: 0\n"
+              << "  -backlog <ms>    data in sender buffer counted as stall, default: 1000\n"
+              << "  -seed <n>        seed for burst jitter, default: 1\n";
+}
+
+bool parse_options(int argc, char** argv, LoadOptions* options, int* first_arg) {
+    int i = 1;
+
+    // options go first, everything after them is positional arguments
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        const char* name = argv[i];
+
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for option " << name << '\n';
+            return false;
+        }
+
+        const char* value = argv[i + 1];
+
+        if (strcmp(name, "-n") == 0) {
+            options->streams = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(name, "-start") == 0) {
+            options->start_streams = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(name, "-step") == 0) {
+            options->step = atof(value) > 0 ? atof(value) : 10;
+        } else if (strcmp(name, "-speed") == 0) {
+            options->speed = atof(value) > 0 ? atof(value) : 1;
+        } else if (strcmp(name, "-burst") == 0) {
+            options->burst_ms = atoi(value) > 0 ? atoi(value) : 0;
+        } else if (strcmp(name, "-jitter") == 0) {
+            options->jitter = std::min(std::max(atof(value), 0.0), 100.0);
+        } else if (strcmp(name, "-latency") == 0) {
+            options->latency_ms = atoi(value) > 0 ? atoi(value) : 120;
+        } else if (strcmp(name, "-loss") == 0) {
+            options->loss_limit = atoll(value);
+        } else if (strcmp(name, "-backlog") == 0) {
+            options->backlog_ms = atoi(value) > 0 ? atoi(value) : 1000;
+        } else if (strcmp(name, "-seed") == 0) {
+            options->seed = strtoull(value, NULL, 10);
+        } else {
+            std::cout << "Unknown option " << name << '\n';
+            return false;
+        }
+    }
+
+    *first_arg = i;
+    return true;
+}
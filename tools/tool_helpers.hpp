@@ -0,0 +1,37 @@
+/*
+* File: tools/tool_helpers.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* what gen_media, bench_runner and srt_loadgen share
+*
+*/
+
+#ifndef tool_helpers_hpp
+#define tool_helpers_hpp
+
+#include <stdint.h>
+
+// MPEG-TS packets in one SRT message, 7 * 188 is what every SRT sender uses
+const int SrtMessageSize = 1316;
+
+// xorshift64*, same seed gives the same sequence on every host, unlike rand()
+struct Random {
+    Random(uint64_t seed = 1) : state(seed ^ 0x9e3779b97f4a7c15ULL) {
+        if (state == 0) {
+            state = 1;
+        }
+    }
+
+    uint32_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (state * 2685821657736338717ULL) >> 32;
+    }
+
+    uint64_t state;
+};
+
+#endif /* tool_helpers_hpp */
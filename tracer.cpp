@@ -0,0 +1,231 @@
+/*
+* File: tracer.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* hot path tracing, see tracer.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#include "tracer.hpp"
+#include "logger.hpp"
+
+struct TraceEvent {
+    const char* name;
+    int64_t start_us;
+    int64_t duration_us;
+};
+
+// written by its thread only, buffers are never freed: threads may be gone before trace is dumped
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> written;
+    int tid;
+    std::string name;               // under s_mutex
+};
+
+std::atomic<bool> Tracer::s_enabled(false);
+
+static std::mutex s_mutex;
+static std::vector<TraceBuffer*> s_buffers;
+static size_t s_events_per_thread = 65536;
+static thread_local TraceBuffer* t_buffer = NULL;
+
+// thread waiting for dump signal, stopped and joined when statics are destroyed at exit
+struct SignalDumper {
+    SignalDumper() : signum(0), stopping(false) {}
+
+    ~SignalDumper() {
+        if (!thread.joinable()) {
+            return;
+        }
+
+        stopping.store(true);
+        pthread_kill(thread.native_handle(), signum);
+        thread.join();
+    }
+
+    std::thread thread;
+    int signum;
+    std::atomic<bool> stopping;
+};
+
+static SignalDumper s_dumper;
+
+static TraceBuffer* thread_buffer() {
+    if (t_buffer) {
+        return t_buffer;
+    }
+
+    TraceBuffer* buffer = new TraceBuffer();
+    buffer->events.resize(s_events_per_thread);
+    buffer->written.store(0);
+    buffer->tid = int(syscall(SYS_gettid));
+
+    std::lock_guard<std::mutex> lk(s_mutex);
+    s_buffers.push_back(buffer);
+    t_buffer = buffer;
+
+    return buffer;
+}
+
+void Tracer::enable(size_t events_per_thread) {
+    s_events_per_thread = events_per_thread > 0 ? events_per_thread : 1;
+    s_enabled.store(true);
+}
+
+void Tracer::set_thread_name(const char* name) {
+    if (!enabled()) {
+        return;
+    }
+
+    TraceBuffer* buffer = thread_buffer();
+
+    std::lock_guard<std::mutex> lk(s_mutex);
+    buffer->name = name;
+}
+
+void Tracer::add(const char* name, int64_t start_us, int64_t end_us) {
+    TraceBuffer* buffer = thread_buffer();
+
+    uint64_t n = buffer->written.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[n % buffer->events.size()];
+    event.name = name;
+    event.start_us = start_us;
+    event.duration_us = end_us - start_us;
+
+    buffer->written.store(n + 1, std::memory_order_release);
+}
+
+int64_t Tracer::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// last count events of buffer, oldest first. owner thread may go on writing while they're
+// copied, it overwrites slot of the oldest event before counter tells: events in slots the
+// owner could have reached by the end of copy are left out
+static void copy_events(const TraceBuffer* buffer, uint64_t count, std::vector<TraceEvent>* events) {
+    uint64_t capacity = buffer->events.size();
+    uint64_t written = buffer->written.load(std::memory_order_acquire);
+    uint64_t first = written > std::min(capacity, count) ? written - std::min(capacity, count) : 0;
+
+    events->clear();
+    for (uint64_t n = first; n < written; n++) {
+        events->push_back(buffer->events[n % capacity]);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t now_written = buffer->written.load(std::memory_order_relaxed);
+    uint64_t safe = now_written >= capacity ? now_written - capacity + 1 : 0;
+    if (first < safe) {
+        events->erase(events->begin(), events->begin() + std::min<uint64_t>(safe - first, events->size()));
+    }
+}
+
+bool Tracer::dump(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        Logger::log(LogError, "Could not open trace file %s for writing", filename);
+        return false;
+    }
+
+    int pid = getpid();
+    bool first = true;
+    std::vector<TraceEvent> events;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    std::lock_guard<std::mutex> lk(s_mutex);
+    for (size_t i = 0; i < s_buffers.size(); i++) {
+        TraceBuffer* buffer = s_buffers[i];
+
+        if (!buffer->name.empty()) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, buffer->tid, buffer->name.c_str());
+            first = false;
+        }
+
+        copy_events(buffer, buffer->events.size(), &events);
+        for (size_t n = 0; n < events.size(); n++) {
+            const TraceEvent& event = events[n];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+                first ? "" : ",\n", event.name, pid, buffer->tid, (long long)event.start_us, (long long)event.duration_us);
+            first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0) {
+        Logger::log(LogError, "Failed to write trace file %s", filename);
+        return false;
+    }
+
+    return true;
+}
+
+void Tracer::print_recent(std::string* out, const std::string& thread_name, size_t count, const char* indent) {
+    int64_t now = now_us();
+    std::vector<TraceEvent> events;
+
+    std::lock_guard<std::mutex> lk(s_mutex);
+    for (size_t i = 0; i < s_buffers.size(); i++) {
+        TraceBuffer* buffer = s_buffers[i];
+        if (buffer->name != thread_name) {
+            continue;
+        }
+
+        copy_events(buffer, count, &events);
+        for (size_t n = 0; n < events.size(); n++) {
+            const TraceEvent& event = events[n];
+
+            char line[256];
+            snprintf(line, sizeof line, "%s%s: %lld us, ended %lld ms ago\n", indent, event.name,
+                (long long)event.duration_us, (long long)(now - event.start_us - event.duration_us) / 1000);
+            *out += line;
+        }
+    }
+}
+
+// signal is never delivered to a handler: it's blocked everywhere and taken by sigwait(), so the
+// trace is written on an ordinary thread. the same signal sent to that thread stops it
+void Tracer::dump_on_signal(int signum, const char* filename) {
+    if (s_dumper.thread.joinable()) {
+        return;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signum);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    std::string name = filename;
+    s_dumper.signum = signum;
+    s_dumper.thread = std::thread([set, name]() {
+        while (true) {
+            int received;
+            if (sigwait(&set, &received) != 0 || s_dumper.stopping.load()) {
+                break;
+            }
+
+            if (dump(name.c_str())) {
+                Logger::log(LogInfo, "Trace written to %s", name.c_str());
+            }
+        }
+    });
+}
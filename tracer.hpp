@@ -0,0 +1,64 @@
+/*
+* File: tracer.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* hot path tracing, Chrome trace JSON export (chrome://tracing, ui.perfetto.dev).
+* TraceScope measures the scope it's declared in. every thread writes its events to its own
+* fixed size buffer without locks, oldest events are overwritten. tracing is always compiled
+* in, while it's not enabled TraceScope costs one relaxed atomic load. trace is written on
+* demand (signal) or whenever dump() is called, e.g. at exit. errors and dumps are reported
+* through Logger
+*
+*/
+
+#ifndef tracer_hpp
+#define tracer_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <atomic>
+
+class Tracer {
+public:
+    static void enable(size_t events_per_thread);   // before traced threads start
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    static void set_thread_name(const char* name);  // calling thread track name in trace viewer
+    static void add(const char* name, int64_t start_us, int64_t end_us);   // name must outlive tracer
+    static int64_t now_us();                        // monotonic clock
+
+    // oldest events of threads still running are left out, they may be overwritten while
+    // being read. dump when threads are done for exact trace
+    static bool dump(const char* filename);
+
+    // signal is blocked and waited for by a background thread, which is stopped at exit. call
+    // before any other thread starts, threads inherit the blocked signal
+    static void dump_on_signal(int signum, const char* filename);
+
+    // last events of named thread, newest last, for diagnostics. scope which hasn't ended yet
+    // isn't an event yet, so what's stuck shows in stack rather than here
+    static void print_recent(std::string* out, const std::string& thread_name, size_t count, const char* indent);
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+class TraceScope {
+public:
+    TraceScope(const char* name) : m_name(name), m_start(Tracer::enabled() ? Tracer::now_us() : -1) {}
+
+    ~TraceScope() {
+        if (m_start >= 0) {
+            Tracer::add(m_name, m_start, Tracer::now_us());
+        }
+    }
+
+private:
+    const char* m_name;
+    int64_t m_start;
+};
+
+#endif /* tracer_hpp */
@@ -0,0 +1,1560 @@
+/*
+* File: transcoder.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* multi-threaded transcoding engine, see transcoder.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <chrono>
+#include <functional>
+
+extern "C" {
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+    #include <libavutil/channel_layout.h>
+}
+
+#include "helpers.hpp"
+#include "transcoder.hpp"
+#include "slice_scaler.hpp"
+
+// decoded samples go through resampler in batches of this size, ~85 ms at 48 kHz
+const int AudioBatchSamples = 4096;
+
+// room for one more decoded frame on top of a batch, and for resampler delay in batch output
+const int AudioBatchSlack = 4096;
+
+RenditionOptions::RenditionOptions() :
+    width(0),
+    height(0),
+    video_bitrate(0)
+{
+}
+
+TranscodeOptions::TranscodeOptions() :
+    format_name("flv"),
+    width(0),
+    height(0),
+    video_bitrate(0),
+    crf(23),
+    x264_preset("veryfast"),
+    autotune(false),
+    autotune_headroom(1.2),
+    gop_size(0),
+    align_keyframes(false),
+    auto_passthrough(false),
+    transcode_audio(false),
+    audio_sample_rate(48000),
+    audio_channels(2),
+    audio_bitrate(128000),
+    decode_threads(0),
+    scale_threads(2),
+    slice_threads(1),
+    scaler("bicubic"),
+    encode_threads(0),
+    queue_size(8),
+    stats_interval_ms(1000)
+{
+}
+
+StageStats::StageStats() :
+    frames(0), busy_us(0), threads(1)
+{
+}
+
+AudioTranscode::AudioTranscode() :
+    in_stream(-1),
+    decoder(NULL),
+    encoder(NULL),
+    swr_ctx(NULL),
+    in_fifo(NULL),
+    fifo(NULL),
+    in_samples(NULL),
+    out_samples(NULL),
+    out_capacity(0),
+    frame(NULL),
+    next_pts(AV_NOPTS_VALUE),
+    encoded_samples(0)
+{
+}
+
+AudioTranscode::~AudioTranscode() {
+    avcodec_free_context(&decoder);
+    avcodec_free_context(&encoder);
+    swr_free(&swr_ctx);
+    av_frame_free(&frame);
+
+    if (in_fifo) {
+        av_audio_fifo_free(in_fifo);
+    }
+
+    if (fifo) {
+        av_audio_fifo_free(fifo);
+    }
+
+    if (in_samples) {
+        av_freep(&in_samples[0]);
+        av_freep(&in_samples);
+    }
+
+    if (out_samples) {
+        av_freep(&out_samples[0]);
+        av_freep(&out_samples);
+    }
+}
+
+Rendition::Rendition(const RenditionOptions& options, size_t queue_size, int scale_threads, int slice_threads) :
+    options(options),
+    output_ctx(NULL),
+    encoder(NULL),
+    streams_map(NULL),
+    out_video_stream(-1),
+    encode_threads(0),
+    tuner(NULL),
+    new_extradata(false),
+    last_dts(AV_NOPTS_VALUE),
+    encoder_budget(0),
+    decoded(queue_size),
+    scaled(queue_size),
+    scale_pool(scale_threads),
+    encode_pool(1),
+    scale_workers_left(0)
+{
+    scale_stats.threads = scale_pool.size() * (slice_threads > 1 ? slice_threads : 1);
+}
+
+Rendition::~Rendition() {
+    avcodec_free_context(&encoder);
+    delete tuner;
+
+    if (output_ctx) {
+        if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&output_ctx->pb);
+        }
+
+        avformat_free_context(output_ctx);
+    }
+
+    av_freep(&streams_map);
+}
+
+Transcoder::Transcoder(const TranscodeOptions& options, CoreScheduler* scheduler) :
+    m_options(options),
+    m_input_ctx(NULL),
+    m_decoder(NULL),
+    m_video_stream(-1),
+    m_transcode_video(true),
+    m_gop_size(0),
+    m_scale_flags(SWS_BICUBIC),
+    m_width(0),
+    m_height(0),
+    m_sample_aspect_ratio(av_make_q(0, 1)),
+    m_packets(options.queue_size),
+    m_decode_pool(1),
+    m_audio_packets(options.queue_size),
+    m_audio_pool(1),
+    m_start_time(0),
+    m_scheduler(scheduler),
+    m_session(-1),
+    m_weight(1),
+    m_decoder_budget(0),
+    m_failed(false),
+    m_stats_stop(false)
+{
+}
+
+Transcoder::~Transcoder() {
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        delete m_renditions[i];
+    }
+
+    for (size_t i = 0; i < m_audio_transcodes.size(); i++) {
+        delete m_audio_transcodes[i];
+    }
+
+    avcodec_free_context(&m_decoder);
+
+    if (m_input_ctx) {
+        avformat_close_input(&m_input_ctx);
+    }
+
+    // session cores go to the sessions still running
+    if (m_session >= 0) {
+        m_scheduler->remove_session(m_session);
+    }
+}
+
+AVFormatContext* Transcoder::input_ctx() const {
+    return m_input_ctx;
+}
+
+bool Transcoder::open(const char* in_filename, const char* out_filename) {
+    RenditionOptions rendition;
+    rendition.filename = out_filename;
+    rendition.width = m_options.width;
+    rendition.height = m_options.height;
+    rendition.video_bitrate = m_options.video_bitrate;
+
+    return open(in_filename, std::vector<RenditionOptions>(1, rendition));
+}
+
+bool Transcoder::open(const char* in_filename, const std::vector<RenditionOptions>& ladder) {
+    m_in_filename = in_filename;
+
+    m_scale_flags = SliceScaler::flags_by_name(m_options.scaler.c_str());
+    if (m_scale_flags < 0) {
+        std::cout << "Unknown scaling algorithm " << m_options.scaler << '\n';
+        return false;
+    }
+
+    if (!open_input(in_filename)) {
+        return false;
+    }
+
+    if (!choose_stream_modes(ladder, m_options.format_name.c_str())) {
+        return false;
+    }
+
+    // encoders take most of the time, session weighs as much as the number of them. copied video
+    // costs next to nothing, such session doesn't take cores from others
+    if (m_scheduler && m_transcode_video) {
+        m_weight = ladder.size();
+        m_session = m_scheduler->add_session(m_weight);
+    }
+
+    if (m_transcode_video && !open_decoder()) {
+        return false;
+    }
+
+    if (m_transcode_video) {
+        m_width = m_decoder->width;
+        m_height = m_decoder->height;
+        m_sample_aspect_ratio = m_decoder->sample_aspect_ratio;
+    }
+
+    AVStream* in_stream = m_input_ctx->streams[m_video_stream];
+    AVRational frame_rate = av_guess_frame_rate(m_input_ctx, in_stream, NULL);
+    if (frame_rate.num == 0 || frame_rate.den == 0) {
+        frame_rate = av_make_q(25, 1);
+    }
+
+    m_gop_size = m_options.gop_size > 0 ? m_options.gop_size : int(av_q2d(frame_rate) * 2 + 0.5);
+
+    if (m_options.autotune && m_transcode_video) {
+        std::string profile = m_options.autotune_profile.empty() ? x264_default_profile() : m_options.autotune_profile;
+        if (m_x264_profile.load(profile.c_str())) {
+            std::cout << "Autotune: using x264 profile " << profile << '\n';
+        } else {
+            std::cout << "Autotune: no x264 profile " << profile << ", default preset speeds are used\n";
+        }
+    }
+
+    for (size_t i = 0; i < ladder.size(); i++) {
+        Rendition* r = new Rendition(ladder[i], m_options.queue_size, m_options.scale_threads, m_options.slice_threads);
+        r->preset = m_options.x264_preset;
+        r->encode_threads = budget_encode_threads();
+        m_renditions.push_back(r);
+
+        const char* filename = r->options.filename.c_str();
+        int ret = avformat_alloc_output_context2(&r->output_ctx, NULL, m_options.format_name.c_str(), filename);
+        if (ret < 0 || !r->output_ctx) {
+            std::cout << "Could not create output context for " << filename << ", reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        // encoder has to know output format flags (global header), so it's opened after output context is created
+        if (m_transcode_video && !open_encoder(r)) {
+            return false;
+        }
+
+        if (!m_transcode_video) {
+            r->name = "copy";
+        }
+    }
+
+    // audio is encoded once and shared by all renditions, they all have the same container format
+    m_audio_transcodes.resize(m_input_ctx->nb_streams, NULL);
+    for (size_t i = 0; i < m_stream_modes.size(); i++) {
+        if (int(i) == m_video_stream || m_stream_modes[i] != STREAM_TRANSCODE) {
+            continue;
+        }
+
+        if (!open_audio_transcode(i, m_renditions[0]->output_ctx->oformat)) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        if (!open_output(m_renditions[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Transcoder::open_input(const char* filename) {
+    int ret = avformat_open_input(&m_input_ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open input file " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    ret = avformat_find_stream_info(m_input_ctx, NULL);
+    if (ret < 0) {
+        std::cout << "Failed to retrieve input stream information from " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html#gaa6fa468c922ff5c60a6021dcac09ff5a
+    m_video_stream = av_find_best_stream(m_input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (m_video_stream < 0) {
+        std::cout << "Could not find video stream in " << filename << ", reason: " << av_err2str(m_video_stream) << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+// output container can carry this codec. avformat_query_codec() returns 1 for supported codecs,
+// 0 for unsupported ones and negative value when format doesn't tell, we assume the best in that case
+static bool container_accepts(AVOutputFormat* oformat, AVCodecID codec_id) {
+    return avformat_query_codec(oformat, codec_id, FF_COMPLIANCE_NORMAL) != 0;
+}
+
+// decide what to do with every input stream. without auto mode video is always transcoded and audio
+// is always copied, in auto mode only streams output container can't carry are transcoded
+bool Transcoder::choose_stream_modes(const std::vector<RenditionOptions>& ladder, const char* format_name) {
+    AVOutputFormat* oformat = av_guess_format(format_name, NULL, NULL);
+    if (!oformat) {
+        std::cout << "Unknown output format " << format_name << '\n';
+        return false;
+    }
+
+    // resizing, bitrate change or several renditions mean video has to be re-encoded anyway
+    bool video_changes = ladder.size() != 1 || ladder[0].width > 0 || ladder[0].height > 0 || ladder[0].video_bitrate > 0;
+    int input_streams_count = m_input_ctx->nb_streams;
+
+    m_stream_modes.assign(input_streams_count, STREAM_DROP);
+
+    for (int i = 0; i < input_streams_count; i++) {
+        AVCodecParameters* c = m_input_ctx->streams[i]->codecpar;
+        bool compatible = container_accepts(oformat, c->codec_id);
+
+        if (i == m_video_stream) {
+            m_transcode_video = !(m_options.auto_passthrough && compatible && !video_changes);
+            m_stream_modes[i] = m_transcode_video ? STREAM_TRANSCODE : STREAM_COPY;
+        } else if (c->codec_type == AVMEDIA_TYPE_AUDIO) {
+            bool transcode = m_options.transcode_audio || (m_options.auto_passthrough && !compatible);
+            m_stream_modes[i] = transcode ? STREAM_TRANSCODE : STREAM_COPY;
+        } else {
+            continue;
+        }
+
+        if (m_options.auto_passthrough || m_options.transcode_audio) {
+            std::cout << "Stream #" << i << " (" << avcodec_get_name(c->codec_id) << "): "
+                      << (m_stream_modes[i] == STREAM_COPY ? "copy" : "transcode") << '\n';
+        }
+    }
+
+    return true;
+}
+
+bool Transcoder::open_decoder() {
+    AVStream* in_stream = m_input_ctx->streams[m_video_stream];
+
+    AVCodec* codec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+    if (!codec) {
+        std::cout << "Could not find decoder for " << avcodec_get_name(in_stream->codecpar->codec_id) << '\n';
+        return false;
+    }
+
+    m_decoder = avcodec_alloc_context3(codec);
+    if (!m_decoder) {
+        std::cout << "Could not allocate decoder context\n";
+        return false;
+    }
+
+    int ret = avcodec_parameters_to_context(m_decoder, in_stream->codecpar);
+    if (ret < 0) {
+        std::cout << "Failed to copy codec parameters to decoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    // decoded frames will carry timestamps in input stream time base
+    m_decoder->pkt_timebase = in_stream->time_base;
+
+    // this is decoder's own thread pool: frame threading decodes several frames in parallel,
+    // slice threading splits single frame between threads
+    m_decoder->thread_count = budget_decode_threads();
+    m_decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    // decoded pictures are allocated from our pool and reused once all renditions are done with them
+    m_decoder_frame_pool.attach(m_decoder);
+
+    // decoder threads are created by avcodec_open2() and inherit cores of this thread
+    follow_budget(&m_decoder_budget);
+
+    ret = avcodec_open2(m_decoder, codec, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open decoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+bool Transcoder::open_encoder(Rendition* r) {
+    AVStream* in_stream = m_input_ctx->streams[m_video_stream];
+
+    AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        std::cout << "Could not find libx264 encoder\n";
+        return false;
+    }
+
+    r->encoder = avcodec_alloc_context3(codec);
+    if (!r->encoder) {
+        std::cout << "Could not allocate encoder context\n";
+        return false;
+    }
+
+    AVCodecContext* enc = r->encoder;
+    enc->width = r->options.width > 0 ? r->options.width : m_width;
+    enc->height = r->options.height > 0 ? r->options.height : m_height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->sample_aspect_ratio = m_sample_aspect_ratio;
+
+    AVRational frame_rate = av_guess_frame_rate(m_input_ctx, in_stream, NULL);
+    enc->framerate = frame_rate.num > 0 && frame_rate.den > 0 ? frame_rate : av_make_q(25, 1);
+
+    // keep input time base, this way frame timestamps pass through encoder untouched
+    enc->time_base = in_stream->time_base;
+
+    // first open decides where autotuner starts: calibrated profile knows which preset is fast enough
+    if (m_options.autotune && !r->tuner) {
+        // with core budget tuner never asks for more threads than rendition share of session cores
+        int max_threads = m_scheduler ? std::max(1, budget_cores() / m_weight) : int(std::thread::hardware_concurrency());
+        r->tuner = new X264Tuner(av_q2d(enc->framerate), m_options.autotune_headroom, max_threads,
+            int64_t(enc->width) * enc->height, &m_x264_profile);
+
+        int preset = x264_preset_index(r->preset.c_str());
+        int threads = r->encode_threads > 0 ? r->encode_threads : max_threads;
+        r->tuner->initial(&preset, &threads);
+
+        r->preset = X264Presets[preset >= 0 ? preset : x264_preset_index("veryfast")];
+        r->encode_threads = threads;
+    }
+
+    enc->gop_size = m_gop_size;
+    enc->thread_count = r->encode_threads;
+
+    av_opt_set(enc->priv_data, "preset", r->preset.c_str(), 0);
+    if (r->options.video_bitrate > 0) {
+        enc->bit_rate = r->options.video_bitrate;
+    } else {
+        av_opt_set_int(enc->priv_data, "crf", m_options.crf, 0);
+    }
+
+    // keyframes are forced on every gop_size-th source frame (see encode_frame()), scene cut
+    // detection is off so x264 never inserts keyframes of its own and all renditions switch
+    // at exactly the same points
+    if (m_options.align_keyframes) {
+        enc->keyint_min = m_gop_size;
+        av_opt_set(enc->priv_data, "x264-params", "scenecut=0", 0);
+        av_opt_set_int(enc->priv_data, "forced-idr", 1, 0);
+    }
+
+    // some containers (mp4, flv) want sps/pps in stream header instead of every keyframe
+    if (r->output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    // same as decoder, x264 threads inherit cores of this thread
+    follow_budget(&r->encoder_budget);
+
+    int ret = avcodec_open2(enc, codec, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open libx264 encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    char name[32];
+    snprintf(name, sizeof name, "%dx%d", enc->width, enc->height);
+    r->name = name;
+
+    return true;
+}
+
+bool Transcoder::open_audio_transcode(int stream_index, AVOutputFormat* oformat) {
+    AVStream* in_stream = m_input_ctx->streams[stream_index];
+
+    AudioTranscode* at = new AudioTranscode();
+    at->in_stream = stream_index;
+    m_audio_transcodes[stream_index] = at;
+
+    AVCodec* decoder = avcodec_find_decoder(in_stream->codecpar->codec_id);
+    if (!decoder) {
+        std::cout << "Could not find decoder for " << avcodec_get_name(in_stream->codecpar->codec_id) << '\n';
+        return false;
+    }
+
+    at->decoder = avcodec_alloc_context3(decoder);
+    if (!at->decoder) {
+        std::cout << "Could not allocate audio decoder context\n";
+        return false;
+    }
+
+    int ret = avcodec_parameters_to_context(at->decoder, in_stream->codecpar);
+    if (ret < 0) {
+        std::cout << "Failed to copy codec parameters to audio decoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    at->decoder->pkt_timebase = in_stream->time_base;
+
+    ret = avcodec_open2(at->decoder, decoder, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open audio decoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    // some containers don't signal channel layout, only number of channels
+    if (!at->decoder->channel_layout) {
+        at->decoder->channel_layout = av_get_default_channel_layout(at->decoder->channels);
+    }
+
+    AVCodec* encoder = avcodec_find_encoder_by_name("libfdk_aac");
+    if (!encoder) {
+        std::cout << "Could not find libfdk_aac encoder\n";
+        return false;
+    }
+
+    at->encoder = avcodec_alloc_context3(encoder);
+    if (!at->encoder) {
+        std::cout << "Could not allocate audio encoder context\n";
+        return false;
+    }
+
+    // every transcoded stream ends up with the same sample rate and channels, whatever input was
+    AVCodecContext* enc = at->encoder;
+    enc->sample_rate = m_options.audio_sample_rate;
+    enc->channel_layout = av_get_default_channel_layout(m_options.audio_channels);
+    enc->channels = m_options.audio_channels;
+    enc->sample_fmt = encoder->sample_fmts[0]; // fdk-aac takes interleaved s16 only
+    enc->bit_rate = m_options.audio_bitrate;
+    enc->time_base = av_make_q(1, enc->sample_rate);
+
+    if (oformat->flags & AVFMT_GLOBALHEADER) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    ret = avcodec_open2(enc, encoder, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open libfdk_aac encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    // resampler converts decoder output to whatever encoder takes
+    at->swr_ctx = swr_alloc_set_opts(NULL,
+        enc->channel_layout, enc->sample_fmt, enc->sample_rate,
+        at->decoder->channel_layout, at->decoder->sample_fmt, at->decoder->sample_rate,
+        0, NULL);
+
+    if (!at->swr_ctx || (ret = swr_init(at->swr_ctx)) < 0) {
+        std::cout << "Could not create audio resampler, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    // resampler works best with large batches, a decoded frame is only 1024 or 1536 samples.
+    // batch output size is known in advance, so buffers and fifos never have to grow later
+    at->out_capacity = av_rescale_rnd(AudioBatchSamples, enc->sample_rate, at->decoder->sample_rate, AV_ROUND_UP) + AudioBatchSlack;
+
+    at->in_fifo = av_audio_fifo_alloc(at->decoder->sample_fmt, at->decoder->channels, AudioBatchSamples + AudioBatchSlack);
+    at->fifo = av_audio_fifo_alloc(enc->sample_fmt, enc->channels, enc->frame_size + at->out_capacity);
+    if (!at->in_fifo || !at->fifo) {
+        std::cout << "Could not allocate audio fifo\n";
+        return false;
+    }
+
+    ret = av_samples_alloc_array_and_samples(&at->in_samples, NULL, at->decoder->channels, AudioBatchSamples, at->decoder->sample_fmt, 0);
+    if (ret >= 0) {
+        ret = av_samples_alloc_array_and_samples(&at->out_samples, NULL, enc->channels, at->out_capacity, enc->sample_fmt, 0);
+    }
+
+    if (ret < 0) {
+        std::cout << "Could not allocate audio samples, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    at->frame = av_frame_alloc();
+    if (!at->frame) {
+        std::cout << "Could not allocate audio frame\n";
+        return false;
+    }
+
+    at->frame->nb_samples = enc->frame_size;
+    at->frame->format = enc->sample_fmt;
+    at->frame->channel_layout = enc->channel_layout;
+    at->frame->sample_rate = enc->sample_rate;
+
+    ret = av_frame_get_buffer(at->frame, 0);
+    if (ret < 0) {
+        std::cout << "Could not allocate audio frame, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+bool Transcoder::open_output(Rendition* r) {
+    const char* filename = r->options.filename.c_str();
+    int input_streams_count = m_input_ctx->nb_streams;
+    int stream_index = 0;
+
+    r->streams_map = (int*)av_mallocz_array(input_streams_count, sizeof(int));
+    if (!r->streams_map) {
+        std::cout << "Could not allocate streams list.\n";
+        return false;
+    }
+
+    for (int i = 0; i < input_streams_count; i++) {
+        AVCodecParameters* in_codecpar = m_input_ctx->streams[i]->codecpar;
+
+        if (m_stream_modes[i] == STREAM_DROP) {
+            r->streams_map[i] = -1;
+            continue;
+        }
+
+        AVStream* out_stream = avformat_new_stream(r->output_ctx, NULL);
+        if (!out_stream) {
+            std::cout << "Failed allocating output stream\n";
+            return false;
+        }
+
+        int ret = 0;
+        if (i == m_video_stream && m_transcode_video) {
+            ret = avcodec_parameters_from_context(out_stream->codecpar, r->encoder);
+            out_stream->time_base = r->encoder->time_base;
+            r->out_video_stream = stream_index;
+        } else if (m_audio_transcodes[i]) {
+            ret = avcodec_parameters_from_context(out_stream->codecpar, m_audio_transcodes[i]->encoder);
+            out_stream->time_base = m_audio_transcodes[i]->encoder->time_base;
+        } else {
+            ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
+        }
+
+        if (ret < 0) {
+            std::cout << "Failed to copy codec parameters, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        // set stream codec tag to 0, for libav to detect automatically
+        out_stream->codecpar->codec_tag = 0;
+        r->streams_map[i] = stream_index++;
+    }
+
+    if (!(r->output_ctx->oformat->flags & AVFMT_NOFILE)) {
+        int ret = avio_open(&r->output_ctx->pb, filename, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            std::cout << "Could not open output file " << filename << ", reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+    }
+
+    int ret = avformat_write_header(r->output_ctx, NULL);
+    if (ret < 0) {
+        std::cout << "Failed to write output file header to " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+void Transcoder::dump_formats() const {
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__misc.html#gae2645941f2dc779c307eb6314fd39f10
+    std::cout << "-------------------------------- IN ------------------------------------\n";
+    av_dump_format(m_input_ctx, 0, m_in_filename.c_str(), 0);
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        std::cout << "-------------------------------- OUT -----------------------------------\n";
+        av_dump_format(m_renditions[i]->output_ctx, i, m_renditions[i]->options.filename.c_str(), 1);
+    }
+    std::cout << "------------------------------------------------------------------------\n";
+}
+
+bool Transcoder::run() {
+    m_start_time = av_gettime_relative();
+
+    if (m_options.stats_interval_ms > 0) {
+        m_stats_thread = std::thread(&Transcoder::stats_loop, this);
+    }
+
+    // start stages, from the end of pipeline to its beginning. copied video needs none of them
+    for (size_t i = 0; i < m_renditions.size() && m_transcode_video; i++) {
+        Rendition* r = m_renditions[i];
+        r->scale_workers_left.store(r->scale_pool.size());
+        r->encode_pool.submit(std::bind(&Transcoder::encode_loop, this, r));
+        for (size_t j = 0; j < r->scale_pool.size(); j++) {
+            r->scale_pool.submit(std::bind(&Transcoder::scale_loop, this, r));
+        }
+    }
+    if (m_transcode_video) {
+        m_decode_pool.submit(std::bind(&Transcoder::decode_loop, this));
+    }
+
+    bool transcode_audio = false;
+    for (size_t i = 0; i < m_audio_transcodes.size(); i++) {
+        transcode_audio = transcode_audio || m_audio_transcodes[i];
+    }
+
+    if (transcode_audio) {
+        m_audio_pool.submit(std::bind(&Transcoder::audio_loop, this));
+    }
+
+    // demux on current thread: video packets go to decoder, transcoded audio to audio stage, the rest is remuxed directly
+    AVPacket packet;
+    int input_streams_count = m_input_ctx->nb_streams;
+
+    while (!m_failed.load()) {
+        int64_t t0 = av_gettime_relative();
+
+        int ret = av_read_frame(m_input_ctx, &packet);
+        if (ret == AVERROR_EOF) { // we have reached end of input file
+            break;
+        }
+
+        if (ret < 0) {
+            std::cout << "Failed to read packet from input, reason: " << av_err2str(ret) << '\n';
+            fail();
+            break;
+        }
+
+        // all renditions map streams the same way, first one is as good as any
+        int* streams_map = m_renditions[0]->streams_map;
+
+        // ignore any packets that are present in non-mapped streams
+        if (packet.stream_index >= input_streams_count || streams_map[packet.stream_index] < 0) {
+            av_packet_unref(&packet);
+            continue;
+        }
+
+        if (packet.stream_index == m_video_stream && m_transcode_video) {
+            AVPacket* video_packet = av_packet_alloc();
+            av_packet_move_ref(video_packet, &packet);
+
+            m_demux_stats.busy_us += av_gettime_relative() - t0;
+            m_demux_stats.frames++;
+
+            if (!m_packets.push(video_packet)) {
+                av_packet_free(&video_packet);
+                break;
+            }
+
+            continue;
+        }
+
+        if (m_audio_transcodes[packet.stream_index]) {
+            AVPacket* audio_packet = av_packet_alloc();
+            av_packet_move_ref(audio_packet, &packet);
+            m_demux_stats.busy_us += av_gettime_relative() - t0;
+
+            if (!m_audio_packets.push(audio_packet)) {
+                av_packet_free(&audio_packet);
+                break;
+            }
+
+            continue;
+        }
+
+        bool written = broadcast_packet(&packet, m_input_ctx->streams[packet.stream_index]->time_base);
+        av_packet_unref(&packet);
+        m_demux_stats.busy_us += av_gettime_relative() - t0;
+
+        if (!written) {
+            fail();
+            break;
+        }
+    }
+
+    // no more packets, stages will drain their queues and exit one after another
+    m_packets.close();
+    m_audio_packets.close();
+    m_audio_pool.wait();
+    m_decode_pool.wait();
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        m_renditions[i]->scale_pool.wait();
+        m_renditions[i]->encode_pool.wait();
+    }
+
+    if (m_stats_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(m_stats_mutex);
+            m_stats_stop = true;
+        }
+        m_stats_cond.notify_all();
+        m_stats_thread.join();
+    }
+
+    if (m_failed.load()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga7f14007e7dc8f481f054b21614dfec13
+        int ret = av_write_trailer(m_renditions[i]->output_ctx);
+        if (ret < 0) {
+            std::cout << "Failed to write trailer to output, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// write packet into every rendition. packet stream_index is input stream index, timestamps are
+// in time_base. stream copy is done this way, same as remux_streams() in other examples
+bool Transcoder::broadcast_packet(AVPacket* packet, AVRational time_base) {
+    AVRounding avr = (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        Rendition* r = m_renditions[i];
+
+        AVPacket out_packet;
+        int ret = av_packet_ref(&out_packet, packet);
+        if (ret < 0) {
+            std::cout << "Failed to reference packet, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        out_packet.stream_index = r->streams_map[packet->stream_index];
+        AVStream* out_stream = r->output_ctx->streams[out_packet.stream_index];
+
+        out_packet.pts = av_rescale_q_rnd(packet->pts, time_base, out_stream->time_base, avr);
+        out_packet.dts = av_rescale_q_rnd(packet->dts, time_base, out_stream->time_base, avr);
+        out_packet.duration = av_rescale_q(packet->duration, time_base, out_stream->time_base);
+        out_packet.pos = -1;
+
+        bool written = write_packet(r, &out_packet);
+        av_packet_unref(&out_packet);
+
+        if (!written) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// decode audio packet, NULL packet flushes everything down to the muxer
+bool Transcoder::transcode_audio(AudioTranscode* at, AVPacket* packet) {
+    // broken packets are not fatal, decoder will skip them
+    int ret = avcodec_send_packet(at->decoder, packet);
+    if (ret < 0 && ret != AVERROR_EOF) {
+        std::cout << "Failed to decode audio packet, reason: " << av_err2str(ret) << '\n';
+        return true;
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    while (avcodec_receive_frame(at->decoder, frame) >= 0) {
+        // first decoded frame sets the clock, after that pts is counted in samples, so encoded
+        // audio has no gaps or overlaps no matter how resampler and fifo split it
+        if (at->next_pts == AV_NOPTS_VALUE && frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            at->next_pts = av_rescale_q(frame->best_effort_timestamp, at->decoder->pkt_timebase, at->encoder->time_base);
+        }
+
+        int written = av_audio_fifo_write(at->in_fifo, (void**)frame->extended_data, frame->nb_samples);
+        av_frame_unref(frame);
+
+        if (written < 0) {
+            std::cout << "Could not buffer decoded audio, reason: " << av_err2str(written) << '\n';
+            av_frame_free(&frame);
+            return false;
+        }
+
+        if (!resample_audio(at, false) || !encode_audio(at, false)) {
+            av_frame_free(&frame);
+            return false;
+        }
+    }
+
+    av_frame_free(&frame);
+
+    if (packet) {
+        return true;
+    }
+
+    // convert last partial batch and drain resampler, then encode whatever is left in fifo
+    if (!resample_audio(at, true)) {
+        return false;
+    }
+
+    return encode_audio(at, true);
+}
+
+// convert decoded samples in batches of AudioBatchSamples. on flush last partial batch is
+// converted too and samples buffered inside resampler are drained
+bool Transcoder::resample_audio(AudioTranscode* at, bool flush) {
+    while (av_audio_fifo_size(at->in_fifo) >= AudioBatchSamples || (flush && av_audio_fifo_size(at->in_fifo) > 0)) {
+        int nb_samples = av_audio_fifo_read(at->in_fifo, (void**)at->in_samples, AudioBatchSamples);
+        if (!convert_audio(at, (const uint8_t**)at->in_samples, nb_samples)) {
+            return false;
+        }
+    }
+
+    if (flush) {
+        return convert_audio(at, NULL, 0);
+    }
+
+    return true;
+}
+
+// convert samples to encoder format and put them into fifo. NULL data drains resampler
+bool Transcoder::convert_audio(AudioTranscode* at, const uint8_t** data, int nb_samples) {
+    int converted = swr_convert(at->swr_ctx, at->out_samples, at->out_capacity, data, nb_samples);
+    if (converted < 0) {
+        std::cout << "Failed to convert audio samples, reason: " << av_err2str(converted) << '\n';
+        return false;
+    }
+
+    // output buffer is big enough for a whole batch, anything that didn't fit stays buffered
+    // inside resampler and comes out with the next batch or the drain
+    if (converted > 0 && av_audio_fifo_write(at->fifo, (void**)at->out_samples, converted) < converted) {
+        std::cout << "Could not buffer converted audio\n";
+        return false;
+    }
+
+    return true;
+}
+
+// encode full frames from fifo. on flush last partial frame is encoded too and encoder is drained
+bool Transcoder::encode_audio(AudioTranscode* at, bool flush) {
+    AVCodecContext* enc = at->encoder;
+
+    AVFrame* frame = at->frame;
+
+    while (av_audio_fifo_size(at->fifo) >= enc->frame_size || (flush && av_audio_fifo_size(at->fifo) > 0)) {
+        // buffer is copied only if encoder still holds a reference to the previous frame
+        frame->nb_samples = enc->frame_size;
+        int ret = av_frame_make_writable(frame);
+        if (ret < 0) {
+            std::cout << "Could not allocate audio frame, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        frame->nb_samples = av_audio_fifo_read(at->fifo, (void**)frame->data, enc->frame_size);
+
+        frame->pts = at->next_pts != AV_NOPTS_VALUE ? at->next_pts : 0;
+        at->next_pts = frame->pts + frame->nb_samples;
+        at->encoded_samples += frame->nb_samples;
+        m_audio_stats.frames++;
+
+        if (!encode_audio_frame(at, frame)) {
+            return false;
+        }
+    }
+
+    if (flush) {
+        return encode_audio_frame(at, NULL);
+    }
+
+    return true;
+}
+
+bool Transcoder::encode_audio_frame(AudioTranscode* at, AVFrame* frame) {
+    // NULL frame flushes encoder
+    int ret = avcodec_send_frame(at->encoder, frame);
+    if (ret < 0) {
+        std::cout << "Failed to send frame to audio encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    while (1) {
+        ret = avcodec_receive_packet(at->encoder, &packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+
+        if (ret < 0) {
+            std::cout << "Failed to encode audio frame, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        packet.stream_index = at->in_stream;
+        bool written = broadcast_packet(&packet, at->encoder->time_base);
+        av_packet_unref(&packet);
+
+        if (!written) {
+            return false;
+        }
+    }
+}
+
+bool Transcoder::write_packet(Rendition* r, AVPacket* packet) {
+    std::lock_guard<std::mutex> lk(r->mux_mutex);
+
+    //https://ffmpeg.org/doxygen/trunk/group__lavf__encoding.html#ga37352ed2c63493c38219d935e71db6c1
+    int ret = av_interleaved_write_frame(r->output_ctx, packet);
+    if (ret < 0) {
+        std::cout << "Failed to write packet to " << r->options.filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+void Transcoder::fail() {
+    m_failed.store(true);
+
+    // wake up every stage, they will notice closed queues and exit
+    m_packets.close();
+    m_audio_packets.close();
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        m_renditions[i]->decoded.close();
+        m_renditions[i]->scaled.close();
+    }
+}
+
+void Transcoder::audio_loop() {
+    AVPacket* packet = NULL;
+    uint64_t budget = 0;
+
+    // all transcoded audio streams share this thread, audio is cheap compared to video
+    while (m_audio_packets.pop(packet)) {
+        follow_budget(&budget);
+
+        if (m_failed.load()) {
+            av_packet_free(&packet);
+            continue;
+        }
+
+        int64_t t0 = av_gettime_relative();
+        bool transcoded = transcode_audio(m_audio_transcodes[packet->stream_index], packet);
+        av_packet_free(&packet);
+        m_audio_stats.busy_us += av_gettime_relative() - t0;
+
+        if (!transcoded) {
+            fail();
+        }
+    }
+
+    // flush audio decoders, resamplers and encoders
+    int64_t t0 = av_gettime_relative();
+    for (size_t i = 0; i < m_audio_transcodes.size() && !m_failed.load(); i++) {
+        if (m_audio_transcodes[i] && !transcode_audio(m_audio_transcodes[i], NULL)) {
+            fail();
+        }
+    }
+    m_audio_stats.busy_us += av_gettime_relative() - t0;
+}
+
+void Transcoder::decode_loop() {
+    int64_t seq = 0;
+    AVPacket* packet = NULL;
+
+    uint64_t budget = 0;
+
+    // decoder output goes into this frame over and over again, renditions get their own references
+    AVFrame* frame = av_frame_alloc();
+
+    while (m_packets.pop(packet)) {
+        follow_budget(&budget);
+
+        // decoder threads still run on old cores, new decoder starts on keyframe without losing anything
+        if (m_scheduler && (packet->flags & AV_PKT_FLAG_KEY) && m_scheduler->budget(m_session, NULL) != m_decoder_budget) {
+            if (!reopen_decoder(frame, &seq)) {
+                av_packet_free(&packet);
+                fail();
+                break;
+            }
+        }
+
+        int64_t t0 = av_gettime_relative();
+        int ret = avcodec_send_packet(m_decoder, packet);
+        av_packet_free(&packet);
+        m_decode_stats.busy_us += av_gettime_relative() - t0;
+
+        // broken packets are not fatal, decoder will resync on next keyframe
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            std::cout << "Failed to decode packet, reason: " << av_err2str(ret) << '\n';
+        }
+
+        if (!receive_decoded_frames(frame, &seq)) {
+            break;
+        }
+    }
+
+    // flush decoder, NULL packet tells decoder there's no more input
+    if (!m_failed.load()) {
+        avcodec_send_packet(m_decoder, NULL);
+        receive_decoded_frames(frame, &seq);
+    }
+
+    av_frame_free(&frame);
+
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        m_renditions[i]->decoded.close();
+    }
+}
+
+// drain decoder and open new one with current core budget
+bool Transcoder::reopen_decoder(AVFrame* frame, int64_t* seq) {
+    int64_t t0 = av_gettime_relative();
+    int threads = m_decoder->thread_count;
+
+    avcodec_send_packet(m_decoder, NULL);
+    if (!receive_decoded_frames(frame, seq)) {
+        return false;
+    }
+
+    avcodec_free_context(&m_decoder);
+    if (!open_decoder()) {
+        return false;
+    }
+
+    m_decode_stats.busy_us += av_gettime_relative() - t0;
+
+    printf("decoder: core budget changed, threads %d -> %d\n", threads, m_decoder->thread_count);
+    fflush(stdout);
+
+    return true;
+}
+
+bool Transcoder::receive_decoded_frames(AVFrame* frame, int64_t* seq) {
+    while (1) {
+        int64_t t0 = av_gettime_relative();
+
+        int ret = avcodec_receive_frame(m_decoder, frame);
+        if (ret < 0) {
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+        }
+
+        frame->pts = frame->best_effort_timestamp;
+
+        m_decode_stats.busy_us += av_gettime_relative() - t0;
+        m_decode_stats.frames++;
+
+        // every rendition gets its own reference to the same decoded picture, no pixel data is copied
+        for (size_t i = 0; i < m_renditions.size(); i++) {
+            AVFrame* ref = av_frame_clone(frame);
+            if (!ref) {
+                std::cout << "Could not reference decoded frame\n";
+                av_frame_unref(frame);
+                fail();
+                return false;
+            }
+
+            FrameItem item = { *seq, ref };
+            if (!m_renditions[i]->decoded.push(item)) {
+                av_frame_free(&ref);
+                av_frame_unref(frame);
+                return false;
+            }
+        }
+
+        av_frame_unref(frame);
+        (*seq)++;
+    }
+}
+
+void Transcoder::scale_loop(Rendition* r) {
+    // every worker has its own scaler, swscale contexts are not threadsafe
+    SliceScaler scaler(m_options.slice_threads, m_scale_flags);
+    uint64_t budget = 0;
+    FrameItem item;
+
+    // encoder can be reopened by encode thread while we work, picture it wants stays the same
+    int width = r->encoder->width;
+    int height = r->encoder->height;
+    AVPixelFormat pix_fmt = r->encoder->pix_fmt;
+
+    while (r->decoded.pop(item)) {
+        follow_budget(&budget);
+
+        int64_t t0 = av_gettime_relative();
+        AVFrame* in = item.frame;
+
+        bool needs_scaling = in->width != width || in->height != height || in->format != pix_fmt;
+
+        if (needs_scaling) {
+            // picture buffers come from rendition pool and go back there once encoder is done with them
+            AVFrame* out = r->frame_pool.get_frame(width, height, pix_fmt);
+            if (!out) {
+                std::cout << "Could not allocate scaled frame\n";
+                av_frame_free(&in);
+                fail();
+                break;
+            }
+
+            if (!scaler.scale(in, out)) {
+                std::cout << "Could not create scaler context\n";
+                av_frame_free(&out);
+                av_frame_free(&in);
+                fail();
+                break;
+            }
+            av_frame_copy_props(out, in);
+            av_frame_free(&in);
+            item.frame = out;
+        }
+
+        r->scale_stats.busy_us += av_gettime_relative() - t0;
+        r->scale_stats.frames++;
+
+        if (!r->scaled.push(item)) {
+            av_frame_free(&item.frame);
+            break;
+        }
+    }
+
+    // last worker out closes the door
+    if (--r->scale_workers_left == 0) {
+        r->scaled.close();
+    }
+}
+
+void Transcoder::encode_loop(Rendition* r) {
+    // frames come out of scaling workers in any order, keep them here till it's their turn
+    std::map<int64_t, AVFrame*> pending;
+    int64_t next_seq = 0;
+    uint64_t budget = 0;
+    FrameItem item;
+
+    while (r->scaled.pop(item)) {
+        follow_budget(&budget);
+        pending[item.seq] = item.frame;
+
+        std::map<int64_t, AVFrame*>::iterator it;
+        while ((it = pending.find(next_seq)) != pending.end()) {
+            AVFrame* frame = it->second;
+            pending.erase(it);
+
+            bool encoded = encode_frame(r, frame, next_seq);
+            av_frame_free(&frame);
+            next_seq++;
+
+            if (!encoded) {
+                fail();
+                break;
+            }
+        }
+    }
+
+    // only possible on failure
+    for (std::map<int64_t, AVFrame*>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        av_frame_free(&it->second);
+    }
+
+    if (!m_failed.load() && !encode_frame(r, NULL, next_seq)) {
+        fail();
+    }
+}
+
+bool Transcoder::encode_frame(Rendition* r, AVFrame* frame, int64_t seq) {
+    int64_t t0 = av_gettime_relative();
+
+    // settings change on GOP boundaries only, new encoder starts with a keyframe right there
+    if (frame && (r->tuner || m_scheduler) && seq > 0 && seq % m_gop_size == 0) {
+        int preset = x264_preset_index(r->preset.c_str());
+        int threads = r->encode_threads;
+        bool reopen = false;
+
+        // x264 threads still run on old cores, encoder has to be reopened even if threads count is the same
+        if (m_scheduler && m_scheduler->budget(m_session, NULL) != r->encoder_budget) {
+            int share = std::max(1, budget_cores() / m_weight);
+            threads = r->tuner ? std::min(threads, share) : budget_encode_threads();
+            reopen = true;
+
+            if (r->tuner) {
+                r->tuner->set_max_threads(share);
+            }
+        }
+
+        if (r->tuner) {
+            reopen = r->tuner->update(&preset, &threads) || reopen;
+        }
+
+        if (reopen && !reopen_encoder(r, preset >= 0 ? std::string(X264Presets[preset]) : r->preset, threads)) {
+            return false;
+        }
+    }
+
+    int64_t t1 = av_gettime_relative();
+    AVCodecContext* enc = r->encoder;
+
+    if (frame) {
+        // don't inherit picture types from source. with aligned keyframes, force them by source
+        // frame number, this is the same frame for every rendition
+        bool force_key = m_options.align_keyframes && seq % m_gop_size == 0;
+        frame->pict_type = force_key ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    }
+
+    // NULL frame flushes encoder
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0) {
+        std::cout << "Failed to send frame to encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    if (!receive_packets(r)) {
+        return false;
+    }
+
+    int64_t t2 = av_gettime_relative();
+    r->encode_stats.busy_us += t2 - t0;
+
+    if (frame) {
+        r->encode_stats.frames++;
+
+        // encoder reopening is not counted, that's not what tuner measures
+        if (r->tuner) {
+            r->tuner->add_frame(t2 - t1);
+        }
+    }
+
+    return true;
+}
+
+// write every packet encoder has ready
+bool Transcoder::receive_packets(Rendition* r) {
+    AVCodecContext* enc = r->encoder;
+    AVStream* out_stream = r->output_ctx->streams[r->out_video_stream];
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    while (1) {
+        int ret = avcodec_receive_packet(enc, &packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+
+        if (ret < 0) {
+            std::cout << "Failed to encode frame, reason: " << av_err2str(ret) << '\n';
+            return false;
+        }
+
+        packet.stream_index = r->out_video_stream;
+        av_packet_rescale_ts(&packet, enc->time_base, out_stream->time_base);
+
+        // reopened encoder starts dts below the last dts of previous one (b-frames delay),
+        // muxer wants dts strictly increasing. few ticks shift is enough, pts stay untouched
+        if (packet.dts != AV_NOPTS_VALUE && r->last_dts != AV_NOPTS_VALUE && packet.dts <= r->last_dts) {
+            packet.dts = r->last_dts + 1;
+            if (packet.pts != AV_NOPTS_VALUE && packet.pts < packet.dts) {
+                packet.pts = packet.dts;
+            }
+        }
+        r->last_dts = packet.dts;
+
+        // with global header sps/pps live in stream header, muxer writes new ones when it sees this side data
+        if (r->new_extradata && enc->extradata_size > 0) {
+            uint8_t* extradata = av_packet_new_side_data(&packet, AV_PKT_DATA_NEW_EXTRADATA, enc->extradata_size);
+            if (extradata) {
+                memcpy(extradata, enc->extradata, enc->extradata_size);
+            }
+            r->new_extradata = false;
+        }
+
+        bool written = write_packet(r, &packet);
+        av_packet_unref(&packet);
+
+        if (!written) {
+            return false;
+        }
+    }
+}
+
+// libx264 can't change preset of running encoder: old one is drained and closed, new one is
+// opened with new settings and starts with IDR frame
+bool Transcoder::reopen_encoder(Rendition* r, const std::string& preset, int threads) {
+    int ret = avcodec_send_frame(r->encoder, NULL);
+    if (ret < 0) {
+        std::cout << "Failed to flush encoder, reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    if (!receive_packets(r)) {
+        return false;
+    }
+
+    if (r->tuner) {
+        printf("%s: encoder %.1f fps, x264 preset %s -> %s, threads %d -> %d\n",
+            r->name.c_str(), r->tuner->measured_fps(), r->preset.c_str(), preset.c_str(), r->encode_threads, threads);
+    } else {
+        printf("%s: core budget changed, x264 threads %d -> %d\n", r->name.c_str(), r->encode_threads, threads);
+    }
+    fflush(stdout);
+
+    avcodec_free_context(&r->encoder);
+    r->preset = preset;
+    r->encode_threads = threads;
+
+    if (!open_encoder(r)) {
+        return false;
+    }
+
+    r->new_extradata = (r->encoder->flags & AV_CODEC_FLAG_GLOBAL_HEADER) != 0;
+    return true;
+}
+
+// move calling thread to session cores if they changed since version, true if thread was moved
+bool Transcoder::follow_budget(uint64_t* version) {
+    if (!m_scheduler) {
+        return false;
+    }
+
+    std::vector<int> cores;
+    uint64_t current = m_scheduler->budget(m_session, &cores);
+    if (current == *version) {
+        return false;
+    }
+
+    *version = current;
+    return CoreScheduler::pin_thread(cores);
+}
+
+int Transcoder::budget_cores() const {
+    std::vector<int> cores;
+    m_scheduler->budget(m_session, &cores);
+    return cores.size();
+}
+
+// threads counts given in options win, otherwise they come from session budget: decoder is
+// cheap compared to encoders and gets a quarter of it, encoders split the rest of the cores
+int Transcoder::budget_decode_threads() const {
+    if (!m_scheduler || m_options.decode_threads > 0) {
+        return m_options.decode_threads;
+    }
+
+    return std::max(1, budget_cores() / 4);
+}
+
+int Transcoder::budget_encode_threads() const {
+    if (!m_scheduler || m_options.encode_threads > 0) {
+        return m_options.encode_threads;
+    }
+
+    return std::max(1, budget_cores() / m_weight);
+}
+
+void Transcoder::stats_loop() {
+    std::unique_lock<std::mutex> lk(m_stats_mutex);
+
+    while (!m_stats_stop) {
+        m_stats_cond.wait_for(lk, std::chrono::milliseconds(m_options.stats_interval_ms));
+        if (!m_stats_stop) {
+            print_stats(false);
+        }
+    }
+}
+
+void Transcoder::print_stats(bool final) const {
+    struct Row {
+        std::string name;
+        const StageStats* stats;
+        size_t queued;      // frames waiting in stage input queue
+        size_t capacity;
+        bool video;         // audio frames are not comparable to video ones, audio never is the bottleneck
+    };
+
+    std::vector<Row> rows;
+    Row demux = { "demux", &m_demux_stats, 0, 0, true };
+    Row decode = { "decode", &m_decode_stats, m_packets.size(), m_packets.capacity(), true };
+    rows.push_back(demux);
+    rows.push_back(decode);
+
+    int audio_streams = 0;
+    int64_t audio_samples = 0;
+    for (size_t i = 0; i < m_audio_transcodes.size(); i++) {
+        if (m_audio_transcodes[i]) {
+            audio_streams++;
+            audio_samples += m_audio_transcodes[i]->encoded_samples;
+        }
+    }
+
+    if (audio_streams > 0) {
+        Row audio = { "audio", &m_audio_stats, m_audio_packets.size(), m_audio_packets.capacity(), false };
+        rows.push_back(audio);
+    }
+
+    for (size_t i = 0; i < m_renditions.size(); i++) {
+        const Rendition* r = m_renditions[i];
+        Row scale = { "scale " + r->name, &r->scale_stats, r->decoded.size(), r->decoded.capacity(), true };
+        Row encode = { "encode " + r->name, &r->encode_stats, r->scaled.size(), r->scaled.capacity(), true };
+        rows.push_back(scale);
+        rows.push_back(encode);
+    }
+
+    double elapsed = (av_gettime_relative() - m_start_time) / 1000000.0;
+    if (elapsed <= 0) {
+        return;
+    }
+
+    // fps is what the stage actually delivered, max fps is what it could deliver if it never
+    // waited on its neighbours. stage with the lowest max fps is the bottleneck
+    const Row* bottleneck = NULL;
+    double bottleneck_fps = 0;
+
+    printf("%s %.1fs\n", final ? "total" : "stats", elapsed);
+    for (size_t i = 0; i < rows.size(); i++) {
+        const Row& r = rows[i];
+        uint64_t frames = r.stats->frames.load();
+        double busy = r.stats->busy_us.load() / 1000000.0 / r.stats->threads;
+        double fps = frames / elapsed;
+        double max_fps = busy > 0 ? frames / busy : 0;
+
+        printf("  %-18s frames: %8llu  fps: %8.1f  max fps: %8.1f  busy: %5.1f%%  threads: %d  queue: %zu/%zu\n",
+            r.name.c_str(), (unsigned long long)frames, fps, max_fps, 100.0 * busy / elapsed,
+            r.stats->threads, r.queued, r.capacity);
+
+        if (r.video && frames > 0 && busy > 0 && (!bottleneck || max_fps < bottleneck_fps)) {
+            bottleneck = &r;
+            bottleneck_fps = max_fps;
+        }
+    }
+
+    if (bottleneck) {
+        printf("  bottleneck: %s\n", bottleneck->name.c_str());
+    }
+
+    if (m_session >= 0) {
+        std::vector<int> cores;
+        m_scheduler->budget(m_session, &cores);
+        printf("  cores: %s\n", CoreScheduler::format(cores).c_str());
+    }
+
+    // cost of one audio stream: milliseconds of audio thread time per second of audio
+    if (final && audio_samples > 0) {
+        double audio_seconds = double(audio_samples) / audio_streams / m_options.audio_sample_rate;
+        double busy_ms = m_audio_stats.busy_us.load() / 1000.0 / audio_streams;
+        printf("  audio per stream: %.2f ms per second of audio (%.2f%% of a core)\n",
+            busy_ms / audio_seconds, busy_ms / audio_seconds / 10.0);
+    }
+
+    // pools stop allocating once enough frames are in flight, growing numbers mean leaking frames
+    if (final) {
+        printf("  frame buffers allocated: decode %llu", (unsigned long long)m_decoder_frame_pool.allocations());
+        for (size_t i = 0; i < m_renditions.size(); i++) {
+            printf(", scale %s %llu", m_renditions[i]->name.c_str(),
+                (unsigned long long)m_renditions[i]->frame_pool.allocations());
+        }
+        printf("\n");
+    }
+
+    fflush(stdout);
+}
@@ -0,0 +1,264 @@
+/*
+* File: transcoder.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* multi-threaded transcoding engine. input is demuxed on the calling thread, video goes
+* through decode -> scale -> encode stages, each stage runs on its own thread pool and
+* stages are connected with bounded frame queues. audio streams are copied as is.
+* every stage counts processed frames and time spent working, so we can tell which stage
+* is the bottleneck
+*
+* one decoder can feed several renditions (ABR ladder): every rendition has its own
+* scaling workers, x264 encoder and output file, decoded frames are shared between
+* renditions by reference, so source is decoded only once
+*
+* in auto mode every input stream is checked against output container: streams container
+* can carry are copied as is (same as remux_streams() in other examples), only the rest
+* is transcoded. incompatible audio (e.g. AC-3 for FLV) is re-encoded to AAC with fdk-aac.
+* transcoded audio is normalized to 48 kHz stereo by default and runs on its own thread
+*
+* every scaling worker can split its frame into horizontal slices scaled in parallel (see
+* slice_scaler.hpp), so single 4K stream can use more than one core per frame
+*
+* with autotune on, every rendition encoder keeps an eye on its own speed and switches x264
+* preset and threads on GOP boundaries to the best quality host can sustain (see x264_tuner.hpp)
+*
+* with core scheduler (see core_scheduler.hpp), transcoder is one of many sessions sharing the
+* host: decoder and encoder threads are sized to session core budget, all session threads are
+* pinned to its cores. when budget changes, decoder is reopened on next keyframe and encoders on
+* next GOP boundary, so codec thread pools move to the new cores too
+*
+* decoded and scaled pictures live in buffer pools (see frame_pool.hpp), so in steady state
+* transcoding doesn't allocate picture memory per frame
+*
+*/
+
+#ifndef transcoder_hpp
+#define transcoder_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libswscale/swscale.h>
+    #include <libswresample/swresample.h>
+    #include <libavutil/audio_fifo.h>
+}
+
+#include "frame_queue.hpp"
+#include "thread_pool.hpp"
+#include "frame_pool.hpp"
+#include "x264_tuner.hpp"
+#include "core_scheduler.hpp"
+
+// single output of the transcoder
+struct RenditionOptions {
+    RenditionOptions();
+
+    std::string filename;       // output file
+    int width;                  // output video width, 0 - same as input
+    int height;                 // output video height, 0 - same as input
+    int64_t video_bitrate;      // target video bitrate in bits/s, 0 - constant quality (crf)
+};
+
+// what happens to input stream
+enum StreamMode {
+    STREAM_DROP,        // not written to output
+    STREAM_COPY,        // remuxed as is
+    STREAM_TRANSCODE    // decoded and encoded again
+};
+
+struct TranscodeOptions {
+    TranscodeOptions();
+
+    std::string format_name;    // output container format
+    int width;                  // output video width, 0 - same as input
+    int height;                 // output video height, 0 - same as input
+    int64_t video_bitrate;      // target video bitrate in bits/s, 0 - constant quality (crf)
+    int crf;                    // x264 constant rate factor, used when video_bitrate is 0
+    std::string x264_preset;    // x264 speed preset
+    bool autotune;              // change x264 preset and threads on the fly to keep up with real time
+    double autotune_headroom;   // encoder must be this many times faster than real time
+    std::string autotune_profile; // per-host x264 speeds made by calibration, empty - x264_<hostname>.profile
+    int gop_size;               // keyframe interval in frames, 0 - 2 seconds worth of frames
+    bool align_keyframes;       // put keyframes on the same source frames in all renditions
+    bool auto_passthrough;      // copy streams output container accepts, transcode only the rest
+    bool transcode_audio;       // re-encode every audio stream, not only ones output container can't carry
+    int audio_sample_rate;      // transcoded audio sample rate
+    int audio_channels;         // transcoded audio channels, default channel layout for that number is used
+    int64_t audio_bitrate;      // transcoded audio bitrate in bits/s
+    int decode_threads;         // decoder threads, 0 - let libavcodec decide, or from core budget
+    int scale_threads;          // number of scaling workers per rendition
+    int slice_threads;          // threads every scaling worker splits frame between, 1 - no slicing
+    std::string scaler;         // scaling algorithm, see SliceScaler::flags_by_name()
+    int encode_threads;         // x264 threads per rendition, 0 - let x264 decide, or from core budget
+    size_t queue_size;          // max frames queued between two stages
+    int stats_interval_ms;      // how often to print stage stats, 0 - only at the end
+};
+
+// per stage counters, updated by stage workers and read by stats reporter
+struct StageStats {
+    StageStats();
+
+    std::atomic<uint64_t> frames;   // frames that went out of the stage
+    std::atomic<uint64_t> busy_us;  // time spent doing actual work, queue waits are excluded
+    int threads;                    // number of threads doing the work
+};
+
+// frame travelling between stages. seq is decode order number, scaling workers may
+// finish frames out of order, encoder uses seq to restore the order
+struct FrameItem {
+    int64_t seq;
+    AVFrame* frame;
+};
+
+// transcoded audio stream: decoded, normalized to output sample rate and channels and encoded
+// to AAC. encoded packets go to every rendition. decoded samples are collected into batches
+// before going through resampler, all buffers are allocated once when stream is opened
+struct AudioTranscode {
+    AudioTranscode();
+    ~AudioTranscode();
+
+    int in_stream;                  // input stream index
+    AVCodecContext* decoder;
+    AVCodecContext* encoder;
+    SwrContext* swr_ctx;
+    AVAudioFifo* in_fifo;           // decoded samples waiting for next resampler batch
+    AVAudioFifo* fifo;              // encoder needs exactly frame_size samples per frame
+    uint8_t** in_samples;           // resampler batch input, decoder sample format
+    uint8_t** out_samples;          // resampler batch output, encoder sample format
+    int out_capacity;               // out_samples size in samples
+    AVFrame* frame;                 // encoder input frame, reused for every encoded frame
+    int64_t next_pts;               // pts of next encoded frame, in encoder time base
+    int64_t encoded_samples;        // samples sent to encoder so far
+};
+
+// everything that belongs to one output: scaling and encoding stages and the muxer
+struct Rendition {
+    Rendition(const RenditionOptions& options, size_t queue_size, int scale_threads, int slice_threads);
+    ~Rendition();
+
+    RenditionOptions options;
+    std::string name;                   // used in stats output
+
+    AVFormatContext* output_ctx;
+    AVCodecContext* encoder;
+    int* streams_map;
+    int out_video_stream;               // output stream index for transcoded video
+
+    std::string preset;                 // current x264 preset and threads, autotuner changes them
+    int encode_threads;
+    X264Tuner* tuner;                   // NULL if autotune is off
+    bool new_extradata;                 // encoder was reopened, next packet carries new sps/pps
+    int64_t last_dts;                   // last video packet dts, in output stream time base
+    uint64_t encoder_budget;            // core budget version encoder threads were created with
+
+    FrameQueue<FrameItem> decoded;      // decode -> scale
+    FrameQueue<FrameItem> scaled;       // scale -> encode
+
+    ThreadPool scale_pool;
+    ThreadPool encode_pool;
+    std::atomic<int> scale_workers_left;
+
+    StageStats scale_stats;
+    StageStats encode_stats;
+
+    FramePool frame_pool;               // scaled pictures
+
+    std::mutex mux_mutex;               // output context is shared between demux and encode threads
+};
+
+class Transcoder {
+public:
+    Transcoder(const TranscodeOptions& options, CoreScheduler* scheduler = NULL);   // NULL - threads are not budgeted
+    ~Transcoder();
+
+    bool open(const char* in_filename, const char* out_filename);                   // single output, size/bitrate from options
+    bool open(const char* in_filename, const std::vector<RenditionOptions>& ladder); // one output per rendition
+    bool run();                                                                     // transcode whole input, blocks till done
+    void dump_formats() const;                                                      // print input and output formats/streams info
+    void print_stats(bool final) const;                                             // print per stage fps
+
+    AVFormatContext* input_ctx() const;
+
+private:
+    bool open_input(const char* filename);
+    bool choose_stream_modes(const std::vector<RenditionOptions>& ladder, const char* format_name);
+    bool open_decoder();
+    bool reopen_decoder(AVFrame* frame, int64_t* seq);
+    bool open_encoder(Rendition* r);
+    bool reopen_encoder(Rendition* r, const std::string& preset, int threads);
+    bool open_audio_transcode(int stream_index, AVOutputFormat* oformat);
+    bool open_output(Rendition* r);
+    bool write_packet(Rendition* r, AVPacket* packet);
+    bool broadcast_packet(AVPacket* packet, AVRational time_base);
+    bool transcode_audio(AudioTranscode* at, AVPacket* packet);
+    bool resample_audio(AudioTranscode* at, bool flush);
+    bool convert_audio(AudioTranscode* at, const uint8_t** data, int nb_samples);
+    bool encode_audio(AudioTranscode* at, bool flush);
+    bool encode_audio_frame(AudioTranscode* at, AVFrame* frame);
+    bool receive_decoded_frames(AVFrame* frame, int64_t* seq);
+    bool encode_frame(Rendition* r, AVFrame* frame, int64_t seq);
+    bool receive_packets(Rendition* r);
+    void audio_loop();
+    void decode_loop();
+    void scale_loop(Rendition* r);
+    void encode_loop(Rendition* r);
+    void stats_loop();
+    void fail();
+    bool follow_budget(uint64_t* version);
+    int budget_cores() const;
+    int budget_decode_threads() const;
+    int budget_encode_threads() const;
+
+    TranscodeOptions m_options;
+    std::string m_in_filename;
+
+    AVFormatContext* m_input_ctx;
+    AVCodecContext* m_decoder;
+    FramePool m_decoder_frame_pool;     // decoded pictures
+    int m_video_stream;         // input video stream index
+    bool m_transcode_video;     // video goes through decode -> scale -> encode, otherwise it's copied
+    int m_gop_size;
+    int m_scale_flags;          // swscale flags for chosen scaling algorithm
+    int m_width;                // decoded video size, decoder can be reopened while encoders use it
+    int m_height;
+    AVRational m_sample_aspect_ratio;
+    X264Profile m_x264_profile;
+    std::vector<int> m_stream_modes;                // StreamMode for every input stream
+    std::vector<AudioTranscode*> m_audio_transcodes; // per input stream, NULL if stream is not transcoded audio
+
+    FrameQueue<AVPacket*> m_packets;    // demux -> decode
+    ThreadPool m_decode_pool;
+    FrameQueue<AVPacket*> m_audio_packets;  // demux -> audio
+    ThreadPool m_audio_pool;
+    std::vector<Rendition*> m_renditions;
+
+    StageStats m_demux_stats;
+    StageStats m_decode_stats;
+    StageStats m_audio_stats;
+    int64_t m_start_time;
+
+    CoreScheduler* m_scheduler;
+    int m_session;              // scheduler session id, -1 if not scheduled
+    int m_weight;               // session weight, number of transcoded renditions
+    uint64_t m_decoder_budget;  // core budget version decoder threads were created with
+
+    std::atomic<bool> m_failed;
+
+    std::thread m_stats_thread;
+    std::mutex m_stats_mutex;
+    std::condition_variable m_stats_cond;
+    bool m_stats_stop;
+};
+
+#endif /* transcoder_hpp */
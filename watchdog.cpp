@@ -0,0 +1,191 @@
+/*
+* File: watchdog.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* stall watchdog, see watchdog.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <execinfo.h>
+#include <atomic>
+#include <chrono>
+
+#include "watchdog.hpp"
+
+const int StackSignal = SIGUSR2;            // SIGUSR1 is trace dump
+const int MaxStackFrames = 64;
+const int StackWaitMs = 200;                // thread stuck in uninterruptible sleep (disk) won't answer
+
+// one stack at a time, filled by signalled thread
+static std::mutex s_stack_mutex;
+static void* s_frames[MaxStackFrames];
+static std::atomic<int> s_frames_count(-1);
+
+static int64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stack_signal_handler(int) {
+    s_frames_count.store(backtrace(s_frames, MaxStackFrames), std::memory_order_release);
+}
+
+Watchdog::Watchdog() :
+    m_check_interval_us(0),
+    m_next_id(0),
+    m_running(false),
+    m_stopping(false)
+{
+}
+
+Watchdog::~Watchdog() {
+    stop();
+}
+
+void Watchdog::start(int64_t check_interval_us) {
+    if (m_running) {
+        return;
+    }
+
+    // interrupted syscalls of signalled threads are restarted, pipeline never sees EINTR
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = stack_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(StackSignal, &sa, NULL);
+
+    // first backtrace() loads unwinder and allocates, must not happen in signal handler
+    void* frames[1];
+    backtrace(frames, 1);
+
+    m_check_interval_us = check_interval_us;
+    m_stopping = false;
+    m_running = true;
+    m_thread = std::thread(&Watchdog::run, this);
+}
+
+void Watchdog::stop() {
+    if (!m_running) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(m_stop_mutex);
+        m_stopping = true;
+    }
+    m_stop_cond.notify_all();
+
+    m_thread.join();
+    m_running = false;
+}
+
+int Watchdog::watch(const std::string& name, int64_t timeout_us, Progress progress, StallHandler stalled) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    Watch w;
+    w.id = m_next_id++;
+    w.name = name;
+    w.timeout_us = timeout_us;
+    w.progress = progress;
+    w.stalled = stalled;
+    w.last_value = progress();
+    w.last_change_time = monotonic_us();
+    w.fired = false;
+    m_watches.push_back(w);
+
+    return w.id;
+}
+
+void Watchdog::unwatch(int id) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    for (size_t i = 0; i < m_watches.size(); i++) {
+        if (m_watches[i].id == id) {
+            m_watches.erase(m_watches.begin() + i);
+            return;
+        }
+    }
+}
+
+void Watchdog::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(m_stop_mutex);
+            m_stop_cond.wait_for(lk, std::chrono::microseconds(m_check_interval_us), [this]() { return m_stopping; });
+            if (m_stopping) {
+                return;
+            }
+        }
+
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for (size_t i = 0; i < m_watches.size(); i++) {
+            Watch& w = m_watches[i];
+
+            int64_t now = monotonic_us();
+            int64_t value = w.progress();
+            if (value != w.last_value) {
+                w.last_value = value;
+                w.last_change_time = now;
+                w.fired = false;
+                continue;
+            }
+
+            if (!w.fired && now - w.last_change_time >= w.timeout_us) {
+                w.fired = true;
+                w.stalled(now - w.last_change_time);
+            }
+        }
+    }
+}
+
+std::string Watchdog::thread_stack(pthread_t thread, const char* indent) {
+    std::lock_guard<std::mutex> lk(s_stack_mutex);
+
+    s_frames_count.store(-1);
+    if (pthread_kill(thread, StackSignal) != 0) {
+        return std::string(indent) + "thread is gone\n";
+    }
+
+    int count = -1;
+    for (int i = 0; i < StackWaitMs && count < 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        count = s_frames_count.load(std::memory_order_acquire);
+    }
+
+    if (count < 0) {
+        // late answer must not land in the next request
+        std::string result = std::string(indent) + "thread didn't answer, likely stuck in kernel\n";
+        for (int i = 0; i < StackWaitMs && s_frames_count.load() < 0; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return result;
+    }
+
+    std::string result;
+    char** symbols = backtrace_symbols(s_frames, count);
+
+    // frame 0 is the signal handler
+    for (int i = 1; i < count; i++) {
+        result += indent;
+        if (symbols) {
+            result += symbols[i];
+        } else {
+            char address[32];
+            snprintf(address, sizeof address, "%p", s_frames[i]);
+            result += address;
+        }
+        result += '\n';
+    }
+
+    free(symbols);
+    return result;
+}
@@ -0,0 +1,72 @@
+/*
+* File: watchdog.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* stall watchdog. every watched thing gives a progress function, any value which changes while
+* it moves (counters, last write time). background thread polls them, when value stays the same
+* for longer than timeout stall handler is called, once per stall: it's armed again as soon as
+* progress changes.
+* thread_stack() gets stack of another thread of the process, for diagnostics: thread is
+* signalled and calls backtrace() on itself
+*
+*/
+
+#ifndef watchdog_hpp
+#define watchdog_hpp
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+class Watchdog {
+public:
+    typedef std::function<int64_t()> Progress;
+    typedef std::function<void(int64_t stalled_us)> StallHandler;
+
+    Watchdog();
+    ~Watchdog();
+
+    void start(int64_t check_interval_us);
+    void stop();
+
+    // progress and stall handler are called on watchdog thread. unwatch() waits for running
+    // handler to return, after it returns nothing of the watched thing is called anymore
+    int watch(const std::string& name, int64_t timeout_us, Progress progress, StallHandler stalled);
+    void unwatch(int id);
+
+    // symbol names need -rdynamic at link time, thread must be alive and not block SIGUSR2
+    static std::string thread_stack(pthread_t thread, const char* indent);
+
+private:
+    struct Watch {
+        int id;
+        std::string name;
+        int64_t timeout_us;
+        Progress progress;
+        StallHandler stalled;
+        int64_t last_value;
+        int64_t last_change_time;
+        bool fired;
+    };
+
+    void run();
+
+    std::vector<Watch> m_watches;
+    std::mutex m_mutex;                 // watches, held while progress and handlers run
+    std::mutex m_stop_mutex;
+    std::condition_variable m_stop_cond;
+    std::thread m_thread;
+    int64_t m_check_interval_us;
+    int m_next_id;
+    bool m_running;
+    bool m_stopping;
+};
+
+#endif /* watchdog_hpp */
@@ -0,0 +1,475 @@
+/*
+* File: x264_tuner.cpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* x264 preset and threads autotuner, see x264_tuner.hpp for description
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libswscale/swscale.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+}
+
+#include "helpers.hpp"
+#include "x264_tuner.hpp"
+
+// placebo is left out, it's never worth it
+const char* const X264Presets[] = {
+    "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow"
+};
+
+const int X264PresetsCount = sizeof(X264Presets) / sizeof(X264Presets[0]);
+
+// rough relative speeds of presets, used when host has no profile. measurement after
+// every change corrects the guess
+static const double X264DefaultSpeeds[] = {
+    10.0, 7.0, 5.0, 3.0, 2.4, 2.0, 1.2, 0.6, 0.3
+};
+
+// slower settings are taken only if predicted speed beats the target by this much, so
+// measurement noise doesn't bounce settings back and forth
+const double X264TunerSlack = 1.15;
+
+// longest time failed preset is not tried again, in GOPs
+const int X264TunerMaxBackoff = 64;
+
+int x264_preset_index(const char* name) {
+    for (int i = 0; i < X264PresetsCount; i++) {
+        if (strcmp(name, X264Presets[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+std::string x264_default_profile() {
+    char hostname[256];
+    if (gethostname(hostname, sizeof hostname) != 0) {
+        strcpy(hostname, "localhost");
+    }
+    hostname[sizeof hostname - 1] = '\0';
+
+    return std::string("x264_") + hostname + ".profile";
+}
+
+X264Profile::X264Profile() :
+    pixels(0)
+{
+}
+
+bool X264Profile::empty() const {
+    return m_fps.empty() || pixels <= 0;
+}
+
+void X264Profile::set(int preset, int threads, double fps) {
+    m_fps[std::make_pair(preset, threads)] = fps;
+}
+
+double X264Profile::fps(int preset, int threads, int64_t picture_pixels) const {
+    std::map<std::pair<int, int>, double>::const_iterator it = m_fps.find(std::make_pair(preset, threads));
+    if (it == m_fps.end() || pixels <= 0 || picture_pixels <= 0) {
+        return 0;
+    }
+
+    // encoding time is roughly proportional to number of pixels
+    return it->second * pixels / picture_pixels;
+}
+
+// profile is plain text: "pixels <n>" line, then "<preset> <threads> <fps>" lines
+bool X264Profile::load(const char* filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string word;
+    if (!(file >> word >> pixels) || word != "pixels") {
+        return false;
+    }
+
+    std::string preset;
+    int threads = 0;
+    double fps = 0;
+
+    while (file >> preset >> threads >> fps) {
+        int index = x264_preset_index(preset.c_str());
+        if (index >= 0) {
+            set(index, threads, fps);
+        }
+    }
+
+    return !empty();
+}
+
+bool X264Profile::save(const char* filename) const {
+    std::ofstream file(filename, std::ofstream::out | std::ofstream::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    file << "pixels " << pixels << '\n';
+
+    std::map<std::pair<int, int>, double>::const_iterator it = m_fps.begin();
+    for (; it != m_fps.end(); ++it) {
+        file << X264Presets[it->first.first] << ' ' << it->first.second << ' ' << it->second << '\n';
+    }
+
+    file.close();
+    return !file.fail();
+}
+
+X264Tuner::X264Tuner(double target_fps, double headroom, int max_threads, int64_t pixels, const X264Profile* profile) :
+    m_target_fps(target_fps),
+    m_headroom(headroom),
+    m_max_threads(max_threads > 0 ? max_threads : 1),
+    m_pixels(pixels),
+    m_profile(profile && !profile->empty() ? profile : NULL),
+    m_frames(0),
+    m_encode_us(0),
+    m_measured_fps(0),
+    m_skip(1),
+    m_gops(0),
+    m_blocked(X264PresetsCount, 0),
+    m_backoff(X264PresetsCount, 2)
+{
+}
+
+void X264Tuner::initial(int* preset, int* threads) const {
+    if (!m_profile) {
+        return;
+    }
+
+    double need = m_target_fps * m_headroom;
+
+    // best quality first, then least threads
+    for (int p = X264PresetsCount - 1; p >= 0; p--) {
+        for (int t = 1; t <= m_max_threads; t++) {
+            if (m_profile->fps(p, t, m_pixels) >= need) {
+                *preset = p;
+                *threads = t;
+                return;
+            }
+        }
+    }
+
+    // nothing is fast enough, do the best we can
+    *preset = 0;
+    *threads = m_max_threads;
+}
+
+void X264Tuner::add_frame(int64_t encode_us) {
+    m_frames++;
+    m_encode_us += encode_us;
+}
+
+double X264Tuner::measured_fps() const {
+    return m_measured_fps;
+}
+
+void X264Tuner::set_max_threads(int max_threads) {
+    max_threads = max_threads > 0 ? max_threads : 1;
+
+    // encoder is reopened on new cores, first GOP after that is not representative
+    if (max_threads != m_max_threads) {
+        m_max_threads = max_threads;
+        m_skip = 1;
+    }
+}
+
+bool X264Tuner::update(int* preset, int* threads) {
+    m_gops++;
+
+    if (m_frames == 0 || m_encode_us <= 0) {
+        return false;
+    }
+
+    m_measured_fps = m_frames * 1000000.0 / m_encode_us;
+    m_frames = 0;
+    m_encode_us = 0;
+
+    if (m_skip > 0) {
+        m_skip--;
+        return false;
+    }
+
+    double need = m_target_fps * m_headroom;
+    int p = *preset;
+    int t = *threads;
+
+    if (m_measured_fps < need) {
+        if (t < m_max_threads) {
+            // more threads first, quality stays the same
+            t = std::min(m_max_threads, std::max(t + 1, int(ceil(t * need / m_measured_fps))));
+        } else if (p > 0) {
+            // this preset is too slow, don't come back to it for a while
+            m_blocked[p] = m_gops + m_backoff[p];
+            m_backoff[p] = std::min(m_backoff[p] * 2, X264TunerMaxBackoff);
+
+            // slowest faster preset predicted to keep up, the fastest one if none
+            for (p = *preset - 1; p > 0; p--) {
+                if (predict(p, t, *preset, *threads, m_measured_fps) >= need) {
+                    break;
+                }
+            }
+        } else {
+            return false; // nothing left to speed up
+        }
+    } else {
+        // slowest preset predicted to keep up with the same threads
+        for (int q = X264PresetsCount - 1; q > p; q--) {
+            if (m_gops >= m_blocked[q] && predict(q, t, *preset, *threads, m_measured_fps) >= need * X264TunerSlack) {
+                p = q;
+                break;
+            }
+        }
+
+        // or give a thread back, other sessions may need it
+        if (p == *preset && t > 1 && predict(p, t - 1, *preset, *threads, m_measured_fps) >= need * X264TunerSlack) {
+            t--;
+        }
+    }
+
+    if (p == *preset && t == *threads) {
+        return false;
+    }
+
+    *preset = p;
+    *threads = t;
+    m_skip = 1;
+    return true;
+}
+
+// predicted speed of preset/threads given measured speed of current ones
+double X264Tuner::predict(int preset, int threads, int from_preset, int from_threads, double from_fps) const {
+    // profile is used only if it has both settings, its speeds and default ones don't mix
+    if (m_profile) {
+        double to = m_profile->fps(preset, threads, m_pixels);
+        double from = m_profile->fps(from_preset, from_threads, m_pixels);
+        if (to > 0 && from > 0) {
+            return from_fps * to / from;
+        }
+    }
+
+    return from_fps * speed(preset, threads) / speed(from_preset, from_threads);
+}
+
+// default speed, threads are assumed to scale linearly, measurement tells the truth later
+double X264Tuner::speed(int preset, int threads) const {
+    return X264DefaultSpeeds[preset] * std::max(threads, 1);
+}
+
+X264Calibration::X264Calibration() :
+    m_width(0),
+    m_height(0)
+{
+}
+
+X264Calibration::~X264Calibration() {
+    for (size_t i = 0; i < m_frames.size(); i++) {
+        av_frame_free(&m_frames[i]);
+    }
+}
+
+bool X264Calibration::load(const char* filename, int width, int height, int frames_count) {
+    AVFormatContext* input_ctx = NULL;
+    int ret = avformat_open_input(&input_ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open input file " << filename << ", reason: " << av_err2str(ret) << '\n';
+        return false;
+    }
+
+    ret = avformat_find_stream_info(input_ctx, NULL);
+    int video_stream = ret < 0 ? ret : av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (video_stream < 0) {
+        std::cout << "Could not find video stream in " << filename << ", reason: " << av_err2str(video_stream) << '\n';
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    AVCodecParameters* par = input_ctx->streams[video_stream]->codecpar;
+    AVCodec* codec = avcodec_find_decoder(par->codec_id);
+    AVCodecContext* decoder = codec ? avcodec_alloc_context3(codec) : NULL;
+    if (!decoder || avcodec_parameters_to_context(decoder, par) < 0 || avcodec_open2(decoder, codec, NULL) < 0) {
+        std::cout << "Could not open decoder for " << avcodec_get_name(par->codec_id) << '\n';
+        avcodec_free_context(&decoder);
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    m_width = width > 0 ? width : decoder->width;
+    m_height = height > 0 ? height : decoder->height;
+
+    // frames are kept in memory, so only encoding is measured
+    SwsContext* sws_ctx = NULL;
+    AVFrame* frame = av_frame_alloc();
+    AVPacket packet;
+    bool eof = false;
+
+    while (int(m_frames.size()) < frames_count) {
+        ret = avcodec_receive_frame(decoder, frame);
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+
+        if (ret == AVERROR(EAGAIN)) {
+            if (eof) {
+                break;
+            }
+
+            if (av_read_frame(input_ctx, &packet) < 0) {
+                eof = true;
+                avcodec_send_packet(decoder, NULL);
+                continue;
+            }
+
+            if (packet.stream_index == video_stream) {
+                avcodec_send_packet(decoder, &packet);
+            }
+
+            av_packet_unref(&packet);
+            continue;
+        }
+
+        if (ret < 0) {
+            break;
+        }
+
+        AVFrame* scaled = av_frame_alloc();
+        scaled->width = m_width;
+        scaled->height = m_height;
+        scaled->format = AV_PIX_FMT_YUV420P;
+
+        sws_ctx = sws_getCachedContext(sws_ctx,
+            frame->width, frame->height, (AVPixelFormat)frame->format,
+            m_width, m_height, AV_PIX_FMT_YUV420P,
+            SWS_BICUBIC, NULL, NULL, NULL);
+
+        if (!sws_ctx || av_frame_get_buffer(scaled, 32) < 0) {
+            av_frame_free(&scaled);
+            av_frame_unref(frame);
+            break;
+        }
+
+        sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
+        m_frames.push_back(scaled);
+        av_frame_unref(frame);
+    }
+
+    sws_freeContext(sws_ctx);
+    av_frame_free(&frame);
+    avcodec_free_context(&decoder);
+    avformat_close_input(&input_ctx);
+
+    if (m_frames.empty()) {
+        std::cout << "No frames decoded from " << filename << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+bool X264Calibration::run(int max_threads, X264Profile* profile) {
+    profile->pixels = int64_t(m_width) * m_height;
+
+    // 1, 2, 4... threads and max_threads itself
+    std::vector<int> threads;
+    for (int t = 1; t < max_threads; t *= 2) {
+        threads.push_back(t);
+    }
+    threads.push_back(max_threads > 0 ? max_threads : 1);
+
+    for (int p = 0; p < X264PresetsCount; p++) {
+        for (size_t i = 0; i < threads.size(); i++) {
+            double fps = encode(p, threads[i]);
+            if (fps <= 0) {
+                return false;
+            }
+
+            printf("%-10s threads: %2d  fps: %8.1f\n", X264Presets[p], threads[i], fps);
+            fflush(stdout);
+
+            profile->set(p, threads[i], fps);
+        }
+    }
+
+    return true;
+}
+
+// encode all loaded frames, returns fps or 0 on failure
+double X264Calibration::encode(int preset, int threads) {
+    AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        std::cout << "Could not find libx264 encoder\n";
+        return 0;
+    }
+
+    AVCodecContext* enc = avcodec_alloc_context3(codec);
+    if (!enc) {
+        std::cout << "Could not allocate encoder context\n";
+        return 0;
+    }
+
+    // same settings transcoder uses, only preset and threads change
+    enc->width = m_width;
+    enc->height = m_height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = av_make_q(1, 25);
+    enc->framerate = av_make_q(25, 1);
+    enc->gop_size = 50;
+    enc->thread_count = threads;
+    av_opt_set(enc->priv_data, "preset", X264Presets[preset], 0);
+    av_opt_set_int(enc->priv_data, "crf", 23, 0);
+
+    int ret = avcodec_open2(enc, codec, NULL);
+    if (ret < 0) {
+        std::cout << "Could not open libx264 encoder, reason: " << av_err2str(ret) << '\n';
+        avcodec_free_context(&enc);
+        return 0;
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    int64_t t0 = av_gettime_relative();
+
+    // last iteration sends NULL frame, which flushes encoder
+    for (size_t i = 0; i <= m_frames.size() && ret >= 0; i++) {
+        AVFrame* frame = i < m_frames.size() ? m_frames[i] : NULL;
+        if (frame) {
+            frame->pts = i;
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+        }
+
+        ret = avcodec_send_frame(enc, frame);
+        while (ret >= 0 && avcodec_receive_packet(enc, &packet) >= 0) {
+            av_packet_unref(&packet);
+        }
+    }
+
+    double elapsed = (av_gettime_relative() - t0) / 1000000.0;
+    avcodec_free_context(&enc);
+
+    if (ret < 0) {
+        std::cout << "Failed to encode calibration clip, reason: " << av_err2str(ret) << '\n';
+        return 0;
+    }
+
+    return elapsed > 0 ? m_frames.size() / elapsed : 0;
+}
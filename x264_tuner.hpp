@@ -0,0 +1,113 @@
+/*
+* File: x264_tuner.hpp
+*
+* Author: Rim Zaydullin
+* Repo: https://github.com/tinybit/ffmpeg_code_examples
+*
+* x264 preset and threads autotuner for real-time transcoding. tuner is fed with encode time
+* of every frame, on every GOP boundary it compares encoder speed with input frame rate and
+* picks the slowest (best quality) preset and the least threads which still keep up with real
+* time plus some headroom. libx264 can't change preset of running encoder, so encoder is
+* reopened with new settings on GOP boundary (see Transcoder::reopen_encoder())
+*
+* how much faster or slower other settings would be is predicted from per-host profile made
+* by calibration (encode sample clip with every preset and threads count), or from rough
+* default preset speeds when there's no profile. predictions are checked by measurement after
+* every change, settings which turn out too slow are not tried again for a while
+*
+*/
+
+#ifndef x264_tuner_hpp
+#define x264_tuner_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+extern "C" {
+    #include <libavutil/frame.h>
+}
+
+// x264 presets from the fastest to the slowest
+extern const char* const X264Presets[];
+extern const int X264PresetsCount;
+
+int x264_preset_index(const char* name);   // -1 if there's no such preset
+
+// encoder speed (fps) for every preset and threads count, measured on this host
+class X264Profile {
+public:
+    X264Profile();
+
+    bool load(const char* filename);
+    bool save(const char* filename) const;
+    bool empty() const;
+
+    void set(int preset, int threads, double fps);
+    double fps(int preset, int threads, int64_t pixels) const;  // scaled to picture size, 0 if not measured
+
+    int64_t pixels;     // picture size speeds were measured with
+
+private:
+    std::map<std::pair<int, int>, double> m_fps;
+};
+
+// profile file for this host: x264_<hostname>.profile
+std::string x264_default_profile();
+
+class X264Tuner {
+public:
+    X264Tuner(double target_fps, double headroom, int max_threads, int64_t pixels, const X264Profile* profile);
+
+    // settings to start with: slowest preset profile says is fast enough, given ones without profile
+    void initial(int* preset, int* threads) const;
+
+    void add_frame(int64_t encode_us);      // time spent encoding one frame
+    bool update(int* preset, int* threads); // on GOP boundary, true if settings should change
+
+    double measured_fps() const;            // encoder speed over the last GOP
+    void set_max_threads(int max_threads);  // core budget changed
+
+private:
+    double predict(int preset, int threads, int from_preset, int from_threads, double from_fps) const;
+    double speed(int preset, int threads) const;
+
+    double m_target_fps;
+    double m_headroom;
+    int m_max_threads;
+    int64_t m_pixels;
+    const X264Profile* m_profile;
+
+    int64_t m_frames;
+    int64_t m_encode_us;
+    double m_measured_fps;
+    int m_skip;                         // GOPs to skip after change, encoder lookahead warms up
+
+    int64_t m_gops;
+    std::vector<int64_t> m_blocked;     // per preset, GOP number till which preset is not tried
+    std::vector<int> m_backoff;         // per preset, GOPs to block preset for next time it fails
+};
+
+// offline calibration: encode sample clip with every preset and threads count
+class X264Calibration {
+public:
+    X264Calibration();
+    ~X264Calibration();
+
+    // decode up to frames_count frames of video file, scaled to width x height (0 - same as input)
+    bool load(const char* filename, int width, int height, int frames_count);
+
+    // encode loaded frames with every preset and threads count up to max_threads, store speeds in profile
+    bool run(int max_threads, X264Profile* profile);
+
+private:
+    double encode(int preset, int threads);
+
+    std::vector<AVFrame*> m_frames;
+    int m_width;
+    int m_height;
+};
+
+#endif /* x264_tuner_hpp */